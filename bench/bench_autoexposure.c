@@ -0,0 +1,245 @@
+/* End-to-end check of response fitting and auto exposure against the mock
+ * backend in mocksane.c, whose samples are
+ *
+ *     64 * offset + scene * exposure * (1 + gain / 16)
+ *
+ * main.c is compiled in as bench_sweep.c does and run twice in a scratch
+ * directory: a sweep with response=yes over three gains and two offsets,
+ * whose fitted profile must find that gain curve and those black levels,
+ * then one with auto_exposure=yes using the profile. A preview scanned at
+ * the exposures and gains that picked must have its highlights at the
+ * target in every channel, which none of them reaches without gain.
+ *
+ *     make build/release/bench_autoexposure
+ *
+ * Usage: bench_autoexposure [width height]
+ */
+#define _GNU_SOURCE
+
+#include <ftw.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "histogram.h"
+
+// The sweep itself, with its main() renamed so it can be called from here.
+#define main piescan_main
+#include "main.c"
+#undef main
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// What the profile and the picked settings are allowed to be off by.
+#define FACTOR_TOLERANCE    0.02
+#define BLACK_TOLERANCE     4.0
+#define HIGHLIGHT_TOLERANCE 0.03
+
+// parse_arguments() splits key=value in place, so the arguments are arrays.
+#define ARG_SIZE 48
+
+
+
+/*****************************************************************************\
+| Global variables                                                            |
+\*****************************************************************************/
+
+// Settings both sweeps share. The longest exposures stop short of the
+// target, so auto exposure has to make up the rest with gain.
+static char common[][ARG_SIZE] = {
+    "light=on", "exposure=geometric(500, 1.5, 6)",
+    "exposure_i=300, 450, 675, 1000, 1500, 2250",
+    "output=.", "raw=no", "hdr=no", "png=no",
+};
+#define N_COMMON (sizeof(common) / sizeof(common[0]))
+
+static char response_args[][ARG_SIZE] = {
+    "prefix=r", "gain=0, 16, 32", "offset=0, 2", "response=yes",
+};
+#define N_RESPONSE (sizeof(response_args) / sizeof(response_args[0]))
+
+static char auto_args[][ARG_SIZE] = {
+    "prefix=a", "auto_exposure=yes", "response_profile=r" RESPONSE_SUFFIX,
+};
+#define N_AUTO (sizeof(auto_args) / sizeof(auto_args[0]))
+
+static const char* const names[4] = {"r", "g", "b", "i"};
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+static int
+remove_file(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+    (void) st;
+    (void) type;
+    (void) ftw;
+
+    return remove(path);
+}
+
+// Runs main.c on the common settings followed by args, which are also left
+// in argv for parse_arguments().
+static int
+run_sweep(char** argv, char (*args)[ARG_SIZE], size_t n_args,
+          double* seconds)
+{
+    int argc = 1;
+    for (size_t k = 0; k < N_COMMON; ++k) argv[argc++] = common[k];
+    for (size_t k = 0; k < n_args; ++k) argv[argc++] = args[k];
+    argv[argc] = NULL;
+
+    double t0 = now();
+    int status = piescan_main(argc, argv);
+    *seconds = now() - t0;
+    return status == EXIT_SUCCESS ? argc : -1;
+}
+
+// The fitted gain curve and black levels against the mock's.
+static int
+check_profile(const ResponseProfile* profile)
+{
+    int failures = 0;
+
+    for (int c = 0; c < 4; ++c) {
+        const ResponseChannel* channel = &profile->channels[c];
+        if (!channel->valid || channel->base_gain != 0 ||
+            channel->n_gains != 3) {
+            printf("%s: expected gains 0, 16 and 32 fitted from gain 0\n",
+                   names[c]);
+            failures++;
+            continue;
+        }
+        for (size_t k = 0; k < channel->n_gains; ++k) {
+            const ResponseGain* g = &channel->gains[k];
+            const double factor = 1.0 + g->gain / 16.0;
+            const bool ok =
+                fabs(g->factor - factor) <= FACTOR_TOLERANCE * factor &&
+                fabs(g->black) <= BLACK_TOLERANCE &&
+                fabs(g->black_per_offset - 64.0) <= BLACK_TOLERANCE;
+
+            printf("%s gain %2d: factor %.3f (%.3f), black %.1f + %.1f per "
+                   "offset step (0 + 64)%s\n", names[c], g->gain, g->factor,
+                   factor, g->black, g->black_per_offset, ok ? "" : "  BAD");
+            failures += !ok;
+        }
+    }
+    return failures;
+}
+
+// Scans a preview at the settings auto exposure picked, as the sweep's
+// first lit frame has them, and checks where its highlights are.
+static int
+check_highlights(SweepConfig* config)
+{
+    const AutoExposureOptions options = auto_exposure_default();
+    const double target = config->auto_target * 65535.0;
+    PiescanDevice* device = NULL;
+    ScanSettings base;
+    SweepPlan plan;
+    int failures = 0;
+
+    if (sweep_config_load(config, "a" AUTO_SUFFIX) != 0) return 1;
+    int status = piescan_open(&device, NULL, NULL);
+    if (status == 0) status = piescan_get_default_settings(device, &base);
+    if (status != 0 || sweep_plan(&plan, config, &base) != 0) {
+        printf("unable to plan a scan at the picked settings\n");
+        if (device) piescan_close(device);
+        return 1;
+    }
+
+    ScanSettings settings = plan.points[0].settings;
+    sweep_plan_free(&plan);
+    settings.resolution = config->preview_resolution;
+    settings.preview = true;
+
+    Image* im = new_image();
+    Histogram* histograms = (Histogram*) malloc(4 * sizeof(Histogram));
+    if (!im || !histograms ||
+        piescan_scan_image(device, im, settings) != SANE_STATUS_GOOD) {
+        printf("unable to scan at the picked settings\n");
+        failures++;
+        goto done;
+    }
+
+    image_histograms(im, histograms);
+    const int exposures[4] = {settings.exposure_r, settings.exposure_g,
+                              settings.exposure_b, settings.exposure_i};
+    const int gains[4] = {settings.gain_r, settings.gain_g,
+                          settings.gain_b, settings.gain_i};
+    for (int c = 0; c < 4; ++c) {
+        const uint16_t level =
+            histogram_percentile(&histograms[c], 1.0 - options.highlight);
+        const bool ok = fabs(level - target) <= HIGHLIGHT_TOLERANCE * target;
+
+        printf("%s: exposure %5d at gain %2d, highlights at %5u (%.0f)%s\n",
+               names[c], exposures[c], gains[c], level, target,
+               ok ? "" : "  BAD");
+        failures += !ok;
+    }
+
+done:
+    free(histograms);
+    if (im) free_image(im);
+    piescan_close(device);
+    return failures;
+}
+
+int
+main(int argc, char** argv)
+{
+    char scratch[] = "bench_autoexposure.XXXXXX";
+    char* sweep_argv[N_COMMON + N_RESPONSE + N_AUTO + 2] = {argv[0]};
+    ResponseProfile profile;
+    SweepConfig config;
+    double t_response, t_auto;
+    int failures = 0;
+
+    setenv("MOCKSANE_WIDTH", argc > 2 ? argv[1] : "600", argc > 2);
+    setenv("MOCKSANE_HEIGHT", argc > 2 ? argv[2] : "400", argc > 2);
+
+    if (!mkdtemp(scratch) || chdir(scratch) != 0) {
+        perror(scratch);
+        return EXIT_FAILURE;
+    }
+
+    printf("Response and auto exposure sweeps of %sx%s frames from the mock "
+           "backend\n\n", getenv("MOCKSANE_WIDTH"), getenv("MOCKSANE_HEIGHT"));
+
+    if (run_sweep(sweep_argv, response_args, N_RESPONSE, &t_response) < 0 ||
+        read_response_profile(&profile, "r" RESPONSE_SUFFIX) != 0) {
+        printf("response sweep failed\n");
+        failures++;
+        goto done;
+    }
+    printf("\n");
+    failures += check_profile(&profile);
+    printf("\n");
+
+    int n_args = run_sweep(sweep_argv, auto_args, N_AUTO, &t_auto);
+    if (n_args < 0 || parse_arguments(&config, n_args, sweep_argv) != 0) {
+        printf("auto exposure sweep failed\n");
+        failures++;
+        goto done;
+    }
+    printf("\n");
+    failures += check_highlights(&config);
+
+    printf("\nresponse sweep : %8.2f s\n", t_response);
+    printf("auto exposure  : %8.2f s\n", t_auto);
+
+done:
+    if (chdir("..") == 0) {
+        nftw(scratch, remove_file, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
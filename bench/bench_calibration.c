@@ -0,0 +1,213 @@
+/* Benchmark for the dark and flat field calibration: dark and flat frames of
+ * a sensor with per-column offsets and sensitivities are averaged into a
+ * calibration file, which is read back and used to correct a synthetic scan.
+ * The corrected samples are checked against a double-precision reference of
+ * the same correction, and a corrected flat frame against being flat.
+ *
+ *     gcc -O2 -Isrc bench/bench_calibration.c src/calibration.c \
+ *         src/mmaparray.c src/threadpool.c -lm -lpthread
+ *
+ * Usage: bench_calibration [width height [scratch file]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "calibration.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+#define N_FRAMES 4
+#define LEVEL    30000.0
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// The sensor: each column reads offset + sensitivity * light, plus noise.
+static double
+column_offset(size_t x, int c)
+{
+    return 200.0 + (double) ((x * 7919 + c * 104729) % 97);
+}
+
+static double
+column_sensitivity(size_t x, int c)
+{
+    return 0.8 + 0.4 * (double) ((x * 104729 + c * 7919) % 1009) / 1009.0;
+}
+
+static void
+expose(Image* im, double (*light)(size_t x, size_t y, int c))
+{
+    uint16_t* planes[4] = {im->r, im->g, im->b, im->i};
+
+    for (int c = 0; c < 4; ++c) {
+        for (size_t y = 0; y < im->height; ++y) {
+            for (size_t x = 0; x < im->width; ++x) {
+                double v = column_offset(x, c) +
+                           column_sensitivity(x, c) * light(x, y, c) +
+                           (double) (rand() % 16) - 7.5;
+                v = v < 0 ? 0 : v > 65535 ? 65535 : v;
+                planes[c][y * im->width + x] = (uint16_t) v;
+            }
+        }
+    }
+}
+
+static double
+dark(size_t x, size_t y, int c)
+{
+    (void) x, (void) y, (void) c;
+    return 0;
+}
+
+static double
+flat(size_t x, size_t y, int c)
+{
+    (void) x, (void) y, (void) c;
+    return LEVEL;
+}
+
+static double
+scene(size_t x, size_t y, int c)
+{
+    return 50000.0 * (double) ((x * 31 + y * 17 + c * 5) % 1024) / 1024.0;
+}
+
+int
+main(int argc, char** argv)
+{
+    uint32_t width = argc > 2 ? (uint32_t) atol(argv[1]) : 2000;
+    uint32_t height = argc > 2 ? (uint32_t) atol(argv[2]) : 1500;
+    const char* filename = argc > 3 ? argv[3] : "bench_calibration.pcal";
+    const size_t n = (size_t) width * height;
+    int failures = 0;
+
+    Image im = {.width = width, .height = height};
+    uint16_t* planes[4];
+    for (int c = 0; c < 4; ++c) {
+        planes[c] = (uint16_t*) malloc(n * sizeof(uint16_t));
+    }
+    im.r = planes[0];
+    im.g = planes[1];
+    im.b = planes[2];
+    im.i = planes[3];
+
+    ScanSettings settings = {0};
+    settings.mode = "RGBI";
+    settings.resolution = 5000;
+    settings.exposure_r = settings.exposure_g = 3000;
+    settings.exposure_b = settings.exposure_i = 3000;
+
+    // Build
+    srand(1);
+    CalibrationBuilder* builder = new_calibration_builder();
+    double t_add = 0;
+    for (int f = 0; f < 2 * N_FRAMES; ++f) {
+        settings.light = f < N_FRAMES ? 0 : 1;
+        expose(&im, f < N_FRAMES ? dark : flat);
+
+        double t0 = now();
+        failures += calibration_builder_add(builder, &im, &settings) != 0;
+        t_add += now() - t0;
+    }
+    failures += calibration_builder_write(builder, filename) != 0;
+    free_calibration_builder(builder);
+
+    Calibration* calibration;
+    if (open_calibration(&calibration, filename) != 0) {
+        printf("unable to read back %s\n", filename);
+        return EXIT_FAILURE;
+    }
+
+    // Correct a flat frame, then a scene, channel by channel as a scan does
+    const float* darks[4];
+    const float* gains[4];
+    for (int c = 0; c < 4; ++c) {
+        if (!calibration_find(calibration, &settings, c, width, &darks[c],
+                              &gains[c])) {
+            printf("no references for channel %d\n", c);
+            return EXIT_FAILURE;
+        }
+    }
+
+    expose(&im, flat);
+    double worst_sd = 0;
+    for (int c = 0; c < 4; ++c) {
+        calibration_correct(planes[c], width, height, darks[c], gains[c]);
+        double s = 0, s2 = 0;
+        for (size_t x = 0; x < width; ++x) {
+            double m = 0;
+            for (size_t y = 0; y < height; ++y) m += planes[c][y * width + x];
+            m /= height;
+            s += m;
+            s2 += m * m;
+        }
+        double mean = s / width;
+        double sd = sqrt(fmax(s2 / width - mean * mean, 0));
+        worst_sd = sd > worst_sd ? sd : worst_sd;
+    }
+
+    expose(&im, scene);
+    uint16_t* raw = (uint16_t*) malloc(n * sizeof(uint16_t));
+    double t_correct = 0;
+    uint16_t max_diff = 0;
+    for (int c = 0; c < 4; ++c) {
+        memcpy(raw, planes[c], n * sizeof(uint16_t));
+
+        double t0 = now();
+        calibration_correct(planes[c], width, height, darks[c], gains[c]);
+        t_correct += now() - t0;
+
+        for (size_t k = 0; k < n; ++k) {
+            size_t x = k % width;
+            double v = ((double) raw[k] - darks[c][x]) * gains[c][x];
+            v = round(v < 0 ? 0 : v > 65535 ? 65535 : v);
+            double d = fabs(v - planes[c][k]);
+            max_diff = d > max_diff ? (uint16_t) d : max_diff;
+        }
+    }
+
+    // Float rounding may land a half-way sample on the other side
+    if (max_diff > 1) {
+        printf("MISMATCH against reference: off by up to %u\n", max_diff);
+        failures++;
+    }
+    if (worst_sd > 2.0) {
+        printf("corrected flat frame not flat: column sd %.2f\n", worst_sd);
+        failures++;
+    }
+
+    double mb = 4.0 * n * sizeof(uint16_t) / 1e6;
+    printf("Calibrating %ux%u RGBI (%.0f MB per frame)\n", width, height, mb);
+    printf("add     : %8.1f ms/frame  %8.1f MB/s\n",
+           t_add * 1e3 / (2 * N_FRAMES), 2 * N_FRAMES * mb / t_add);
+    printf("correct : %8.1f ms/frame  %8.1f MB/s\n", t_correct * 1e3,
+           mb / t_correct);
+    printf("flat column sd after correction: %.3f\n", worst_sd);
+
+    close_calibration(calibration);
+    remove(filename);
+    free(raw);
+    for (int c = 0; c < 4; ++c) free(planes[c]);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+/* Micro-benchmark for the RGBI de-interleave kernels.
+ *
+ * Every available implementation is first checked for bit-exactness against
+ * the scalar reference, over odd lengths and both byte orders, and then
+ * timed on one 7200 dpi scanline's worth of pixels.
+ *
+ *     gcc -O2 -Isrc bench/bench_deinterleave.c src/deinterleave.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "deinterleave.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+#define LINE_PIXELS 10000
+#define ITERATIONS  2000
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int
+check_exact(DeinterleaveFunc f, const uint16_t* src, size_t max_pixels)
+{
+    DeinterleaveFunc ref = get_deinterleave_func(DEINTERLEAVE_SCALAR);
+    size_t bytes = max_pixels * sizeof(uint16_t);
+    uint16_t* expect = (uint16_t*) malloc(4 * bytes);
+    uint16_t* got = (uint16_t*) malloc(4 * bytes);
+    int errors = 0;
+
+    for (int swap = 0; swap <= 1; ++swap) {
+        for (size_t n = 0; n <= max_pixels; n += (n < 64 ? 1 : 997)) {
+            memset(expect, 0xAA, 4 * bytes);
+            memset(got, 0xAA, 4 * bytes);
+            ref(src, expect, expect + max_pixels, expect + 2*max_pixels,
+                expect + 3*max_pixels, n, swap);
+            f(src, got, got + max_pixels, got + 2*max_pixels,
+              got + 3*max_pixels, n, swap);
+            if (memcmp(expect, got, 4 * bytes) != 0) {
+                fprintf(stderr, "\tmismatch at n=%zu swap=%d\n", n, swap);
+                ++errors;
+            }
+        }
+    }
+
+    free(got);
+    free(expect);
+    return errors;
+}
+
+int
+main()
+{
+    uint16_t* src = (uint16_t*) malloc(4 * LINE_PIXELS * sizeof(uint16_t));
+    uint16_t* planes = (uint16_t*) malloc(4 * LINE_PIXELS * sizeof(uint16_t));
+    int failures = 0;
+
+    srand(1);
+    for (size_t k = 0; k < 4 * LINE_PIXELS; ++k) {
+        src[k] = (uint16_t) rand();
+    }
+
+    DeinterleaveImpl impls[] = {DEINTERLEAVE_SCALAR, DEINTERLEAVE_SSE2,
+                                DEINTERLEAVE_AVX2};
+    double scalar_rate = 0.0;
+
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); ++k) {
+        DeinterleaveFunc f = get_deinterleave_func(impls[k]);
+        const char* name = deinterleave_impl_name(impls[k]);
+        if (!f) {
+            printf("%-8s: not supported on this CPU\n", name);
+            continue;
+        }
+
+        if (check_exact(f, src, LINE_PIXELS) != 0) {
+            printf("%-8s: NOT bit-exact with scalar\n", name);
+            ++failures;
+            continue;
+        }
+
+        for (int swap = 0; swap <= 1; ++swap) {
+            double t0 = now();
+            for (int it = 0; it < ITERATIONS; ++it) {
+                f(src, planes, planes + LINE_PIXELS, planes + 2*LINE_PIXELS,
+                  planes + 3*LINE_PIXELS, LINE_PIXELS, swap);
+            }
+            double dt = now() - t0;
+            double rate = (double) ITERATIONS * LINE_PIXELS * 8 / dt / 1e9;
+            if (impls[k] == DEINTERLEAVE_SCALAR && !swap) scalar_rate = rate;
+
+            printf("%-8s: swap=%d %7.2f GB/s", name, swap, rate);
+            if (!swap && scalar_rate > 0) {
+                printf("  (%.1fx scalar)", rate / scalar_rate);
+            }
+            printf("\n");
+        }
+    }
+
+    free(planes);
+    free(src);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,266 @@
+/* Benchmark for the infrared dust filter on a synthetic frame: a smooth
+ * scene with a little red crosstalk into infrared, specks of dust dimming r,
+ * g and b and blocking more of i. The frame is cleaned in one call and
+ * again streamed in uneven batches of lines, as a scan delivers them, which
+ * must give the same result. Cleaned specks are checked against the scene
+ * without dust, and the frame away from them against being left alone. A
+ * scan cut short halfway must have its specks cleaned all the same and the
+ * lines it never delivered left alone.
+ *
+ *     gcc -O2 -Isrc bench/bench_dust.c src/dust.c src/threadpool.c \
+ *         -lm -lpthread
+ *
+ * Usage: bench_dust [width height [specks]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "dust.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// Lines a scan hands over at a time, cycled through.
+#define N_BATCHES 5
+static const uint32_t batches[N_BATCHES] = {37, 1, 200, 64, 13};
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// The scene without dust, with the lamp falling off down the frame.
+static void
+expose(uint16_t* planes[4], uint32_t width, uint32_t height)
+{
+    for (uint32_t y = 0; y < height; ++y) {
+        const double fall_off = 1.0 - 0.5 * y / height;
+        for (uint32_t x = 0; x < width; ++x) {
+            const size_t k = (size_t) y * width + x;
+            double v[4];
+            for (int c = 0; c < 3; ++c) {
+                v[c] = 20000.0 + 15000.0 * sin(x * 0.01 + y * 0.007 + c);
+            }
+            v[3] = 44000.0 + 0.2 * v[0];
+            for (int c = 0; c < 4; ++c) {
+                planes[c][k] = (uint16_t) (v[c] * fall_off
+                                           + (double) (rand() % 32));
+            }
+        }
+    }
+}
+
+// Dims discs of radius 2 to 6, marking them in specks with 1 and the ring
+// the filter's mask grows into around them with 2.
+static void
+add_dust(uint16_t* planes[4], uint8_t* specks, uint32_t width,
+         uint32_t height, int n, int grow)
+{
+    memset(specks, 0, (size_t) width * height);
+    for (int s = 0; s < n; ++s) {
+        const long cx = rand() % width;
+        const long cy = rand() % height;
+        const long r = 2 + rand() % 5;
+        const long outer = r + grow + 1;
+        for (long y = cy - outer; y <= cy + outer; ++y) {
+            for (long x = cx - outer; x <= cx + outer; ++x) {
+                if (x < 0 || y < 0 || x >= width || y >= height) continue;
+
+                const size_t k = (size_t) y * width + x;
+                const long d2 = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+                if (d2 > r * r) {
+                    if (!specks[k]) specks[k] = 2;
+                    continue;
+                }
+                for (int c = 0; c < 4; ++c) {
+                    planes[c][k] = (uint16_t) (planes[c][k]
+                                               * (c == 3 ? 0.1 : 0.3));
+                }
+                specks[k] = 1;
+            }
+        }
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    uint32_t width = argc > 2 ? (uint32_t) atol(argv[1]) : 4000;
+    uint32_t height = argc > 2 ? (uint32_t) atol(argv[2]) : 3000;
+    int n_specks = argc > 3 ? atoi(argv[3]) : 500;
+    const size_t n = (size_t) width * height;
+    int failures = 0;
+
+    uint16_t* clean[4];
+    uint16_t* dusty[4];
+    uint16_t* once[4];
+    uint16_t* streamed[4];
+    for (int c = 0; c < 4; ++c) {
+        clean[c] = (uint16_t*) malloc(n * sizeof(uint16_t));
+        dusty[c] = (uint16_t*) malloc(n * sizeof(uint16_t));
+        once[c] = (uint16_t*) malloc(n * sizeof(uint16_t));
+        streamed[c] = (uint16_t*) malloc(n * sizeof(uint16_t));
+    }
+    uint8_t* specks = (uint8_t*) malloc(n);
+
+    DustOptions options = dust_options_default();
+    DustFilter* filter = new_dust_filter(&options);
+
+    srand(1);
+    expose(clean, width, height);
+    for (int c = 0; c < 4; ++c) {
+        memcpy(dusty[c], clean[c], n * sizeof(uint16_t));
+    }
+    add_dust(dusty, specks, width, height, n_specks, options.grow);
+
+    Image im = {.width = width, .height = height};
+
+    // In one call
+    for (int c = 0; c < 4; ++c) {
+        memcpy(once[c], dusty[c], n * sizeof(uint16_t));
+    }
+    im.r = once[0];
+    im.g = once[1];
+    im.b = once[2];
+    im.i = once[3];
+    double t0 = now();
+    failures += dust_filter_start(filter, width, height) != 0;
+    dust_filter_lines(filter, &im, height);
+    double t_once = now() - t0;
+    size_t found = dust_filter_count(filter);
+
+    // Streamed
+    for (int c = 0; c < 4; ++c) {
+        memcpy(streamed[c], dusty[c], n * sizeof(uint16_t));
+    }
+    im.r = streamed[0];
+    im.g = streamed[1];
+    im.b = streamed[2];
+    im.i = streamed[3];
+    t0 = now();
+    failures += dust_filter_start(filter, width, height) != 0;
+    uint32_t lines = 0;
+    for (int b = 0; lines < height; b = (b + 1) % N_BATCHES) {
+        lines += batches[b];
+        dust_filter_lines(filter, &im, lines < height ? lines : height);
+    }
+    double t_streamed = now() - t0;
+
+    for (int c = 0; c < 4; ++c) {
+        if (memcmp(once[c], streamed[c], n * sizeof(uint16_t)) != 0) {
+            printf("MISMATCH between streamed and one-shot filtering\n");
+            failures++;
+            break;
+        }
+    }
+    if (dust_filter_count(filter) != found) {
+        printf("MISMATCH in defects found: %zu streamed, %zu in one call\n",
+               dust_filter_count(filter), found);
+        failures++;
+    }
+
+    // Cut short, in the same batches as far as halfway
+    const uint32_t cut = height / 2 + 7;
+    for (int c = 0; c < 4; ++c) {
+        memcpy(streamed[c], dusty[c], n * sizeof(uint16_t));
+    }
+    failures += dust_filter_start(filter, width, height) != 0;
+    lines = 0;
+    for (int b = 0; lines + batches[b] < cut; b = (b + 1) % N_BATCHES) {
+        lines += batches[b];
+        dust_filter_lines(filter, &im, lines);
+    }
+    dust_filter_finish(filter, &im, cut);
+
+    const size_t n_cut = (size_t) cut * width;
+    double cut_before = 0, cut_after = 0;
+    size_t n_cut_dust = 0;
+    for (size_t k = 0; k < n_cut; ++k) {
+        if (specks[k] != 1) continue;
+        for (int c = 0; c < 3; ++c) {
+            cut_before += fabs((double) dusty[c][k] - clean[c][k]);
+            cut_after += fabs((double) streamed[c][k] - clean[c][k]);
+        }
+        n_cut_dust++;
+    }
+    for (int c = 0; c < 4; ++c) {
+        if (memcmp(streamed[c] + n_cut, dusty[c] + n_cut,
+                   (n - n_cut) * sizeof(uint16_t)) != 0) {
+            printf("lines after the end of a short scan changed\n");
+            failures++;
+            break;
+        }
+    }
+    if (n_cut_dust && !(cut_after < 0.1 * cut_before)) {
+        printf("specks of a short scan not cleaned\n");
+        failures++;
+    }
+
+    // Error against the scene without dust on specks, and samples changed
+    // away from them
+    double before = 0, after = 0;
+    size_t n_dust = 0, n_clear = 0, changed = 0;
+    for (size_t k = 0; k < n; ++k) {
+        for (int c = 0; c < 3; ++c) {
+            if (specks[k] == 1) {
+                before += fabs((double) dusty[c][k] - clean[c][k]);
+                after += fabs((double) once[c][k] - clean[c][k]);
+            } else if (specks[k] == 0) {
+                changed += once[c][k] != dusty[c][k];
+            }
+        }
+        n_dust += specks[k] == 1;
+        n_clear += specks[k] == 0;
+    }
+    before /= 3.0 * (n_dust ? n_dust : 1);
+    after /= 3.0 * (n_dust ? n_dust : 1);
+
+    double mb = 4.0 * n * sizeof(uint16_t) / 1e6;
+    printf("Dust filter on %ux%u RGBI (%.0f MB), %d specks, %zu pixels\n",
+           width, height, mb, n_specks, n_dust);
+    printf("found     : %zu defective pixels\n", found);
+    printf("one call  : %8.1f ms  %8.1f MB/s\n", t_once * 1e3, mb / t_once);
+    printf("streamed  : %8.1f ms  %8.1f MB/s\n", t_streamed * 1e3,
+           mb / t_streamed);
+    printf("specks    : mean error %.0f before, %.0f after\n", before, after);
+    printf("elsewhere : %.3f%% of samples changed\n",
+           100.0 * changed / (3.0 * (n_clear ? n_clear : 1)));
+    printf("cut short : mean error %.0f before, %.0f after, on %u lines\n",
+           cut_before / (3.0 * (n_cut_dust ? n_cut_dust : 1)),
+           cut_after / (3.0 * (n_cut_dust ? n_cut_dust : 1)), cut);
+
+    if (n_dust && !(after < 0.1 * before)) {
+        printf("specks not cleaned\n");
+        failures++;
+    }
+    if (changed > 3 * n_clear / 1000) {
+        printf("too much of the clean frame changed\n");
+        failures++;
+    }
+
+    free_dust_filter(filter);
+    free(specks);
+    for (int c = 0; c < 4; ++c) {
+        free(clean[c]);
+        free(dusty[c]);
+        free(once[c]);
+        free(streamed[c]);
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
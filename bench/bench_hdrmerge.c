@@ -0,0 +1,226 @@
+/* Benchmark for the HDR merge: a synthetic scene with fourteen stops of
+ * dynamic range is exposed at the sweep's 26 exposure times, with clipping
+ * at 65535, and merged frame by frame. The merged file is read back and
+ * checked against a double-precision reference of the same weighting, and
+ * against the scene itself wherever some exposure saw it unclipped. Headers
+ * lying about the layout of the file must be refused.
+ *
+ *     gcc -O2 -Isrc bench/bench_hdrmerge.c src/hdrmerge.c src/rawframe.c \
+ *         src/mmaparray.c src/threadpool.c -lm -lpthread
+ *
+ * Usage: bench_hdrmerge [width height [scratch file]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "hdrmerge.h"
+#include "rawframe.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+#define N_EXPOSURES 26
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int
+exposure_of(int frame)
+{
+    return 3000 + 280 * frame;
+}
+
+// Counts per unit of exposure time, from 1/500 up to 32, i.e. from deep
+// shadow to clipped even in the shortest exposure.
+static double
+scene(size_t k, int c)
+{
+    return 32.0 * pow(2.0, -14.0 * (double) ((k * 7919 + c * 104729) % 4096)
+                                  / 4096.0);
+}
+
+static uint16_t
+expose(double radiance, int exposure)
+{
+    double v = radiance * exposure;
+    return v >= 65535.0 ? 65535 : (uint16_t) v;
+}
+
+// Rewrites the header of filename with each of a few lies about the layout
+// that would put planes outside the file or off their alignment, which
+// open_raw_frame() must refuse, then puts the real one back.
+static int
+check_corrupt_headers(const char* filename)
+{
+    FILE* file = fopen(filename, "r+b");
+    RawFrameHeader header;
+    int failures = 0;
+
+    if (!file || fread(&header, sizeof(header), 1, file) != 1) {
+        if (file) fclose(file);
+        return 1;
+    }
+
+    RawFrameHeader lies[3] = {header, header, header};
+    // 3 * plane_stride wraps around to just past 0
+    lies[0].plane_stride = (UINT64_MAX / 3 / RAWFRAME_ALIGN + 1)
+                         * RAWFRAME_ALIGN;
+    lies[1].header_size -= 8;
+    lies[2].width = UINT32_MAX;
+    lies[2].height = UINT32_MAX;
+
+    for (size_t k = 0; k <= 3; ++k) {
+        const RawFrameHeader* written = k < 3 ? &lies[k] : &header;
+        RawFrame* frame;
+
+        if (fseek(file, 0, SEEK_SET) != 0 ||
+            fwrite(written, sizeof(header), 1, file) != 1 ||
+            fflush(file) != 0) {
+            failures++;
+            break;
+        }
+        if (k < 3 && open_raw_frame(&frame, filename) == 0) {
+            printf("Corrupt header %zu accepted\n", k);
+            close_raw_frame(frame);
+            failures++;
+        }
+    }
+
+    fclose(file);
+    return failures;
+}
+
+static double
+weight_of(uint16_t v, uint16_t clip)
+{
+    float x = (float) v;
+    float w = 1.0f - fabsf(x * (2.0f / 65535.0f) - 1.0f);
+    w = w > 1.0f / 1024.0f ? w : 1.0f / 1024.0f;
+    return x < clip ? w : 0.0f;
+}
+
+int
+main(int argc, char** argv)
+{
+    uint32_t width = argc > 2 ? (uint32_t) atol(argv[1]) : 2000;
+    uint32_t height = argc > 2 ? (uint32_t) atol(argv[2]) : 1500;
+    const char* filename = argc > 3 ? argv[3] : "bench_hdrmerge.phdr";
+    const size_t n = (size_t) width * height;
+    int failures = 0;
+
+    Image im = {.width = width, .height = height};
+    uint16_t* planes[4];
+    for (int c = 0; c < 4; ++c) {
+        planes[c] = (uint16_t*) malloc(n * sizeof(uint16_t));
+    }
+    im.r = planes[0];
+    im.g = planes[1];
+    im.b = planes[2];
+    im.i = planes[3];
+
+    ScanSettings settings = {0};
+    settings.mode = "RGBI";
+    HdrMerge* merge = new_hdr_merge(filename, HDR_CLIP_DEFAULT);
+    double t_add = 0;
+
+    for (int f = 0; f < N_EXPOSURES; ++f) {
+        int exposure = exposure_of(f);
+        settings.exposure_r = exposure;
+        settings.exposure_g = exposure;
+        settings.exposure_b = exposure;
+        settings.exposure_i = exposure;
+        for (int c = 0; c < 4; ++c) {
+            for (size_t k = 0; k < n; ++k) {
+                planes[c][k] = expose(scene(k, c), exposure);
+            }
+        }
+
+        double t0 = now();
+        failures += hdr_merge_add(merge, &im, &settings) != 0;
+        t_add += now() - t0;
+    }
+
+    double t0 = now();
+    failures += hdr_merge_finish(merge) != 0;
+    double t_finish = now() - t0;
+
+    RawFrame* frame;
+    if (open_raw_frame(&frame, filename) != 0 ||
+        frame->header->bit_depth != 32 ||
+        frame->header->width != width || frame->header->height != height) {
+        printf("Unable to read back %s\n", filename);
+        return EXIT_FAILURE;
+    }
+
+    double max_ref_error = 0, max_scene_error = 0;
+    size_t n_saturated = 0;
+    for (int c = 0; c < 4; ++c) {
+        const float* merged = (const float*) frame->planes[c];
+        for (size_t k = 0; k < n; ++k) {
+            double sum = 0, weight = 0;
+            for (int f = 0; f < N_EXPOSURES; ++f) {
+                uint16_t v = expose(scene(k, c), exposure_of(f));
+                double w = weight_of(v, HDR_CLIP_DEFAULT);
+                sum += w * v / exposure_of(f);
+                weight += w;
+            }
+            if (weight == 0) {
+                float saturated = (float) HDR_CLIP_DEFAULT / exposure_of(0);
+                failures += merged[k] != saturated;
+                ++n_saturated;
+                continue;
+            }
+
+            double ref = sum / weight;
+            double err = fabs(merged[k] - ref) / (ref > 1e-3 ? ref : 1e-3);
+            if (err > max_ref_error) max_ref_error = err;
+
+            // Truncation to whole counts dominates in the deep shadows.
+            double truth = scene(k, c);
+            if (truth > 0.05) {
+                err = fabs(merged[k] - truth) / truth;
+                if (err > max_scene_error) max_scene_error = err;
+            }
+        }
+    }
+    close_raw_frame(frame);
+
+    printf("Merged %d exposures of %ux%u RGBI\n", N_EXPOSURES, width, height);
+    printf("\tadd      : %8.1f ms/frame, %.1f Mpx/s\n",
+           1e3 * t_add / N_EXPOSURES, N_EXPOSURES * n / t_add / 1e6);
+    printf("\tfinish   : %8.1f ms\n", 1e3 * t_finish);
+    printf("\tvs ref   : %8.2e max relative error\n", max_ref_error);
+    printf("\tvs scene : %8.2e max relative error\n", max_scene_error);
+    printf("\tclipped  : %8zu samples in every exposure\n", n_saturated);
+
+    if (max_ref_error > 1e-4 || max_scene_error > 1e-2) {
+        printf("FAILED\n");
+        ++failures;
+    }
+
+    failures += check_corrupt_headers(filename);
+
+    remove(filename);
+    for (int c = 0; c < 4; ++c) {
+        free(planes[c]);
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
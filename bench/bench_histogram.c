@@ -0,0 +1,112 @@
+/* Benchmark for histogram_add() against a plain one-bin-at-a-time loop,
+ * which is kept here as the reference. Both histograms are compared bin by
+ * bin before timings are reported, on noise and on a flat plane, where
+ * every sample hits the same bin.
+ *
+ *     gcc -O2 -Isrc bench/bench_histogram.c src/histogram.c \
+ *         src/threadpool.c -lpthread
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "histogram.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+#define WIDTH  8000
+#define HEIGHT 6000
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void
+reference_histogram(Histogram* histogram, const uint16_t* samples, size_t n)
+{
+    for (size_t k = 0; k < n; ++k) {
+        ++histogram->bins[samples[k] >> HISTOGRAM_SHIFT];
+    }
+    histogram->count += n;
+}
+
+static int
+compare(const char* name, const uint16_t* samples, size_t n)
+{
+    static Histogram ref, hist;
+
+    memset(&ref, 0, sizeof(ref));
+    memset(&hist, 0, sizeof(hist));
+
+    double t0 = now();
+    reference_histogram(&ref, samples, n);
+    double t_ref = now() - t0;
+
+    t0 = now();
+    histogram_add(&hist, samples, n);
+    double t_new = now() - t0;
+
+    double mb = n * sizeof(uint16_t) / 1e6;
+    printf("%-9s reference : %8.1f ms  %8.1f MB/s\n", name, t_ref * 1e3,
+           mb / t_ref);
+    printf("%-9s histogram : %8.1f ms  %8.1f MB/s  (%.1fx)\n", name,
+           t_new * 1e3, mb / t_new, t_ref / t_new);
+
+    if (memcmp(&ref, &hist, sizeof(Histogram)) != 0) {
+        printf("MISMATCH against reference implementation\n");
+        return 1;
+    }
+    return 0;
+}
+
+int
+main()
+{
+    const size_t n = (size_t) WIDTH * HEIGHT;
+    uint16_t* samples = (uint16_t*) malloc(n * sizeof(uint16_t));
+    int failures = 0;
+
+    printf("Histogram of %dx%d samples (%.0f MB), %d bins\n", WIDTH, HEIGHT,
+           n * sizeof(uint16_t) / 1e6, HISTOGRAM_BINS);
+
+    srand(1);
+    for (size_t k = 0; k < n; ++k) samples[k] = (uint16_t) rand();
+    failures += compare("noise", samples, n);
+
+    for (size_t k = 0; k < n; ++k) samples[k] = 4242;
+    failures += compare("flat", samples, n);
+
+    // An odd length leaves a tail for the scalar loop
+    failures += compare("tail", samples + 1, 1001);
+
+    Histogram h = {{0}, 0};
+    for (uint32_t v = 0; v < 65536; ++v) {
+        uint16_t s = (uint16_t) v;
+        histogram_add(&h, &s, 1);
+    }
+    if (histogram_percentile(&h, 0.5) != 32767 ||
+        histogram_percentile(&h, 1.0) != 65535 ||
+        histogram_percentile(&h, 0.0) != (1 << HISTOGRAM_SHIFT) - 1) {
+        printf("percentiles of a uniform histogram are off\n");
+        failures++;
+    }
+
+    free(samples);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
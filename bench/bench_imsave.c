@@ -0,0 +1,220 @@
+/* Benchmark for the PNG writer: throughput and file size of a synthetic
+ * 16-bit scan plane across compression levels, strategies and filters.
+ * Every file is decoded again with libpng and compared with the input.
+ * The band-parallel writer is then timed at 1, 2, 4 and 8 threads, and
+ * against the serial writer for a frame's four channel files.
+ *
+ *     gcc -O2 -Isrc bench/bench_imsave.c src/imsave.c src/threadpool.c \
+ *         -lpng -lz -lpthread
+ *
+ * Usage: bench_imsave [width height [scratch.png]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include <time.h>
+#include <png.h>
+#include <zlib.h>
+
+#include <sys/stat.h>
+
+#include "imsave.h"
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef struct {
+    const char* name;
+    ImsaveOptions opts;
+} Setting;
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Smooth film-like content plus sensor noise in the low bits, which is what
+// makes real scans hard to compress.
+static uint16_t*
+make_plane(size_t width, size_t height)
+{
+    uint16_t* buf = (uint16_t*) malloc(width * height * sizeof(uint16_t));
+
+    srand(1);
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            double v = 20000.0 + 15000.0 * sin(x / 300.0) * cos(y / 170.0);
+            buf[x + width*y] = (uint16_t) (v + rand() % 256);
+        }
+    }
+
+    return buf;
+}
+
+static int
+verify_png16(const char* filename, const uint16_t* expect, size_t width,
+             size_t height)
+{
+    FILE* fp = fopen(filename, "rb");
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                                 NULL, NULL, NULL);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    uint16_t* row = (uint16_t*) malloc(width * sizeof(uint16_t));
+    int status = -1;
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        goto done;
+    }
+
+    png_init_io(png_ptr, fp);
+    png_read_info(png_ptr, info_ptr);
+    if (png_get_image_width(png_ptr, info_ptr) != width ||
+        png_get_image_height(png_ptr, info_ptr) != height ||
+        png_get_bit_depth(png_ptr, info_ptr) != 16) {
+        goto done;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    png_set_swap(png_ptr);
+#endif
+
+    for (size_t y = 0; y < height; ++y) {
+        png_read_row(png_ptr, (png_bytep) row, NULL);
+        if (memcmp(row, expect + y*width, width * sizeof(uint16_t)) != 0) {
+            goto done;
+        }
+    }
+    status = 0;
+
+ done:
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    free(row);
+    fclose(fp);
+    return status;
+}
+
+int
+main(int argc, char** argv)
+{
+    size_t width = argc > 2 ? (size_t) atol(argv[1]) : 4000;
+    size_t height = argc > 2 ? (size_t) atol(argv[2]) : 3000;
+    const char* filename = argc > 3 ? argv[3] : "bench_imsave.png";
+    double mbytes = width * height * sizeof(uint16_t) / 1e6;
+    int failures = 0;
+
+    uint16_t* buf = make_plane(width, height);
+
+    Setting settings[] = {
+        {"default",            imsave_preset(IMSAVE_PRESET_DEFAULT)},
+        {"preset fast",        imsave_preset(IMSAVE_PRESET_FAST)},
+        {"preset none",        imsave_preset(IMSAVE_PRESET_NONE)},
+        {"preset small",       imsave_preset(IMSAVE_PRESET_SMALL)},
+        {"l1 none",            {1, -1, PNG_FILTER_NONE, -1}},
+        {"l1 up",              {1, -1, PNG_FILTER_UP, -1}},
+        {"l1 paeth",           {1, -1, PNG_FILTER_PAETH, -1}},
+        {"l1 all",             {1, -1, PNG_ALL_FILTERS, -1}},
+        {"l1 up rle",          {1, Z_RLE, PNG_FILTER_UP, -1}},
+        {"l1 up huffman",      {1, Z_HUFFMAN_ONLY, PNG_FILTER_UP, -1}},
+        {"l3 up",              {3, -1, PNG_FILTER_UP, -1}},
+        {"l6 up",              {6, -1, PNG_FILTER_UP, -1}},
+        {"l6 up filtered",     {6, Z_FILTERED, PNG_FILTER_UP, -1}},
+        {"l6 all",             {6, -1, PNG_ALL_FILTERS, -1}},
+        {"l9 all",             {9, -1, PNG_ALL_FILTERS, -1}},
+    };
+
+    printf("Encoding %zux%zu 16-bit gray (%.1f MB)\n\n", width, height, mbytes);
+    printf("%-18s %10s %10s %8s\n", "setting", "MB/s", "size MB", "ratio");
+
+    for (size_t k = 0; k < sizeof(settings) / sizeof(settings[0]); ++k) {
+        double t0 = now();
+        int status = imsave16_opts(buf, width, height, 1, filename,
+                                   &settings[k].opts);
+        double dt = now() - t0;
+
+        struct stat st;
+        if (status != 0 || stat(filename, &st) != 0 ||
+            verify_png16(filename, buf, width, height) != 0) {
+            printf("%-18s FAILED\n", settings[k].name);
+            ++failures;
+            continue;
+        }
+
+        printf("%-18s %10.1f %10.2f %8.3f\n", settings[k].name, mbytes / dt,
+               st.st_size / 1e6, st.st_size / 1e6 / mbytes);
+    }
+
+    const char* fast = "preset fast";
+    ImsaveOptions opts = imsave_preset(IMSAVE_PRESET_FAST);
+    const size_t thread_counts[] = {1, 2, 4, 8};
+    double t_serial = 0;
+
+    printf("\n%-18s %10s %10s %8s\n", "parallel", "MB/s", "size MB",
+           "speedup");
+    for (size_t k = 0; k <= sizeof(thread_counts) / sizeof(size_t); ++k) {
+        opts.n_threads = k == 0 ? -1 : (int) thread_counts[k - 1];
+        double t0 = now();
+        int status = imsave16_opts(buf, width, height, 1, filename, &opts);
+        double dt = now() - t0;
+
+        char name[32];
+        if (k == 0) {
+            snprintf(name, sizeof(name), "%s serial", fast);
+            t_serial = dt;
+        } else {
+            snprintf(name, sizeof(name), "%s x%d", fast, opts.n_threads);
+        }
+
+        struct stat st;
+        if (status != 0 || stat(filename, &st) != 0 ||
+            verify_png16(filename, buf, width, height) != 0) {
+            printf("%-18s FAILED\n", name);
+            ++failures;
+            continue;
+        }
+
+        printf("%-18s %10.1f %10.2f %8.2f\n", name, mbytes / dt,
+               st.st_size / 1e6, t_serial / dt);
+    }
+
+    // Four channel files per frame, as the sweep writes them.
+    const uint16_t* planes[4] = {buf, buf, buf, buf};
+    const char* filenames[4] = {"bench_imsave_r.png", "bench_imsave_g.png",
+                                "bench_imsave_b.png", "bench_imsave_i.png"};
+    opts.n_threads = -1;
+
+    double t0 = now();
+    for (int c = 0; c < 4; ++c) {
+        failures += imsave16_opts(planes[c], width, height, 1, filenames[c],
+                                  &opts) != 0;
+    }
+    double t_one_by_one = now() - t0;
+
+    t0 = now();
+    failures += imsave16_planes(planes, filenames, 4, width, height,
+                                &opts) != 0;
+    double t_planes = now() - t0;
+
+    for (int c = 0; c < 4; ++c) {
+        failures += verify_png16(filenames[c], buf, width, height) != 0;
+        remove(filenames[c]);
+    }
+    printf("\n4 planes: %.2f s one by one, %.2f s concurrently (%.2fx)\n",
+           t_one_by_one, t_planes, t_one_by_one / t_planes);
+
+    remove(filename);
+    free(buf);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
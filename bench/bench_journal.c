@@ -0,0 +1,125 @@
+/* Benchmark for the sweep journal: records appended to the journal of the
+ * default plan, then read back on resume. A journal whose last record was
+ * torn by a crash is resumed and added to, which must keep the torn record
+ * out of the next resume and every record after it in.
+ *
+ *     gcc -O2 -Isrc bench/bench_journal.c src/journal.c src/sweep.c -lm \
+ *         -lpthread
+ *
+ * Usage: bench_journal [records [scratch file]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Points 2 to 12 done and the record of 12 torn down to "done 1", as a
+// crash halfway through writing it leaves it. Resuming and marking 13 must
+// leave 2 to 11 and 13 done, not 1 read back from the torn record glued to
+// the next one.
+static int
+check_torn(const char* filename, const SweepPlan* plan)
+{
+    SweepJournal* journal = open_sweep_journal(filename, plan, false);
+    int failures = 0;
+
+    if (!journal) return 1;
+    for (size_t k = 2; k <= 12; ++k) sweep_journal_mark_done(journal, k);
+    close_sweep_journal(journal);
+
+    FILE* file = fopen(filename, "r");
+    if (!file || fseek(file, 0, SEEK_END) != 0) {
+        if (file) fclose(file);
+        return 1;
+    }
+    const long size = ftell(file);
+    fclose(file);
+    if (truncate(filename, size - 2) != 0) return 1;   // "done 12\n"
+
+    journal = open_sweep_journal(filename, plan, true);
+    if (!journal) return 1;
+    failures += sweep_journal_done(journal, 12);
+    failures += sweep_journal_count_done(journal) != 10;
+    sweep_journal_mark_done(journal, 13);
+    close_sweep_journal(journal);
+
+    journal = open_sweep_journal(filename, plan, true);
+    if (!journal) return 1;
+    for (size_t k = 0; k < plan->n_points; ++k) {
+        const bool expected = (k >= 2 && k < 12) || k == 13;
+        if (sweep_journal_done(journal, k) != expected) {
+            printf("torn record: point %zu %s\n", k,
+                   expected ? "lost" : "marked done");
+            failures++;
+        }
+    }
+    close_sweep_journal(journal);
+
+    return failures;
+}
+
+int
+main(int argc, char** argv)
+{
+    size_t n_records = argc > 1 ? (size_t) atol(argv[1]) : 100000;
+    const char* filename = argc > 2 ? argv[2] : "bench_journal.journal";
+    const ScanSettings base = {.resolution = 1200};
+    SweepConfig config;
+    SweepPlan plan;
+    int failures = 0;
+
+    sweep_config_default(&config);
+    if (sweep_plan(&plan, &config, &base) != 0 || plan.n_points < 14) {
+        printf("unable to plan the default sweep\n");
+        return EXIT_FAILURE;
+    }
+
+    // Appending, points over and over, as several scanners would
+    SweepJournal* journal = open_sweep_journal(filename, &plan, false);
+    if (!journal) return EXIT_FAILURE;
+    double t0 = now();
+    for (size_t k = 0; k < n_records; ++k) {
+        sweep_journal_mark_done(journal, k % plan.n_points);
+    }
+    double t_append = now() - t0;
+    close_sweep_journal(journal);
+
+    // Reading them back
+    t0 = now();
+    journal = open_sweep_journal(filename, &plan, true);
+    double t_resume = now() - t0;
+    if (!journal ||
+        sweep_journal_count_done(journal) !=
+        (n_records < plan.n_points ? n_records : plan.n_points)) {
+        printf("records lost on resume\n");
+        failures++;
+    }
+    close_sweep_journal(journal);
+
+    failures += check_torn(filename, &plan);
+
+    printf("Journal of %zu points, %zu records\n", plan.n_points, n_records);
+    printf("append    : %8.2f us/record\n", t_append * 1e6 / n_records);
+    printf("resume    : %8.2f ms\n", t_resume * 1e3);
+    printf("torn      : %s\n", failures ? "FAILED" : "ok");
+
+    sweep_plan_free(&plan);
+    remove(filename);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
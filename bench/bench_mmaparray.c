@@ -0,0 +1,200 @@
+/* Benchmark for the mmap writer: page faults and write throughput of one
+ * frame plane written through a fresh mapping, for the old lseek+write
+ * sparse-file writer and for the option combinations of the current one.
+ * Every file is read back and checked.
+ *
+ *     gcc -O2 -Isrc bench/bench_mmaparray.c src/mmaparray.c
+ *
+ * Usage: bench_mmaparray [megabytes [scratch file]]
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "mmaparray.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+#define ROUNDS 3
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef struct {
+    const char* name;
+    MmapOptions opts;
+    bool legacy;   // The lseek+write writer this module used to have
+    bool reuse;    // Leave the file from the previous round in place
+} Setting;
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static long
+page_faults(long* major)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    *major = ru.ru_majflt;
+    return ru.ru_minflt;
+}
+
+static MmapArray*
+legacy_mmap_writer(const char* filename, size_t size)
+{
+    MmapArray* result = (MmapArray*) malloc(sizeof(MmapArray));
+    result->size = size;
+
+    int fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, (mode_t)0600);
+    if (lseek(fd, size - 1, SEEK_SET) == -1 || write(fd, "", 1) == -1) {
+        close(fd);
+        free(result);
+        return NULL;
+    }
+
+    result->data = mmap(0, size, PROT_READ|PROT_WRITE, MAP_FILE|MAP_SHARED,
+                        fd, 0);
+    close(fd);
+    if (result->data == MAP_FAILED) {
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+// Writes the plane row by row, the way the de-interleave fills it.
+static void
+fill(uint16_t* data, size_t n, uint16_t seed)
+{
+    for (size_t k = 0; k < n; ++k) {
+        data[k] = (uint16_t) (k * 2654435761u >> 16) ^ seed;
+    }
+}
+
+static int
+verify(const char* filename, size_t n, uint16_t seed)
+{
+    MmapArray* arr = get_mmap_reader(filename);
+    int status = -1;
+
+    if (arr && arr->size == n * sizeof(uint16_t)) {
+        const uint16_t* data = (const uint16_t*) arr->data;
+        size_t k = 0;
+        while (k < n &&
+               data[k] == ((uint16_t) (k * 2654435761u >> 16) ^ seed)) {
+            ++k;
+        }
+        status = k == n ? 0 : -1;
+    }
+
+    if (arr) free_mmap_array(arr);
+    return status;
+}
+
+int
+main(int argc, char** argv)
+{
+    size_t mbytes = argc > 1 ? (size_t) atol(argv[1]) : 96;
+    const char* filename = argc > 2 ? argv[2] : "bench_mmaparray.mmarr";
+    size_t size = mbytes * 1000 * 1000 & ~(size_t) 1;
+    size_t n = size / sizeof(uint16_t);
+    int failures = 0;
+
+    Setting settings[] = {
+        {"legacy",            {0},                               true,  false},
+        {"sparse",            {MMAP_ACCESS_DEFAULT, 0, 0, 0},    false, false},
+        {"sparse seq",        {MMAP_ACCESS_SEQUENTIAL, 0, 0, 0}, false, false},
+        {"prealloc",          {MMAP_ACCESS_DEFAULT, 1, 0, 0},    false, false},
+        {"prealloc seq",      {MMAP_ACCESS_SEQUENTIAL, 1, 0, 0}, false, false},
+        {"prealloc populate", {MMAP_ACCESS_SEQUENTIAL, 1, 1, 0}, false, false},
+        {"prealloc huge",     {MMAP_ACCESS_SEQUENTIAL, 1, 0, 1}, false, false},
+        {"reuse",             {MMAP_ACCESS_SEQUENTIAL, 1, 0, 0}, false, true},
+        {"reuse populate",    {MMAP_ACCESS_SEQUENTIAL, 1, 1, 0}, false, true},
+    };
+
+    printf("Writing %.1f MB through a fresh mapping, best of %d\n\n",
+           size / 1e6, ROUNDS);
+    printf("%-18s %10s %10s %10s %8s\n", "setting", "MB/s", "open ms",
+           "minflt", "majflt");
+
+    for (size_t s = 0; s < sizeof(settings) / sizeof(settings[0]); ++s) {
+        double best = 0, best_open = 0;
+        long best_minor = 0, best_major = 0;
+
+        for (int round = 0; round < ROUNDS; ++round) {
+            // Reuse runs find the file of the run before them in place.
+            if (!settings[s].reuse) {
+                remove(filename);
+            }
+
+            long major0, major1;
+            long minor0 = page_faults(&major0);
+            double t0 = now();
+
+            MmapArray* arr = NULL;
+            if (settings[s].legacy) {
+                arr = legacy_mmap_writer(filename, size);
+            } else if (get_mmap_writer_opts(&arr, filename, size,
+                                            &settings[s].opts) != 0) {
+                arr = NULL;
+            }
+            if (!arr) {
+                ++failures;
+                break;
+            }
+
+            double t1 = now();
+            fill((uint16_t*) arr->data, n, (uint16_t) round);
+            free_mmap_array(arr);
+            double t2 = now();
+            long minor1 = page_faults(&major1);
+
+            if (verify(filename, n, (uint16_t) round) != 0) {
+                ++failures;
+                break;
+            }
+
+            if (round == 0 || t2 - t0 < best) {
+                best = t2 - t0;
+                best_open = t1 - t0;
+                best_minor = minor1 - minor0;
+                best_major = major1 - major0;
+            }
+        }
+
+        if (best == 0) {
+            printf("%-18s FAILED\n", settings[s].name);
+            continue;
+        }
+        printf("%-18s %10.1f %10.2f %10ld %8ld\n", settings[s].name,
+               size / 1e6 / best, 1e3 * best_open, best_minor, best_major);
+    }
+
+    remove(filename);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
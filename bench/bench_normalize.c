@@ -0,0 +1,159 @@
+/* Benchmark for normalize_image() against the original two-pass
+ * double-precision implementation, which is kept here as the reference.
+ * The output of both is compared sample by sample before timings are
+ * reported, then flat channels and ranges of the caller's are checked.
+ * Images come from new_image(), so the mock backend stands in for libsane.
+ *
+ *     make build/release/bench_normalize
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "normalize.h"
+#include "threadpool.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+#define WIDTH  8000
+#define HEIGHT 6000
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void
+reference_normalize_plane(uint16_t* p, size_t n)
+{
+    uint16_t minval = 65535;
+    uint16_t maxval = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        if (p[i] < minval) minval = p[i];
+        if (p[i] > maxval) maxval = p[i];
+    }
+
+    double range = maxval - minval;
+    for (size_t i = 0; i < n; ++i) {
+        p[i] = (uint16_t) round(65535.0 * ((double) (p[i] - minval)) / range);
+    }
+}
+
+static Image*
+make_image(uint32_t width, uint32_t height)
+{
+    Image* im = new_image();
+    size_t n = (size_t) width * height;
+    if (!im || resize_image(im, width, height) != 0) {
+        printf("out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Different ranges per channel, like an underexposed scan
+    srand(1);
+    for (size_t k = 0; k < n; ++k) {
+        im->r[k] = (uint16_t) (1200 + rand() % 30000);
+        im->g[k] = (uint16_t) (800 + rand() % 41000);
+        im->b[k] = (uint16_t) (rand() % 9000);
+        im->i[k] = (uint16_t) (20000 + rand() % 45535);
+    }
+
+    return im;
+}
+
+int
+main()
+{
+    size_t n = (size_t) WIDTH * HEIGHT;
+    Image* im = make_image(WIDTH, HEIGHT);
+    Image* ref = make_image(WIDTH, HEIGHT);
+    int status = EXIT_SUCCESS;
+
+    printf("Normalizing %dx%d RGBI (%.0f MB), %zu threads\n", WIDTH, HEIGHT,
+           4.0 * n * sizeof(uint16_t) / 1e6, get_n_threads());
+
+    double t0 = now();
+    reference_normalize_plane(ref->r, n);
+    reference_normalize_plane(ref->g, n);
+    reference_normalize_plane(ref->b, n);
+    reference_normalize_plane(ref->i, n);
+    double t_ref = now() - t0;
+
+    t0 = now();
+    if (normalize_image(im) != 0) {
+        printf("out of memory\n");
+        return EXIT_FAILURE;
+    }
+    double t_new = now() - t0;
+
+    if (memcmp(im->r, ref->r, n * sizeof(uint16_t)) ||
+        memcmp(im->g, ref->g, n * sizeof(uint16_t)) ||
+        memcmp(im->b, ref->b, n * sizeof(uint16_t)) ||
+        memcmp(im->i, ref->i, n * sizeof(uint16_t))) {
+        printf("MISMATCH against reference implementation\n");
+        status = EXIT_FAILURE;
+    }
+
+    printf("reference : %8.1f ms\n", t_ref * 1e3);
+    printf("normalize : %8.1f ms  (%.1fx)\n", t_new * 1e3, t_ref / t_new);
+
+    // A flat channel used to divide by zero
+    for (size_t k = 0; k < n; ++k) im->b[k] = 4242;
+    normalize_image(im);
+    for (size_t k = 0; k < n; ++k) {
+        if (im->b[k] != 0) {
+            printf("flat channel not mapped to zero\n");
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    // Values outside a caller's range clamp to the ends, even when the
+    // range is flat (g) or inverted (b)
+    const ChannelRange ranges[4] = {{1000, 3000}, {2000, 2000},
+                                    {3000, 1000}, {1000, 3000}};
+    uint16_t* const clamped[3] = {im->r, im->g, im->b};
+    static const uint16_t inputs[3][4] = {
+        {500, 2000, 3001, 65535},
+        {500, 2000, 2001, 65535},
+        {500, 1000, 1001, 65535},
+    };
+    static const uint16_t expected[3][4] = {
+        {0, 32768, 65535, 65535},
+        {0, 0, 65535, 65535},
+        {0, 0, 65535, 65535},
+    };
+    for (int c = 0; c < 3; ++c) {
+        memcpy(clamped[c], inputs[c], sizeof(inputs[c]));
+    }
+    normalize_image_ranges(im, ranges);
+    for (int c = 0; c < 3; ++c) {
+        if (memcmp(clamped[c], expected[c], sizeof(expected[c])) != 0) {
+            printf("values outside range %d not clamped: %u %u %u %u\n", c,
+                   clamped[c][0], clamped[c][1], clamped[c][2],
+                   clamped[c][3]);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    free_image(im);
+    free_image(ref);
+    return status;
+}
@@ -0,0 +1,148 @@
+/* End-to-end benchmark of the default sweep in main.c, scanning from the
+ * mock backend in mocksane.c instead of a real scanner. main.c is compiled
+ * in unchanged and run as is, in a scratch directory it writes raw/, hdr/
+ * and png/ to. It reports its own per-stage timings;
+ * this adds peak RSS and the size of what was written.
+ *
+ *     gcc -O2 -Isrc bench/bench_sweep.c bench/mocksane.c src/piescan.c \
+ *         src/deinterleave.c src/framequeue.c src/hdrmerge.c src/imsave.c \
+ *         src/mmaparray.c src/normalize.c src/rawframe.c src/sweep.c \
+ *         src/threadpool.c -lpng -lz -lm -lpthread
+ *
+ * Only the SANE headers are needed, not libsane.
+ *
+ * Usage: bench_sweep [width height [line_us [chunk [scratch dir]]]]
+ *                    [key=value]...
+ *
+ * The arguments set the MOCKSANE_* variables described in mocksane.c; the
+ * frame size defaults to 2000x1500. The scratch directory is removed
+ * afterwards unless one was given. key=value arguments, wherever they are,
+ * go to the sweep, so
+ *
+ *     MOCKSANE_DEVICES=2 bench_sweep devices=all
+ *
+ * runs it on two mock scanners at once.
+ */
+#define _GNU_SOURCE
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+// The sweep itself, with its main() renamed so it can be called from here.
+#define main piescan_main
+#include "main.c"
+#undef main
+
+
+
+/*****************************************************************************\
+| Global variables                                                            |
+\*****************************************************************************/
+
+static char scratch[4096];
+static bool keep_scratch;
+static size_t output_bytes;
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+static int
+count_file(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+    (void) path;
+    (void) ftw;
+
+    if (type == FTW_F) output_bytes += (size_t) st->st_size;
+    return 0;
+}
+
+static int
+remove_file(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+    (void) st;
+    (void) type;
+    (void) ftw;
+
+    return remove(path);
+}
+
+static void
+report(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    nftw(scratch, count_file, 16, FTW_PHYS);
+
+    printf("\nPeak RSS: %.1f MB\n", usage.ru_maxrss / 1024.0);
+    printf("Written : %.1f MB in %s\n", output_bytes / 1e6, scratch);
+
+    if (!keep_scratch) {
+        nftw(scratch, remove_file, 16, FTW_DEPTH | FTW_PHYS);
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    char** sweep_argv = (char**) calloc((size_t) argc + 1, sizeof(char*));
+    int sweep_argc = 1;
+
+    // Leave the positional arguments in argv and pass the rest on.
+    sweep_argv[0] = argv[0];
+    int n = 1;
+    for (int a = 1; a < argc; ++a) {
+        if (strchr(argv[a], '=')) {
+            sweep_argv[sweep_argc++] = argv[a];
+        } else {
+            argv[n++] = argv[a];
+        }
+    }
+    argc = n;
+
+    setenv("MOCKSANE_WIDTH", argc > 2 ? argv[1] : "2000", argc > 2);
+    setenv("MOCKSANE_HEIGHT", argc > 2 ? argv[2] : "1500", argc > 2);
+    if (argc > 3) setenv("MOCKSANE_LINE_US", argv[3], 1);
+    if (argc > 4) setenv("MOCKSANE_CHUNK", argv[4], 1);
+
+    if (argc > 5) {
+        keep_scratch = true;
+        mkdir(argv[5], 0755);
+        if (!realpath(argv[5], scratch)) {
+            perror(argv[5]);
+            free(sweep_argv);
+            return EXIT_FAILURE;
+        }
+    } else {
+        char name[] = "bench_sweep.XXXXXX";
+        if (!mkdtemp(name) || !realpath(name, scratch)) {
+            perror("mkdtemp");
+            free(sweep_argv);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (chdir(scratch) != 0) {
+        perror(scratch);
+        free(sweep_argv);
+        return EXIT_FAILURE;
+    }
+
+    printf("Sweep of %sx%s frames from the mock backend in %s\n",
+           getenv("MOCKSANE_WIDTH"), getenv("MOCKSANE_HEIGHT"), scratch);
+
+    int status = piescan_main(sweep_argc, sweep_argv);
+    report();
+    free(sweep_argv);
+
+    return status;
+}
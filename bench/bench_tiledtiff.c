@@ -0,0 +1,466 @@
+/* Benchmark for the tiled, pyramid-backed TIFF writer against the per-channel
+ * PNGs the sweep writes. A synthetic RGBI frame is streamed into the TIFF in
+ * uneven batches of lines, then read back here: every tile of every level
+ * is inflated and checked against a reference pyramid of 2x2 box filtered
+ * copies. The time to open the file and read its thumbnail, or one tile of
+ * the full image, is reported next to decoding a whole PNG. A small frame
+ * of odd size is also written stored, without compression.
+ *
+ *     gcc -O2 -Isrc bench/bench_tiledtiff.c src/tiledtiff.c src/imsave.c \
+ *         src/threadpool.c -lpng -lz -lpthread
+ *
+ * Usage: bench_tiledtiff [width height [scratch directory]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <png.h>
+#include <zlib.h>
+
+#include "tiledtiff.h"
+#include "imsave.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// Lines a scan hands over at a time, cycled through.
+#define N_BATCHES 5
+static const uint32_t batches[N_BATCHES] = {37, 1, 200, 64, 13};
+
+#define PATH_SIZE 512
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+// What the reader needs of a directory.
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t tile_size;
+    uint16_t n_channels;
+    uint16_t compression;
+    uint16_t predictor;
+    uint64_t n_tiles;
+    uint64_t* offsets;
+    uint64_t* byte_counts;
+    uint64_t next;
+} Directory;
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void
+synthesize(uint16_t* planes[4], uint32_t width, uint32_t height)
+{
+    for (uint32_t y = 0; y < height; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            const size_t k = (size_t) y * width + x;
+            for (int c = 0; c < 4; ++c) {
+                planes[c][k] = (uint16_t) ((x * (c + 1) * 7 + y * 13) % 50000
+                                           + (rand() & 63));
+            }
+        }
+    }
+}
+
+// Level k + 1 from level k, as the writer's box filter has it.
+static void
+reduce(uint16_t* const* src, uint32_t width, uint32_t height,
+       uint16_t** dst)
+{
+    const uint32_t w = (width + 1) / 2, h = (height + 1) / 2;
+
+    for (int c = 0; c < 4; ++c) {
+        for (uint32_t y = 0; y < h; ++y) {
+            const uint32_t y0 = 2 * y;
+            const uint32_t y1 = 2 * y + 1 < height ? 2 * y + 1 : 2 * y;
+            for (uint32_t x = 0; x < w; ++x) {
+                const uint32_t x0 = 2 * x;
+                const uint32_t x1 = 2 * x + 1 < width ? 2 * x + 1 : 2 * x;
+                uint32_t s = (uint32_t) src[c][(size_t) y0 * width + x0]
+                           + src[c][(size_t) y0 * width + x1]
+                           + src[c][(size_t) y1 * width + x0]
+                           + src[c][(size_t) y1 * width + x1];
+                dst[c][(size_t) y * w + x] = (uint16_t) ((s + 2) >> 2);
+            }
+        }
+    }
+}
+
+static uint64_t
+read_u64(FILE* fp, uint64_t offset)
+{
+    uint64_t v = 0;
+    if (fseeko(fp, (off_t) offset, SEEK_SET) != 0 ||
+        fread(&v, sizeof(v), 1, fp) != 1) {
+        return 0;
+    }
+    return v;
+}
+
+// Reads the directory at offset, in the machine's byte order. Directories
+// and the arrays they point to must start on a word boundary.
+static int
+read_directory(FILE* fp, uint64_t offset, Directory* dir)
+{
+    memset(dir, 0, sizeof(Directory));
+    if (offset % 2) return -1;
+    uint64_t n_entries = read_u64(fp, offset);
+    if (n_entries == 0 || n_entries > 64) return -1;
+
+    uint64_t offsets_at = 0, counts_at = 0;
+    for (uint64_t e = 0; e < n_entries; ++e) {
+        uint16_t tag, type;
+        uint64_t count;
+        union { uint64_t u64; uint32_t u32; uint16_t u16; } value;
+        if (fread(&tag, 2, 1, fp) != 1 || fread(&type, 2, 1, fp) != 1 ||
+            fread(&count, 8, 1, fp) != 1 || fread(&value, 8, 1, fp) != 1) {
+            return -1;
+        }
+        const uint32_t scalar = type == 3 ? value.u16 : value.u32;
+        switch (tag) {
+            case 256: dir->width = scalar; break;
+            case 257: dir->height = scalar; break;
+            case 259: dir->compression = (uint16_t) scalar; break;
+            case 277: dir->n_channels = (uint16_t) scalar; break;
+            case 317: dir->predictor = (uint16_t) scalar; break;
+            case 322: dir->tile_size = scalar; break;
+            case 324: dir->n_tiles = count; offsets_at = value.u64; break;
+            case 325: counts_at = value.u64; break;
+        }
+    }
+    dir->next = read_u64(fp, offset + 8 + n_entries * 20);
+
+    if (dir->n_tiles > 1 && (offsets_at % 2 || counts_at % 2)) return -1;
+
+    dir->offsets = (uint64_t*) malloc(dir->n_tiles * sizeof(uint64_t));
+    dir->byte_counts = (uint64_t*) malloc(dir->n_tiles * sizeof(uint64_t));
+    if (dir->n_tiles == 1) {
+        dir->offsets[0] = offsets_at;
+        dir->byte_counts[0] = counts_at;
+    } else if (fseeko(fp, (off_t) offsets_at, SEEK_SET) != 0 ||
+               fread(dir->offsets, 8, dir->n_tiles, fp) != dir->n_tiles ||
+               fseeko(fp, (off_t) counts_at, SEEK_SET) != 0 ||
+               fread(dir->byte_counts, 8, dir->n_tiles, fp) != dir->n_tiles) {
+        return -1;
+    }
+    return 0;
+}
+
+// Reads, inflates and un-differences tile t into tile, which holds
+// tile_size^2 pixels of n_channels.
+static int
+read_tile(FILE* fp, const Directory* dir, uint64_t t, uint16_t* tile)
+{
+    const size_t n = dir->n_channels;
+    const size_t ts = dir->tile_size;
+    const size_t tile_bytes = ts * ts * n * sizeof(uint16_t);
+    uint8_t* data = (uint8_t*) malloc(dir->byte_counts[t]);
+    int status = -1;
+
+    if (fseeko(fp, (off_t) dir->offsets[t], SEEK_SET) != 0 ||
+        fread(data, 1, dir->byte_counts[t], fp) != dir->byte_counts[t]) {
+        goto done;
+    }
+    if (dir->compression == 1) {
+        if (dir->byte_counts[t] != tile_bytes) goto done;
+        memcpy(tile, data, tile_bytes);
+    } else {
+        uLongf size = (uLongf) tile_bytes;
+        if (uncompress((Bytef*) tile, &size, data, dir->byte_counts[t])
+                != Z_OK || size != tile_bytes) {
+            goto done;
+        }
+    }
+    if (dir->predictor == 2) {
+        for (size_t y = 0; y < ts; ++y) {
+            uint16_t* row = tile + y * ts * n;
+            for (size_t k = n; k < ts * n; ++k) row[k] += row[k - n];
+        }
+    }
+    status = 0;
+
+done:
+    free(data);
+    return status;
+}
+
+// Checks every tile of every level of filename against the reference
+// pyramid of planes. Returns the number of failures.
+static int
+verify(const char* filename, uint16_t* planes[4], uint32_t width,
+       uint32_t height, size_t* n_levels)
+{
+    FILE* fp = fopen(filename, "rb");
+    char header[8];
+    int failures = 0;
+
+    if (!fp || fread(header, 1, 8, fp) != 8 || header[2] != 43) {
+        printf("%s: not a BigTIFF\n", filename);
+        if (fp) fclose(fp);
+        return 1;
+    }
+
+    uint16_t* level[4];
+    uint16_t* next[4];
+    for (int c = 0; c < 4; ++c) {
+        level[c] = (uint16_t*) malloc((size_t) width * height * 2);
+        next[c] = (uint16_t*) malloc((size_t) width * height * 2);
+        memcpy(level[c], planes[c], (size_t) width * height * 2);
+    }
+
+    uint64_t offset = read_u64(fp, 8);
+    uint32_t w = width, h = height;
+    *n_levels = 0;
+    while (offset && !failures) {
+        Directory dir;
+        if (read_directory(fp, offset, &dir) != 0 || dir.width != w ||
+            dir.height != h || dir.n_channels != 4) {
+            printf("%s: level %zu directory is off\n", filename, *n_levels);
+            failures++;
+            break;
+        }
+
+        const size_t ts = dir.tile_size;
+        const uint32_t across = (uint32_t) ((w + ts - 1) / ts);
+        uint16_t* tile = (uint16_t*) malloc(ts * ts * 4 * 2);
+        for (uint64_t t = 0; t < dir.n_tiles && !failures; ++t) {
+            const size_t x0 = (t % across) * ts, y0 = (t / across) * ts;
+            if (read_tile(fp, &dir, t, tile) != 0) {
+                printf("%s: level %zu tile %" PRIu64 " unreadable\n",
+                       filename, *n_levels, t);
+                failures++;
+                break;
+            }
+            for (size_t y = 0; y < ts; ++y) {
+                for (size_t x = 0; x < ts; ++x) {
+                    for (int c = 0; c < 4; ++c) {
+                        uint16_t want = x0 + x < w && y0 + y < h
+                            ? level[c][(y0 + y) * w + x0 + x] : 0;
+                        if (tile[(y * ts + x) * 4 + c] != want) {
+                            failures++;
+                        }
+                    }
+                }
+            }
+            if (failures) {
+                printf("%s: level %zu tile %" PRIu64 " MISMATCH against "
+                       "reference\n", filename, *n_levels, t);
+            }
+        }
+        free(tile);
+        free(dir.offsets);
+        free(dir.byte_counts);
+
+        ++*n_levels;
+        offset = dir.next;
+        if (offset) {
+            reduce(level, w, h, next);
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+            for (int c = 0; c < 4; ++c) {
+                uint16_t* tmp = level[c]; level[c] = next[c]; next[c] = tmp;
+            }
+        } else if (w > ts || h > ts) {
+            printf("%s: smallest level is %ux%u\n", filename, w, h);
+            failures++;
+        }
+    }
+
+    for (int c = 0; c < 4; ++c) {
+        free(level[c]);
+        free(next[c]);
+    }
+    fclose(fp);
+    return failures;
+}
+
+// Opens filename and reads one tile: the only one of the last level, or
+// the first of the full image.
+static int
+read_one_tile(const char* filename, int thumbnail)
+{
+    FILE* fp = fopen(filename, "rb");
+    Directory dir = {0};
+    int status = -1;
+
+    if (!fp) return -1;
+    uint64_t offset = read_u64(fp, 8);
+    while (offset) {
+        free(dir.offsets);
+        free(dir.byte_counts);
+        if (read_directory(fp, offset, &dir) != 0) break;
+        offset = thumbnail ? dir.next : 0;
+    }
+    if (dir.n_tiles) {
+        uint16_t* tile = (uint16_t*) malloc((size_t) dir.tile_size
+                                            * dir.tile_size * 4 * 2);
+        status = read_tile(fp, &dir, 0, tile);
+        free(tile);
+    }
+    free(dir.offsets);
+    free(dir.byte_counts);
+    fclose(fp);
+    return status;
+}
+
+static double
+decode_png(const char* filename)
+{
+    png_image image;
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+
+    double t0 = now();
+    if (!png_image_begin_read_from_file(&image, filename)) return -1;
+    image.format = PNG_FORMAT_LINEAR_Y;
+    void* buf = malloc(PNG_IMAGE_SIZE(image));
+    int ok = png_image_finish_read(&image, NULL, buf, 0, NULL);
+    free(buf);
+    return ok ? now() - t0 : -1;
+}
+
+static long
+file_size(const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) return -1;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+int
+main(int argc, char** argv)
+{
+    uint32_t width = argc > 2 ? (uint32_t) atol(argv[1]) : 4000;
+    uint32_t height = argc > 2 ? (uint32_t) atol(argv[2]) : 3000;
+    const char* dir = argc > 3 ? argv[3] : ".";
+    const size_t n = (size_t) width * height;
+    char tif[PATH_SIZE], small[PATH_SIZE], pngs[4][PATH_SIZE];
+    int failures = 0;
+
+    snprintf(tif, sizeof(tif), "%s/bench_tiledtiff.tif", dir);
+    snprintf(small, sizeof(small), "%s/bench_tiledtiff_small.tif", dir);
+    for (int c = 0; c < 4; ++c) {
+        snprintf(pngs[c], sizeof(pngs[c]), "%s/bench_tiledtiff_%c.png", dir,
+                 "rgbi"[c]);
+    }
+
+    uint16_t* planes[4];
+    for (int c = 0; c < 4; ++c) {
+        planes[c] = (uint16_t*) malloc(n * sizeof(uint16_t));
+    }
+    srand(1);
+    synthesize(planes, width, height);
+
+    // Streamed, as a scan delivers lines
+    TiledTiffOptions options = tiled_tiff_default();
+    TiledTiff* tiff;
+    double t0 = now();
+    if (open_tiled_tiff(&tiff, tif, width, height, 4, &options) != 0) {
+        printf("unable to create %s\n", tif);
+        return EXIT_FAILURE;
+    }
+    uint32_t lines = 0;
+    for (int b = 0; lines < height; b = (b + 1) % N_BATCHES) {
+        uint32_t m = batches[b] < height - lines ? batches[b]
+                                                 : height - lines;
+        const uint16_t* rows[4];
+        for (int c = 0; c < 4; ++c) {
+            rows[c] = planes[c] + (size_t) lines * width;
+        }
+        failures += tiled_tiff_write_lines(tiff, rows, m) != 0;
+        lines += m;
+    }
+    failures += close_tiled_tiff(tiff) != 0;
+    double t_tiff = now() - t0;
+
+    const ImsaveOptions png_options = imsave_preset(IMSAVE_PRESET_FAST);
+    const char* names[4] = {pngs[0], pngs[1], pngs[2], pngs[3]};
+    t0 = now();
+    failures += imsave16_planes((const uint16_t* const*) planes, names, 4,
+                                width, height, &png_options) != 0;
+    double t_png = now() - t0;
+
+    size_t n_levels;
+    failures += verify(tif, planes, width, height, &n_levels);
+
+    t0 = now();
+    failures += read_one_tile(tif, 1) != 0;
+    double t_thumb = now() - t0;
+    t0 = now();
+    failures += read_one_tile(tif, 0) != 0;
+    double t_tile = now() - t0;
+    double t_decode = decode_png(pngs[0]);
+    failures += t_decode < 0;
+
+    long png_size = 0;
+    for (int c = 0; c < 4; ++c) png_size += file_size(pngs[c]);
+
+    double mb = 4.0 * n * sizeof(uint16_t) / 1e6;
+    printf("Tiled TIFF of %ux%u RGBI (%.0f MB), %u tiles, %zu levels\n",
+           width, height, mb, options.tile_size, n_levels);
+    printf("png       : %8.1f ms  %8.1f MB/s  %6.1f MB\n", t_png * 1e3,
+           mb / t_png, png_size / 1e6);
+    printf("tiff      : %8.1f ms  %8.1f MB/s  %6.1f MB\n", t_tiff * 1e3,
+           mb / t_tiff, file_size(tif) / 1e6);
+    printf("thumbnail : %8.2f ms  (decoding one channel's png: %.1f ms)\n",
+           t_thumb * 1e3, t_decode * 1e3);
+    printf("one tile  : %8.2f ms\n", t_tile * 1e3);
+
+    // Odd sizes, small tiles, stored
+    const uint32_t sw = 1001, sh = 777;
+    if (sw <= width && sh <= height) {
+        uint16_t* sub[4];
+        for (int c = 0; c < 4; ++c) {
+            sub[c] = (uint16_t*) malloc((size_t) sw * sh * 2);
+            for (uint32_t y = 0; y < sh; ++y) {
+                memcpy(sub[c] + (size_t) y * sw,
+                       planes[c] + (size_t) y * width, sw * 2);
+            }
+        }
+        Image im = {.width = sw, .height = sh,
+                    .r = sub[0], .g = sub[1], .b = sub[2], .i = sub[3]};
+        TiledTiffOptions stored = {.tile_size = 64};
+        failures += save_tiled_tiff(&im, small, &stored) != 0;
+        failures += verify(small, sub, sw, sh, &n_levels);
+        for (int c = 0; c < 4; ++c) free(sub[c]);
+    }
+
+    // A line too many is refused.
+    if (open_tiled_tiff(&tiff, small, 16, 1, 4, NULL) == 0) {
+        const uint16_t* rows[4] = {planes[0], planes[1], planes[2],
+                                   planes[3]};
+        failures += tiled_tiff_write_lines(tiff, rows, 2) == 0;
+        failures += close_tiled_tiff(tiff) == 0;
+    }
+
+    remove(tif);
+    remove(small);
+    for (int c = 0; c < 4; ++c) {
+        remove(pngs[c]);
+        free(planes[c]);
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,759 @@
+/* A stand-in for the pie SANE backend, linked in place of libsane so that the
+ * whole pipeline can be run and timed without a scanner attached. It
+ * implements the SANE API in-process, offers the options piescan sets under
+ * the same names and indices as the real backend, with comparable
+ * constraints, and synthesizes interleaved frames whose size follows the
+ * resolution and scan area and whose sample values follow the exposure,
+ * gain, offset and light settings.
+ *
+ * Only the SANE headers are needed to build it; see bench_sweep.c. The
+ * environment tunes it:
+ *
+ *     MOCKSANE_WIDTH, MOCKSANE_HEIGHT  Frame size in pixels, overriding the
+ *                                      size the scan area would have
+ *     MOCKSANE_LINE_US                 Time the device takes per line, paced
+ *                                      against the start of the frame
+ *     MOCKSANE_CHUNK                   Largest number of bytes a sane_read()
+ *                                      returns, 0 for as many as asked for
+ *     MOCKSANE_BUSY_EVERY              Every nth sane_start() reports
+ *                                      SANE_STATUS_DEVICE_BUSY
+ *     MOCKSANE_IO_ERROR_EVERY          Every nth frame fails halfway with
+ *                                      SANE_STATUS_IO_ERROR
+ *     MOCKSANE_DEVICES                 Number of scanners attached, named
+ *                                      mock:pie, mock:pie:1, mock:pie:2...
+ *     MOCKSANE_DUST                    Number of dust specks on the film,
+ *                                      dark in every channel and darker in
+ *                                      infrared
+ *
+ * A chunk that isn't a multiple of the line size returns partial lines, as
+ * real backends may. sane_cancel() only flags the scan as stopped, so it
+ * can be called from a signal handler. Each scanner has its own state and
+ * counters, so several can be driven from different threads at once.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <sane/sane.h>
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+#define N_OPTIONS 44
+#define STRING_SIZE 32
+
+#define MM_PER_INCH 25.4
+
+#define MAX_DEVICES 16
+#define NAME_SIZE 32
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef struct {
+    SANE_Option_Descriptor desc;
+    SANE_Word word;
+    char string[STRING_SIZE];
+} MockOption;
+
+typedef struct {
+    const char* name;
+    MockOption options[N_OPTIONS];
+
+    // Set by sane_start()
+    volatile bool scanning;
+    SANE_Parameters parm;
+    int n_channels;
+    uint8_t* line;
+    float* row;              // Scene along a line, per channel
+    float* dust;             // Visible transmission along the current line
+    int current_line;
+    int line_offset;         // Bytes of the current line already returned
+    struct timespec t_start;
+
+    // Totals reported by sane_close()
+    size_t n_frames;
+    size_t n_starts;
+    size_t n_faults;
+    size_t n_reads;
+    size_t n_sets;
+    size_t bytes;
+} MockDevice;
+
+// Options piescan doesn't use, filling the gaps between the indices it does.
+enum {
+    OPT_NUM_OPTIONS = 0,
+    OPT_MODE = 2,
+    OPT_DEPTH = 3,
+    OPT_RESOLUTION = 4,
+    OPT_THRESHOLD = 6,
+    OPT_SHARPEN = 7,
+    OPT_SHADING_ANALYSIS = 8,
+    OPT_FAST_INFRARED = 9,
+    OPT_ADVANCE = 10,
+    OPT_CALIBRATION = 11,
+    OPT_TL_X = 13,
+    OPT_TL_Y = 14,
+    OPT_BR_X = 15,
+    OPT_BR_Y = 16,
+    OPT_CORRECT_SHADING = 18,
+    OPT_CORRECT_INFRARED = 19,
+    OPT_CLEAN_IMAGE = 20,
+    OPT_GAIN_ADJUST = 21,
+    OPT_CROP = 22,
+    OPT_SMOOTH = 23,
+    OPT_PREVIEW = 27,
+    OPT_SAVE_SHADING = 28,
+    OPT_SAVE_CCDMASK = 29,
+    OPT_LIGHT = 30,
+    OPT_DOUBLE_TIMES = 31,
+    OPT_EXPOSURE_R = 32,
+    OPT_GAIN_R = 36,
+    OPT_OFFSET_R = 40,
+};
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+static long env_long(const char* name, long fallback);
+static void add_option(MockDevice* dev, int index, const char* name, SANE_Value_Type type,
+                       SANE_Unit unit, SANE_Word word);
+static void add_range(MockDevice* dev, int index, const char* name, SANE_Value_Type type,
+                      SANE_Unit unit, const SANE_Range* range, SANE_Word word);
+static void add_strings(MockDevice* dev, int index, const char* name,
+                        const SANE_String_Const* list, const char* value);
+static void init_options(MockDevice* dev);
+static SANE_Status set_option(MockDevice* dev, int index, void* value,
+                              SANE_Int* info);
+static void compute_parameters(const MockDevice* dev, SANE_Parameters* parm,
+                               int* n_channels);
+static void synthesize_line(MockDevice* dev, int y);
+static void pace_line(const MockDevice* dev, int y);
+
+
+
+/*****************************************************************************\
+| Global variables                                                            |
+\*****************************************************************************/
+
+static const SANE_String_Const mode_list[] = {
+    "Lineart", "Halftone", "Gray", "Color", "RGBI", NULL
+};
+static const SANE_String_Const calibration_list[] = {
+    "default", "from options", "quick", "full", NULL
+};
+static const SANE_String_Const gain_adjust_list[] = {
+    "* 0.5", "* 0.75", "* 1.0", "* 1.25", "* 1.5", "* 2.0", NULL
+};
+static const SANE_String_Const crop_list[] = {
+    "None", "Outside", "Inside", NULL
+};
+static const SANE_Word depth_list[] = {2, 8, 16};
+
+static const SANE_Range resolution_range = {SANE_FIX(50), SANE_FIX(7200), 0};
+static const SANE_Range percent_range = {SANE_FIX(0), SANE_FIX(100), 0};
+static const SANE_Range x_range = {SANE_FIX(0), SANE_FIX(36.8), 0};
+static const SANE_Range y_range = {SANE_FIX(0), SANE_FIX(25.4), 0};
+static const SANE_Range smooth_range = {0, 4, 1};
+static const SANE_Range light_range = {0, 9, 1};
+static const SANE_Range double_times_range = {0, 3, 1};
+static const SANE_Range exposure_range = {0, 65535, 1};
+static const SANE_Range gain_range = {0, 63, 1};
+static const SANE_Range offset_range = {0, 255, 1};
+
+static char device_names[MAX_DEVICES][NAME_SIZE];
+static SANE_Device devices[MAX_DEVICES];
+static const SANE_Device* device_list[MAX_DEVICES + 1];
+static MockDevice mocks[MAX_DEVICES];
+static int n_devices;
+
+static int env_width;
+static int env_height;
+static long env_line_us;
+static long env_chunk;
+static long env_busy_every;
+static long env_io_error_every;
+static long env_dust;
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+long
+env_long(const char* name, long fallback)
+{
+    const char* value = getenv(name);
+    return value && *value ? strtol(value, NULL, 10) : fallback;
+}
+
+void
+add_option(MockDevice* dev, int index, const char* name, SANE_Value_Type type,
+           SANE_Unit unit, SANE_Word word)
+{
+    MockOption* opt = &dev->options[index];
+
+    opt->desc.name = name;
+    opt->desc.title = name;
+    opt->desc.desc = name;
+    opt->desc.type = type;
+    opt->desc.unit = unit;
+    opt->desc.size = type == SANE_TYPE_STRING ? STRING_SIZE
+                                              : (SANE_Int) sizeof(SANE_Word);
+    opt->desc.cap = SANE_CAP_SOFT_SELECT | SANE_CAP_SOFT_DETECT;
+    opt->desc.constraint_type = SANE_CONSTRAINT_NONE;
+    opt->word = word;
+}
+
+void
+add_range(MockDevice* dev, int index, const char* name, SANE_Value_Type type,
+          SANE_Unit unit, const SANE_Range* range, SANE_Word word)
+{
+    add_option(dev, index, name, type, unit, word);
+    dev->options[index].desc.constraint_type = SANE_CONSTRAINT_RANGE;
+    dev->options[index].desc.constraint.range = range;
+}
+
+void
+add_strings(MockDevice* dev, int index, const char* name,
+            const SANE_String_Const* list, const char* value)
+{
+    add_option(dev, index, name, SANE_TYPE_STRING, SANE_UNIT_NONE, 0);
+    dev->options[index].desc.constraint_type = SANE_CONSTRAINT_STRING_LIST;
+    dev->options[index].desc.constraint.string_list = list;
+    strcpy(dev->options[index].string, value);
+}
+
+void
+init_options(MockDevice* dev)
+{
+    memset(dev->options, 0, sizeof(dev->options));
+
+    for (int k = 1; k < N_OPTIONS; ++k) {
+        add_option(dev, k, "", SANE_TYPE_GROUP, SANE_UNIT_NONE, 0);
+        dev->options[k].desc.size = 0;
+        dev->options[k].desc.cap = 0;
+    }
+    add_option(dev, OPT_NUM_OPTIONS, "", SANE_TYPE_INT, SANE_UNIT_NONE, N_OPTIONS);
+    dev->options[OPT_NUM_OPTIONS].desc.cap = SANE_CAP_SOFT_DETECT;
+
+    add_strings(dev, OPT_MODE, "mode", mode_list, "RGBI");
+    add_option(dev, OPT_DEPTH, "depth", SANE_TYPE_INT, SANE_UNIT_BIT, 16);
+    dev->options[OPT_DEPTH].desc.constraint_type = SANE_CONSTRAINT_WORD_LIST;
+    dev->options[OPT_DEPTH].desc.constraint.word_list = depth_list;
+    add_range(dev, OPT_RESOLUTION, "resolution", SANE_TYPE_FIXED, SANE_UNIT_DPI,
+              &resolution_range, SANE_FIX(300));
+    add_range(dev, OPT_THRESHOLD, "threshold", SANE_TYPE_FIXED, SANE_UNIT_PERCENT,
+              &percent_range, SANE_FIX(50));
+    add_option(dev, OPT_SHARPEN, "sharpen", SANE_TYPE_BOOL, SANE_UNIT_NONE, 0);
+    add_option(dev, OPT_SHADING_ANALYSIS, "shading-analysis", SANE_TYPE_BOOL,
+               SANE_UNIT_NONE, 0);
+    add_option(dev, OPT_FAST_INFRARED, "fast-infrared", SANE_TYPE_BOOL,
+               SANE_UNIT_NONE, 0);
+    add_option(dev, OPT_ADVANCE, "advance", SANE_TYPE_BOOL, SANE_UNIT_NONE, 0);
+    add_strings(dev, OPT_CALIBRATION, "calibration", calibration_list, "default");
+
+    add_range(dev, OPT_TL_X, "tl-x", SANE_TYPE_FIXED, SANE_UNIT_MM, &x_range,
+              x_range.min);
+    add_range(dev, OPT_TL_Y, "tl-y", SANE_TYPE_FIXED, SANE_UNIT_MM, &y_range,
+              y_range.min);
+    add_range(dev, OPT_BR_X, "br-x", SANE_TYPE_FIXED, SANE_UNIT_MM, &x_range,
+              x_range.max);
+    add_range(dev, OPT_BR_Y, "br-y", SANE_TYPE_FIXED, SANE_UNIT_MM, &y_range,
+              y_range.max);
+
+    add_option(dev, OPT_CORRECT_SHADING, "correct-shading", SANE_TYPE_BOOL,
+               SANE_UNIT_NONE, 1);
+    add_option(dev, OPT_CORRECT_INFRARED, "correct-infrared", SANE_TYPE_BOOL,
+               SANE_UNIT_NONE, 0);
+    add_option(dev, OPT_CLEAN_IMAGE, "clean-image", SANE_TYPE_BOOL,
+               SANE_UNIT_NONE, 0);
+    add_strings(dev, OPT_GAIN_ADJUST, "gain-adjust", gain_adjust_list, "* 1.0");
+    add_strings(dev, OPT_CROP, "crop", crop_list, "None");
+    add_range(dev, OPT_SMOOTH, "smooth", SANE_TYPE_INT, SANE_UNIT_NONE,
+              &smooth_range, 0);
+
+    add_option(dev, OPT_PREVIEW, "preview", SANE_TYPE_BOOL, SANE_UNIT_NONE, 0);
+    add_option(dev, OPT_SAVE_SHADING, "save-shading-data", SANE_TYPE_BOOL,
+               SANE_UNIT_NONE, 0);
+    add_option(dev, OPT_SAVE_CCDMASK, "save-ccdmask", SANE_TYPE_BOOL,
+               SANE_UNIT_NONE, 0);
+    add_range(dev, OPT_LIGHT, "light", SANE_TYPE_INT, SANE_UNIT_NONE, &light_range,
+              4);
+    add_range(dev, OPT_DOUBLE_TIMES, "double-times", SANE_TYPE_INT, SANE_UNIT_NONE,
+              &double_times_range, 0);
+
+    static const char* const exposure_names[4] = {
+        "exposure-time-r", "exposure-time-g", "exposure-time-b",
+        "exposure-time-i"
+    };
+    static const char* const gain_names[4] = {
+        "gain-r", "gain-g", "gain-b", "gain-i"
+    };
+    static const char* const offset_names[4] = {
+        "offset-r", "offset-g", "offset-b", "offset-i"
+    };
+    for (int c = 0; c < 4; ++c) {
+        add_range(dev, OPT_EXPOSURE_R + c, exposure_names[c], SANE_TYPE_INT,
+                  SANE_UNIT_MICROSECOND, &exposure_range, 2937);
+        add_range(dev, OPT_GAIN_R + c, gain_names[c], SANE_TYPE_INT,
+                  SANE_UNIT_NONE, &gain_range, 19);
+        add_range(dev, OPT_OFFSET_R + c, offset_names[c], SANE_TYPE_INT,
+                  SANE_UNIT_NONE, &offset_range, 0);
+    }
+}
+
+// Checks and stores one value the way a backend would: strings must be
+// listed, numbers are clamped into range and reported as inexact.
+SANE_Status
+set_option(MockDevice* dev, int index, void* value, SANE_Int* info)
+{
+    MockOption* opt = &dev->options[index];
+    const SANE_Option_Descriptor* desc = &opt->desc;
+    SANE_Int result = 0;
+
+    if (desc->type == SANE_TYPE_STRING) {
+        const SANE_String_Const* s = desc->constraint.string_list;
+        while (*s && strcmp(*s, (const char*) value) != 0) ++s;
+        if (!*s) return SANE_STATUS_INVAL;
+
+        if (strcmp(opt->string, *s) != 0) {
+            strcpy(opt->string, *s);
+            result |= SANE_INFO_RELOAD_PARAMS;
+            // Switching mode changes which options apply.
+            if (index == OPT_MODE) result |= SANE_INFO_RELOAD_OPTIONS;
+        }
+    } else {
+        SANE_Word word = *(SANE_Word*) value;
+
+        if (desc->type == SANE_TYPE_BOOL && word != SANE_FALSE &&
+            word != SANE_TRUE) {
+            return SANE_STATUS_INVAL;
+        }
+        if (desc->constraint_type == SANE_CONSTRAINT_RANGE) {
+            const SANE_Range* range = desc->constraint.range;
+            SANE_Word clamped = word < range->min ? range->min
+                              : word > range->max ? range->max : word;
+            if (clamped != word) result |= SANE_INFO_INEXACT;
+            word = clamped;
+        } else if (desc->constraint_type == SANE_CONSTRAINT_WORD_LIST) {
+            const SANE_Word* list = desc->constraint.word_list;
+            SANE_Int k = 1;
+            while (k <= list[0] && list[k] != word) ++k;
+            if (k > list[0]) return SANE_STATUS_INVAL;
+        }
+
+        if (opt->word != word) {
+            opt->word = word;
+            if (index == OPT_DEPTH || index == OPT_RESOLUTION ||
+                (index >= OPT_TL_X && index <= OPT_BR_Y)) {
+                result |= SANE_INFO_RELOAD_PARAMS;
+            }
+        }
+    }
+
+    if (info) *info = result;
+    return SANE_STATUS_GOOD;
+}
+
+void
+compute_parameters(const MockDevice* dev, SANE_Parameters* parm,
+                   int* n_channels)
+{
+    const char* mode = dev->options[OPT_MODE].string;
+    const double dpi = SANE_UNFIX(dev->options[OPT_RESOLUTION].word);
+    const double w_mm = SANE_UNFIX(dev->options[OPT_BR_X].word)
+                      - SANE_UNFIX(dev->options[OPT_TL_X].word);
+    const double h_mm = SANE_UNFIX(dev->options[OPT_BR_Y].word)
+                      - SANE_UNFIX(dev->options[OPT_TL_Y].word);
+
+    *n_channels = strcmp(mode, "RGBI") == 0 ? 4
+                : strcmp(mode, "Color") == 0 ? 3 : 1;
+
+    parm->format = *n_channels > 1 ? SANE_FRAME_RGB : SANE_FRAME_GRAY;
+    parm->last_frame = SANE_TRUE;
+    parm->depth = dev->options[OPT_DEPTH].word;
+    parm->pixels_per_line = env_width > 0
+                          ? env_width : (int) (w_mm / MM_PER_INCH * dpi);
+    parm->lines = env_height > 0 ? env_height
+                                 : (int) (h_mm / MM_PER_INCH * dpi);
+    if (parm->pixels_per_line < 1) parm->pixels_per_line = 1;
+    if (parm->lines < 1) parm->lines = 1;
+    parm->bytes_per_line = parm->pixels_per_line * *n_channels
+                         * (parm->depth / 8);
+}
+
+// The scene is a smooth pattern that gets darker down the frame, in counts
+// per unit of exposure time, so that it spans the sensor's range over the
+// exposures a sweep uses. Samples scale with exposure and gain, the offset
+// adds a dark level, and with the light off only a faint ambient remains.
+// Dust specks sit at fixed fractions of the frame, so every scan of it
+// shows them in the same place.
+void
+synthesize_line(MockDevice* dev, int y)
+{
+    const SANE_Parameters* parm = &dev->parm;
+    const int nc = dev->n_channels;
+    const int width = parm->pixels_per_line;
+    const bool light = dev->options[OPT_LIGHT].word > 0;
+    const float fall_off = exp2f(-6.0f * (float) y / (float) parm->lines);
+
+    for (int x = 0; x < width; ++x) dev->dust[x] = 1.0f;
+    for (long k = 0; k < env_dust; ++k) {
+        uint32_t h = (uint32_t) k * 2654435761u + 12345u;
+        const int cx = (int) ((h >> 8) % 1000u * (uint32_t) width / 1000u);
+        h = h * 1103515245u + 12345u;
+        const int cy = (int) ((h >> 8) % 1000u * (uint32_t) parm->lines
+                              / 1000u);
+        const int r = 2 + (int) (h >> 28) % 5;
+        if (y < cy - r || y > cy + r) continue;
+        for (int x = cx - r; x <= cx + r; ++x) {
+            if (x < 0 || x >= width) continue;
+            if ((x - cx) * (x - cx) + (y - cy) * (y - cy) <= r * r) {
+                dev->dust[x] = 0.3f;
+            }
+        }
+    }
+
+    for (int c = 0; c < nc; ++c) {
+        const float exposure = (float) dev->options[OPT_EXPOSURE_R + c].word;
+        const float gain = 1.0f + dev->options[OPT_GAIN_R + c].word / 16.0f;
+        const float scale = exposure * gain * fall_off
+                          * (light ? 1.0f : 1.0f / 256.0f);
+        const float offset = 64.0f * dev->options[OPT_OFFSET_R + c].word;
+        const float* row = dev->row + (size_t) c * width;
+        const float* dust = dev->dust;
+        // Dust blocks infrared more than it darkens the dyes
+        const bool infrared = c == 3;
+
+        if (parm->depth == 16) {
+            uint16_t* out = (uint16_t*) dev->line + c;
+            for (int x = 0; x < width; ++x) {
+                const float t = infrared ? dust[x] * dust[x] : dust[x];
+                float v = row[x] * t * scale + offset;
+                out[(size_t) x * nc] = v >= 65535.0f ? 65535 : (uint16_t) v;
+            }
+        } else {
+            uint8_t* out = dev->line + c;
+            for (int x = 0; x < width; ++x) {
+                const float t = infrared ? dust[x] * dust[x] : dust[x];
+                float v = (row[x] * t * scale + offset) / 256.0f;
+                out[(size_t) x * nc] = v >= 255.0f ? 255 : (uint8_t) v;
+            }
+        }
+    }
+}
+
+// Holds line y back until the device would have finished it.
+void
+pace_line(const MockDevice* dev, int y)
+{
+    if (env_line_us <= 0) return;
+
+    long long ns = (long long) (y + 1) * env_line_us * 1000
+                 + dev->t_start.tv_nsec;
+    struct timespec deadline = {
+        .tv_sec = dev->t_start.tv_sec + (time_t) (ns / 1000000000),
+        .tv_nsec = (long) (ns % 1000000000),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)
+           == EINTR) {
+    }
+}
+
+SANE_Status
+sane_init(SANE_Int* version_code, SANE_Auth_Callback authorize)
+{
+    (void) authorize;
+
+    if (version_code) *version_code = SANE_VERSION_CODE(1, 0, 0);
+
+    env_width = (int) env_long("MOCKSANE_WIDTH", 0);
+    env_height = (int) env_long("MOCKSANE_HEIGHT", 0);
+    env_line_us = env_long("MOCKSANE_LINE_US", 0);
+    env_chunk = env_long("MOCKSANE_CHUNK", 0);
+    env_busy_every = env_long("MOCKSANE_BUSY_EVERY", 0);
+    env_io_error_every = env_long("MOCKSANE_IO_ERROR_EVERY", 0);
+    env_dust = env_long("MOCKSANE_DUST", 0);
+
+    long n = env_long("MOCKSANE_DEVICES", 1);
+    n_devices = n < 1 ? 1 : n > MAX_DEVICES ? MAX_DEVICES : (int) n;
+    for (int k = 0; k < n_devices; ++k) {
+        if (k == 0) {
+            strcpy(device_names[k], "mock:pie");
+        } else {
+            snprintf(device_names[k], NAME_SIZE, "mock:pie:%d", k);
+        }
+        devices[k] = (SANE_Device) {
+            device_names[k], "PIE", "Mock film scanner", "film scanner"
+        };
+        device_list[k] = &devices[k];
+    }
+    device_list[n_devices] = NULL;
+
+    return SANE_STATUS_GOOD;
+}
+
+void
+sane_exit(void)
+{
+}
+
+SANE_Status
+sane_get_devices(const SANE_Device*** list, SANE_Bool local_only)
+{
+    (void) local_only;
+
+    *list = device_list;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status
+sane_open(SANE_String_Const name, SANE_Handle* handle)
+{
+    int k = 0;
+
+    // An empty name opens the first device, as with real backends.
+    if (name && *name) {
+        while (k < n_devices && strcmp(name, devices[k].name) != 0) ++k;
+        if (k == n_devices) return SANE_STATUS_INVAL;
+    }
+
+    MockDevice* dev = &mocks[k];
+    memset(dev, 0, sizeof(*dev));
+    dev->name = devices[k].name;
+    init_options(dev);
+    *handle = dev;
+
+    return SANE_STATUS_GOOD;
+}
+
+void
+sane_close(SANE_Handle handle)
+{
+    MockDevice* dev = (MockDevice*) handle;
+
+    sane_cancel(dev);
+    free(dev->line);
+    free(dev->row);
+    free(dev->dust);
+    fprintf(stderr, "mocksane: %s: %zu frames, %.1f MB in %zu reads, "
+            "%zu options set, %zu faults\n", dev->name, dev->n_frames,
+            dev->bytes / 1e6, dev->n_reads, dev->n_sets, dev->n_faults);
+}
+
+const SANE_Option_Descriptor*
+sane_get_option_descriptor(SANE_Handle handle, SANE_Int option)
+{
+    MockDevice* dev = (MockDevice*) handle;
+
+    if (option < 0 || option >= N_OPTIONS) return NULL;
+    return &dev->options[option].desc;
+}
+
+SANE_Status
+sane_control_option(SANE_Handle handle, SANE_Int option, SANE_Action action,
+                    void* value, SANE_Int* info)
+{
+    MockDevice* dev = (MockDevice*) handle;
+
+    if (info) *info = 0;
+    if (option < 0 || option >= N_OPTIONS || !value ||
+        dev->options[option].desc.type == SANE_TYPE_GROUP) {
+        return SANE_STATUS_INVAL;
+    }
+    if (dev->scanning) return SANE_STATUS_DEVICE_BUSY;
+
+    MockOption* opt = &dev->options[option];
+
+    switch (action) {
+        case SANE_ACTION_GET_VALUE:
+            if (opt->desc.type == SANE_TYPE_STRING) {
+                strcpy((char*) value, opt->string);
+            } else {
+                *(SANE_Word*) value = opt->word;
+            }
+            return SANE_STATUS_GOOD;
+
+        case SANE_ACTION_SET_VALUE:
+            if (option == OPT_NUM_OPTIONS) return SANE_STATUS_INVAL;
+            ++dev->n_sets;
+            return set_option(dev, option, value, info);
+
+        default:
+            return SANE_STATUS_UNSUPPORTED;
+    }
+}
+
+SANE_Status
+sane_get_parameters(SANE_Handle handle, SANE_Parameters* params)
+{
+    MockDevice* dev = (MockDevice*) handle;
+
+    if (dev->scanning) {
+        *params = dev->parm;
+    } else {
+        int n_channels;
+        compute_parameters(dev, params, &n_channels);
+    }
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status
+sane_start(SANE_Handle handle)
+{
+    MockDevice* dev = (MockDevice*) handle;
+
+    if (dev->scanning) return SANE_STATUS_DEVICE_BUSY;
+    if (env_busy_every > 0 && ++dev->n_starts % env_busy_every == 0) {
+        ++dev->n_faults;
+        return SANE_STATUS_DEVICE_BUSY;
+    }
+
+    compute_parameters(dev, &dev->parm, &dev->n_channels);
+    if (dev->parm.depth < 8) return SANE_STATUS_UNSUPPORTED;
+
+    const int width = dev->parm.pixels_per_line;
+    free(dev->line);
+    free(dev->row);
+    free(dev->dust);
+    dev->line = (uint8_t*) malloc(dev->parm.bytes_per_line);
+    dev->row = (float*) malloc((size_t) dev->n_channels * width
+                               * sizeof(float));
+    dev->dust = (float*) malloc((size_t) width * sizeof(float));
+    if (!dev->line || !dev->row || !dev->dust) {
+        free(dev->line);
+        free(dev->row);
+        free(dev->dust);
+        dev->line = NULL;
+        dev->row = NULL;
+        dev->dust = NULL;
+        return SANE_STATUS_NO_MEM;
+    }
+
+    // Film is nearly clear in infrared but for a little of the red dye
+    for (int c = 0; c < dev->n_channels; ++c) {
+        for (int x = 0; x < width; ++x) {
+            float t = (float) x / (float) width;
+            float v = 6.0f + 5.0f * sinf(6.2831853f * (4.0f * t + 0.25f * c));
+            if (c == 3) v = 8.8f + 0.2f * dev->row[x];
+            dev->row[(size_t) c * width + x] = v;
+        }
+    }
+
+    dev->scanning = true;
+    dev->current_line = 0;
+    dev->line_offset = 0;
+    clock_gettime(CLOCK_MONOTONIC, &dev->t_start);
+
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status
+sane_read(SANE_Handle handle, SANE_Byte* data, SANE_Int max_length,
+          SANE_Int* length)
+{
+    MockDevice* dev = (MockDevice*) handle;
+
+    *length = 0;
+    if (!dev->scanning) return SANE_STATUS_CANCELLED;
+    if (dev->current_line >= dev->parm.lines) {
+        ++dev->n_frames;
+        return SANE_STATUS_EOF;
+    }
+
+    // A faulty frame stops halfway, and the read after that fails.
+    const bool faulty = env_io_error_every > 0 &&
+        (dev->n_frames + dev->n_faults + 1) % env_io_error_every == 0;
+    const int last_line = faulty ? dev->parm.lines / 2 : dev->parm.lines;
+    if (dev->current_line >= last_line) {
+        ++dev->n_faults;
+        dev->scanning = false;
+        return SANE_STATUS_IO_ERROR;
+    }
+
+    SANE_Int limit = env_chunk > 0 && env_chunk < max_length
+                   ? (SANE_Int) env_chunk : max_length;
+    ++dev->n_reads;
+
+    // Whole lines and pieces of them, as many as fit.
+    while (*length < limit && dev->current_line < last_line) {
+        if (dev->line_offset == 0) {
+            pace_line(dev, dev->current_line);
+            synthesize_line(dev, dev->current_line);
+        }
+
+        SANE_Int n = dev->parm.bytes_per_line - dev->line_offset;
+        if (n > limit - *length) n = limit - *length;
+        memcpy(data + *length, dev->line + dev->line_offset, n);
+        *length += n;
+        dev->line_offset += n;
+
+        if (dev->line_offset == dev->parm.bytes_per_line) {
+            dev->line_offset = 0;
+            ++dev->current_line;
+        }
+    }
+
+    dev->bytes += *length;
+    return SANE_STATUS_GOOD;
+}
+
+void
+sane_cancel(SANE_Handle handle)
+{
+    MockDevice* dev = (MockDevice*) handle;
+
+    // The buffers are reused by the next sane_start().
+    dev->scanning = false;
+}
+
+SANE_Status
+sane_set_io_mode(SANE_Handle handle, SANE_Bool non_blocking)
+{
+    (void) handle;
+
+    return non_blocking ? SANE_STATUS_UNSUPPORTED : SANE_STATUS_GOOD;
+}
+
+SANE_Status
+sane_get_select_fd(SANE_Handle handle, SANE_Int* fd)
+{
+    (void) handle;
+    (void) fd;
+
+    return SANE_STATUS_UNSUPPORTED;
+}
+
+SANE_String_Const
+sane_strstatus(SANE_Status status)
+{
+    static const char* const messages[] = {
+        "Success", "Operation not supported", "Operation was cancelled",
+        "Device busy", "Invalid argument", "End of file reached",
+        "Document feeder jammed", "Document feeder out of documents",
+        "Scanner cover is open", "Error during device I/O",
+        "Out of memory", "Access to resource has been denied",
+    };
+
+    if (status >= 0 &&
+        (size_t) status < sizeof(messages) / sizeof(messages[0])) {
+        return messages[status];
+    }
+    return "Unknown SANE status code";
+}
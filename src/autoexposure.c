@@ -0,0 +1,144 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sane/sane.h>
+
+#include "autoexposure.h"
+#include "histogram.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// Highlights at or above this clipped in the preview, so say nothing about
+// the scene but that it is brighter.
+#define CLIP_LEVEL 65000
+
+// Highlights below this fraction of the target are rescanned brighter, as
+// a few counts are too coarse to scale from.
+#define MIN_FRACTION (1.0 / 16)
+
+// Most a rescan changes the exposure by.
+#define MAX_STEP 16.0
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+AutoExposureOptions
+auto_exposure_default(void)
+{
+    AutoExposureOptions options = {
+        .preview_resolution = 300,
+        .target = 0.9,
+        .highlight = 1e-4,
+        .max_exposure = {65535, 65535, 65535, 65535},
+        .n_brackets = 1,
+        .bracket_ratio = 4.0,
+    };
+    return options;
+}
+
+int
+auto_expose(PiescanDevice* device, const ScanSettings* settings,
+            const AutoExposureOptions* options,
+            const ResponseProfile* profile, AutoExposure* result)
+{
+    ScanSettings preview = *settings;
+    int* exposures[4] = {&preview.exposure_r, &preview.exposure_g,
+                         &preview.exposure_b, &preview.exposure_i};
+    const int gains[4] = {settings->gain_r, settings->gain_g,
+                          settings->gain_b, settings->gain_i};
+    const int offsets[4] = {settings->offset_r, settings->offset_g,
+                            settings->offset_b, settings->offset_i};
+    const double target = options->target * 65535.0;
+    int measured[4] = {0};   // What highlights[c] was measured at
+    bool settled = false;
+    int status = SANE_STATUS_GOOD;
+
+    memset(result, 0, sizeof(AutoExposure));
+    result->n_brackets = options->n_brackets < 1 ? 1
+                       : options->n_brackets > AUTO_MAX_BRACKETS
+                       ? AUTO_MAX_BRACKETS : options->n_brackets;
+
+    Image* im = new_image();
+    Histogram* histograms = (Histogram*) malloc(4 * sizeof(Histogram));
+    if (!im || !histograms) {
+        status = SANE_STATUS_NO_MEM;
+        goto done;
+    }
+
+    preview.resolution = options->preview_resolution;
+    preview.preview = true;
+
+    // A clipped channel is rescanned shorter and a dark one longer, until
+    // every highlight can be measured.
+    while (!settled && result->n_previews < AUTO_MAX_PREVIEWS) {
+        status = piescan_scan_image(device, im, preview);
+        if (status != SANE_STATUS_GOOD) goto done;
+        ++result->n_previews;
+
+        image_histograms(im, histograms);
+        settled = true;
+        for (int c = 0; c < 4; ++c) {
+            const uint16_t level =
+                histogram_percentile(&histograms[c], 1.0 - options->highlight);
+            const int exposure = *exposures[c];
+            double next = exposure;
+
+            result->highlights[c] = level;
+            measured[c] = exposure;
+            if (level >= CLIP_LEVEL) {
+                next = exposure / MAX_STEP;
+            } else if (level < target * MIN_FRACTION) {
+                next = level > 0 ? exposure * target / level
+                                 : exposure * MAX_STEP;
+                next = fmin(next, exposure * MAX_STEP);
+            }
+            next = fmax(1.0, fmin(next, options->max_exposure[c]));
+            if ((int) next != exposure) {
+                *exposures[c] = (int) next;
+                settled = false;
+            }
+        }
+    }
+
+    for (int c = 0; c < 4; ++c) {
+        const ResponseChannel* channel =
+            profile && profile->channels[c].valid ? &profile->channels[c]
+                                                  : NULL;
+        const uint16_t level = result->highlights[c];
+        const int max_exposure = options->max_exposure[c];
+        int exposure = max_exposure;
+        int gain = gains[c];
+
+        bool picked = false;
+        if (channel) {
+            double rate = response_rate(channel, level, measured[c],
+                                        gains[c], offsets[c]);
+            picked = response_pick(channel, rate, offsets[c], target,
+                                   max_exposure, &exposure, &gain);
+        }
+        if (!picked && level > 0) {
+            double e = measured[c] * target / level;
+            exposure = (int) fmax(1.0, fmin(e, max_exposure));
+        }
+
+        double e = exposure;
+        for (size_t k = 0; k < result->n_brackets; ++k) {
+            result->exposures[c][k] = (int) fmin(e, max_exposure);
+            e *= options->bracket_ratio;
+        }
+        result->gains[c] = gain;
+    }
+
+done:
+    free(histograms);
+    if (im) free_image(im);
+    return status;
+}
@@ -0,0 +1,77 @@
+#ifndef AUTOEXPOSURE_H
+#define AUTOEXPOSURE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "piescan.h"
+#include "response.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+#define AUTO_MAX_BRACKETS 8
+
+// Previews scanned at most, rescanning after one clipped or came out too
+// dark to measure.
+#define AUTO_MAX_PREVIEWS 4
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef struct {
+    int preview_resolution;   // dpi
+    double target;            // Highlight level, fraction of full scale
+    double highlight;         // Fraction of samples allowed above it
+    int max_exposure[4];      // Longest exposure per channel
+    size_t n_brackets;        // Full-resolution exposures per channel
+    double bracket_ratio;     // Between consecutive exposures
+} AutoExposureOptions;
+
+typedef struct {
+    int exposures[4][AUTO_MAX_BRACKETS];   // Ascending
+    int gains[4];
+    size_t n_brackets;
+    uint16_t highlights[4];   // Of the last preview
+    size_t n_previews;
+} AutoExposure;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+// 300 dpi previews, highlights of all but 0.01% of the samples at 90% of
+// full scale, a single exposure and a ratio of 4 between brackets.
+AutoExposureOptions auto_exposure_default(void);
+
+// Scans previews of settings at low resolution and picks each channel's
+// exposures and gain from their histograms so the highlights sit just
+// below clipping. The first exposure of the result is that one; further
+// brackets are longer by bracket_ratio each, for the shadows, up to the
+// channel's max_exposure. The previews start at settings' exposures and
+// gains. Gains are picked with profile if it has the channel; otherwise the
+// gain is kept and the response taken as proportional to exposure. Returns
+// 0 or a SANE status of the previews.
+int auto_expose(PiescanDevice* device, const ScanSettings* settings,
+                const AutoExposureOptions* options,
+                const ResponseProfile* profile, AutoExposure* result);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // AUTOEXPOSURE_H
@@ -0,0 +1,493 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CALIBRATION_X86
+#include <immintrin.h>
+#endif
+
+#include "calibration.h"
+#include "threadpool.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+#define ALIGN_UP(n) \
+    (((n) + CALIBRATION_ALIGN - 1) / CALIBRATION_ALIGN * CALIBRATION_ALIGN)
+
+// A flat frame reaching this anywhere is clipped.
+#define CLIP_LEVEL 65535
+
+// Columns darker than this above the dark level keep a gain of 1 rather
+// than amplifying noise.
+#define MIN_SIGNAL 1.0
+
+_Static_assert(sizeof(CalibrationKey) == 32, "calibration key has padding");
+_Static_assert(sizeof(CalibrationEntry) == 48,
+               "calibration entry has padding");
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef void (*CorrectFunc)(uint16_t* line, size_t width, const float* dark,
+                            const float* gain);
+
+struct Calibration {
+    MmapArray* map;
+    const CalibrationHeader* header;
+    const CalibrationEntry* entries;
+};
+
+// Running column sums of one key.
+typedef struct {
+    CalibrationKey key;
+    double* dark;   // width
+    double* flat;   // width
+    uint32_t n_dark;
+    uint32_t n_flat;
+} BuilderEntry;
+
+struct CalibrationBuilder {
+    BuilderEntry* entries;
+    size_t n_entries;
+    size_t capacity;
+
+    pthread_mutex_t lock;
+};
+
+typedef struct {
+    const uint16_t* planes[4];
+    uint32_t width;
+    uint32_t height;
+    double* means[4];      // width each
+    uint16_t max[4];
+} ColumnJob;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+static void correct_scalar(uint16_t* line, size_t width, const float* dark,
+                           const float* gain);
+#ifdef CALIBRATION_X86
+static void correct_avx2(uint16_t* line, size_t width, const float* dark,
+                         const float* gain);
+#endif
+static CorrectFunc get_correct_func(void);
+static void make_key(CalibrationKey* key, const ScanSettings* settings,
+                     int channel, uint32_t width);
+static bool same_key(const CalibrationKey* a, const CalibrationKey* b);
+static void column_means(void* arg, size_t channel);
+static BuilderEntry* find_entry(CalibrationBuilder* builder,
+                                const CalibrationKey* key);
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+int
+open_calibration(Calibration** calibration, const char* filename)
+{
+    const MmapOptions opts = {MMAP_ACCESS_WILLNEED, false, false, false};
+    MmapArray* map = NULL;
+
+    *calibration = NULL;
+    int err = get_mmap_reader_opts(&map, filename, &opts);
+    if (err) return err;
+
+    const CalibrationHeader* header = (const CalibrationHeader*) map->data;
+    if (map->size < sizeof(CalibrationHeader) ||
+        memcmp(header->magic, CALIBRATION_MAGIC,
+               sizeof(CALIBRATION_MAGIC)) != 0) {
+        err = EINVAL;
+    } else if (header->byte_order != CALIBRATION_BYTE_ORDER) {
+        err = ENOTSUP;
+    } else if (header->version != CALIBRATION_VERSION ||
+               header->entries_offset + (uint64_t) header->n_entries
+                   * sizeof(CalibrationEntry) > map->size) {
+        err = EINVAL;
+    }
+
+    // Every entry's arrays must lie within the file too.
+    const CalibrationEntry* entries = (const CalibrationEntry*)
+        ((const uint8_t*) map->data + (err ? 0 : header->entries_offset));
+    for (uint32_t k = 0; !err && k < header->n_entries; ++k) {
+        uint64_t bytes = ALIGN_UP((uint64_t) entries[k].key.width
+                                  * sizeof(float))
+                       + (uint64_t) entries[k].key.width * sizeof(float);
+        if (entries[k].offset % CALIBRATION_ALIGN ||
+            entries[k].offset + bytes > map->size) {
+            err = EINVAL;
+        }
+    }
+
+    Calibration* result = err ? NULL
+                        : (Calibration*) calloc(1, sizeof(Calibration));
+    if (!err && !result) err = ENOMEM;
+    if (err) {
+        free_mmap_array(map);
+        return err;
+    }
+
+    result->map = map;
+    result->header = header;
+    result->entries = entries;
+    *calibration = result;
+    return 0;
+}
+
+void
+close_calibration(Calibration* calibration)
+{
+    if (!calibration) return;
+
+    free_mmap_array(calibration->map);
+    free(calibration);
+}
+
+size_t
+calibration_count(const Calibration* calibration)
+{
+    return calibration->header->n_entries;
+}
+
+void
+make_key(CalibrationKey* key, const ScanSettings* settings, int channel,
+         uint32_t width)
+{
+    const int exposures[4] = {settings->exposure_r, settings->exposure_g,
+                              settings->exposure_b, settings->exposure_i};
+    const int gains[4] = {settings->gain_r, settings->gain_g,
+                          settings->gain_b, settings->gain_i};
+    const int offsets[4] = {settings->offset_r, settings->offset_g,
+                            settings->offset_b, settings->offset_i};
+
+    memset(key, 0, sizeof(CalibrationKey));
+    key->channel = channel;
+    key->resolution = settings->resolution;
+    key->tl_x = settings->tl_x;
+    key->width = width;
+    key->exposure = exposures[channel];
+    key->gain = gains[channel];
+    key->offset = offsets[channel];
+}
+
+bool
+same_key(const CalibrationKey* a, const CalibrationKey* b)
+{
+    return a->channel == b->channel && a->resolution == b->resolution &&
+           a->tl_x == b->tl_x && a->width == b->width &&
+           a->exposure == b->exposure && a->gain == b->gain &&
+           a->offset == b->offset;
+}
+
+bool
+calibration_find(const Calibration* calibration, const ScanSettings* settings,
+                 int channel, uint32_t width, const float** dark,
+                 const float** gain)
+{
+    CalibrationKey key;
+    make_key(&key, settings, channel, width);
+
+    for (uint32_t k = 0; k < calibration->header->n_entries; ++k) {
+        const CalibrationEntry* entry = &calibration->entries[k];
+        if (!same_key(&entry->key, &key)) continue;
+
+        const uint8_t* base = (const uint8_t*) calibration->map->data;
+        *dark = (const float*) (base + entry->offset);
+        *gain = (const float*) (base + entry->offset
+                                + ALIGN_UP(width * sizeof(float)));
+        return true;
+    }
+    return false;
+}
+
+void
+correct_scalar(uint16_t* line, size_t width, const float* dark,
+               const float* gain)
+{
+    for (size_t x = 0; x < width; ++x) {
+        float v = ((float) line[x] - dark[x]) * gain[x] + 0.5f;
+        v = v < 0.0f ? 0.0f : v > 65535.0f ? 65535.0f : v;
+        line[x] = (uint16_t) v;
+    }
+}
+
+#ifdef CALIBRATION_X86
+
+// Eight samples at a time: widen to float, subtract and scale, clamp, and
+// narrow back with unsigned saturation. Same operations as the scalar
+// version, so the results match it exactly.
+__attribute__((target("avx2")))
+void
+correct_avx2(uint16_t* line, size_t width, const float* dark,
+             const float* gain)
+{
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 top = _mm256_set1_ps(65535.0f);
+    size_t x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        __m128i raw = _mm_loadu_si128((const __m128i*) (line + x));
+        __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(raw));
+        v = _mm256_mul_ps(_mm256_sub_ps(v, _mm256_loadu_ps(dark + x)),
+                          _mm256_loadu_ps(gain + x));
+        v = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(v, half), zero), top);
+
+        __m256i n = _mm256_cvttps_epi32(v);
+        __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(n),
+                                          _mm256_extracti128_si256(n, 1));
+        _mm_storeu_si128((__m128i*) (line + x), packed);
+    }
+
+    correct_scalar(line + x, width - x, dark + x, gain + x);
+}
+
+#endif  // CALIBRATION_X86
+
+CorrectFunc
+get_correct_func(void)
+{
+#ifdef CALIBRATION_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return correct_avx2;
+#endif
+    return correct_scalar;
+}
+
+void
+calibration_correct(uint16_t* samples, size_t width, size_t n_lines,
+                    const float* dark, const float* gain)
+{
+    const CorrectFunc correct = get_correct_func();
+
+    for (size_t y = 0; y < n_lines; ++y) {
+        correct(samples + y * width, width, dark, gain);
+    }
+}
+
+CalibrationBuilder*
+new_calibration_builder(void)
+{
+    CalibrationBuilder* builder =
+        (CalibrationBuilder*) calloc(1, sizeof(CalibrationBuilder));
+    if (builder) pthread_mutex_init(&builder->lock, NULL);
+    return builder;
+}
+
+void
+free_calibration_builder(CalibrationBuilder* builder)
+{
+    if (!builder) return;
+
+    for (size_t k = 0; k < builder->n_entries; ++k) {
+        free(builder->entries[k].dark);
+        free(builder->entries[k].flat);
+    }
+    free(builder->entries);
+    pthread_mutex_destroy(&builder->lock);
+    free(builder);
+}
+
+size_t
+calibration_builder_count(const CalibrationBuilder* builder)
+{
+    return builder->n_entries;
+}
+
+// Sums the columns of one channel line by line, so the plane is read in
+// order.
+void
+column_means(void* arg, size_t channel)
+{
+    ColumnJob* job = (ColumnJob*) arg;
+    const uint16_t* plane = job->planes[channel];
+    double* means = job->means[channel];
+    uint16_t max = 0;
+
+    for (uint32_t y = 0; y < job->height; ++y) {
+        const uint16_t* line = plane + (size_t) y * job->width;
+        for (uint32_t x = 0; x < job->width; ++x) {
+            means[x] += line[x];
+            if (line[x] > max) max = line[x];
+        }
+    }
+    for (uint32_t x = 0; x < job->width; ++x) {
+        means[x] /= job->height;
+    }
+    job->max[channel] = max;
+}
+
+// Called with builder->lock held.
+BuilderEntry*
+find_entry(CalibrationBuilder* builder, const CalibrationKey* key)
+{
+    for (size_t k = 0; k < builder->n_entries; ++k) {
+        if (same_key(&builder->entries[k].key, key)) {
+            return &builder->entries[k];
+        }
+    }
+
+    if (builder->n_entries == builder->capacity) {
+        size_t capacity = builder->capacity ? 2 * builder->capacity : 16;
+        BuilderEntry* grown = (BuilderEntry*)
+            realloc(builder->entries, capacity * sizeof(BuilderEntry));
+        if (!grown) return NULL;
+        builder->entries = grown;
+        builder->capacity = capacity;
+    }
+
+    BuilderEntry* entry = &builder->entries[builder->n_entries];
+    memset(entry, 0, sizeof(BuilderEntry));
+    entry->key = *key;
+    entry->dark = (double*) calloc(key->width, sizeof(double));
+    entry->flat = (double*) calloc(key->width, sizeof(double));
+    if (!entry->dark || !entry->flat) {
+        free(entry->dark);
+        free(entry->flat);
+        return NULL;
+    }
+    ++builder->n_entries;
+    return entry;
+}
+
+int
+calibration_builder_add(CalibrationBuilder* builder, const Image* im,
+                        const ScanSettings* settings)
+{
+    const bool dark = settings->light == 0;
+    ColumnJob job = {
+        .planes = {im->r, im->g, im->b, im->i},
+        .width = im->width,
+        .height = im->height,
+    };
+    int err = 0;
+
+    if (im->width == 0 || im->height == 0) return 0;
+
+    // The means are taken outside the lock; only adding them up is shared.
+    for (int c = 0; c < 4; ++c) {
+        job.means[c] = (double*) calloc(im->width, sizeof(double));
+        if (!job.means[c]) err = ENOMEM;
+    }
+    if (!err) parallel_for(4, column_means, &job);
+
+    pthread_mutex_lock(&builder->lock);
+    for (int c = 0; !err && c < 4; ++c) {
+        if (!dark && job.max[c] >= CLIP_LEVEL) continue;
+
+        CalibrationKey key;
+        make_key(&key, settings, c, im->width);
+        BuilderEntry* entry = find_entry(builder, &key);
+        if (!entry) {
+            err = ENOMEM;
+            break;
+        }
+
+        double* sums = dark ? entry->dark : entry->flat;
+        for (uint32_t x = 0; x < im->width; ++x) {
+            sums[x] += job.means[c][x];
+        }
+        if (dark) {
+            ++entry->n_dark;
+        } else {
+            ++entry->n_flat;
+        }
+    }
+    pthread_mutex_unlock(&builder->lock);
+
+    for (int c = 0; c < 4; ++c) {
+        free(job.means[c]);
+    }
+    return err;
+}
+
+int
+calibration_builder_write(CalibrationBuilder* builder, const char* filename)
+{
+    pthread_mutex_lock(&builder->lock);
+
+    const size_t n = builder->n_entries;
+    const size_t table = ALIGN_UP(sizeof(CalibrationHeader));
+    const size_t data = ALIGN_UP(table + n * sizeof(CalibrationEntry));
+    size_t size = data;
+    CalibrationEntry* entries = (CalibrationEntry*)
+        calloc(n ? n : 1, sizeof(CalibrationEntry));
+    int err = entries ? 0 : ENOMEM;
+
+    for (size_t k = 0; !err && k < n; ++k) {
+        entries[k].key = builder->entries[k].key;
+        entries[k].n_dark = builder->entries[k].n_dark;
+        entries[k].n_flat = builder->entries[k].n_flat;
+        entries[k].offset = size;
+        size += 2 * ALIGN_UP(entries[k].key.width * sizeof(float));
+    }
+
+    MmapArray* map = NULL;
+    if (!err) err = get_mmap_writer_opts(&map, filename, size, NULL);
+
+    uint8_t* base = map ? (uint8_t*) map->data : NULL;
+    for (size_t k = 0; !err && k < n; ++k) {
+        const BuilderEntry* entry = &builder->entries[k];
+        const uint32_t width = entry->key.width;
+        float* dark = (float*) (base + entries[k].offset);
+        float* gain = (float*) (base + entries[k].offset
+                                + ALIGN_UP(width * sizeof(float)));
+        double level = 0;
+
+        // The writer may reuse an old file, so every byte is written.
+        memset(dark, 0, 2 * ALIGN_UP(width * sizeof(float)));
+        for (uint32_t x = 0; x < width; ++x) {
+            dark[x] = entry->n_dark ? (float) (entry->dark[x]
+                                               / entry->n_dark) : 0.0f;
+            gain[x] = 1.0f;
+            if (entry->n_flat) {
+                level += entry->flat[x] / entry->n_flat - dark[x];
+            }
+        }
+
+        // Columns are scaled to the mean response, so levels stay put.
+        level /= width;
+        for (uint32_t x = 0; entry->n_flat && x < width; ++x) {
+            double signal = entry->flat[x] / entry->n_flat - dark[x];
+            if (signal >= MIN_SIGNAL && level >= MIN_SIGNAL) {
+                gain[x] = (float) (level / signal);
+            }
+        }
+    }
+
+    if (!err) {
+        CalibrationHeader* header = (CalibrationHeader*) base;
+        memset(base, 0, data);
+        memcpy(header->magic, CALIBRATION_MAGIC, sizeof(CALIBRATION_MAGIC));
+        header->version = CALIBRATION_VERSION;
+        header->byte_order = CALIBRATION_BYTE_ORDER;
+        header->n_entries = (uint32_t) n;
+        header->entries_offset = (uint32_t) table;
+        memcpy(base + table, entries, n * sizeof(CalibrationEntry));
+    }
+
+    pthread_mutex_unlock(&builder->lock);
+
+    if (map) free_mmap_array(map);
+    free(entries);
+    if (err) {
+        fprintf(stderr, "Error: unable to write %s: %s\n", filename,
+                strerror(err));
+    }
+    return err;
+}
@@ -0,0 +1,124 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "piescan.h"
+#include "mmaparray.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// A calibration file is a CalibrationHeader, a table of CalibrationEntry
+// and, for every entry, width floats of dark level followed by width floats
+// of gain, each array starting on a CALIBRATION_ALIGN boundary and stored
+// in the producer's byte order. It is mapped and used in place.
+//
+// The CCD is a line sensor, so every line of a scan is read by the same
+// elements: references are per column, averaged over all lines of every
+// frame scanned with the same settings. Scanning moves a corrected sample
+// to (raw - dark) * gain, where the gain brings the lit frame's columns to
+// their common mean. Dark levels come from frames scanned with the light
+// off, gains from frames with it on, scanned without film.
+#define CALIBRATION_MAGIC "PIECALB"
+#define CALIBRATION_VERSION 1
+#define CALIBRATION_ALIGN 64
+#define CALIBRATION_BYTE_ORDER 0x0102
+
+// Conventional file name suffix.
+#define CALIBRATION_SUFFIX ".pcal"
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+// What a channel's references were built for. Both the scan area's origin
+// and its width matter, as they say which CCD elements the columns are.
+typedef struct {
+    int32_t channel;     // 0-3: r, g, b, i
+    int32_t resolution;
+    double tl_x;
+    uint32_t width;
+    int32_t exposure;
+    int32_t gain;
+    int32_t offset;
+} CalibrationKey;
+
+typedef struct {
+    CalibrationKey key;
+    uint32_t n_dark;     // Frames averaged; 0 leaves the dark level at 0
+    uint32_t n_flat;     // 0 leaves the gain at 1
+    uint64_t offset;     // Of the dark levels; the gains follow
+} CalibrationEntry;
+
+typedef struct {
+    char magic[8];             // CALIBRATION_MAGIC
+    uint32_t version;          // CALIBRATION_VERSION
+    uint16_t byte_order;       // CALIBRATION_BYTE_ORDER as stored
+    uint16_t reserved;
+    uint32_t n_entries;
+    uint32_t entries_offset;   // Of the CalibrationEntry table
+} CalibrationHeader;
+
+typedef struct Calibration Calibration;
+typedef struct CalibrationBuilder CalibrationBuilder;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+// Maps a calibration file and checks it. Returns 0 or an errno value:
+// EINVAL for anything that isn't a version 1 calibration, ENOTSUP for one
+// written on a machine of the other byte order.
+int open_calibration(Calibration** calibration, const char* filename);
+void close_calibration(Calibration* calibration);
+size_t calibration_count(const Calibration* calibration);
+
+// The references for one channel of a scan width samples wide, scanned with
+// settings. Returns false if the calibration has none.
+bool calibration_find(const Calibration* calibration,
+                      const ScanSettings* settings, int channel,
+                      uint32_t width, const float** dark, const float** gain);
+
+// Corrects n_lines consecutive lines of width samples in place, rounding
+// and clamping to 0-65535. Vectorized where the CPU allows.
+void calibration_correct(uint16_t* samples, size_t width, size_t n_lines,
+                         const float* dark, const float* gain);
+
+CalibrationBuilder* new_calibration_builder(void);
+void free_calibration_builder(CalibrationBuilder* builder);
+
+// Adds the column means of every channel of im, scanned with settings, to
+// the dark references if the light was off and to the flat ones otherwise.
+// A flat frame with clipped samples is left out, as its columns would come
+// out too dark. Safe to call from several threads at once. Returns 0 or
+// ENOMEM.
+int calibration_builder_add(CalibrationBuilder* builder, const Image* im,
+                            const ScanSettings* settings);
+size_t calibration_builder_count(const CalibrationBuilder* builder);
+
+// Writes everything added so far as a calibration file. Returns 0 or an
+// errno value.
+int calibration_builder_write(CalibrationBuilder* builder,
+                              const char* filename);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // CALIBRATION_H
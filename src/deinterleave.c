@@ -0,0 +1,230 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DEINTERLEAVE_X86
+#include <immintrin.h>
+#endif
+
+#include "deinterleave.h"
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+static void deinterleave_scalar(const uint16_t* src, uint16_t* r, uint16_t* g,
+                                uint16_t* b, uint16_t* i, size_t n_pixels,
+                                bool byteswap);
+#ifdef DEINTERLEAVE_X86
+static void deinterleave_sse2(const uint16_t* src, uint16_t* r, uint16_t* g,
+                              uint16_t* b, uint16_t* i, size_t n_pixels,
+                              bool byteswap);
+static void deinterleave_avx2(const uint16_t* src, uint16_t* r, uint16_t* g,
+                              uint16_t* b, uint16_t* i, size_t n_pixels,
+                              bool byteswap);
+#endif
+
+
+
+/*****************************************************************************\
+| Global variables                                                            |
+\*****************************************************************************/
+
+static DeinterleaveFunc best_impl = NULL;
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+DeinterleaveFunc
+get_deinterleave_func(DeinterleaveImpl impl)
+{
+    switch (impl) {
+        case DEINTERLEAVE_SCALAR:
+            return deinterleave_scalar;
+#ifdef DEINTERLEAVE_X86
+        case DEINTERLEAVE_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2") ? deinterleave_sse2 : NULL;
+        case DEINTERLEAVE_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") ? deinterleave_avx2 : NULL;
+#endif
+        case DEINTERLEAVE_AUTO: {
+            DeinterleaveFunc f = get_deinterleave_func(DEINTERLEAVE_AVX2);
+            if (!f) f = get_deinterleave_func(DEINTERLEAVE_SSE2);
+            if (!f) f = deinterleave_scalar;
+            return f;
+        }
+        default:
+            return NULL;
+    }
+}
+
+const char*
+deinterleave_impl_name(DeinterleaveImpl impl)
+{
+    switch (impl) {
+        case DEINTERLEAVE_AUTO:   return "auto";
+        case DEINTERLEAVE_SCALAR: return "scalar";
+        case DEINTERLEAVE_SSE2:   return "sse2";
+        case DEINTERLEAVE_AVX2:   return "avx2";
+        default:                  return "unknown";
+    }
+}
+
+void
+deinterleave_rgbi(const uint16_t* src,
+                  uint16_t* r,
+                  uint16_t* g,
+                  uint16_t* b,
+                  uint16_t* i,
+                  size_t n_pixels,
+                  bool byteswap)
+{
+    // Benign race: every thread resolves the same pointer.
+    DeinterleaveFunc f = __atomic_load_n(&best_impl, __ATOMIC_RELAXED);
+    if (!f) {
+        f = get_deinterleave_func(DEINTERLEAVE_AUTO);
+        __atomic_store_n(&best_impl, f, __ATOMIC_RELAXED);
+    }
+    f(src, r, g, b, i, n_pixels, byteswap);
+}
+
+void
+deinterleave_scalar(const uint16_t* src,
+                    uint16_t* r,
+                    uint16_t* g,
+                    uint16_t* b,
+                    uint16_t* i,
+                    size_t n_pixels,
+                    bool byteswap)
+{
+    if (byteswap) {
+        for (size_t p = 0; p < n_pixels; ++p) {
+            r[p] = __builtin_bswap16(src[4*p]);
+            g[p] = __builtin_bswap16(src[4*p + 1]);
+            b[p] = __builtin_bswap16(src[4*p + 2]);
+            i[p] = __builtin_bswap16(src[4*p + 3]);
+        }
+    } else {
+        for (size_t p = 0; p < n_pixels; ++p) {
+            r[p] = src[4*p];
+            g[p] = src[4*p + 1];
+            b[p] = src[4*p + 2];
+            i[p] = src[4*p + 3];
+        }
+    }
+}
+
+#ifdef DEINTERLEAVE_X86
+
+// Eight pixels per iteration: a 4x4 transpose of 16-bit lanes done with two
+// rounds of unpacks, followed by a 64-bit unpack to gather each channel.
+__attribute__((target("sse2")))
+void
+deinterleave_sse2(const uint16_t* src,
+                  uint16_t* r,
+                  uint16_t* g,
+                  uint16_t* b,
+                  uint16_t* i,
+                  size_t n_pixels,
+                  bool byteswap)
+{
+    size_t p = 0;
+
+    for (; p + 8 <= n_pixels; p += 8) {
+        const __m128i* in = (const __m128i*) (src + 4*p);
+        __m128i v0 = _mm_loadu_si128(in);
+        __m128i v1 = _mm_loadu_si128(in + 1);
+        __m128i v2 = _mm_loadu_si128(in + 2);
+        __m128i v3 = _mm_loadu_si128(in + 3);
+
+        if (byteswap) {
+            v0 = _mm_or_si128(_mm_slli_epi16(v0, 8), _mm_srli_epi16(v0, 8));
+            v1 = _mm_or_si128(_mm_slli_epi16(v1, 8), _mm_srli_epi16(v1, 8));
+            v2 = _mm_or_si128(_mm_slli_epi16(v2, 8), _mm_srli_epi16(v2, 8));
+            v3 = _mm_or_si128(_mm_slli_epi16(v3, 8), _mm_srli_epi16(v3, 8));
+        }
+
+        __m128i t0 = _mm_unpacklo_epi16(v0, v1);  // r0 r2 g0 g2 b0 b2 i0 i2
+        __m128i t1 = _mm_unpackhi_epi16(v0, v1);  // r1 r3 g1 g3 b1 b3 i1 i3
+        __m128i t2 = _mm_unpacklo_epi16(v2, v3);
+        __m128i t3 = _mm_unpackhi_epi16(v2, v3);
+
+        __m128i u0 = _mm_unpacklo_epi16(t0, t1);  // r0 r1 r2 r3 g0 g1 g2 g3
+        __m128i u1 = _mm_unpackhi_epi16(t0, t1);  // b0 b1 b2 b3 i0 i1 i2 i3
+        __m128i u2 = _mm_unpacklo_epi16(t2, t3);
+        __m128i u3 = _mm_unpackhi_epi16(t2, t3);
+
+        _mm_storeu_si128((__m128i*) (r + p), _mm_unpacklo_epi64(u0, u2));
+        _mm_storeu_si128((__m128i*) (g + p), _mm_unpackhi_epi64(u0, u2));
+        _mm_storeu_si128((__m128i*) (b + p), _mm_unpacklo_epi64(u1, u3));
+        _mm_storeu_si128((__m128i*) (i + p), _mm_unpackhi_epi64(u1, u3));
+    }
+
+    deinterleave_scalar(src + 4*p, r + p, g + p, b + p, i + p, n_pixels - p,
+                        byteswap);
+}
+
+// Same transpose as the SSE2 kernel, run independently in both 128-bit
+// lanes. Each lane ends up holding every other pair of pixels, which a
+// final cross-lane permute puts back in order.
+__attribute__((target("avx2")))
+void
+deinterleave_avx2(const uint16_t* src,
+                  uint16_t* r,
+                  uint16_t* g,
+                  uint16_t* b,
+                  uint16_t* i,
+                  size_t n_pixels,
+                  bool byteswap)
+{
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t p = 0;
+
+    for (; p + 16 <= n_pixels; p += 16) {
+        const __m256i* in = (const __m256i*) (src + 4*p);
+        __m256i v0 = _mm256_loadu_si256(in);
+        __m256i v1 = _mm256_loadu_si256(in + 1);
+        __m256i v2 = _mm256_loadu_si256(in + 2);
+        __m256i v3 = _mm256_loadu_si256(in + 3);
+
+        if (byteswap) {
+            v0 = _mm256_or_si256(_mm256_slli_epi16(v0, 8), _mm256_srli_epi16(v0, 8));
+            v1 = _mm256_or_si256(_mm256_slli_epi16(v1, 8), _mm256_srli_epi16(v1, 8));
+            v2 = _mm256_or_si256(_mm256_slli_epi16(v2, 8), _mm256_srli_epi16(v2, 8));
+            v3 = _mm256_or_si256(_mm256_slli_epi16(v3, 8), _mm256_srli_epi16(v3, 8));
+        }
+
+        __m256i t0 = _mm256_unpacklo_epi16(v0, v1);
+        __m256i t1 = _mm256_unpackhi_epi16(v0, v1);
+        __m256i t2 = _mm256_unpacklo_epi16(v2, v3);
+        __m256i t3 = _mm256_unpackhi_epi16(v2, v3);
+
+        __m256i u0 = _mm256_unpacklo_epi16(t0, t1);
+        __m256i u1 = _mm256_unpackhi_epi16(t0, t1);
+        __m256i u2 = _mm256_unpacklo_epi16(t2, t3);
+        __m256i u3 = _mm256_unpackhi_epi16(t2, t3);
+
+        __m256i vr = _mm256_permutevar8x32_epi32(_mm256_unpacklo_epi64(u0, u2), order);
+        __m256i vg = _mm256_permutevar8x32_epi32(_mm256_unpackhi_epi64(u0, u2), order);
+        __m256i vb = _mm256_permutevar8x32_epi32(_mm256_unpacklo_epi64(u1, u3), order);
+        __m256i vi = _mm256_permutevar8x32_epi32(_mm256_unpackhi_epi64(u1, u3), order);
+
+        _mm256_storeu_si256((__m256i*) (r + p), vr);
+        _mm256_storeu_si256((__m256i*) (g + p), vg);
+        _mm256_storeu_si256((__m256i*) (b + p), vb);
+        _mm256_storeu_si256((__m256i*) (i + p), vi);
+    }
+
+    deinterleave_sse2(src + 4*p, r + p, g + p, b + p, i + p, n_pixels - p,
+                      byteswap);
+}
+
+#endif  // DEINTERLEAVE_X86
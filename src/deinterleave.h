@@ -0,0 +1,56 @@
+#ifndef DEINTERLEAVE_H
+#define DEINTERLEAVE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef enum {
+    DEINTERLEAVE_AUTO = 0,
+    DEINTERLEAVE_SCALAR,
+    DEINTERLEAVE_SSE2,
+    DEINTERLEAVE_AVX2,
+} DeinterleaveImpl;
+
+// Splits n_pixels interleaved RGBI samples from src into four planes,
+// optionally swapping the byte order of every sample on the way.
+typedef void (*DeinterleaveFunc)(const uint16_t* src,
+                                 uint16_t* r,
+                                 uint16_t* g,
+                                 uint16_t* b,
+                                 uint16_t* i,
+                                 size_t n_pixels,
+                                 bool byteswap);
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+// Returns NULL if the requested implementation is not available on this CPU.
+// DEINTERLEAVE_AUTO picks the fastest available one.
+DeinterleaveFunc get_deinterleave_func(DeinterleaveImpl impl);
+const char* deinterleave_impl_name(DeinterleaveImpl impl);
+
+void deinterleave_rgbi(const uint16_t* src, uint16_t* r, uint16_t* g,
+                       uint16_t* b, uint16_t* i, size_t n_pixels,
+                       bool byteswap);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // DEINTERLEAVE_H
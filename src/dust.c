@@ -0,0 +1,445 @@
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dust.h"
+#include "threadpool.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// A row's local infrared level is the largest over BLOCK_REACH blocks of
+// BLOCK samples either side, so it follows the lamp's fall-off but not a
+// speck of dust up to about 2 * BLOCK_REACH * BLOCK pixels wide.
+#define BLOCK 32
+#define BLOCK_REACH 2
+
+// Rows whose infrared is dimmer than this, such as those of a frame
+// scanned with the light off, aren't checked.
+#define MIN_LEVEL 256.0f
+
+// Samples at or above this are left out of the crosstalk fit.
+#define CLIP_LEVEL 65000
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+struct DustFilter {
+    DustOptions options;
+
+    uint32_t width;
+    uint32_t height;
+    uint8_t* defects;   // width x height, as found
+    uint8_t* mask;      // width x height, grown
+    size_t capacity;    // Of each
+
+    // Lines each stage is done with; every stage trails the one before.
+    uint32_t detected;
+    uint32_t grown;
+    uint32_t cleaned;
+    size_t n_defects;
+};
+
+// One stage over lines first to end, in tiles of DUST_BAND lines.
+typedef struct {
+    DustFilter* filter;
+    Image* im;
+    uint32_t first;
+    uint32_t end;
+    size_t* counts;     // Defects per tile, for detection
+} StageJob;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+static double fit_crosstalk(const DustFilter* filter, const Image* im,
+                            uint32_t first, uint32_t end, bool exclude);
+static size_t mark_defects(DustFilter* filter, const Image* im,
+                           uint32_t first, uint32_t end, float crosstalk,
+                           float* residual, float* levels);
+static void detect_tile(void* arg, size_t tile);
+static void grow_tile(void* arg, size_t tile);
+static void clean_tile(void* arg, size_t tile);
+static void run_stage(DustFilter* filter, Image* im, uint32_t first,
+                      uint32_t end, void (*stage)(void*, size_t));
+static void filter_lines(DustFilter* filter, Image* im, uint32_t n_lines,
+                         bool last);
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+DustOptions
+dust_options_default(void)
+{
+    DustOptions options = {
+        .threshold = 0.3,
+        .grow = 2,
+        .radius = 16,
+    };
+    return options;
+}
+
+DustFilter*
+new_dust_filter(const DustOptions* options)
+{
+    DustFilter* filter = (DustFilter*) calloc(1, sizeof(DustFilter));
+    if (!filter) return NULL;
+
+    filter->options = options ? *options : dust_options_default();
+    if (filter->options.grow < 0) filter->options.grow = 0;
+    if (filter->options.radius < 1) filter->options.radius = 1;
+    return filter;
+}
+
+void
+free_dust_filter(DustFilter* filter)
+{
+    if (!filter) return;
+
+    free(filter->defects);
+    free(filter->mask);
+    free(filter);
+}
+
+int
+dust_filter_start(DustFilter* filter, uint32_t width, uint32_t height)
+{
+    const size_t size = (size_t) width * height;
+
+    if (size > filter->capacity) {
+        free(filter->defects);
+        free(filter->mask);
+        filter->defects = (uint8_t*) malloc(size);
+        filter->mask = (uint8_t*) malloc(size);
+        filter->capacity = filter->defects && filter->mask ? size : 0;
+        if (!filter->capacity) {
+            free(filter->defects);
+            free(filter->mask);
+            filter->defects = NULL;
+            filter->mask = NULL;
+            filter->width = filter->height = 0;
+            return ENOMEM;
+        }
+    }
+
+    filter->width = width;
+    filter->height = height;
+    filter->detected = 0;
+    filter->grown = 0;
+    filter->cleaned = 0;
+    filter->n_defects = 0;
+    return 0;
+}
+
+size_t
+dust_filter_count(const DustFilter* filter)
+{
+    return filter->n_defects;
+}
+
+// Slope of i against r within rows over the lines, leaving out clipped
+// samples and, with exclude, the defects found so far. Each row is taken
+// about its own means, as the lamp falls off down the frame in both planes
+// alike. Dye only takes infrared away, so the slope is never negative.
+double
+fit_crosstalk(const DustFilter* filter, const Image* im, uint32_t first,
+              uint32_t end, bool exclude)
+{
+    const size_t width = filter->width;
+    double sxx = 0, sxy = 0;
+
+    for (uint32_t y = first; y < end; ++y) {
+        const uint16_t* r = im->r + y * width;
+        const uint16_t* i = im->i + y * width;
+        const uint8_t* defects = filter->defects + y * width;
+        double n = 0, sr = 0, si = 0, srr = 0, sri = 0;
+
+        for (size_t x = 0; x < width; ++x) {
+            if (r[x] >= CLIP_LEVEL || i[x] >= CLIP_LEVEL ||
+                (exclude && defects[x])) {
+                continue;
+            }
+            n += 1;
+            sr += r[x];
+            si += i[x];
+            srr += (double) r[x] * r[x];
+            sri += (double) r[x] * i[x];
+        }
+        if (n < 2) continue;
+        sxx += srr - sr * sr / n;
+        sxy += sri - sr * si / n;
+    }
+
+    double slope = sxx > 0 ? sxy / sxx : 0;
+    return slope > 0 ? slope : 0;
+}
+
+// Marks the defects of the lines against their rows' local level, using
+// residual and levels as scratch for a row. Returns the number found.
+size_t
+mark_defects(DustFilter* filter, const Image* im, uint32_t first,
+             uint32_t end, float crosstalk, float* residual, float* levels)
+{
+    const size_t width = filter->width;
+    const size_t n_blocks = (width + BLOCK - 1) / BLOCK;
+    const float keep = (float) (1.0 - filter->options.threshold);
+    size_t count = 0;
+
+    for (uint32_t y = first; y < end; ++y) {
+        const uint16_t* r = im->r + y * width;
+        const uint16_t* i = im->i + y * width;
+        uint8_t* defects = filter->defects + y * width;
+
+        for (size_t x = 0; x < width; ++x) {
+            residual[x] = (float) i[x] - crosstalk * (float) r[x];
+        }
+
+        // Block maxima, then the largest within reach of each block, scaled
+        // to the level a sample has to stay above.
+        for (size_t b = 0; b < n_blocks; ++b) {
+            const size_t stop = (b + 1) * BLOCK < width ? (b + 1) * BLOCK
+                                                        : width;
+            float top = residual[b * BLOCK];
+            for (size_t x = b * BLOCK + 1; x < stop; ++x) {
+                top = residual[x] > top ? residual[x] : top;
+            }
+            levels[n_blocks + b] = top;
+        }
+        for (size_t b = 0; b < n_blocks; ++b) {
+            const size_t lo = b > BLOCK_REACH ? b - BLOCK_REACH : 0;
+            const size_t hi = b + BLOCK_REACH < n_blocks
+                            ? b + BLOCK_REACH : n_blocks - 1;
+            float top = levels[n_blocks + lo];
+            for (size_t k = lo + 1; k <= hi; ++k) {
+                float v = levels[n_blocks + k];
+                top = v > top ? v : top;
+            }
+            levels[b] = top >= MIN_LEVEL ? keep * top : -INFINITY;
+        }
+
+        for (size_t x = 0; x < width; ++x) {
+            defects[x] = residual[x] < levels[x / BLOCK];
+            count += defects[x];
+        }
+    }
+    return count;
+}
+
+// The crosstalk is fitted to all of the tile, then again without the
+// defects that fit found, which would pull it down.
+void
+detect_tile(void* arg, size_t tile)
+{
+    StageJob* job = (StageJob*) arg;
+    DustFilter* filter = job->filter;
+    const uint32_t first = job->first + (uint32_t) tile * DUST_BAND;
+    const uint32_t end = first + DUST_BAND < job->end ? first + DUST_BAND
+                                                      : job->end;
+    const size_t n_blocks = (filter->width + BLOCK - 1) / BLOCK;
+    float* residual = (float*) malloc(filter->width * sizeof(float));
+    float* levels = (float*) malloc(2 * n_blocks * sizeof(float));
+
+    job->counts[tile] = 0;
+    if (!residual || !levels) {
+        // Nothing found is the safe way to fail.
+        memset(filter->defects + (size_t) first * filter->width, 0,
+               (size_t) (end - first) * filter->width);
+    } else {
+        float crosstalk = (float) fit_crosstalk(filter, job->im, first, end,
+                                                false);
+        mark_defects(filter, job->im, first, end, crosstalk, residual,
+                     levels);
+        crosstalk = (float) fit_crosstalk(filter, job->im, first, end, true);
+        job->counts[tile] = mark_defects(filter, job->im, first, end,
+                                         crosstalk, residual, levels);
+    }
+
+    free(residual);
+    free(levels);
+}
+
+// Grows the defects into the mask, rows first and then along them.
+void
+grow_tile(void* arg, size_t tile)
+{
+    StageJob* job = (StageJob*) arg;
+    const DustFilter* filter = job->filter;
+    const size_t width = filter->width;
+    const int grow = filter->options.grow;
+    const uint32_t first = job->first + (uint32_t) tile * DUST_BAND;
+    const uint32_t end = first + DUST_BAND < job->end ? first + DUST_BAND
+                                                      : job->end;
+    uint8_t* column = (uint8_t*) malloc(width);
+
+    for (uint32_t y = first; y < end; ++y) {
+        const uint32_t lo = y > (uint32_t) grow ? y - grow : 0;
+        const uint32_t hi = y + grow < filter->height ? y + grow
+                                                      : filter->height - 1;
+        uint8_t* mask = filter->mask + y * width;
+
+        if (!column) {
+            memcpy(mask, filter->defects + y * width, width);
+            continue;
+        }
+
+        memset(column, 0, width);
+        for (uint32_t yy = lo; yy <= hi; ++yy) {
+            const uint8_t* defects = filter->defects + yy * width;
+            for (size_t x = 0; x < width; ++x) column[x] |= defects[x];
+        }
+        for (size_t x = 0; x < width; ++x) {
+            const size_t a = x > (size_t) grow ? x - grow : 0;
+            const size_t b = x + grow < width ? x + grow : width - 1;
+            uint8_t m = 0;
+            for (size_t xx = a; xx <= b; ++xx) m |= column[xx];
+            mask[x] = m;
+        }
+    }
+
+    free(column);
+}
+
+// Fills r, g and b under the mask from the nearest clean sample in each
+// direction. Clean samples are never written, so tiles can read across
+// each other's lines.
+void
+clean_tile(void* arg, size_t tile)
+{
+    StageJob* job = (StageJob*) arg;
+    const DustFilter* filter = job->filter;
+    const Image* im = job->im;
+    const size_t width = filter->width;
+    const int radius = filter->options.radius;
+    const uint32_t first = job->first + (uint32_t) tile * DUST_BAND;
+    const uint32_t end = first + DUST_BAND < job->end ? first + DUST_BAND
+                                                      : job->end;
+    uint16_t* planes[3] = {im->r, im->g, im->b};
+
+    for (uint32_t y = first; y < end; ++y) {
+        const uint8_t* mask = filter->mask + y * width;
+
+        for (size_t x = 0; x < width; ++x) {
+            if (!mask[x]) continue;
+
+            // Left, right, up and down.
+            const long steps[4] = {-1, 1, -(long) width, (long) width};
+            const long reach[4] = {
+                (long) x < radius ? (long) x : radius,
+                (long) (width - 1 - x) < radius ? (long) (width - 1 - x)
+                                                : radius,
+                (long) y < radius ? (long) y : radius,
+                (long) (filter->height - 1 - y) < radius
+                    ? (long) (filter->height - 1 - y) : radius,
+            };
+            const size_t k = (size_t) y * width + x;
+            float sums[3] = {0, 0, 0};
+            float weight = 0;
+
+            for (int d = 0; d < 4; ++d) {
+                for (long s = 1; s <= reach[d]; ++s) {
+                    const size_t kk = k + s * steps[d];
+                    if (filter->mask[kk]) continue;
+
+                    const float w = 1.0f / (float) s;
+                    for (int c = 0; c < 3; ++c) {
+                        sums[c] += w * planes[c][kk];
+                    }
+                    weight += w;
+                    break;
+                }
+            }
+
+            if (weight == 0) continue;
+            for (int c = 0; c < 3; ++c) {
+                planes[c][k] = (uint16_t) (sums[c] / weight + 0.5f);
+            }
+        }
+    }
+}
+
+void
+run_stage(DustFilter* filter, Image* im, uint32_t first, uint32_t end,
+          void (*stage)(void*, size_t))
+{
+    const size_t n_tiles = (end - first + DUST_BAND - 1) / DUST_BAND;
+    size_t* counts = (size_t*) calloc(n_tiles, sizeof(size_t));
+    StageJob job = {filter, im, first, end, counts};
+
+    if (!counts) return;
+    parallel_for(n_tiles, stage, &job);
+    for (size_t t = 0; t < n_tiles; ++t) {
+        filter->n_defects += counts[t];
+    }
+    free(counts);
+}
+
+// Runs the stages as far as n_lines lines allow, or to the end of the
+// frame if last.
+void
+filter_lines(DustFilter* filter, Image* im, uint32_t n_lines, bool last)
+{
+    const uint32_t grow = (uint32_t) filter->options.grow;
+    const uint32_t radius = (uint32_t) filter->options.radius;
+
+    // Detection goes band by band; growing needs grow lines below, and
+    // cleaning radius lines of the grown mask below.
+    uint32_t detect = last ? filter->height : n_lines / DUST_BAND * DUST_BAND;
+    if (detect > filter->detected) {
+        run_stage(filter, im, filter->detected, detect, detect_tile);
+        filter->detected = detect;
+    }
+
+    uint32_t grown = last ? filter->height
+                   : filter->detected > grow ? filter->detected - grow : 0;
+    if (grown > filter->grown) {
+        run_stage(filter, im, filter->grown, grown, grow_tile);
+        filter->grown = grown;
+    }
+
+    uint32_t cleaned = last ? filter->height
+                     : filter->grown > radius ? filter->grown - radius : 0;
+    if (cleaned > filter->cleaned) {
+        run_stage(filter, im, filter->cleaned, cleaned, clean_tile);
+        filter->cleaned = cleaned;
+    }
+}
+
+void
+dust_filter_lines(DustFilter* filter, Image* im, uint32_t n_lines)
+{
+    if (!filter->capacity || im->width != filter->width ||
+        im->height != filter->height) {
+        return;
+    }
+
+    filter_lines(filter, im, n_lines, n_lines >= filter->height);
+}
+
+void
+dust_filter_finish(DustFilter* filter, Image* im, uint32_t n_lines)
+{
+    if (!filter->capacity || im->width != filter->width ||
+        im->height != filter->height) {
+        return;
+    }
+
+    // Cut the frame short at the last line scanned, though never before
+    // lines already done with.
+    if (n_lines < filter->detected) n_lines = filter->detected;
+    if (n_lines < filter->height) filter->height = n_lines;
+    filter_lines(filter, im, filter->height, true);
+}
@@ -0,0 +1,83 @@
+#ifndef DUST_H
+#define DUST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "piescan.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// Film is nearly transparent in infrared, so the i plane is even but for
+// a little of the red dye's density showing through, while dust and
+// scratches block it. A sample is a defect where i, less that crosstalk,
+// is darker than its row's local level by more than the threshold. The
+// crosstalk is fitted per band as the slope of i against r. The defect
+// mask is grown by a few pixels to cover the edges, and r, g and b under
+// it are filled in from the nearest clean samples left, right, above and
+// below, weighted by inverse distance. The i plane is left as scanned.
+//
+// Frames are processed in bands of DUST_BAND lines as they are scanned, a
+// band's lines being cleaned once the lines around them have arrived, so
+// the work overlaps the scan instead of taking another pass afterwards.
+#define DUST_BAND 64
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef struct DustOptions {
+    double threshold;  // Fraction of the local infrared level
+    int grow;          // Pixels the mask is grown by
+    int radius;        // Furthest a clean sample is looked for
+} DustOptions;
+
+typedef struct DustFilter DustFilter;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+// A threshold of 0.3, grown by 2 and filled from up to 16 pixels away.
+DustOptions dust_options_default(void);
+
+// A filter keeps its mask from frame to frame. NULL if out of memory.
+DustFilter* new_dust_filter(const DustOptions* options);
+void free_dust_filter(DustFilter* filter);
+
+// Starts a frame of width x height. Returns 0 or ENOMEM.
+int dust_filter_start(DustFilter* filter, uint32_t width, uint32_t height);
+
+// Tells the filter that lines 0 to n_lines - 1 of im have been scanned,
+// im being of the size started with. Every line whose neighbourhood is
+// complete is cleaned; with n_lines equal to the height, all the rest are.
+// Lines can't be taken back, so n_lines only grows within a frame.
+void dust_filter_lines(DustFilter* filter, Image* im, uint32_t n_lines);
+
+// Ends the frame after its first n_lines lines, when a scan stops short of
+// the height started with, and cleans them all as if the frame ended
+// there. Lines after them are left alone.
+void dust_filter_finish(DustFilter* filter, Image* im, uint32_t n_lines);
+
+// Pixels of the current frame found defective so far, before growing.
+size_t dust_filter_count(const DustFilter* filter);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // DUST_H
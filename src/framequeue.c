@@ -0,0 +1,98 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "framequeue.h"
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+struct FrameQueue {
+    Frame** items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    bool closed;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+FrameQueue*
+new_frame_queue(size_t capacity)
+{
+    FrameQueue* q = (FrameQueue*) malloc(sizeof(FrameQueue));
+    q->items = (Frame**) malloc(capacity * sizeof(Frame*));
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->closed = false;
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+
+    return q;
+}
+
+void
+free_frame_queue(FrameQueue* q)
+{
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+    free(q);
+}
+
+void
+frame_queue_push(FrameQueue* q, Frame* frame)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->items[(q->head + q->count) % q->capacity] = frame;
+    ++q->count;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+Frame*
+frame_queue_pop(FrameQueue* q)
+{
+    Frame* frame = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    if (q->count > 0) {
+        frame = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        --q->count;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return frame;
+}
+
+void
+frame_queue_close(FrameQueue* q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,57 @@
+#ifndef FRAMEQUEUE_H
+#define FRAMEQUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include "piescan.h"
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+// A frame travelling through the acquisition pipeline: the image buffer plus
+// everything the output stages need to know about how it was captured.
+typedef struct {
+    Image* im;
+    ScanSettings settings;
+    size_t index;  // Point in the sweep
+    size_t group;  // Exposures of one group are merged together
+    size_t step;   // Position within the group
+    void* owner;   // Whoever scanned the frame, left alone by the queue
+
+    double t_scan;
+} Frame;
+
+typedef struct FrameQueue FrameQueue;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+FrameQueue* new_frame_queue(size_t capacity);
+void free_frame_queue(FrameQueue* q);
+
+// Blocks while the queue is full.
+void frame_queue_push(FrameQueue* q, Frame* frame);
+
+// Blocks while the queue is empty. Returns NULL once the queue has been
+// closed and drained.
+Frame* frame_queue_pop(FrameQueue* q);
+
+void frame_queue_close(FrameQueue* q);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // FRAMEQUEUE_H
@@ -0,0 +1,371 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HDRMERGE_X86
+#include <immintrin.h>
+#endif
+
+#include "hdrmerge.h"
+#include "mmaparray.h"
+#include "rawframe.h"
+#include "threadpool.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// Samples per tile and plane. A tile touches one 16-bit plane, its sums and
+// its weights: 640 KiB, within L2 on anything recent.
+#define TILE_SAMPLES (64*1024)
+
+// Smallest weight of an unclipped sample, so pixels that are dark in every
+// exposure still average to their (near zero) radiance.
+#define HAT_FLOOR (1.0f / 1024.0f)
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef void (*AccumulateFunc)(const uint16_t* v, float* sum, float* weight,
+                               size_t n, float inv_exposure, float clip);
+
+struct HdrMerge {
+    char* filename;
+    float clip;
+    uint32_t width;
+    uint32_t height;
+    size_t n_frames;
+    float min_exposure[4];
+
+    MmapArray* map;
+    float* sums[4];     // Planes of the output file
+    float* weights;     // 4 planes on the heap
+
+    AccumulateFunc accumulate;
+    pthread_mutex_t lock;
+};
+
+typedef struct {
+    HdrMerge* merge;
+    const uint16_t* planes[4];
+    float inv_exposure[4];
+    float saturated[4];
+    size_t n_samples;
+} MergeJob;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+static void accumulate_scalar(const uint16_t* v, float* sum, float* weight,
+                              size_t n, float inv_exposure, float clip);
+#ifdef HDRMERGE_X86
+static void accumulate_sse2(const uint16_t* v, float* sum, float* weight,
+                            size_t n, float inv_exposure, float clip);
+static void accumulate_avx2(const uint16_t* v, float* sum, float* weight,
+                            size_t n, float inv_exposure, float clip);
+#endif
+static AccumulateFunc get_accumulate_func(void);
+static int start_merge(HdrMerge* merge, const Image* im,
+                       const ScanSettings* settings);
+static void accumulate_tile(void* arg, size_t tile);
+static void finish_tile(void* arg, size_t tile);
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+// The SIMD versions below do the same float operations in the same order,
+// so all three give identical sums.
+void
+accumulate_scalar(const uint16_t* v, float* sum, float* weight, size_t n,
+                  float inv_exposure, float clip)
+{
+    for (size_t k = 0; k < n; ++k) {
+        float x = (float) v[k];
+        float w = 1.0f - fabsf(x * (2.0f / 65535.0f) - 1.0f);
+        w = w > HAT_FLOOR ? w : HAT_FLOOR;
+        w = x < clip ? w : 0.0f;
+        sum[k] += w * x * inv_exposure;
+        weight[k] += w;
+    }
+}
+
+#ifdef HDRMERGE_X86
+
+__attribute__((target("sse2")))
+void
+accumulate_sse2(const uint16_t* v, float* sum, float* weight, size_t n,
+                float inv_exposure, float clip)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 scale = _mm_set1_ps(2.0f / 65535.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 hat_floor = _mm_set1_ps(HAT_FLOOR);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 vclip = _mm_set1_ps(clip);
+    const __m128 vinv = _mm_set1_ps(inv_exposure);
+    size_t k = 0;
+
+    for (; k + 8 <= n; k += 8) {
+        __m128i raw = _mm_loadu_si128((const __m128i*) (v + k));
+        __m128 halves[2] = {
+            _mm_cvtepi32_ps(_mm_unpacklo_epi16(raw, zero)),
+            _mm_cvtepi32_ps(_mm_unpackhi_epi16(raw, zero)),
+        };
+
+        for (int h = 0; h < 2; ++h) {
+            __m128 x = halves[h];
+            __m128 t = _mm_sub_ps(_mm_mul_ps(x, scale), one);
+            __m128 w = _mm_sub_ps(one, _mm_and_ps(t, abs_mask));
+            w = _mm_max_ps(w, hat_floor);
+            w = _mm_and_ps(w, _mm_cmplt_ps(x, vclip));
+
+            float* s = sum + k + 4*h;
+            float* ws = weight + k + 4*h;
+            _mm_storeu_ps(s, _mm_add_ps(_mm_loadu_ps(s),
+                                        _mm_mul_ps(_mm_mul_ps(w, x), vinv)));
+            _mm_storeu_ps(ws, _mm_add_ps(_mm_loadu_ps(ws), w));
+        }
+    }
+
+    accumulate_scalar(v + k, sum + k, weight + k, n - k, inv_exposure, clip);
+}
+
+__attribute__((target("avx2")))
+void
+accumulate_avx2(const uint16_t* v, float* sum, float* weight, size_t n,
+                float inv_exposure, float clip)
+{
+    const __m256 scale = _mm256_set1_ps(2.0f / 65535.0f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 hat_floor = _mm256_set1_ps(HAT_FLOOR);
+    const __m256 abs_mask =
+        _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 vclip = _mm256_set1_ps(clip);
+    const __m256 vinv = _mm256_set1_ps(inv_exposure);
+    size_t k = 0;
+
+    for (; k + 8 <= n; k += 8) {
+        __m128i raw = _mm_loadu_si128((const __m128i*) (v + k));
+        __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(raw));
+        __m256 t = _mm256_sub_ps(_mm256_mul_ps(x, scale), one);
+        __m256 w = _mm256_sub_ps(one, _mm256_and_ps(t, abs_mask));
+        w = _mm256_max_ps(w, hat_floor);
+        w = _mm256_and_ps(w, _mm256_cmp_ps(x, vclip, _CMP_LT_OQ));
+
+        _mm256_storeu_ps(sum + k,
+                         _mm256_add_ps(_mm256_loadu_ps(sum + k),
+                                       _mm256_mul_ps(_mm256_mul_ps(w, x),
+                                                     vinv)));
+        _mm256_storeu_ps(weight + k,
+                         _mm256_add_ps(_mm256_loadu_ps(weight + k), w));
+    }
+
+    accumulate_scalar(v + k, sum + k, weight + k, n - k, inv_exposure, clip);
+}
+
+#endif  // HDRMERGE_X86
+
+AccumulateFunc
+get_accumulate_func(void)
+{
+#ifdef HDRMERGE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return accumulate_avx2;
+    if (__builtin_cpu_supports("sse2")) return accumulate_sse2;
+#endif
+    return accumulate_scalar;
+}
+
+HdrMerge*
+new_hdr_merge(const char* filename, uint16_t clip)
+{
+    HdrMerge* merge = (HdrMerge*) calloc(1, sizeof(HdrMerge));
+    if (!merge) return NULL;
+    merge->filename = strdup(filename);
+    if (!merge->filename) {
+        free(merge);
+        return NULL;
+    }
+    merge->clip = (float) clip;
+    merge->accumulate = get_accumulate_func();
+    pthread_mutex_init(&merge->lock, NULL);
+
+    return merge;
+}
+
+// Sizes the output on the first frame and records its settings.
+int
+start_merge(HdrMerge* merge, const Image* im, const ScanSettings* settings)
+{
+    const MmapOptions opts = {MMAP_ACCESS_SEQUENTIAL, true, false, false};
+    const size_t n = (size_t) im->width * im->height;
+
+    if (n == 0 ||
+        get_mmap_writer_opts(&merge->map, merge->filename,
+                             raw_frame_size(im->width, im->height, 32),
+                             &opts) != 0) {
+        return -1;
+    }
+
+    merge->weights = (float*) calloc(4 * n, sizeof(float));
+    if (!merge->weights) {
+        free_mmap_array(merge->map);
+        merge->map = NULL;
+        return -1;
+    }
+
+    // A reused file may hold an old merge.
+    uint8_t* base = (uint8_t*) merge->map->data;
+    write_raw_frame_header(base, im->width, im->height, 32, settings);
+    for (int c = 0; c < 4; ++c) {
+        merge->sums[c] = (float*) (base + raw_frame_plane_offset(
+                                       im->width, im->height, 32, c));
+        memset(merge->sums[c], 0, n * sizeof(float));
+        merge->min_exposure[c] = INFINITY;
+    }
+    merge->width = im->width;
+    merge->height = im->height;
+
+    return 0;
+}
+
+int
+hdr_merge_add(HdrMerge* merge, const Image* im, const ScanSettings* settings)
+{
+    const int exposures[4] = {settings->exposure_r, settings->exposure_g,
+                              settings->exposure_b, settings->exposure_i};
+    int status = -1;
+
+    for (int c = 0; c < 4; ++c) {
+        if (exposures[c] <= 0) return -1;
+    }
+
+    pthread_mutex_lock(&merge->lock);
+
+    if (!merge->map && start_merge(merge, im, settings) != 0) {
+        goto done;
+    }
+    if (im->width != merge->width || im->height != merge->height) {
+        goto done;
+    }
+
+    MergeJob job = {
+        .merge = merge,
+        .planes = {im->r, im->g, im->b, im->i},
+        .n_samples = (size_t) im->width * im->height,
+    };
+    for (int c = 0; c < 4; ++c) {
+        job.inv_exposure[c] = 1.0f / (float) exposures[c];
+        if (exposures[c] < merge->min_exposure[c]) {
+            merge->min_exposure[c] = (float) exposures[c];
+        }
+    }
+
+    parallel_for((job.n_samples + TILE_SAMPLES - 1) / TILE_SAMPLES,
+                 accumulate_tile, &job);
+    ++merge->n_frames;
+    status = 0;
+
+ done:
+    pthread_mutex_unlock(&merge->lock);
+    return status;
+}
+
+size_t
+hdr_merge_count(const HdrMerge* merge)
+{
+    return merge->n_frames;
+}
+
+int
+hdr_merge_finish(HdrMerge* merge)
+{
+    int status = -1;
+
+    if (merge->map && merge->n_frames > 0) {
+        MergeJob job = {
+            .merge = merge,
+            .n_samples = (size_t) merge->width * merge->height,
+        };
+        for (int c = 0; c < 4; ++c) {
+            job.saturated[c] = merge->clip / merge->min_exposure[c];
+        }
+
+        parallel_for((job.n_samples + TILE_SAMPLES - 1) / TILE_SAMPLES,
+                     finish_tile, &job);
+
+        RawFrameSettings* settings =
+            &((RawFrameHeader*) merge->map->data)->settings;
+        settings->exposure_r = 1;
+        settings->exposure_g = 1;
+        settings->exposure_b = 1;
+        settings->exposure_i = 1;
+
+        status = sync_mmap_array(merge->map, MS_SYNC);
+    }
+
+    free_hdr_merge(merge);
+    return status;
+}
+
+void
+free_hdr_merge(HdrMerge* merge)
+{
+    if (merge->map) free_mmap_array(merge->map);
+    free(merge->weights);
+    free(merge->filename);
+    pthread_mutex_destroy(&merge->lock);
+    free(merge);
+}
+
+void
+accumulate_tile(void* arg, size_t tile)
+{
+    MergeJob* job = (MergeJob*) arg;
+    HdrMerge* merge = job->merge;
+    size_t start = tile * TILE_SAMPLES;
+    size_t n = job->n_samples - start < TILE_SAMPLES ?
+               job->n_samples - start : TILE_SAMPLES;
+
+    for (int c = 0; c < 4; ++c) {
+        merge->accumulate(job->planes[c] + start, merge->sums[c] + start,
+                          merge->weights + c * job->n_samples + start, n,
+                          job->inv_exposure[c], merge->clip);
+    }
+}
+
+void
+finish_tile(void* arg, size_t tile)
+{
+    MergeJob* job = (MergeJob*) arg;
+    HdrMerge* merge = job->merge;
+    size_t start = tile * TILE_SAMPLES;
+    size_t n = job->n_samples - start < TILE_SAMPLES ?
+               job->n_samples - start : TILE_SAMPLES;
+
+    for (int c = 0; c < 4; ++c) {
+        float* sum = merge->sums[c] + start;
+        const float* weight = merge->weights + c * job->n_samples + start;
+        const float saturated = job->saturated[c];
+
+        for (size_t k = 0; k < n; ++k) {
+            sum[k] = weight[k] > 0.0f ? sum[k] / weight[k] : saturated;
+        }
+    }
+}
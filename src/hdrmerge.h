@@ -0,0 +1,69 @@
+#ifndef HDRMERGE_H
+#define HDRMERGE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "piescan.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// Samples at or above this are treated as clipped and get no weight.
+#define HDR_CLIP_DEFAULT 65000
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef struct HdrMerge HdrMerge;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+// Starts merging an exposure stack into the 32-bit raw frame file filename
+// (see rawframe.h). The file's planes double as the running weighted sums,
+// so only one frame of weights is held on the heap. clip is the smallest
+// sample value to reject, e.g. HDR_CLIP_DEFAULT. NULL if out of memory.
+HdrMerge* new_hdr_merge(const char* filename, uint16_t clip);
+
+// Adds one exposure. Each sample v of channel c contributes v / exposure_c,
+// weighted by a hat function that peaks at mid-range and falls to zero for
+// clipped samples. The first frame fixes the size; frames of another size
+// are rejected with -1. Safe to call from several threads at once.
+int hdr_merge_add(HdrMerge* merge, const Image* im,
+                  const ScanSettings* settings);
+
+// Number of frames added so far.
+size_t hdr_merge_count(const HdrMerge* merge);
+
+// Turns the sums into radiance in counts per unit of exposure time, writes
+// the header and closes the file. Samples that clipped in every frame get
+// the largest value the shortest exposure could measure. The header carries
+// the settings of the first frame with every exposure set to 1. Returns 0,
+// or -1 if nothing was added or the file couldn't be written. Frees merge.
+int hdr_merge_finish(HdrMerge* merge);
+
+// Drops a merge without finishing it, leaving the file without a valid
+// header.
+void free_hdr_merge(HdrMerge* merge);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // HDRMERGE_H
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HISTOGRAM_X86
+#include <immintrin.h>
+#endif
+
+#include "histogram.h"
+#include "threadpool.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// The kernels count into this many interleaved copies of the histogram, so
+// that consecutive samples landing in the same bin don't wait on each
+// other's increments.
+#define N_COPIES 4
+
+// Samples per kernel call, so 32-bit counts can't overflow.
+#define CHUNK_SAMPLES ((size_t) 1 << 30)
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef void (*HistogramFunc)(uint32_t (*copies)[HISTOGRAM_BINS],
+                              const uint16_t* samples, size_t n);
+
+typedef struct {
+    const uint16_t* planes[4];
+    size_t n_samples;
+    Histogram* histograms;
+} HistogramJob;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+static void histogram_scalar(uint32_t (*copies)[HISTOGRAM_BINS],
+                             const uint16_t* samples, size_t n);
+#ifdef HISTOGRAM_X86
+static void histogram_sse2(uint32_t (*copies)[HISTOGRAM_BINS],
+                           const uint16_t* samples, size_t n);
+static void histogram_avx2(uint32_t (*copies)[HISTOGRAM_BINS],
+                           const uint16_t* samples, size_t n);
+#endif
+static HistogramFunc get_histogram_func(void);
+static void histogram_channel(void* arg, size_t channel);
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+void
+histogram_scalar(uint32_t (*copies)[HISTOGRAM_BINS], const uint16_t* samples,
+                 size_t n)
+{
+    for (size_t k = 0; k < n; ++k) {
+        ++copies[0][samples[k] >> HISTOGRAM_SHIFT];
+    }
+}
+
+#ifdef HISTOGRAM_X86
+
+// Bins are computed a vector at a time and spread over the copies in turn.
+__attribute__((target("sse2")))
+void
+histogram_sse2(uint32_t (*copies)[HISTOGRAM_BINS], const uint16_t* samples,
+               size_t n)
+{
+    uint16_t bins[8] __attribute__((aligned(16)));
+    size_t k = 0;
+
+    for (; k + 8 <= n; k += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (samples + k));
+        _mm_store_si128((__m128i*) bins, _mm_srli_epi16(v, HISTOGRAM_SHIFT));
+        for (int j = 0; j < 8; j += N_COPIES) {
+            ++copies[0][bins[j]];
+            ++copies[1][bins[j + 1]];
+            ++copies[2][bins[j + 2]];
+            ++copies[3][bins[j + 3]];
+        }
+    }
+
+    histogram_scalar(copies, samples + k, n - k);
+}
+
+__attribute__((target("avx2")))
+void
+histogram_avx2(uint32_t (*copies)[HISTOGRAM_BINS], const uint16_t* samples,
+               size_t n)
+{
+    uint16_t bins[16] __attribute__((aligned(32)));
+    size_t k = 0;
+
+    for (; k + 16 <= n; k += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (samples + k));
+        _mm256_store_si256((__m256i*) bins,
+                           _mm256_srli_epi16(v, HISTOGRAM_SHIFT));
+        for (int j = 0; j < 16; j += N_COPIES) {
+            ++copies[0][bins[j]];
+            ++copies[1][bins[j + 1]];
+            ++copies[2][bins[j + 2]];
+            ++copies[3][bins[j + 3]];
+        }
+    }
+
+    histogram_scalar(copies, samples + k, n - k);
+}
+
+#endif  // HISTOGRAM_X86
+
+HistogramFunc
+get_histogram_func(void)
+{
+#ifdef HISTOGRAM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return histogram_avx2;
+    if (__builtin_cpu_supports("sse2")) return histogram_sse2;
+#endif
+    return histogram_scalar;
+}
+
+void
+histogram_add(Histogram* histogram, const uint16_t* samples, size_t n)
+{
+    const HistogramFunc count = get_histogram_func();
+    uint32_t copies[N_COPIES][HISTOGRAM_BINS];
+
+    for (size_t k = 0; k < n; k += CHUNK_SAMPLES) {
+        size_t chunk = n - k < CHUNK_SAMPLES ? n - k : CHUNK_SAMPLES;
+
+        memset(copies, 0, sizeof(copies));
+        count(copies, samples + k, chunk);
+        for (size_t b = 0; b < HISTOGRAM_BINS; ++b) {
+            histogram->bins[b] += (uint64_t) copies[0][b] + copies[1][b]
+                                + copies[2][b] + copies[3][b];
+        }
+    }
+    histogram->count += n;
+}
+
+void
+histogram_channel(void* arg, size_t channel)
+{
+    HistogramJob* job = (HistogramJob*) arg;
+    histogram_add(&job->histograms[channel], job->planes[channel],
+                  job->n_samples);
+}
+
+void
+image_histograms(const Image* im, Histogram histograms[4])
+{
+    HistogramJob job = {
+        .planes = {im->r, im->g, im->b, im->i},
+        .n_samples = (size_t) im->width * im->height,
+        .histograms = histograms,
+    };
+
+    memset(histograms, 0, 4 * sizeof(Histogram));
+    parallel_for(4, histogram_channel, &job);
+}
+
+uint16_t
+histogram_percentile(const Histogram* histogram, double fraction)
+{
+    const double wanted = fraction * (double) histogram->count;
+    uint64_t seen = 0;
+
+    if (histogram->count == 0) return 0;
+
+    for (size_t b = 0; b < HISTOGRAM_BINS; ++b) {
+        seen += histogram->bins[b];
+        if ((double) seen >= wanted && seen > 0) {
+            return (uint16_t) (((b + 1) << HISTOGRAM_SHIFT) - 1);
+        }
+    }
+    return 65535;
+}
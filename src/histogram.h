@@ -0,0 +1,57 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "piescan.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// Bins of 64 sample values each: fine enough to place highlights within
+// 0.1% of full scale, small enough for several copies to stay in L1.
+#define HISTOGRAM_SHIFT 6
+#define HISTOGRAM_BINS (65536 >> HISTOGRAM_SHIFT)
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef struct {
+    uint64_t bins[HISTOGRAM_BINS];
+    uint64_t count;
+} Histogram;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+// Adds n samples to histogram. Vectorized where the CPU allows.
+void histogram_add(Histogram* histogram, const uint16_t* samples, size_t n);
+
+// Histograms of every channel of im, in r, g, b, i order, one thread each.
+void image_histograms(const Image* im, Histogram histograms[4]);
+
+// The smallest sample value that at least fraction of the samples are at or
+// below, to the upper edge of its bin. 0 for an empty histogram.
+uint16_t histogram_percentile(const Histogram* histogram, double fraction);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // HISTOGRAM_H
@@ -3,25 +3,137 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <png.h>
+#include <zlib.h>
 
 #include "imsave.h"
+#include "threadpool.h"
 
-int
-imsave16(uint16_t* buf,
-         const size_t width,
-         const size_t height,
-         const size_t n_channels,
-         const char* filename)
+// Size of the zlib output buffer, and so of each IDAT chunk. Larger chunks
+// mean fewer write calls and CRCs on multi-hundred-megabyte images.
+#define IDAT_BUFFER_SIZE (1024*1024)
+
+// Uncompressed bytes per band in the parallel writer. Each band costs one
+// empty stored block (5 bytes) at its end, so this keeps the overhead small
+// while still giving every thread several bands to balance over.
+#define BAND_BYTES (1024*1024)
+
+// Deflate window; each band is primed with this much of the preceding
+// filtered data so splitting costs almost nothing in ratio.
+#define DICT_BYTES 32768
+
+// The byte swap and the filters are plain loops left to the compiler to
+// vectorize. On x86-64 they are also built for AVX2, and the loader picks
+// that version where the CPU has it. Define IMSAVE_NO_CLONES for targets
+// without ifunc support.
+#if defined(__x86_64__) && defined(__has_attribute) && \
+    !defined(IMSAVE_NO_CLONES)
+#if __has_attribute(target_clones)
+#define ROW_KERNEL __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+#ifndef ROW_KERNEL
+#define ROW_KERNEL
+#endif
+
+typedef struct {
+    const uint8_t* buf;
+    size_t width;
+    size_t height;
+    size_t row_bytes;      // Unfiltered, without the filter type byte
+    size_t bpp;            // Bytes per complete pixel, for the filters
+    int bit_depth;
+    int level;
+    int strategy;
+    int filters;           // PNG_FILTER_* mask
+
+    size_t rows_per_band;
+    size_t n_bands;
+    unsigned char** out;   // Compressed bytes of each band
+    size_t* out_size;
+    uLong* adler;          // Adler-32 of each band's filtered bytes
+    int failed;
+} BandJob;
+
+typedef struct {
+    const uint16_t* const* planes;
+    const char* const* filenames;
+    size_t width;
+    size_t height;
+    const ImsaveOptions* opts;
+    int failed;
+} PlanesJob;
+
+static int imsave(const void* buf, const size_t width, const size_t height,
+                  const size_t n_channels, const int bit_depth,
+                  const char* filename, const ImsaveOptions* opts);
+static int imsave_parallel(const void* buf, const size_t width,
+                           const size_t height, const size_t n_channels,
+                           const int bit_depth, const char* filename,
+                           const ImsaveOptions* opts);
+static void load_row(const BandJob* job, size_t y, uint8_t* dst);
+static const uint8_t* filter_row(const BandJob* job, const uint8_t* cur,
+                                 const uint8_t* prev, uint8_t* scratch);
+static void encode_band(void* arg, size_t band);
+static void encode_plane(void* arg, size_t index);
+
+ImsaveOptions
+imsave_preset(ImsavePreset preset)
+{
+    ImsaveOptions opts = {-1, -1, -1, -1};
+
+    switch (preset) {
+        case IMSAVE_PRESET_FAST:
+            opts.compression_level = 1;
+            opts.compression_strategy = Z_RLE;
+            opts.filters = PNG_FILTER_UP;
+            break;
+        case IMSAVE_PRESET_NONE:
+            opts.compression_level = 0;
+            opts.filters = PNG_FILTER_NONE;
+            break;
+        case IMSAVE_PRESET_SMALL:
+            opts.compression_level = 9;
+            opts.filters = PNG_ALL_FILTERS;
+            break;
+        case IMSAVE_PRESET_DEFAULT:
+        default:
+            break;
+    }
+
+    return opts;
+}
+
+// Rows are handed to libpng straight from the caller's buffer, one at a time;
+// libpng copies each into its own row buffer before filtering, so nothing is
+// allocated per row. 16-bit samples are byte-swapped by libpng itself.
+static int
+imsave(const void* buf,
+       const size_t width,
+       const size_t height,
+       const size_t n_channels,
+       const int bit_depth,
+       const char* filename,
+       const ImsaveOptions* opts)
 {
-    size_t bit_depth = 16;
     FILE * fp;
     png_structp png_ptr = NULL;
     png_infop info_ptr = NULL;
-    png_byte** row_pointers = NULL;
-    size_t x, y;
+    size_t row_bytes = width * n_channels * (bit_depth / 8);
+    size_t y;
 
-    int status = -1;
+    volatile int status = -1;
+
+    if (n_channels != 1 && n_channels != 3) {
+        goto fopen_failed;
+    }
+    if (opts && opts->n_threads > 0) {
+        return imsave_parallel(buf, width, height, n_channels, bit_depth,
+                               filename, opts);
+    }
+    const int color_type = n_channels == 1 ? PNG_COLOR_TYPE_GRAY
+                                           : PNG_COLOR_TYPE_RGB;
 
     fp = fopen (filename, "wb");
     if (! fp) {
@@ -42,57 +154,43 @@ imsave16(uint16_t* buf,
         goto png_failure;
     }
 
-    switch (n_channels) {
-        case 1:
-            png_set_IHDR (png_ptr,
-                          info_ptr,
-                          width,
-                          height,
-                          bit_depth,
-                          PNG_COLOR_TYPE_GRAY,
-                          PNG_INTERLACE_NONE,
-                          PNG_COMPRESSION_TYPE_DEFAULT,
-                          PNG_FILTER_TYPE_DEFAULT);
-            break;
-        case 3:
-            png_set_IHDR (png_ptr,
-                          info_ptr,
-                          width,
-                          height,
-                          bit_depth,
-                          PNG_COLOR_TYPE_RGB,
-                          PNG_INTERLACE_NONE,
-                          PNG_COMPRESSION_TYPE_DEFAULT,
-                          PNG_FILTER_TYPE_DEFAULT);
-            break;
-        default:
-            goto png_failure;
-    }
+    png_init_io (png_ptr, fp);
+    png_set_IHDR (png_ptr,
+                  info_ptr,
+                  width,
+                  height,
+                  bit_depth,
+                  color_type,
+                  PNG_INTERLACE_NONE,
+                  PNG_COMPRESSION_TYPE_DEFAULT,
+                  PNG_FILTER_TYPE_DEFAULT);
 
-    row_pointers = (png_byte**) png_malloc(png_ptr, height * sizeof (png_byte *));
-    for (y = 0; y < height; y++) {
-        png_byte *row = (png_byte*) png_malloc(png_ptr,
-                                            sizeof (int) * width * n_channels);
-        row_pointers[y] = row;
-        for (x = 0; x < width; x++) {
-            for (size_t c = 0; c < n_channels; ++c) {
-                uint16_t color = buf[c + n_channels * (x + width * y)];
-                *row++ = (png_byte)(color >> 8);
-                *row++ = (png_byte)(color & 0xFF);
-            }
-        }
+    png_set_compression_buffer_size (png_ptr, IDAT_BUFFER_SIZE);
+    if (opts && opts->compression_level >= 0) {
+        png_set_compression_level (png_ptr, opts->compression_level);
+    }
+    if (opts && opts->compression_strategy >= 0) {
+        png_set_compression_strategy (png_ptr, opts->compression_strategy);
+    }
+    if (opts && opts->filters >= 0) {
+        png_set_filter (png_ptr, PNG_FILTER_TYPE_BASE, opts->filters);
     }
 
-    png_init_io (png_ptr, fp);
-    png_set_rows (png_ptr, info_ptr, row_pointers);
-    png_write_png (png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+    png_write_info (png_ptr, info_ptr);
 
-    status = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (bit_depth == 16) {
+        png_set_swap (png_ptr);
+    }
+#endif
 
     for (y = 0; y < height; y++) {
-        png_free (png_ptr, row_pointers[y]);
+        png_write_row (png_ptr, (png_const_bytep) buf + y * row_bytes);
     }
-    png_free (png_ptr, row_pointers);
+
+    png_write_end (png_ptr, NULL);
+
+    status = 0;
 
  png_failure:
  png_create_info_struct_failed:
@@ -101,28 +199,88 @@ imsave16(uint16_t* buf,
     fclose (fp);
  fopen_failed:
     return status;
-
 }
 
-int
-imsave8(uint8_t* buf,
-        const size_t width,
-        const size_t height,
-        const size_t n_channels,
-        const char* filename)
+// pigz-style writer: the image is cut into bands of whole rows, and each band
+// is filtered and raw-deflated independently on the thread pool. Every band
+// but the last ends on a sync flush, so the pieces concatenate into a single
+// deflate stream; the zlib header and the Adler-32 (combined from the
+// per-band sums) are added around them here. Each band's window is primed
+// with the filtered tail of the band before it, so output is the same for
+// any thread count and barely larger than a serial encode.
+static int
+imsave_parallel(const void* buf,
+                const size_t width,
+                const size_t height,
+                const size_t n_channels,
+                const int bit_depth,
+                const char* filename,
+                const ImsaveOptions* opts)
 {
-    size_t bit_depth = 8;
     FILE * fp;
     png_structp png_ptr = NULL;
     png_infop info_ptr = NULL;
-    png_byte** row_pointers = NULL;
-    size_t x, y;
+    BandJob job;
+    size_t b;
+
+    volatile int status = -1;
+
+    if (width == 0 || height == 0) {
+        return -1;
+    }
+    const int color_type = n_channels == 1 ? PNG_COLOR_TYPE_GRAY
+                                           : PNG_COLOR_TYPE_RGB;
+
+    job.buf = (const uint8_t*) buf;
+    job.width = width;
+    job.height = height;
+    job.bpp = n_channels * (bit_depth / 8);
+    job.row_bytes = width * job.bpp;
+    job.bit_depth = bit_depth;
+    job.level = opts->compression_level >= 0 ? opts->compression_level
+                                             : Z_DEFAULT_COMPRESSION;
+    job.strategy = opts->compression_strategy >= 0
+                 ? opts->compression_strategy : Z_DEFAULT_STRATEGY;
+    // libpng's own default for 8- and 16-bit non-palette images
+    job.filters = opts->filters > 0 ? opts->filters : PNG_ALL_FILTERS;
+    job.rows_per_band = BAND_BYTES / (job.row_bytes + 1);
+    if (job.rows_per_band == 0) job.rows_per_band = 1;
+    job.n_bands = (height + job.rows_per_band - 1) / job.rows_per_band;
+    job.out = (unsigned char**) calloc(job.n_bands, sizeof(unsigned char*));
+    job.out_size = (size_t*) calloc(job.n_bands, sizeof(size_t));
+    job.adler = (uLong*) calloc(job.n_bands, sizeof(uLong));
+    job.failed = !job.out || !job.out_size || !job.adler;
+
+    if (!job.failed) {
+        parallel_for_n(job.n_bands, (size_t) opts->n_threads, encode_band,
+                       &job);
+    }
+    if (job.failed) {
+        goto encode_failed;
+    }
 
-    int status = -1;
+    // zlib stream header and trailer around the concatenated bands
+    const int level = job.level == Z_DEFAULT_COMPRESSION ? 6 : job.level;
+    const int flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    unsigned char header[2] = {0x78, (unsigned char) (flevel << 6)};
+    header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (b = 0; b < job.n_bands; ++b) {
+        size_t rows = b + 1 < job.n_bands
+                    ? job.rows_per_band
+                    : height - b * job.rows_per_band;
+        adler = adler32_combine(adler, job.adler[b],
+                                (z_off_t) (rows * (job.row_bytes + 1)));
+    }
+    unsigned char trailer[4] = {(unsigned char) (adler >> 24),
+                                (unsigned char) (adler >> 16),
+                                (unsigned char) (adler >> 8),
+                                (unsigned char) adler};
 
     fp = fopen (filename, "wb");
     if (! fp) {
-        goto fopen_failed;
+        goto encode_failed;
     }
 
     png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
@@ -139,62 +297,318 @@ imsave8(uint8_t* buf,
         goto png_failure;
     }
 
-    switch (n_channels) {
-        case 1:
-            png_set_IHDR (png_ptr,
-                          info_ptr,
-                          width,
-                          height,
-                          bit_depth,
-                          PNG_COLOR_TYPE_GRAY,
-                          PNG_INTERLACE_NONE,
-                          PNG_COMPRESSION_TYPE_DEFAULT,
-                          PNG_FILTER_TYPE_DEFAULT);
-            break;
-        case 3:
-            png_set_IHDR (png_ptr,
-                          info_ptr,
-                          width,
-                          height,
-                          bit_depth,
-                          PNG_COLOR_TYPE_RGB,
-                          PNG_INTERLACE_NONE,
-                          PNG_COMPRESSION_TYPE_DEFAULT,
-                          PNG_FILTER_TYPE_DEFAULT);
-            break;
-        default:
-            goto png_failure;
-    }
+    png_init_io (png_ptr, fp);
+    png_set_IHDR (png_ptr,
+                  info_ptr,
+                  width,
+                  height,
+                  bit_depth,
+                  color_type,
+                  PNG_INTERLACE_NONE,
+                  PNG_COMPRESSION_TYPE_DEFAULT,
+                  PNG_FILTER_TYPE_DEFAULT);
+    png_write_info (png_ptr, info_ptr);
 
-    row_pointers = (png_byte**) png_malloc(png_ptr, height * sizeof (png_byte *));
-    for (y = 0; y < height; y++) {
-        png_byte *row = (png_byte*) png_malloc(png_ptr,
-                                            sizeof (int) * width * n_channels);
-        row_pointers[y] = row;
-        for (x = 0; x < width; x++) {
-            for (size_t c = 0; c < n_channels; ++c) {
-                *row++ = buf[c + n_channels * (x + width * y)];
-            }
+    // One IDAT per band, written straight from the band buffers.
+    for (b = 0; b < job.n_bands; ++b) {
+        const int first = b == 0;
+        const int last = b + 1 == job.n_bands;
+        png_write_chunk_start (png_ptr, (png_const_bytep) "IDAT",
+                               job.out_size[b] + (first ? 2 : 0)
+                                               + (last ? 4 : 0));
+        if (first) {
+            png_write_chunk_data (png_ptr, header, sizeof(header));
         }
+        png_write_chunk_data (png_ptr, job.out[b], job.out_size[b]);
+        if (last) {
+            png_write_chunk_data (png_ptr, trailer, sizeof(trailer));
+        }
+        png_write_chunk_end (png_ptr);
     }
 
-    png_init_io (png_ptr, fp);
-    png_set_rows (png_ptr, info_ptr, row_pointers);
-    png_write_png (png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+    png_write_chunk (png_ptr, (png_const_bytep) "IEND", NULL, 0);
 
     status = 0;
 
-    for (y = 0; y < height; y++) {
-        png_free (png_ptr, row_pointers[y]);
-    }
-    png_free (png_ptr, row_pointers);
-
  png_failure:
  png_create_info_struct_failed:
     png_destroy_write_struct (&png_ptr, &info_ptr);
  png_create_write_struct_failed:
     fclose (fp);
- fopen_failed:
+ encode_failed:
+    for (b = 0; job.out && b < job.n_bands; ++b) {
+        free(job.out[b]);
+    }
+    free(job.out);
+    free(job.out_size);
+    free(job.adler);
     return status;
 }
 
+// Row y of the image in PNG byte order.
+ROW_KERNEL static void
+load_row(const BandJob* job, size_t y, uint8_t* dst)
+{
+    const uint8_t* src = job->buf + y * job->row_bytes;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (job->bit_depth == 16) {
+        for (size_t k = 0; k < job->row_bytes; k += 2) {
+            dst[k] = src[k + 1];
+            dst[k + 1] = src[k];
+        }
+        return;
+    }
+#endif
+    memcpy(dst, src, job->row_bytes);
+}
+
+static inline uint8_t
+paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+// Filters cur against prev with every filter in job->filters into scratch
+// (five lines of row_bytes + 1) and returns the line to emit, type byte
+// first. With several filters allowed the pick is libpng's heuristic: the
+// smallest sum of absolute values of the filtered bytes taken as signed.
+ROW_KERNEL static const uint8_t*
+filter_row(const BandJob* job, const uint8_t* cur, const uint8_t* prev,
+           uint8_t* scratch)
+{
+    static const int masks[5] = {PNG_FILTER_NONE, PNG_FILTER_SUB,
+                                 PNG_FILTER_UP, PNG_FILTER_AVG,
+                                 PNG_FILTER_PAETH};
+    const size_t n = job->row_bytes;
+    const size_t bpp = job->bpp;
+    const uint8_t* best = NULL;
+    unsigned long best_sum = 0;
+
+    for (int f = 0; f < 5; ++f) {
+        if (!(job->filters & masks[f])) continue;
+
+        uint8_t* line = scratch + f * (n + 1);
+        uint8_t* out = line + 1;
+        size_t k;
+        line[0] = (uint8_t) f;
+
+        switch (f) {
+            case PNG_FILTER_VALUE_NONE:
+                memcpy(out, cur, n);
+                break;
+            case PNG_FILTER_VALUE_SUB:
+                for (k = 0; k < bpp; ++k) out[k] = cur[k];
+                for (; k < n; ++k) out[k] = cur[k] - cur[k - bpp];
+                break;
+            case PNG_FILTER_VALUE_UP:
+                for (k = 0; k < n; ++k) out[k] = cur[k] - prev[k];
+                break;
+            case PNG_FILTER_VALUE_AVG:
+                for (k = 0; k < bpp; ++k) out[k] = cur[k] - (prev[k] >> 1);
+                for (; k < n; ++k) {
+                    out[k] = cur[k] - ((cur[k - bpp] + prev[k]) >> 1);
+                }
+                break;
+            case PNG_FILTER_VALUE_PAETH:
+                for (k = 0; k < bpp; ++k) out[k] = cur[k] - prev[k];
+                for (; k < n; ++k) {
+                    out[k] = cur[k] - paeth(cur[k - bpp], prev[k],
+                                            prev[k - bpp]);
+                }
+                break;
+        }
+
+        if (job->filters == masks[f]) {
+            return line;
+        }
+
+        unsigned long sum = 0;
+        for (k = 0; k < n; ++k) {
+            sum += out[k] < 128 ? out[k] : 256 - out[k];
+        }
+        if (!best || sum < best_sum) {
+            best = line;
+            best_sum = sum;
+        }
+    }
+
+    return best;
+}
+
+static void
+encode_band(void* arg, size_t band)
+{
+    BandJob* job = (BandJob*) arg;
+    const size_t line_bytes = job->row_bytes + 1;
+    const size_t y0 = band * job->rows_per_band;
+    const size_t y1 = y0 + job->rows_per_band < job->height
+                    ? y0 + job->rows_per_band : job->height;
+    const int last = band + 1 == job->n_bands;
+
+    uint8_t* cur = (uint8_t*) malloc(job->row_bytes);
+    uint8_t* prev = (uint8_t*) calloc(job->row_bytes, 1);
+    uint8_t* scratch = (uint8_t*) malloc(5 * line_bytes);
+    uint8_t* dict = NULL;
+    unsigned char* out = NULL;
+    z_stream strm;
+    size_t capacity = 0;
+    int ret = Z_OK;
+    size_t y;
+
+    memset(&strm, 0, sizeof(strm));
+    if (!cur || !prev || !scratch ||
+        deflateInit2(&strm, job->level, Z_DEFLATED, -15, 8,
+                     job->strategy) != Z_OK) {
+        goto failed;
+    }
+
+    // The rows whose filtered bytes fill the window at the start of this
+    // band, filtered exactly as the previous band filters them.
+    size_t n_dict = (DICT_BYTES + line_bytes - 1) / line_bytes;
+    if (n_dict > y0) n_dict = y0;
+    if (y0 - n_dict > 0) {
+        load_row(job, y0 - n_dict - 1, prev);
+    }
+    if (n_dict > 0) {
+        dict = (uint8_t*) malloc(n_dict * line_bytes);
+        if (!dict) goto failed;
+        for (y = y0 - n_dict; y < y0; ++y) {
+            load_row(job, y, cur);
+            memcpy(dict + (y - (y0 - n_dict)) * line_bytes,
+                   filter_row(job, cur, prev, scratch), line_bytes);
+            uint8_t* tmp = prev; prev = cur; cur = tmp;
+        }
+        size_t dict_size = n_dict * line_bytes;
+        size_t skip = dict_size > DICT_BYTES ? dict_size - DICT_BYTES : 0;
+        if (deflateSetDictionary(&strm, dict + skip,
+                                 (uInt) (dict_size - skip)) != Z_OK) {
+            goto failed;
+        }
+    }
+
+    capacity = deflateBound(&strm, (y1 - y0) * line_bytes) + 64;
+    out = (unsigned char*) malloc(capacity);
+    if (!out) goto failed;
+    strm.next_out = out;
+    strm.avail_out = (uInt) capacity;
+
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (y = y0; y < y1; ++y) {
+        load_row(job, y, cur);
+        const uint8_t* filtered = filter_row(job, cur, prev, scratch);
+        adler = adler32(adler, filtered, (uInt) line_bytes);
+
+        const int flush = y + 1 < y1 ? Z_NO_FLUSH
+                        : last ? Z_FINISH : Z_SYNC_FLUSH;
+        strm.next_in = (Bytef*) filtered;
+        strm.avail_in = (uInt) line_bytes;
+        do {
+            if (strm.avail_out == 0) {
+                size_t used = capacity;
+                capacity *= 2;
+                unsigned char* grown = (unsigned char*) realloc(out, capacity);
+                if (!grown) goto failed;
+                out = grown;
+                strm.next_out = out + used;
+                strm.avail_out = (uInt) (capacity - used);
+            }
+            ret = deflate(&strm, flush);
+        } while (ret == Z_OK && (strm.avail_in > 0 || strm.avail_out == 0));
+        if (ret == Z_STREAM_ERROR || (flush == Z_FINISH && ret != Z_STREAM_END)) {
+            goto failed;
+        }
+
+        uint8_t* tmp = prev; prev = cur; cur = tmp;
+    }
+
+    job->out[band] = out;
+    job->out_size[band] = capacity - strm.avail_out;
+    job->adler[band] = adler;
+    out = NULL;
+    goto cleanup;
+
+ failed:
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+ cleanup:
+    deflateEnd(&strm);
+    free(out);
+    free(dict);
+    free(scratch);
+    free(prev);
+    free(cur);
+}
+
+int
+imsave16_opts(const uint16_t* buf,
+              const size_t width,
+              const size_t height,
+              const size_t n_channels,
+              const char* filename,
+              const ImsaveOptions* opts)
+{
+    return imsave(buf, width, height, n_channels, 16, filename, opts);
+}
+
+int
+imsave8_opts(const uint8_t* buf,
+             const size_t width,
+             const size_t height,
+             const size_t n_channels,
+             const char* filename,
+             const ImsaveOptions* opts)
+{
+    return imsave(buf, width, height, n_channels, 8, filename, opts);
+}
+
+int
+imsave16(uint16_t* buf,
+         const size_t width,
+         const size_t height,
+         const size_t n_channels,
+         const char* filename)
+{
+    return imsave16_opts(buf, width, height, n_channels, filename, NULL);
+}
+
+int
+imsave8(uint8_t* buf,
+        const size_t width,
+        const size_t height,
+        const size_t n_channels,
+        const char* filename)
+{
+    return imsave8_opts(buf, width, height, n_channels, filename, NULL);
+}
+
+static void
+encode_plane(void* arg, size_t index)
+{
+    PlanesJob* job = (PlanesJob*) arg;
+
+    if (imsave16_opts(job->planes[index], job->width, job->height, 1,
+                      job->filenames[index], job->opts) != 0) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+int
+imsave16_planes(const uint16_t* const* planes,
+                const char* const* filenames,
+                const size_t n_planes,
+                const size_t width,
+                const size_t height,
+                const ImsaveOptions* opts)
+{
+    PlanesJob job = {planes, filenames, width, height, opts, 0};
+
+    parallel_for(n_planes, encode_plane, &job);
+    return job.failed ? -1 : 0;
+}
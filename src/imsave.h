@@ -1,15 +1,51 @@
 #ifndef IMSAVE_H
 #define IMSAVE_H
 
+#include <stddef.h>
 #include <inttypes.h>
 
 
 
+typedef enum {
+    IMSAVE_PRESET_DEFAULT = 0,  // libpng defaults
+    IMSAVE_PRESET_FAST,         // Level 1, Up filter, RLE: previews
+    IMSAVE_PRESET_NONE,         // Stored, unfiltered: scratch output
+    IMSAVE_PRESET_SMALL,        // Level 9, adaptive filters: archival
+} ImsavePreset;
+
+// Any field set to -1 keeps libpng's default.
+typedef struct {
+    int compression_level;     // zlib level 0-9
+    int compression_strategy;  // Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE, ...
+    int filters;               // Bitmask of PNG_FILTER_* from png.h
+    int n_threads;             // Above 0: threads deflating row bands
+} ImsaveOptions;
+
+
+
+ImsaveOptions imsave_preset(ImsavePreset preset);
+
 int imsave8(uint8_t* buf, const size_t width, const size_t height,
             const size_t n_channels, const char* fname);
 int imsave16(uint16_t* buf, const size_t width, const size_t height,
              const size_t n_channels, const char* fname);
 
+// As above with explicit compression settings; opts may be NULL.
+int imsave8_opts(const uint8_t* buf, const size_t width, const size_t height,
+                 const size_t n_channels, const char* fname,
+                 const ImsaveOptions* opts);
+int imsave16_opts(const uint16_t* buf, const size_t width, const size_t height,
+                  const size_t n_channels, const char* fname,
+                  const ImsaveOptions* opts);
+
+// Writes n_planes single-channel 16-bit planes to their own files
+// concurrently, up to get_n_threads() at a time. Returns 0 only if every
+// file was written.
+int imsave16_planes(const uint16_t* const* planes,
+                    const char* const* filenames, const size_t n_planes,
+                    const size_t width, const size_t height,
+                    const ImsaveOptions* opts);
+
 
 
 #endif  // IMSAVE_H
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+#define LINE_SIZE 128
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+struct SweepJournal {
+    int fd;
+    bool* done;       // n_points
+    bool* merged;     // n_groups
+    size_t n_points;
+    size_t n_groups;
+    size_t n_done;
+
+    pthread_mutex_t lock;
+};
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+static uint64_t hash_value(uint64_t hash, double value);
+static uint64_t fingerprint(const SweepPlan* plan);
+static int read_journal(SweepJournal* journal, FILE* file,
+                        const char* filename, uint64_t expected, off_t* end);
+static void append(SweepJournal* journal, const char* record, size_t value);
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+uint64_t
+hash_value(uint64_t hash, double value)
+{
+    const unsigned char* bytes = (const unsigned char*) &value;
+
+    for (size_t k = 0; k < sizeof(double); ++k) {
+        hash = (hash ^ bytes[k]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// What each point scans, not where it is written, so moving the outputs or
+// changing the runtime model keeps the journal valid.
+uint64_t
+fingerprint(const SweepPlan* plan)
+{
+    uint64_t hash = FNV_OFFSET;
+
+    for (size_t k = 0; k < plan->n_points; ++k) {
+        const SweepPoint* p = &plan->points[k];
+        const ScanSettings* s = &p->settings;
+        const double values[] = {
+            (double) p->group, (double) p->step, s->resolution,
+            s->tl_x, s->tl_y, s->br_x, s->br_y, s->light,
+            s->exposure_r, s->exposure_g, s->exposure_b, s->exposure_i,
+            s->gain_r, s->gain_g, s->gain_b, s->gain_i,
+            s->offset_r, s->offset_g, s->offset_b, s->offset_i,
+        };
+
+        for (size_t v = 0; v < sizeof(values) / sizeof(values[0]); ++v) {
+            hash = hash_value(hash, values[v]);
+        }
+    }
+    return hash;
+}
+
+// Returns 1 if the journal belongs to the plan, 0 if it has no plan record
+// yet, or -1 if it belongs to another one. end is set past the last whole
+// line.
+int
+read_journal(SweepJournal* journal, FILE* file, const char* filename,
+             uint64_t expected, off_t* end)
+{
+    char line[LINE_SIZE];
+    size_t n_points;
+    uint64_t hash;
+
+    if (!fgets(line, sizeof(line), file) ||
+        sscanf(line, "plan %zu %" SCNx64, &n_points, &hash) != 2) {
+        return 0;
+    }
+    if (n_points != journal->n_points || hash != expected) {
+        fprintf(stderr, "Error: %s is the journal of another sweep; remove "
+                "it or set resume = no to start over\n", filename);
+        return -1;
+    }
+    *end = ftello(file);
+
+    while (fgets(line, sizeof(line), file)) {
+        size_t value;
+
+        // A line without its newline was cut short by a crash.
+        if (!strchr(line, '\n')) break;
+        *end = ftello(file);
+
+        if (sscanf(line, "done %zu", &value) == 1 &&
+            value < journal->n_points) {
+            journal->n_done += !journal->done[value];
+            journal->done[value] = true;
+        } else if (sscanf(line, "merged %zu", &value) == 1 &&
+                   value < journal->n_groups) {
+            journal->merged[value] = true;
+        }
+    }
+    return 1;
+}
+
+SweepJournal*
+open_sweep_journal(const char* filename, const SweepPlan* plan, bool resume)
+{
+    SweepJournal* journal = (SweepJournal*) calloc(1, sizeof(SweepJournal));
+    const uint64_t expected = fingerprint(plan);
+    off_t end = 0;
+    int status = 0;
+
+    journal->fd = -1;
+    journal->n_points = plan->n_points;
+    journal->n_groups = plan->n_groups;
+    journal->done = (bool*) calloc(plan->n_points + 1, sizeof(bool));
+    journal->merged = (bool*) calloc(plan->n_groups + 1, sizeof(bool));
+    pthread_mutex_init(&journal->lock, NULL);
+
+    FILE* file = resume ? fopen(filename, "r") : NULL;
+    if (file) {
+        status = read_journal(journal, file, filename, expected, &end);
+        fclose(file);
+    }
+    if (status < 0) {
+        close_sweep_journal(journal);
+        return NULL;
+    }
+
+    // Unless there is a valid journal to add to, start a new one.
+    int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+    journal->fd = open(filename, status ? flags : flags | O_TRUNC, 0644);
+    if (journal->fd < 0) {
+        fprintf(stderr, "Error: unable to open %s: %s\n", filename,
+                strerror(errno));
+        close_sweep_journal(journal);
+        return NULL;
+    }
+
+    // Drop a torn last line, or the next record would be appended to it.
+    if (status && ftruncate(journal->fd, end) != 0) {
+        fprintf(stderr, "Error: unable to truncate %s: %s\n", filename,
+                strerror(errno));
+        close_sweep_journal(journal);
+        return NULL;
+    }
+
+    if (!status) {
+        char record[LINE_SIZE];
+        int n = snprintf(record, sizeof(record), "plan %zu %016" PRIx64 "\n",
+                         plan->n_points, expected);
+        if (write(journal->fd, record, (size_t) n) != n) {
+            fprintf(stderr, "Error: unable to write %s\n", filename);
+        }
+    }
+
+    return journal;
+}
+
+void
+close_sweep_journal(SweepJournal* journal)
+{
+    if (!journal) return;
+
+    if (journal->fd >= 0) close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal->done);
+    free(journal->merged);
+    free(journal);
+}
+
+bool
+sweep_journal_done(const SweepJournal* journal, size_t index)
+{
+    return index < journal->n_points && journal->done[index];
+}
+
+bool
+sweep_journal_merged(const SweepJournal* journal, size_t group)
+{
+    return group < journal->n_groups && journal->merged[group];
+}
+
+size_t
+sweep_journal_count_done(const SweepJournal* journal)
+{
+    return journal->n_done;
+}
+
+void
+append(SweepJournal* journal, const char* record, size_t value)
+{
+    char line[LINE_SIZE];
+    int n = snprintf(line, sizeof(line), "%s %zu\n", record, value);
+
+    // One write per record, so concurrent appends can't interleave.
+    if (write(journal->fd, line, (size_t) n) != n) {
+        fprintf(stderr, "Error: unable to journal %s %zu\n", record, value);
+    }
+}
+
+void
+sweep_journal_mark_done(SweepJournal* journal, size_t index)
+{
+    if (index >= journal->n_points) return;
+
+    pthread_mutex_lock(&journal->lock);
+    journal->n_done += !journal->done[index];
+    journal->done[index] = true;
+    pthread_mutex_unlock(&journal->lock);
+
+    append(journal, "done", index);
+}
+
+void
+sweep_journal_mark_merged(SweepJournal* journal, size_t group)
+{
+    if (group >= journal->n_groups) return;
+
+    pthread_mutex_lock(&journal->lock);
+    journal->merged[group] = true;
+    pthread_mutex_unlock(&journal->lock);
+
+    append(journal, "merged", group);
+}
@@ -0,0 +1,68 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "sweep.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// A sweep journal is a text file of one record per line:
+//
+//     plan <n_points> <fingerprint>   first line, identifies the sweep
+//     done <index>                    point index's outputs are complete
+//     merged <group>                  group's HDR merge is complete
+//
+// Records are appended with a single write(), so they survive the process
+// being killed or exiting at any point; a torn last line is ignored, and cut
+// off when the journal is resumed. They are not fsync()ed, and neither are
+// the outputs they vouch for, so a power cut can still lose recent frames.
+#define JOURNAL_SUFFIX ".journal"
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef struct SweepJournal SweepJournal;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+// Opens the journal of plan at filename. With resume, the records of an
+// existing journal are read back; one written for a different plan is an
+// error, so changing the sweep can't silently skip points. Without resume,
+// or if there is no journal yet, it starts empty. Returns NULL after
+// printing what went wrong.
+SweepJournal* open_sweep_journal(const char* filename, const SweepPlan* plan,
+                                 bool resume);
+void close_sweep_journal(SweepJournal* journal);
+
+bool sweep_journal_done(const SweepJournal* journal, size_t index);
+bool sweep_journal_merged(const SweepJournal* journal, size_t group);
+size_t sweep_journal_count_done(const SweepJournal* journal);
+
+// Append a record. Safe to call from several threads at once.
+void sweep_journal_mark_done(SweepJournal* journal, size_t index);
+void sweep_journal_mark_merged(SweepJournal* journal, size_t group);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // JOURNAL_H
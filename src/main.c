@@ -1,15 +1,35 @@
+#include <ctype.h>
+#include <errno.h>
 #include <stddef.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 
+#include <sys/stat.h>
 #include <sys/time.h>
 
+#include <sane/sane.h>
+
 #include "piescan.h"
+#include "calibration.h"
+#include "response.h"
+#include "autoexposure.h"
+#include "dust.h"
 #include "imsave.h"
+#include "tiledtiff.h"
 #include "mmaparray.h"
+#include "framequeue.h"
+#include "normalize.h"
+#include "hdrmerge.h"
+#include "journal.h"
+#include "rawframe.h"
+#include "sweep.h"
 
 
 
@@ -17,19 +37,126 @@
 | Macros                                                                      |
 \*****************************************************************************/
 
+// Number of frame buffers in flight per scanner. One is being acquired while
+// the others are being written back and encoded; this caps the pipeline's
+// memory use.
+#define N_FRAMES 3
+
+// Number of output threads per scanner running sync/merge/normalize/encode.
+// Their heavy lifting goes to the shared thread pool, so these only bound
+// how many frames are processed at once.
+#define N_WORKERS 2
+
+#define MAX_SCANNERS 16
+
+#define PATH_SIZE (2 * SWEEP_PATH_SIZE + 64)
+
+// Outputs are written under this suffix and renamed into place once
+// complete, so a file with its final name is never a partial one.
+#define PART_SUFFIX ".part"
+
+// What auto exposure picked, as a sweep config.
+#define AUTO_SUFFIX ".auto"
+
 
 
 /*****************************************************************************\
 | Type definitions                                                            |
 \*****************************************************************************/
 
+typedef struct {
+    double scan;
+    double sync;
+    double merge;
+    double normalize;
+    double encode;
+    size_t frames;
+    size_t bytes;  // Raw RGBI samples scanned
+    double t_end;  // When the last frame was done with
+
+    pthread_mutex_t lock;  // Also guards Scanner.remaining
+} StageTimes;
+
+// A device and the sweep it runs, with frames, journal and merges of its
+// own. Each scanner is driven by a thread of its own, and the output
+// workers serve all of them from one ready queue.
+typedef struct {
+    PiescanDevice* device;
+    char tag[SWEEP_PATH_SIZE + 2];  // "name: " before messages, if several
+    SweepConfig config;
+    SweepPlan plan;
+    SweepJournal* journal;
+    bool* skip;         // Points not to scan
+    size_t n_scans;
+    HdrMerge** merges;  // Indexed by Frame.group, NULL without hdr
+    size_t* remaining;  // Frames left to scan per group
+    bool* incomplete;   // Groups missing a frame, so not worth merging
+    Calibration* calibration;       // Applied to every scan, if any
+    CalibrationBuilder* calibrate;  // Built from every frame, if any
+    ResponseBuilder* response;      // Fitted to every frame, if any
+
+    Frame frames[N_FRAMES];
+    FrameQueue* free;
+    FrameQueue* ready;  // Shared by every scanner
+
+    StageTimes times;
+    double t_start;
+    int status;
+    pthread_t thread;
+} Scanner;
+
 
 
 /*****************************************************************************\
 | Function declarations                                                       |
 \*****************************************************************************/
 
-// static int uniform_int(int min, int max);
+static void sighandler(int signum);
+static void usage(const char* name);
+static int parse_arguments(SweepConfig* config, int argc, char** argv);
+static int select_devices(const SweepConfig* config, char** names,
+                          size_t* n_names);
+static int make_directory(const char* path);
+static int make_directories(const SweepConfig* config);
+static double now(void);
+static void raw_path(char* path, const SweepConfig* config, size_t group,
+                     size_t step);
+static void png_path(char* path, const SweepConfig* config, char channel,
+                     size_t group, size_t step);
+static void tiff_path(char* path, const SweepConfig* config, size_t group,
+                      size_t step);
+static void hdr_path(char* path, const SweepConfig* config, size_t group);
+static void input_path(char* path, const SweepConfig* config,
+                       const char* name);
+static int commit_file(const char* path);
+static int map_frame(const SweepConfig* config, Frame* frame);
+static int encode_frame(const SweepConfig* config, const Frame* frame);
+static int readd_frame(Scanner* sc, const SweepPoint* point);
+static int write_auto_exposure(const char* filename, const AutoExposure* ae);
+static int set_auto_exposure(Scanner* sc, const ScanSettings* base);
+static int open_scanner(Scanner* sc, const SweepConfig* config,
+                        const char* name, bool own_directory,
+                        FrameQueue* ready);
+static void close_scanner(Scanner* sc);
+static void finish_merge(Scanner* sc, size_t group);
+static void write_calibration(Scanner* sc);
+static void write_response(Scanner* sc);
+static void* scan_points(void* arg);
+static void* output_worker(void* arg);
+static double rate(size_t bytes, double seconds);
+static void print_stage_times(const char* title, const StageTimes* times,
+                              double wall);
+
+
+
+/*****************************************************************************\
+| Global variables                                                            |
+\*****************************************************************************/
+
+// For sighandler() to cancel the scans in progress.
+static Scanner* scanners;
+static size_t n_scanners;
+static volatile sig_atomic_t cancelled;
 
 
 
@@ -37,185 +164,954 @@
 | Function implementations                                                    |
 \*****************************************************************************/
 
-/*
-// Taken from https://stackoverflow.com/questions/11641629/generating-a-uniform-distribution-of-integers-in-c
+// The first signal cancels the scans, which ends the sweep after the frames
+// already scanned are written; the second one doesn't wait for that.
+void
+sighandler(int signum)
+{
+    if (!cancelled) {
+        cancelled = 1;
+        for (size_t k = 0; k < n_scanners; ++k) {
+            piescan_cancel(scanners[k].device);
+        }
+    } else {
+        _exit(128 + signum);
+    }
+}
+
+void
+usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [sweep file | key=value]...\n"
+            "See sweep.h for the keys; without any, the default sweep is "
+            "scanned.\n", name);
+}
+
+// Files and key=value overrides are applied in order, so later ones win.
 int
-uniform_int(int min, int max)
+parse_arguments(SweepConfig* config, int argc, char** argv)
 {
-    int range = max - min + 1;
-    int range_max = RAND_MAX - RAND_MAX % range;
-    int x;
-    do x = rand(); while (x >= range_max);
-    return min + x % range;
+    sweep_config_default(config);
+
+    for (int a = 1; a < argc; ++a) {
+        char* eq = strchr(argv[a], '=');
+        int status;
+
+        if (strcmp(argv[a], "-h") == 0 || strcmp(argv[a], "--help") == 0) {
+            usage(argv[0]);
+            return -1;
+        }
+
+        if (eq) {
+            *eq = '\0';
+            status = sweep_config_set(config, argv[a], eq + 1);
+            *eq = '=';
+        } else {
+            status = sweep_config_load(config, argv[a]);
+        }
+        if (status != 0) return -1;
+    }
+
+    return 0;
+}
+
+// Turns config->devices into names for piescan_open(), a single NULL for the
+// first device found. The names are to be freed.
+int
+select_devices(const SweepConfig* config, char** names, size_t* n_names)
+{
+    char list[SWEEP_PATH_SIZE];
+    char* save;
+
+    *n_names = 0;
+
+    if (strcmp(config->devices, "all") == 0) {
+        PiescanDeviceInfo* devices;
+        size_t n_devices;
+
+        if (piescan_list_devices(&devices, &n_devices) != 0) return -1;
+        if (n_devices == 0) fprintf(stderr, "Error: no SANE devices found\n");
+        for (size_t k = 0; k < n_devices && *n_names < MAX_SCANNERS; ++k) {
+            names[(*n_names)++] = strdup(devices[k].name);
+        }
+        piescan_free_device_list(devices, n_devices);
+        return *n_names ? 0 : -1;
+    }
+
+    strcpy(list, config->devices);
+    for (char* name = strtok_r(list, ", \t", &save); name;
+         name = strtok_r(NULL, ", \t", &save)) {
+        if (*n_names == MAX_SCANNERS) {
+            fprintf(stderr, "Error: devices: more than %d\n", MAX_SCANNERS);
+            while (*n_names) free(names[--*n_names]);
+            return -1;
+        }
+        names[(*n_names)++] = strdup(name);
+    }
+    if (*n_names == 0) names[(*n_names)++] = NULL;
+
+    return 0;
+}
+
+int
+make_directory(const char* path)
+{
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        perror(path);
+        return -1;
+    }
+    return 0;
 }
-*/
 
+int
+make_directories(const SweepConfig* config)
+{
+    const char* subdirs[4] = {"raw", "png", "tiff", "hdr"};
+    const bool enabled[4] = {config->raw, config->png, config->tiff,
+                             config->hdr};
+    char path[PATH_SIZE];
+
+    if (make_directory(config->output) != 0) return -1;
+    for (int d = 0; d < 4; ++d) {
+        if (!enabled[d]) continue;
+        snprintf(path, sizeof(path), "%s/%s", config->output, subdirs[d]);
+        if (make_directory(path) != 0) return -1;
+    }
+
+    return 0;
+}
+
+double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+void
+raw_path(char* path, const SweepConfig* config, size_t group, size_t step)
+{
+    snprintf(path, PATH_SIZE, "%s/raw/%s_%02zu_%03zu.praw", config->output,
+             config->prefix, group, step);
+}
+
+void
+png_path(char* path, const SweepConfig* config, char channel, size_t group,
+         size_t step)
+{
+    snprintf(path, PATH_SIZE, "%s/png/%s_%c_%02zu_%03zu.png", config->output,
+             config->prefix, channel, group, step);
+}
+
+void
+tiff_path(char* path, const SweepConfig* config, size_t group, size_t step)
+{
+    snprintf(path, PATH_SIZE, "%s/tiff/%s_%02zu_%03zu.tif", config->output,
+             config->prefix, group, step);
+}
+
+void
+hdr_path(char* path, const SweepConfig* config, size_t group)
+{
+    snprintf(path, PATH_SIZE, "%s/hdr/%s_%02zu.phdr", config->output,
+             config->prefix, group);
+}
+
+// A file the sweep reads, such as the calibration; relative to output.
 void
-normalize_image(Image* im)
+input_path(char* path, const SweepConfig* config, const char* name)
+{
+    if (name[0] == '/') {
+        snprintf(path, PATH_SIZE, "%s", name);
+    } else {
+        snprintf(path, PATH_SIZE, "%s/%s", config->output, name);
+    }
+}
+
+// Renames path's part file to path.
+int
+commit_file(const char* path)
+{
+    char part[PATH_SIZE + sizeof(PART_SUFFIX)];
+
+    if (snprintf(part, sizeof(part), "%s" PART_SUFFIX, path)
+            >= (int) sizeof(part) || rename(part, path) != 0) {
+        fprintf(stderr, "Error: unable to rename %s: %s\n", part,
+                strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Points the frame's planes at its raw frame file, so the scan writes it
+// directly and there is nothing left to dump afterwards.
+// Without raw frames the planes stay on the heap, in a block each frame
+// keeps from scan to scan, which makes huge pages worth asking for.
+int
+map_frame(const SweepConfig* config, Frame* frame)
+{
+    if (!config->raw) {
+        const ImageMapOptions heap = {.mmap = {.hugepages = true}};
+        return map_image(frame->im, NULL, &heap);
+    }
+
+    const ImageMapOptions opts = {
+        .mmap = {.access = MMAP_ACCESS_SEQUENTIAL, .preallocate = true},
+        .sync = IMAGE_SYNC_ASYNC,
+    };
+    char filename[PATH_SIZE + sizeof(PART_SUFFIX)];
+
+    raw_path(filename, config, frame->group, frame->step);
+    strcat(filename, PART_SUFFIX);
+    return map_image(frame->im, filename, &opts);
+}
+
+// Writes the frame's tiled TIFF and PNGs, whichever are enabled.
+int
+encode_frame(const SweepConfig* config, const Frame* frame)
+{
+    const Image* im = frame->im;
+    const uint16_t* planes[4] = {im->r, im->g, im->b, im->i};
+    const char channels[4] = {'r', 'g', 'b', 'i'};
+    const ImsaveOptions opts = imsave_preset(IMSAVE_PRESET_FAST);
+    char filenames[4][PATH_SIZE + sizeof(PART_SUFFIX)];
+    const char* names[4];
+
+    if (config->tiff) {
+        TiledTiffOptions tiff = tiled_tiff_default();
+        tiff.compression_level = config->tiff_compression;
+        tiff_path(filenames[0], config, frame->group, frame->step);
+        strcat(filenames[0], PART_SUFFIX);
+        int err = save_tiled_tiff(im, filenames[0], &tiff);
+        if (err) {
+            fprintf(stderr, "Error: unable to write %s: %s\n", filenames[0],
+                    strerror(err));
+            return -1;
+        }
+        tiff_path(filenames[0], config, frame->group, frame->step);
+        if (commit_file(filenames[0]) != 0) return -1;
+    }
+    if (!config->png) return 0;
+
+    for (int c = 0; c < 4; ++c) {
+        png_path(filenames[c], config, channels[c], frame->group,
+                 frame->step);
+        strcat(filenames[c], PART_SUFFIX);
+        names[c] = filenames[c];
+    }
+
+    if (imsave16_planes(planes, names, 4, im->width, im->height, &opts)) {
+        return -1;
+    }
+    for (int c = 0; c < 4; ++c) {
+        png_path(filenames[c], config, channels[c], frame->group,
+                 frame->step);
+        if (commit_file(filenames[c]) != 0) return -1;
+    }
+    return 0;
+}
+
+// Adds a frame kept by an earlier run to its group's merge and to the
+// calibration and response being built. Returns 0, or -1 if the frame is
+// gone and has to be scanned again. Once the frame is read it counts as
+// done: adding it twice would weigh it twice, so a failure to add it is
+// reported and leaves its group incomplete, as with a scanned frame.
+int
+readd_frame(Scanner* sc, const SweepPoint* point)
+{
+    HdrMerge* merge = sc->merges ? sc->merges[point->group] : NULL;
+    char filename[PATH_SIZE];
+    RawFrame* frame;
+
+    raw_path(filename, &sc->config, point->group, point->step);
+    if (open_raw_frame(&frame, filename) != 0) return -1;
+
+    bool complete = true;
+    if (merge && hdr_merge_add(merge, &frame->im, &frame->settings) != 0) {
+        fprintf(stderr, "Error: %sunable to merge frame %02zu_%03zu\n",
+                sc->tag, point->group, point->step);
+        complete = false;
+    }
+    if (sc->calibrate &&
+        calibration_builder_add(sc->calibrate, &frame->im,
+                                &frame->settings) != 0) {
+        fprintf(stderr, "Error: %sunable to calibrate from frame "
+                "%02zu_%03zu\n", sc->tag, point->group, point->step);
+        complete = false;
+    }
+    if (sc->response &&
+        response_builder_add(sc->response, &frame->im,
+                             &frame->settings) != 0) {
+        fprintf(stderr, "Error: %sunable to fit the response to frame "
+                "%02zu_%03zu\n", sc->tag, point->group, point->step);
+        complete = false;
+    }
+    if (!complete) sc->incomplete[point->group] = true;
+    close_raw_frame(frame);
+    return 0;
+}
+
+// Writes what auto exposure picked to filename as a sweep config.
+int
+write_auto_exposure(const char* filename, const AutoExposure* ae)
+{
+    static const char names[4] = {'r', 'g', 'b', 'i'};
+    FILE* file = fopen(filename, "w");
+
+    if (!file) {
+        fprintf(stderr, "Error: unable to write %s: %s\n", filename,
+                strerror(errno));
+        return -1;
+    }
+
+    fprintf(file, "# Picked by auto exposure from %zu previews\n",
+            ae->n_previews);
+    for (int c = 0; c < 4; ++c) {
+        fprintf(file, "exposure_%c = ", names[c]);
+        for (size_t k = 0; k < ae->n_brackets; ++k) {
+            fprintf(file, "%s%d", k ? ", " : "", ae->exposures[c][k]);
+        }
+        fprintf(file, "\ngain_%c = %d\n", names[c], ae->gains[c]);
+    }
+
+    int err = ferror(file) ? EIO : 0;
+    if (fclose(file) != 0 && !err) err = errno;
+    if (err) {
+        fprintf(stderr, "Error: unable to write %s: %s\n", filename,
+                strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+// Replaces the sweep's exposures and gains with what a preview of its first
+// lit group picks. The preview starts at each channel's shortest exposure
+// and may go up to its longest. What it picks is kept as a sweep config, so
+// a resumed sweep goes on with the exposures it started with rather than
+// those of a new preview.
+int
+set_auto_exposure(Scanner* sc, const ScanSettings* base)
 {
-    uint16_t minval_r = 65535;
-    uint16_t minval_g = 65535;
-    uint16_t minval_b = 65535;
-    uint16_t minval_i = 65535;
+    SweepConfig* cfg = &sc->config;
+    char filename[PATH_SIZE + sizeof(PART_SUFFIX)];
+    char journal[PATH_SIZE];
+    AutoExposureOptions options = auto_exposure_default();
+    ResponseProfile profile;
+    AutoExposure ae;
+    SweepPlan plan;
 
-    uint16_t maxval_r = 0;
-    uint16_t maxval_g = 0;
-    uint16_t maxval_b = 0;
-    uint16_t maxval_i = 0;
+    snprintf(filename, PATH_SIZE, "%s/%s" AUTO_SUFFIX, cfg->output,
+             cfg->prefix);
+    snprintf(journal, sizeof(journal), "%s/%s" JOURNAL_SUFFIX, cfg->output,
+             cfg->prefix);
+    if (cfg->resume && access(filename, R_OK) == 0 &&
+        access(journal, R_OK) == 0) {
+        printf("%sExposures and gains from %s\n", sc->tag, filename);
+        return sweep_config_load(cfg, filename);
+    }
+
+    if (cfg->response_profile[0]) {
+        input_path(filename, cfg, cfg->response_profile);
+        if (read_response_profile(&profile, filename) != 0) return -1;
+    }
 
-    for (size_t i = 0; i < im->width*im->height; ++i) {
-        if (im->r[i] < minval_r) minval_r = im->r[i];
-        if (im->g[i] < minval_g) minval_g = im->g[i];
-        if (im->b[i] < minval_b) minval_b = im->b[i];
-        if (im->i[i] < minval_i) minval_i = im->i[i];
+    if (sweep_plan(&plan, cfg, base) != 0) return -1;
+    const SweepPoint* lit = NULL;
+    for (size_t p = 0; !lit && p < plan.n_points; ++p) {
+        if (plan.points[p].settings.light) lit = &plan.points[p];
+    }
+    if (!lit) {
+        fprintf(stderr, "Error: auto exposure needs a light on\n");
+        sweep_plan_free(&plan);
+        return -1;
+    }
+    ScanSettings settings = lit->settings;
+    sweep_plan_free(&plan);
 
-        if (im->r[i] > maxval_r) maxval_r = im->r[i];
-        if (im->g[i] > maxval_g) maxval_g = im->g[i];
-        if (im->b[i] > maxval_b) maxval_b = im->b[i];
-        if (im->i[i] > maxval_i) maxval_i = im->i[i];
+    int* exposures[4] = {&settings.exposure_r, &settings.exposure_g,
+                         &settings.exposure_b, &settings.exposure_i};
+    for (int c = 0; c < 4; ++c) {
+        const SweepValues* values = &cfg->exposures[c];
+        int shortest = values->values[0];
+        int longest = values->values[0];
+        for (size_t k = 1; k < values->n; ++k) {
+            if (values->values[k] < shortest) shortest = values->values[k];
+            if (values->values[k] > longest) longest = values->values[k];
+        }
+        *exposures[c] = shortest;
+        options.max_exposure[c] = longest;
     }
+    options.preview_resolution = cfg->preview_resolution;
+    options.target = cfg->auto_target;
+    options.n_brackets = cfg->auto_brackets;
+    options.bracket_ratio = cfg->auto_ratio;
 
-    double range_r = maxval_r - minval_r;
-    double range_g = maxval_g - minval_g;
-    double range_b = maxval_b - minval_b;
-    double range_i = maxval_i - minval_i;
+    int status = auto_expose(sc->device, &settings, &options,
+                             cfg->response_profile[0] ? &profile : NULL, &ae);
+    if (status != 0) {
+        fprintf(stderr, "Error: %sauto exposure preview: %s\n", sc->tag,
+                piescan_strstatus(status));
+        return -1;
+    }
 
-    for (size_t i = 0; i < im->width*im->height; ++i) {
-        im->r[i] = (uint16_t) round(65535.0 * ((double) (im->r[i] - minval_r)) / range_r);
-        im->g[i] = (uint16_t) round(65535.0 * ((double) (im->g[i] - minval_g)) / range_g);
-        im->b[i] = (uint16_t) round(65535.0 * ((double) (im->b[i] - minval_b)) / range_b);
-        im->i[i] = (uint16_t) round(65535.0 * ((double) (im->i[i] - minval_i)) / range_i);
+    static const char* const names[4] = {"r", "g", "b", "i"};
+    for (int c = 0; c < 4; ++c) {
+        printf("%sAuto exposure %s: highlights at %u in the last of %zu "
+               "previews; exposure %d", sc->tag, names[c], ae.highlights[c],
+               ae.n_previews, ae.exposures[c][0]);
+        for (size_t k = 1; k < ae.n_brackets; ++k) {
+            printf(", %d", ae.exposures[c][k]);
+        }
+        printf(" at gain %d\n", ae.gains[c]);
     }
+
+    snprintf(filename, PATH_SIZE, "%s/%s" AUTO_SUFFIX, cfg->output,
+             cfg->prefix);
+    strcat(filename, PART_SUFFIX);
+    if (write_auto_exposure(filename, &ae) != 0) return -1;
+    filename[strlen(filename) - strlen(PART_SUFFIX)] = '\0';
+    if (commit_file(filename) != 0) return -1;
+
+    return sweep_config_load(cfg, filename);
 }
 
-int main()
+// Opens the device called name and plans its sweep from config, writing to
+// a subdirectory named after the device with own_directory. Returns 0, or
+// -1 after printing what went wrong; either way sc is for close_scanner().
+int
+open_scanner(Scanner* sc, const SweepConfig* config, const char* name,
+             bool own_directory, FrameQueue* ready)
 {
-    piescan_open();
+    SweepConfig* cfg = &sc->config;
+    char filename[PATH_SIZE];
 
-    ScanSettings settings = get_default_settings();
-    settings.resolution = 7200;
-    settings.gain_r = 0;
-    settings.gain_g = 0;
-    settings.gain_b = 0;
-    settings.gain_i = 0;
+    pthread_mutex_init(&sc->times.lock, NULL);
+    sc->config = *config;
+    sc->ready = ready;
 
-    Image* im = new_image();
+    ScanSettings base;
+    int status = piescan_open(&sc->device, name, NULL);
+    if (status == 0) {
+        status = piescan_get_default_settings(sc->device, &base);
+    }
+    if (status != 0) {
+        fprintf(stderr, "Error: %s: %s\n", name ? name : "default device",
+                piescan_strstatus(status));
+        return -1;
+    }
 
-    struct timeval tv1, tv2;
-    char filename[128];
+    // Device names are full of ':', so only keep what's safe in a path.
+    if (own_directory) {
+        const char* device = piescan_device_name(sc->device);
+        char label[SWEEP_PATH_SIZE];
+        size_t n = 0;
 
-    for (int light = 1; light >= 0; --light) {
-        settings.light = 4*light;
+        snprintf(sc->tag, sizeof(sc->tag), "%s: ", device);
+        for (; device[n] && n < sizeof(label) - 1; ++n) {
+            char c = device[n];
+            label[n] = isalnum((unsigned char) c) || c == '-' || c == '.'
+                     ? c : '_';
+        }
+        label[n] = '\0';
+        if (snprintf(cfg->output, sizeof(cfg->output), "%s/%s",
+                     config->output, label) >= (int) sizeof(cfg->output)) {
+            fprintf(stderr, "Error: %soutput path too long\n", sc->tag);
+            return -1;
+        }
+    }
+    if (make_directories(cfg) != 0) return -1;
+    if (cfg->auto_exposure && set_auto_exposure(sc, &base) != 0) return -1;
 
-        for (size_t i = 0; i < 26; ++i) {
-            gettimeofday(&tv1, NULL);
+    if (sweep_plan(&sc->plan, cfg, &base) != 0) {
+        fprintf(stderr, "Error: %sunable to plan the sweep\n", sc->tag);
+        return -1;
+    }
+    const SweepPlan* plan = &sc->plan;
+    if (cfg->first > plan->n_points) cfg->first = plan->n_points;
 
-            settings.exposure_r = 3000 + 280 * i;
-            settings.exposure_g = 3000 + 280 * i;
-            settings.exposure_b = 3000 + 280 * i;
-            settings.exposure_i =  700 + 372 * i;
+    snprintf(filename, sizeof(filename), "%s/%s" JOURNAL_SUFFIX,
+             cfg->output, cfg->prefix);
+    sc->journal = open_sweep_journal(filename, plan, cfg->resume);
+    if (!sc->journal) return -1;
 
-            scan_image(im, settings);
+    if (cfg->calibration[0]) {
+        input_path(filename, cfg, cfg->calibration);
+        int err = open_calibration(&sc->calibration, filename);
+        if (err) {
+            fprintf(stderr, "Error: unable to open %s: %s\n", filename,
+                    err == EINVAL ? "not a calibration" : strerror(err));
+            return -1;
+        }
+        printf("%sCorrecting scans with %zu references from %s\n", sc->tag,
+               calibration_count(sc->calibration), filename);
+        piescan_set_calibration(sc->device, sc->calibration);
+    }
+    if (cfg->dust) {
+        DustOptions dust = dust_options_default();
+        dust.threshold = cfg->dust_threshold;
+        if (piescan_set_dust_removal(sc->device, &dust) != 0) return -1;
+    }
+    if (cfg->calibrate) {
+        sc->calibrate = new_calibration_builder();
+        if (!sc->calibrate) return -1;
+    }
+    if (cfg->response) {
+        sc->response = new_response_builder();
+        if (!sc->response) return -1;
+    }
 
+    // Merges of groups finished before first are left alone; the group
+    // first falls in is redone from the exposures that are left. Merges the
+    // journal has as written are left alone too, and unfinished ones get
+    // back the frames already done, from their raw files, as do the
+    // calibration and response being built. Without those the frames are
+    // scanned again.
+    sc->skip = (bool*) calloc(plan->n_points, sizeof(bool));
+    sc->remaining = (size_t*) calloc(plan->n_groups, sizeof(size_t));
+    sc->incomplete = (bool*) calloc(plan->n_groups, sizeof(bool));
+    if (!sc->skip || !sc->remaining || !sc->incomplete) return -1;
+    size_t first_group = cfg->first < plan->n_points
+                       ? plan->points[cfg->first].group : plan->n_groups;
+    if (cfg->hdr) {
+        sc->merges = (HdrMerge**) calloc(plan->n_groups, sizeof(HdrMerge*));
+        if (!sc->merges) return -1;
+        for (size_t g = first_group; g < plan->n_groups; ++g) {
+            if (sweep_journal_merged(sc->journal, g)) continue;
+            hdr_path(filename, cfg, g);
+            strcat(filename, PART_SUFFIX);
+            sc->merges[g] = new_hdr_merge(filename, HDR_CLIP_DEFAULT);
+            if (!sc->merges[g]) {
+                fprintf(stderr, "Error: %sno memory to merge group %02zu\n",
+                        sc->tag, g);
+                return -1;
+            }
+        }
+    }
+
+    for (size_t p = 0; p < plan->n_points; ++p) {
+        const SweepPoint* point = &plan->points[p];
+        HdrMerge* merge = sc->merges ? sc->merges[point->group] : NULL;
+        bool* skip = &sc->skip[p];
+
+        *skip = p < cfg->first || sweep_journal_done(sc->journal, p);
+        if (*skip && p >= cfg->first && (merge || sc->calibrate ||
+                                            sc->response)) {
+            *skip = cfg->raw && readd_frame(sc, point) == 0;
+        }
+        if (!*skip) {
+            ++sc->remaining[point->group];
+            ++sc->n_scans;
+        }
+    }
+
+    printf("%sSweep of %zu frames in %zu groups, %zu left to scan: about "
+           "%.1f minutes\n", sc->tag, plan->n_points, plan->n_groups,
+           sc->n_scans, sweep_estimate(plan, cfg, sc->skip) / 60);
+
+    sc->free = new_frame_queue(N_FRAMES);
+    for (int f = 0; f < N_FRAMES; ++f) {
+        sc->frames[f].im = new_image();
+        sc->frames[f].owner = sc;
+        frame_queue_push(sc->free, &sc->frames[f]);
+    }
+
+    // Groups whose frames all came back from raw files only need writing.
+    for (size_t g = 0; sc->merges && g < plan->n_groups; ++g) {
+        if (sc->merges[g] && sc->remaining[g] == 0 &&
+            hdr_merge_count(sc->merges[g])) {
+            finish_merge(sc, g);
+        }
+    }
+
+    return 0;
+}
+
+void
+close_scanner(Scanner* sc)
+{
+    // Only groups the sweep stopped in are left.
+    for (size_t g = 0; sc->merges && g < sc->plan.n_groups; ++g) {
+        if (sc->merges[g]) free_hdr_merge(sc->merges[g]);
+    }
 
-            sprintf(filename, "raw/test_r_%d_%05lu.mmarr", light, i);
-            MmapArray* arr_r = get_mmap_writer(filename, im->width*im->height*sizeof(uint16_t));
-            sprintf(filename, "raw/test_g_%d_%05lu.mmarr", light, i);
-            MmapArray* arr_g = get_mmap_writer(filename, im->width*im->height*sizeof(uint16_t));
-            sprintf(filename, "raw/test_b_%d_%05lu.mmarr", light, i);
-            MmapArray* arr_b = get_mmap_writer(filename, im->width*im->height*sizeof(uint16_t));
-            sprintf(filename, "raw/test_i_%d_%05lu.mmarr", light, i);
-            MmapArray* arr_i = get_mmap_writer(filename, im->width*im->height*sizeof(uint16_t));
+    for (int f = 0; f < N_FRAMES; ++f) {
+        if (sc->frames[f].im) free_image(sc->frames[f].im);
+    }
+    if (sc->free) free_frame_queue(sc->free);
+    free(sc->merges);
+    free(sc->incomplete);
+    free(sc->remaining);
+    free(sc->skip);
+    close_sweep_journal(sc->journal);
+    sweep_plan_free(&sc->plan);
+    pthread_mutex_destroy(&sc->times.lock);
 
-            memcpy(arr_r->data, im->r, arr_r->size);
-            memcpy(arr_g->data, im->g, arr_g->size);
-            memcpy(arr_b->data, im->b, arr_b->size);
-            memcpy(arr_i->data, im->i, arr_i->size);
+    free_calibration_builder(sc->calibrate);
+    free_response_builder(sc->response);
+    if (sc->device) piescan_close(sc->device);
+    close_calibration(sc->calibration);
+}
 
-            free_mmap_array(arr_r);
-            free_mmap_array(arr_g);
-            free_mmap_array(arr_b);
-            free_mmap_array(arr_i);
+void
+finish_merge(Scanner* sc, size_t group)
+{
+    char filename[PATH_SIZE];
 
-            normalize_image(im);
+    if (sc->incomplete[group]) {
+        fprintf(stderr, "Error: %snot merging group %zu, which is missing "
+                "frames\n", sc->tag, group);
+        free_hdr_merge(sc->merges[group]);
+        sc->merges[group] = NULL;
+        return;
+    }
 
-            sprintf(filename, "png/test_r_%d_%05lu.png", light, i);
-            imsave16(im->r, im->width, im->height, 1, filename);
-            sprintf(filename, "png/test_g_%d_%05lu.png", light, i);
-            imsave16(im->g, im->width, im->height, 1, filename);
-            sprintf(filename, "png/test_b_%d_%05lu.png", light, i);
-            imsave16(im->b, im->width, im->height, 1, filename);
-            sprintf(filename, "png/test_i_%d_%05lu.png", light, i);
-            imsave16(im->i, im->width, im->height, 1, filename);
+    hdr_path(filename, &sc->config, group);
+    if (hdr_merge_finish(sc->merges[group]) != 0 ||
+        commit_file(filename) != 0) {
+        fprintf(stderr, "Error: %sunable to write HDR frame %zu\n", sc->tag,
+                group);
+    } else {
+        sweep_journal_mark_merged(sc->journal, group);
+    }
+    sc->merges[group] = NULL;
+}
 
-            gettimeofday(&tv2, NULL);
+// Whatever frames were added are worth keeping: each set of references
+// stands on its own.
+void
+write_calibration(Scanner* sc)
+{
+    char filename[PATH_SIZE + sizeof(PART_SUFFIX)];
 
-            int secs = (int) round((double) (tv2.tv_usec - tv1.tv_usec) / 1000000 +
-                 (double) (tv2.tv_sec - tv1.tv_sec));
+    if (!sc->calibrate || calibration_builder_count(sc->calibrate) == 0) {
+        return;
+    }
 
-            printf("Processing scan %lu took %d seconds\n", i, secs);
+    snprintf(filename, sizeof(filename), "%s/%s" CALIBRATION_SUFFIX,
+             sc->config.output, sc->config.prefix);
+    strcat(filename, PART_SUFFIX);
+    if (calibration_builder_write(sc->calibrate, filename) == 0) {
+        filename[strlen(filename) - strlen(PART_SUFFIX)] = '\0';
+        if (commit_file(filename) == 0) {
+            printf("%sCalibration of %zu channel settings written to %s\n",
+                   sc->tag, calibration_builder_count(sc->calibrate),
+                   filename);
         }
     }
-    free_image(im);
+}
 
+// Fits the scanner's response to the sweep's frames and writes it with a
+// summary of each channel.
+void
+write_response(Scanner* sc)
+{
+    static const char* const names[4] = {"r", "g", "b", "i"};
+    char filename[PATH_SIZE + sizeof(PART_SUFFIX)];
+    ResponseProfile profile;
+
+    if (!sc->response || response_builder_count(sc->response) == 0) return;
+
+    if (response_builder_fit(sc->response, &profile) == 0) {
+        fprintf(stderr, "Error: %sno channel stayed unclipped over two "
+                "exposures of a gain; no response to fit\n", sc->tag);
+        return;
+    }
+    for (int c = 0; c < 4; ++c) {
+        const ResponseChannel* channel = &profile.channels[c];
+        if (!channel->valid) continue;
+
+        const ResponseGain* last = &channel->gains[channel->n_gains - 1];
+        printf("%sResponse %s: %.3g counts per exposure unit at gain %d, "
+               "x%.3f at gain %d, black %.1f + %.1f per offset, "
+               "linear within %.2f%%\n", sc->tag, names[c],
+               channel->peak_rate, channel->base_gain, last->factor,
+               last->gain, channel->gains[0].black,
+               channel->gains[0].black_per_offset, 100 * channel->linearity);
+    }
+
+    snprintf(filename, sizeof(filename), "%s/%s" RESPONSE_SUFFIX,
+             sc->config.output, sc->config.prefix);
+    strcat(filename, PART_SUFFIX);
+    if (write_response_profile(&profile, filename) == 0) {
+        filename[strlen(filename) - strlen(PART_SUFFIX)] = '\0';
+        if (commit_file(filename) == 0) {
+            printf("%sResponse written to %s\n", sc->tag, filename);
+        }
+    }
+}
+
+// Acquisition thread of one scanner.
+void*
+scan_points(void* arg)
+{
+    Scanner* sc = (Scanner*) arg;
+    const SweepPlan* plan = &sc->plan;
+    size_t n_scanned = 0;
+
+    for (size_t p = 0; p < plan->n_points; ++p) {
+        const SweepPoint* point = &plan->points[p];
+        if (sc->skip[p]) continue;
+
+        Frame* frame = frame_queue_pop(sc->free);
+        frame->settings = point->settings;
+        frame->index = point->index;
+        frame->group = point->group;
+        frame->step = point->step;
+
+        // A signal between two scans has no scan to cancel.
+        double t0 = now();
+        sc->status = cancelled ? SANE_STATUS_CANCELLED
+                   : map_frame(&sc->config, frame) ? SANE_STATUS_IO_ERROR
+                   : piescan_scan_image(sc->device, frame->im,
+                                        point->settings);
+        frame->t_scan = now() - t0;
 
-    /*
-    ScanSettings settings = get_default_settings();
-    settings.resolution = 7200;
+        // The frames already scanned are still written and journalled, so
+        // the sweep can be resumed from here.
+        if (sc->status != 0) {
+            fprintf(stderr, "Error: %spoint %zu: %s\n", sc->tag, p + 1,
+                    piescan_strstatus(sc->status));
+            frame_queue_push(sc->free, frame);
+            break;
+        }
+        frame_queue_push(sc->ready, frame);
 
-    Image* im = new_image();
+        ++n_scanned;
+        double left = (now() - sc->t_start) / (double) n_scanned
+                    * (double) (sc->n_scans - n_scanned);
+        printf("%sPoint %zu of %zu scanned, %.0f s left\n", sc->tag, p + 1,
+               plan->n_points, left);
+    }
 
-    char filename_base[128];
-    char filename[128];
-    struct timeval tv1, tv2;
+    return NULL;
+}
 
-    for (int i = 0; i < 150; ++i) {
-        settings.light = uniform_int(0, 1)*uniform_int(1, 9);
-        settings.gain_r = uniform_int(0, 63);
-        settings.gain_g = settings.gain_r;
-        settings.gain_b = settings.gain_r;
-        settings.gain_i = settings.gain_r;
-        settings.exposure_r = uniform_int(100, 10000);
-        settings.exposure_g = settings.exposure_r;
-        settings.exposure_b = settings.exposure_r;
-        settings.exposure_i = settings.exposure_r;
-        settings.offset_r = uniform_int(0, 255);
-        settings.offset_g = settings.offset_r;
-        settings.offset_b = settings.offset_r;
-        settings.offset_i = settings.offset_r;
-        settings.sharpen = uniform_int(0, 1);
-        settings.threshold = SANE_FIX((double)uniform_int(0, 100));
+void*
+output_worker(void* arg)
+{
+    FrameQueue* ready = (FrameQueue*) arg;
+    Frame* frame;
 
-        gettimeofday(&tv1, NULL);
+    while ((frame = frame_queue_pop(ready))) {
+        Scanner* sc = (Scanner*) frame->owner;
+        const SweepConfig* config = &sc->config;
+        StageTimes* times = &sc->times;
+        char filename[PATH_SIZE];
 
-        scan_image(im, settings);
+        // Start writeback of the raw files and keep normalization off them.
+        double t0 = now();
+        // Without its planes there is nothing left to do with the frame.
+        bool usable = privatize_image(frame->im) == 0;
+        bool complete = usable;
+        if (usable && config->raw) {
+            raw_path(filename, config, frame->group, frame->step);
+            complete &= commit_file(filename) == 0;
+        }
+        double t1 = now();
+        // Raw samples go into the merge and the calibration, so they must
+        // come before normalizing.
+        HdrMerge* merge = sc->merges ? sc->merges[frame->group] : NULL;
+        if (merge && (!usable ||
+                      hdr_merge_add(merge, frame->im, &frame->settings))) {
+            fprintf(stderr, "Error: %sunable to merge frame %02zu_%03zu\n",
+                    sc->tag, frame->group, frame->step);
+            complete = false;
+        }
+        if (sc->calibrate && (!usable ||
+            calibration_builder_add(sc->calibrate, frame->im,
+                                    &frame->settings))) {
+            fprintf(stderr, "Error: %sunable to calibrate from frame "
+                    "%02zu_%03zu\n", sc->tag, frame->group, frame->step);
+            complete = false;
+        }
+        if (sc->response && (!usable ||
+            response_builder_add(sc->response, frame->im,
+                                 &frame->settings))) {
+            fprintf(stderr, "Error: %sunable to fit the response to frame "
+                    "%02zu_%03zu\n", sc->tag, frame->group, frame->step);
+            complete = false;
+        }
+        double t2 = now();
+        const bool encode = config->png || config->tiff;
+        bool normalized = usable && encode;
+        if (normalized && normalize_image(frame->im) != 0) {
+            fprintf(stderr, "Error: %sunable to normalize frame %02zu_%03zu\n",
+                    sc->tag, frame->group, frame->step);
+            normalized = complete = false;
+        }
+        double t3 = now();
+        if (normalized) {
+            complete &= encode_frame(config, frame) == 0;
+        }
+        double t4 = now();
 
-        gettimeofday(&tv2, NULL);
+        if (complete) sweep_journal_mark_done(sc->journal, frame->index);
 
-        int secs = (int) round((double) (tv2.tv_usec - tv1.tv_usec) / 1000000 +
-         (double) (tv2.tv_sec - tv1.tv_sec));
+        printf("%sFrame %02zu_%03zu: scan %.2fs, sync %.2fs, merge %.2fs, "
+               "normalize %.2fs, encode %.2fs\n", sc->tag, frame->group,
+               frame->step, frame->t_scan, t1 - t0, t2 - t1, t3 - t2,
+               t4 - t3);
 
-        sprintf(filename_base, "calib/%d_%02d_%05d_%03d_%d_%03d_%03d",
-                                                settings.light,
-                                                settings.gain_r,
-                                                settings.exposure_r,
-                                                settings.offset_r,
-                                                settings.sharpen,
-                                                (int)round(SANE_UNFIX(settings.threshold)),
-                                                secs);
+        pthread_mutex_lock(&times->lock);
+        times->scan += frame->t_scan;
+        times->sync += t1 - t0;
+        times->merge += t2 - t1;
+        times->normalize += t3 - t2;
+        times->encode += t4 - t3;
+        ++times->frames;
+        times->bytes += (size_t) frame->im->width * frame->im->height
+                      * 4 * sizeof(uint16_t);
+        times->t_end = t4;
+        if (!complete) sc->incomplete[frame->group] = true;
+        bool last = --sc->remaining[frame->group] == 0;
+        pthread_mutex_unlock(&times->lock);
 
-        sprintf(filename, "%s_R.png", filename_base);
-        imsave16(im->r, im->width, im->height, 1, filename);
-        sprintf(filename, "%s_G.png", filename_base);
-        imsave16(im->g, im->width, im->height, 1, filename);
-        sprintf(filename, "%s_B.png", filename_base);
-        imsave16(im->b, im->width, im->height, 1, filename);
-        sprintf(filename, "%s_I.png", filename_base);
-        imsave16(im->i, im->width, im->height, 1, filename);
+        // Once pushed, the frame belongs to the next scan.
+        const size_t group = frame->group;
+        frame_queue_push(sc->free, frame);
+
+        // Every other frame of the group has been added by now.
+        if (last && merge) finish_merge(sc, group);
     }
-    free_image(im);
-    */
 
-    piescan_close();
+    return NULL;
+}
+
+// MB/s, or 0 for a stage that took no measurable time.
+double
+rate(size_t bytes, double seconds)
+{
+    return seconds > 0 ? (double) bytes / 1e6 / seconds : 0;
+}
+
+void
+print_stage_times(const char* title, const StageTimes* times, double wall)
+{
+    if (times->frames == 0) return;
+
+    // The output stages are shared between N_WORKERS threads per scanner,
+    // so their throughput is limited by the per-worker share of their total
+    // time.
+    double output = (times->sync + times->merge + times->normalize
+                     + times->encode) / N_WORKERS;
+    double n = (double) times->frames;
+
+    printf("\n%s: %zu frames in %.1f seconds (%.2f s/frame, "
+           "%.2f frames/s, %.1f MB/s)\n", title, times->frames, wall,
+           wall / n, n / wall, rate(times->bytes, wall));
+    printf("\tscan      : %8.2f s/frame %8.1f MB/s\n", times->scan / n,
+           rate(times->bytes, times->scan));
+    printf("\tsync      : %8.2f s/frame %8.1f MB/s\n", times->sync / n,
+           rate(times->bytes, times->sync));
+    printf("\tmerge     : %8.2f s/frame %8.1f MB/s\n", times->merge / n,
+           rate(times->bytes, times->merge));
+    printf("\tnormalize : %8.2f s/frame %8.1f MB/s\n", times->normalize / n,
+           rate(times->bytes, times->normalize));
+    printf("\tencode    : %8.2f s/frame %8.1f MB/s\n", times->encode / n,
+           rate(times->bytes, times->encode));
+    printf("\tBottleneck: %s\n", times->scan >= output ? "scan" : "output");
 }
 
+int
+main(int argc, char** argv)
+{
+    SweepConfig config;
+    if (parse_arguments(&config, argc, argv) != 0) return EXIT_FAILURE;
+    if (sweep_config_check(&config) != 0) return EXIT_FAILURE;
+
+    char* names[MAX_SCANNERS];
+    size_t n_names;
+    if (select_devices(&config, names, &n_names) != 0) return EXIT_FAILURE;
+
+    // With several scanners, each one gets a directory in output.
+    int status = n_names > 1 ? make_directory(config.output) : 0;
+    Scanner* all = (Scanner*) calloc(n_names, sizeof(Scanner));
+    FrameQueue* ready = new_frame_queue(N_FRAMES * n_names);
+    size_t n_open = 0;
+    while (status == 0 && n_open < n_names) {
+        Scanner* sc = &all[n_open++];
+        status = open_scanner(sc, &config, names[n_open - 1], n_names > 1,
+                              ready);
+    }
+    for (size_t k = 0; k < n_names; ++k) {
+        free(names[k]);
+    }
+    if (status != 0) {
+        for (size_t k = 0; k < n_open; ++k) {
+            close_scanner(&all[k]);
+        }
+        free_frame_queue(ready);
+        free(all);
+        return EXIT_FAILURE;
+    }
+
+    scanners = all;
+    n_scanners = n_names;
+#ifdef SIGHUP
+    signal(SIGHUP, sighandler);
+#endif
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    const size_t n_workers = N_WORKERS * n_scanners;
+    pthread_t* workers = (pthread_t*) malloc(n_workers * sizeof(pthread_t));
+    for (size_t w = 0; w < n_workers; ++w) {
+        pthread_create(&workers[w], NULL, output_worker, ready);
+    }
+
+    double t_start = now();
+    for (size_t k = 0; k < n_scanners; ++k) {
+        all[k].t_start = t_start;
+        pthread_create(&all[k].thread, NULL, scan_points, &all[k]);
+    }
+    for (size_t k = 0; k < n_scanners; ++k) {
+        pthread_join(all[k].thread, NULL);
+        if (all[k].status != 0) status = all[k].status;
+    }
+
+    frame_queue_close(ready);
+    for (size_t w = 0; w < n_workers; ++w) {
+        pthread_join(workers[w], NULL);
+    }
+    double wall = now() - t_start;
+
+    for (size_t k = 0; k < n_scanners; ++k) {
+        write_calibration(&all[k]);
+        write_response(&all[k]);
+    }
+
+    // Each scanner's throughput is over the time until its last frame was
+    // written, so one that finishes early isn't penalized by the others.
+    StageTimes total = {0};
+    for (size_t k = 0; k < n_scanners; ++k) {
+        const StageTimes* times = &all[k].times;
+        const char* title = n_scanners > 1
+                          ? piescan_device_name(all[k].device) : "Pipeline";
+
+        print_stage_times(title, times, times->t_end - t_start);
+        total.scan += times->scan;
+        total.sync += times->sync;
+        total.merge += times->merge;
+        total.normalize += times->normalize;
+        total.encode += times->encode;
+        total.frames += times->frames;
+        total.bytes += times->bytes;
+    }
+    if (n_scanners > 1) print_stage_times("All scanners", &total, wall);
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+#ifdef SIGHUP
+    signal(SIGHUP, SIG_DFL);
+#endif
+    n_scanners = 0;
+    for (size_t k = 0; k < n_names; ++k) {
+        close_scanner(&all[k]);
+    }
+    free(workers);
+    free_frame_queue(ready);
+    free(all);
+
+    return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
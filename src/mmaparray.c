@@ -1,6 +1,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 
@@ -15,6 +16,17 @@
 | Function declarations                                                       |
 \*****************************************************************************/
 
+static int map_fd(MmapArray** arr, int fd, size_t size, int prot, int flags,
+                  const MmapOptions* opts);
+static void apply_hints(MmapArray* arr, const MmapOptions* opts);
+static int size_file(int fd, size_t size, bool preallocate);
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
 void
 free_mmap_array(MmapArray* arr)
 {
@@ -22,79 +34,222 @@ free_mmap_array(MmapArray* arr)
     free(arr);
 }
 
-// TODO: sane filesize handling
 MmapArray*
 get_mmap_writer(const char* filename, const size_t size)
 {
-    MmapArray* result = (MmapArray*) malloc(sizeof(MmapArray));
-    result->size = size;
+    const MmapOptions opts = {MMAP_ACCESS_SEQUENTIAL, true, false, false};
+    MmapArray* result = NULL;
 
-    int fd = open(filename,
-                  O_RDWR|O_CREAT|O_TRUNC,
-                  (mode_t)0600);
-    if(fd < 0) {
-        printf("Error: %d: unable to open file %s\n", errno, filename);
+    int err = get_mmap_writer_opts(&result, filename, size, &opts);
+    if (err) {
+        printf("Error %d: unable to map file %s for writing: %s\n", err,
+               filename, strerror(err));
     }
+    return result;
+}
 
-    // TODO: only perform this (making file big enough) if it's not already so!
-    if(lseek(fd, size - 1, SEEK_SET) == -1) {
-        close(fd);
-        printf("Error: %d: unable to create file %s\n", errno, filename);
+MmapArray*
+get_mmap_reader(const char* filename)
+{
+    const MmapOptions opts = {MMAP_ACCESS_WILLNEED, false, false, false};
+    MmapArray* result = NULL;
+
+    int err = get_mmap_reader_opts(&result, filename, &opts);
+    if (err) {
+        printf("Error %d: unable to map file %s for reading: %s\n", err,
+               filename, strerror(err));
     }
-    if(write(fd, "", 1) == -1) {
-        close(fd);
-        printf("Error: %d: unable to create file %s\n", errno, filename);
+    return result;
+}
+
+MmapArray*
+get_mmap_private(const char* filename)
+{
+    MmapArray* result = NULL;
+
+    int err = get_mmap_private_opts(&result, filename, NULL);
+    if (err) {
+        printf("Error %d: unable to map file %s: %s\n", err, filename,
+               strerror(err));
     }
+    return result;
+}
 
-    result->data = mmap(0,
-                        size,
-                        PROT_READ|PROT_WRITE,
-                        MAP_FILE|MAP_SHARED,
-                        fd,
-                        0);
-    if(result == MAP_FAILED) {
-        printf("Error %d: unable to memory map file %s\n", errno, filename);
+int
+get_mmap_writer_opts(MmapArray** arr, const char* filename, const size_t size,
+                     const MmapOptions* opts)
+{
+    *arr = NULL;
+    if (size == 0) {
+        return EINVAL;
     }
 
-    // TODO: Effect of madvise here?
+    int fd = open(filename, O_RDWR|O_CREAT, (mode_t)0600);
+    if (fd < 0) {
+        return errno;
+    }
+
+    int err = size_file(fd, size, opts && opts->preallocate);
+    if (!err) {
+        err = map_fd(arr, fd, size, PROT_READ|PROT_WRITE, MAP_SHARED, opts);
+    }
 
     close(fd);
-    return result;
+    return err;
 }
 
-MmapArray*
-get_mmap_reader(const char* filename)
+int
+get_mmap_reader_opts(MmapArray** arr, const char* filename,
+                     const MmapOptions* opts)
 {
-    MmapArray* result = (MmapArray*) malloc(sizeof(MmapArray));
     struct stat buf;
+    int err = 0;
 
-    int fd = open(filename,
-                  O_RDONLY);
-    if(fd < 0) {
-        printf("Error %d: unable to open file %s\n", errno, filename);
+    *arr = NULL;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return errno;
     }
 
-    if (fstat(fd,&buf) < 0) {
-        printf("Error %d: unable to determine file size of file %s\n", errno, filename);
+    if (fstat(fd, &buf) < 0) {
+        err = errno;
+    } else {
+        err = map_fd(arr, fd, buf.st_size, PROT_READ, MAP_SHARED, opts);
     }
-    result->size = buf.st_size;
 
-    result->data = mmap(0,
-                        result->size,
-                        PROT_READ,
-                        MAP_FILE|MAP_SHARED,
-                        fd,
-                        0);
+    close(fd);
+    return err;
+}
 
-    if(result == MAP_FAILED) {
-        printf("Error %d: unable to memory map file %s\n", errno, filename);
+int
+get_mmap_private_opts(MmapArray** arr, const char* filename,
+                      const MmapOptions* opts)
+{
+    struct stat buf;
+    int err = 0;
+
+    *arr = NULL;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return errno;
     }
 
-    if(madvise(result->data, result->size, MADV_SEQUENTIAL|MADV_WILLNEED) != 0) {
-        printf("Error %d: failed to set madvise for file %s\n", errno, filename);
+    if (fstat(fd, &buf) < 0) {
+        err = errno;
+    } else {
+        err = map_fd(arr, fd, buf.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+                     opts);
     }
 
     close(fd);
-    return result;
+    return err;
 }
 
+int
+advise_mmap_array(MmapArray* arr, int advice)
+{
+    if(madvise(arr->data, arr->size, advice) != 0) {
+        printf("Error %d: failed to set madvise\n", errno);
+        return -1;
+    }
+    return 0;
+}
+
+int
+sync_mmap_array(MmapArray* arr, int flags)
+{
+    if(msync(arr->data, arr->size, flags) != 0) {
+        printf("Error %d: failed to msync\n", errno);
+        return -1;
+    }
+    return 0;
+}
+
+int
+map_fd(MmapArray** arr, int fd, size_t size, int prot, int flags,
+       const MmapOptions* opts)
+{
+    if (size == 0) {
+        return EINVAL;
+    }
+
+#ifdef MAP_POPULATE
+    if (opts && opts->populate) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+
+    void* data = mmap(0, size, prot, MAP_FILE|flags, fd, 0);
+    if (data == MAP_FAILED) {
+        return errno;
+    }
+
+    MmapArray* result = (MmapArray*) malloc(sizeof(MmapArray));
+    if (!result) {
+        munmap(data, size);
+        return ENOMEM;
+    }
+    result->data = data;
+    result->size = size;
+
+    apply_hints(result, opts);
+    *arr = result;
+    return 0;
+}
+
+// Hints are advisory, so failures (e.g. no huge pages for this filesystem)
+// are not errors.
+void
+apply_hints(MmapArray* arr, const MmapOptions* opts)
+{
+    if (!opts) return;
+
+    switch (opts->access) {
+        case MMAP_ACCESS_SEQUENTIAL:
+            madvise(arr->data, arr->size, MADV_SEQUENTIAL);
+            break;
+        case MMAP_ACCESS_RANDOM:
+            madvise(arr->data, arr->size, MADV_RANDOM);
+            break;
+        case MMAP_ACCESS_WILLNEED:
+            madvise(arr->data, arr->size, MADV_SEQUENTIAL);
+            madvise(arr->data, arr->size, MADV_WILLNEED);
+            break;
+        case MMAP_ACCESS_DEFAULT:
+        default:
+            break;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (opts->hugepages) {
+        madvise(arr->data, arr->size, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+// A file that already has the right size is reused as is. Otherwise it is
+// truncated or extended, and with preallocate its blocks are reserved up
+// front, so stores into the mapping don't allocate on every page fault and
+// a full disk shows up here instead of as SIGBUS later.
+int
+size_file(int fd, size_t size, bool preallocate)
+{
+    struct stat buf;
+
+    if (fstat(fd, &buf) < 0) {
+        return errno;
+    }
+    if ((size_t) buf.st_size != size && ftruncate(fd, size) < 0) {
+        return errno;
+    }
+
+    if (preallocate) {
+        int err = posix_fallocate(fd, 0, size);
+        // Filesystems without fallocate keep the sparse file.
+        if (err && err != EOPNOTSUPP && err != EINVAL) {
+            return err;
+        }
+    }
+
+    return 0;
+}
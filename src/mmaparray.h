@@ -5,6 +5,9 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
+#include <stddef.h>
+
 
 
 /*****************************************************************************\
@@ -16,6 +19,22 @@ typedef struct {
     size_t size;
 } MmapArray;
 
+// How the mapping will be touched, which picks the madvise() hints.
+typedef enum {
+    MMAP_ACCESS_DEFAULT = 0,   // No hint
+    MMAP_ACCESS_SEQUENTIAL,    // Front to back once: aggressive readahead,
+                               // pages dropped soon after use
+    MMAP_ACCESS_RANDOM,        // No readahead
+    MMAP_ACCESS_WILLNEED,      // Whole file needed soon: read it in now
+} MmapAccess;
+
+typedef struct {
+    MmapAccess access;
+    bool preallocate;  // Writers: reserve the blocks, no sparse file
+    bool populate;     // MAP_POPULATE: fault every page in up front
+    bool hugepages;    // MADV_HUGEPAGE, where the filesystem supports it
+} MmapOptions;
+
 
 
 /*****************************************************************************\
@@ -23,9 +42,31 @@ typedef struct {
 \*****************************************************************************/
 
 void free_mmap_array(MmapArray* arr);
+
+// These print a message and return NULL on failure.
 MmapArray* get_mmap_writer(const char* filename, const size_t size);
 MmapArray* get_mmap_reader(const char* filename);
 
+// Read-write view of an existing file whose writes stay private to this
+// process: pages are shared with the page cache until first written.
+MmapArray* get_mmap_private(const char* filename);
+
+// As above, returning 0 and the mapping in *arr, or an errno value. The
+// writer reuses an existing file, resizing it only if needed, so its old
+// contents show through wherever the caller doesn't write. opts may be NULL.
+int get_mmap_writer_opts(MmapArray** arr, const char* filename,
+                         const size_t size, const MmapOptions* opts);
+int get_mmap_reader_opts(MmapArray** arr, const char* filename,
+                         const MmapOptions* opts);
+int get_mmap_private_opts(MmapArray** arr, const char* filename,
+                          const MmapOptions* opts);
+
+// madvise() the whole mapping with advice, e.g. MADV_SEQUENTIAL.
+int advise_mmap_array(MmapArray* arr, int advice);
+
+// msync() the whole mapping with flags MS_ASYNC or MS_SYNC.
+int sync_mmap_array(MmapArray* arr, int flags);
+
 
 
 #ifdef __cplusplus
@@ -0,0 +1,262 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <math.h>
+#include <inttypes.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NORMALIZE_X86
+#include <immintrin.h>
+#endif
+
+#include "normalize.h"
+#include "threadpool.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// Samples per tile and plane: 128 KiB, so a tile of one plane plus its
+// lookup table stay within L2.
+#define TILE_SAMPLES (64*1024)
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef void (*MinmaxFunc)(const uint16_t* data, size_t n, ChannelRange* range);
+
+typedef struct {
+    uint16_t* planes[4];
+    size_t n_samples;
+    size_t n_tiles;
+    ChannelRange* tile_ranges;  // n_tiles x 4
+    uint16_t* luts[4];          // NULL for channels left untouched
+    MinmaxFunc minmax;
+} NormalizeJob;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+static void minmax_scalar(const uint16_t* data, size_t n, ChannelRange* range);
+#ifdef NORMALIZE_X86
+static void minmax_sse2(const uint16_t* data, size_t n, ChannelRange* range);
+static void minmax_avx2(const uint16_t* data, size_t n, ChannelRange* range);
+#endif
+static MinmaxFunc get_minmax_func(void);
+static void minmax_tile(void* arg, size_t tile);
+static void rescale_tile(void* arg, size_t tile);
+static uint16_t* build_lut(ChannelRange range);
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+void
+minmax_scalar(const uint16_t* data, size_t n, ChannelRange* range)
+{
+    uint16_t lo = range->min;
+    uint16_t hi = range->max;
+
+    for (size_t k = 0; k < n; ++k) {
+        if (data[k] < lo) lo = data[k];
+        if (data[k] > hi) hi = data[k];
+    }
+
+    range->min = lo;
+    range->max = hi;
+}
+
+#ifdef NORMALIZE_X86
+
+// SSE2 only has signed 16-bit min/max; flipping the sign bit maps unsigned
+// order onto signed order and back.
+__attribute__((target("sse2")))
+void
+minmax_sse2(const uint16_t* data, size_t n, ChannelRange* range)
+{
+    const __m128i bias = _mm_set1_epi16((short) 0x8000);
+    __m128i lo = _mm_xor_si128(_mm_set1_epi16((short) range->min), bias);
+    __m128i hi = _mm_xor_si128(_mm_set1_epi16((short) range->max), bias);
+    size_t k = 0;
+
+    for (; k + 8 <= n; k += 8) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (data + k)),
+                                  bias);
+        lo = _mm_min_epi16(lo, v);
+        hi = _mm_max_epi16(hi, v);
+    }
+
+    uint16_t lo_lanes[8], hi_lanes[8];
+    _mm_storeu_si128((__m128i*) lo_lanes, _mm_xor_si128(lo, bias));
+    _mm_storeu_si128((__m128i*) hi_lanes, _mm_xor_si128(hi, bias));
+    minmax_scalar(lo_lanes, 8, range);
+    minmax_scalar(hi_lanes, 8, range);
+    minmax_scalar(data + k, n - k, range);
+}
+
+__attribute__((target("avx2")))
+void
+minmax_avx2(const uint16_t* data, size_t n, ChannelRange* range)
+{
+    __m256i lo = _mm256_set1_epi16((short) range->min);
+    __m256i hi = _mm256_set1_epi16((short) range->max);
+    size_t k = 0;
+
+    for (; k + 16 <= n; k += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (data + k));
+        lo = _mm256_min_epu16(lo, v);
+        hi = _mm256_max_epu16(hi, v);
+    }
+
+    uint16_t lo_lanes[16], hi_lanes[16];
+    _mm256_storeu_si256((__m256i*) lo_lanes, lo);
+    _mm256_storeu_si256((__m256i*) hi_lanes, hi);
+    minmax_scalar(lo_lanes, 16, range);
+    minmax_scalar(hi_lanes, 16, range);
+    minmax_scalar(data + k, n - k, range);
+}
+
+#endif  // NORMALIZE_X86
+
+MinmaxFunc
+get_minmax_func(void)
+{
+#ifdef NORMALIZE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return minmax_avx2;
+    if (__builtin_cpu_supports("sse2")) return minmax_sse2;
+#endif
+    return minmax_scalar;
+}
+
+void
+minmax_tile(void* arg, size_t tile)
+{
+    NormalizeJob* job = (NormalizeJob*) arg;
+    size_t start = tile * TILE_SAMPLES;
+    size_t n = job->n_samples - start < TILE_SAMPLES ?
+               job->n_samples - start : TILE_SAMPLES;
+
+    for (int c = 0; c < 4; ++c) {
+        ChannelRange* range = &job->tile_ranges[4*tile + c];
+        range->min = 65535;
+        range->max = 0;
+        job->minmax(job->planes[c] + start, n, range);
+    }
+}
+
+void
+rescale_tile(void* arg, size_t tile)
+{
+    NormalizeJob* job = (NormalizeJob*) arg;
+    size_t start = tile * TILE_SAMPLES;
+    size_t n = job->n_samples - start < TILE_SAMPLES ?
+               job->n_samples - start : TILE_SAMPLES;
+
+    for (int c = 0; c < 4; ++c) {
+        const uint16_t* lut = job->luts[c];
+        uint16_t* data = job->planes[c] + start;
+        if (!lut) continue;
+
+        for (size_t k = 0; k < n; ++k) {
+            data[k] = lut[data[k]];
+        }
+    }
+}
+
+// Table of the exact double-precision result for every value the channel
+// can hold, so the per-sample work is a single load. NULL if out of memory.
+uint16_t*
+build_lut(ChannelRange range)
+{
+    uint16_t* lut = (uint16_t*) calloc(65536, sizeof(uint16_t));
+
+    if (!lut) return NULL;
+
+    if (range.max > range.min) {
+        double scale = 65535.0 / (double) (range.max - range.min);
+        for (uint32_t v = range.min; v <= range.max; ++v) {
+            lut[v] = (uint16_t) round(scale * (double) (v - range.min));
+        }
+    }
+    // Even a flat or inverted range of the caller's clamps above max.
+    for (uint32_t v = range.max + 1u; v < 65536; ++v) lut[v] = 65535;
+
+    return lut;
+}
+
+int
+image_minmax(const Image* im, ChannelRange ranges[4])
+{
+    NormalizeJob job = {
+        .planes = {im->r, im->g, im->b, im->i},
+        .n_samples = (size_t) im->width * im->height,
+        .minmax = get_minmax_func(),
+    };
+    job.n_tiles = (job.n_samples + TILE_SAMPLES - 1) / TILE_SAMPLES;
+    job.tile_ranges = (ChannelRange*) malloc(4 * job.n_tiles
+                                             * sizeof(ChannelRange));
+    if (!job.tile_ranges) return ENOMEM;
+
+    parallel_for(job.n_tiles, minmax_tile, &job);
+
+    for (int c = 0; c < 4; ++c) {
+        ranges[c].min = 65535;
+        ranges[c].max = 0;
+        for (size_t t = 0; t < job.n_tiles; ++t) {
+            const ChannelRange* r = &job.tile_ranges[4*t + c];
+            if (r->min < ranges[c].min) ranges[c].min = r->min;
+            if (r->max > ranges[c].max) ranges[c].max = r->max;
+        }
+    }
+
+    free(job.tile_ranges);
+    return 0;
+}
+
+int
+normalize_image_ranges(Image* im, const ChannelRange ranges[4])
+{
+    NormalizeJob job = {
+        .planes = {im->r, im->g, im->b, im->i},
+        .n_samples = (size_t) im->width * im->height,
+    };
+    job.n_tiles = (job.n_samples + TILE_SAMPLES - 1) / TILE_SAMPLES;
+
+    bool identity = true;
+    int err = 0;
+    for (int c = 0; c < 4; ++c) {
+        // A channel already spanning the full range maps onto itself.
+        if (ranges[c].min == 0 && ranges[c].max == 65535) continue;
+        job.luts[c] = build_lut(ranges[c]);
+        if (!job.luts[c]) err = ENOMEM;
+        identity = false;
+    }
+
+    if (!identity && !err) {
+        parallel_for(job.n_tiles, rescale_tile, &job);
+    }
+
+    for (int c = 0; c < 4; ++c) {
+        free(job.luts[c]);
+    }
+    return err;
+}
+
+int
+normalize_image(Image* im)
+{
+    ChannelRange ranges[4];
+    int err = image_minmax(im, ranges);
+    return err ? err : normalize_image_ranges(im, ranges);
+}
@@ -0,0 +1,48 @@
+#ifndef NORMALIZE_H
+#define NORMALIZE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "piescan.h"
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef struct {
+    uint16_t min;
+    uint16_t max;
+} ChannelRange;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+// Per-channel minimum and maximum, in r, g, b, i order. Returns 0 or
+// ENOMEM.
+int image_minmax(const Image* im, ChannelRange ranges[4]);
+
+// Stretches every channel to the full 0-65535 range, rounding exactly like
+// round(65535.0 * (v - min) / (max - min)). Flat channels become zero. With
+// ranges of the caller's, values below min become 0 and above max 65535;
+// one with max at or below min maps everything up to max to 0.
+// Both return 0, or ENOMEM leaving im untouched.
+int normalize_image(Image* im);
+int normalize_image_ranges(Image* im, const ChannelRange ranges[4]);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // NORMALIZE_H
@@ -1,14 +1,24 @@
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
-#include <signal.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
+
 #include <sane/sane.h>
 
 #include "piescan.h"
+#include "calibration.h"
+#include "dust.h"
+#include "deinterleave.h"
+#include "rawframe.h"
 
 
 
@@ -16,25 +26,163 @@
 | Macros                                                                      |
 \*****************************************************************************/
 
+// Longest string option value the cache keeps.
+#define OPTION_STRING_SIZE 64
+
+// Default size of the buffer sane_read() fills, in MiB. Reads this large let
+// the backend run full-size transfers instead of one call per scanline.
+// PIESCAN_READ_BUFFER_MB overrides it.
+#define READ_BUFFER_MB 8
+
+// Alignment of each heap plane within its image's block, a cache line and
+// the widest vector deinterleave_rgbi() stores.
+#define PLANE_ALIGN 64
+
+// Heap blocks asked to use huge pages are rounded up to whole ones.
+#define HUGE_PAGE_SIZE (2u << 20)
+
 
 
 /*****************************************************************************\
 | Type definitions                                                            |
 \*****************************************************************************/
 
+// Every device option set_options() drives, in the order it sends them.
+// Indexes option_table.
+typedef enum {
+    OPT_MODE,
+    OPT_DEPTH,
+    OPT_RESOLUTION,
+    OPT_THRESHOLD,
+    OPT_SHARPEN,
+    OPT_SHADING_ANALYSIS,
+    OPT_FAST_INFRARED,
+    OPT_ADVANCE,
+    OPT_CALIBRATION,
+    OPT_TL_X,
+    OPT_TL_Y,
+    OPT_BR_X,
+    OPT_BR_Y,
+    OPT_CORRECT_SHADING,
+    OPT_CORRECT_INFRARED,
+    OPT_CLEAN_IMAGE,
+    OPT_GAIN_ADJUST,
+    OPT_CROP,
+    OPT_SMOOTH,
+    OPT_PREVIEW,
+    OPT_SAVE_SHADING,
+    OPT_SAVE_CCDMASK,
+    OPT_LIGHT,
+    OPT_DOUBLE_TIMES,
+    OPT_EXPOSURE_R,
+    OPT_EXPOSURE_G,
+    OPT_EXPOSURE_B,
+    OPT_EXPOSURE_I,
+    OPT_GAIN_R,
+    OPT_GAIN_G,
+    OPT_GAIN_B,
+    OPT_GAIN_I,
+    OPT_OFFSET_R,
+    OPT_OFFSET_G,
+    OPT_OFFSET_B,
+    OPT_OFFSET_I,
+    N_OPTIONS
+} OptionId;
+
+// How a ScanSettings field holds an option's value. How it goes over the
+// wire is up to the device's descriptor, so e.g. an int field can feed a
+// fixed point option.
+typedef enum {
+    FIELD_STRING,  // char*
+    FIELD_BOOL,    // bool
+    FIELD_INT,     // int
+    FIELD_DOUBLE,  // double
+} FieldType;
+
+typedef struct {
+    const char* name;   // As the pie backend reports it
+    FieldType field;
+    size_t offset;      // Of the field in ScanSettings
+    SANE_Int fallback;  // Index in the backend this was written against
+} OptionSpec;
+
+// The value last sent for an option, in SANE representation.
+typedef struct {
+    bool valid;
+    SANE_Word word;
+    char string[OPTION_STRING_SIZE];
+} CachedOption;
+
+struct PiescanDevice {
+    SANE_Handle handle;
+    char* name;
+    PiescanRetry retry;
+
+    // Resolved once the device is open.
+    SANE_Int option_index[N_OPTIONS];
+    const SANE_Option_Descriptor* option_desc[N_OPTIONS];
+
+    // What the device was last told, so unchanged options aren't sent again.
+    CachedOption option_cache[N_OPTIONS];
+
+    // Kept from scan to scan, and only reallocated when a scan needs more.
+    SANE_Byte* read_buffer;
+    size_t read_buffer_size;
+    Image* scratch;  // Lines for a streaming scan without an image
+
+    const Calibration* calibration;
+    DustFilter* dust;
+};
+
 
 
 /*****************************************************************************\
 | Function declarations                                                       |
 \*****************************************************************************/
 
-static void piescan_exit(int status);
-static void sighandler(int signum);
-static const SANE_Option_Descriptor* get_option_descriptor_safe(SANE_Int i);
-static void get_option_value_safe(SANE_Int i, void* v);
-static SANE_Int set_option_value_safe(SANE_Int i, void* v);
-static void set_options(ScanSettings settings);
-static void open_device();
+static bool retry_after(const PiescanRetry* retry, SANE_Status status,
+                        int attempt, const char* what);
+static SANE_Status get_option_value(PiescanDevice* device, SANE_Int i,
+                                    void* v);
+static SANE_Status set_option_value(PiescanDevice* device, SANE_Int i,
+                                    void* v, SANE_Int* info);
+static SANE_Status resolve_options(PiescanDevice* device);
+static void invalidate_options(PiescanDevice* device);
+static double get_field(const ScanSettings* settings, OptionId id);
+static void set_field(ScanSettings* settings, OptionId id, double value);
+static SANE_Status load_option(PiescanDevice* device, ScanSettings* settings,
+                               OptionId id);
+static SANE_Word encode_option(const PiescanDevice* device,
+                               const ScanSettings* settings, OptionId id);
+static SANE_Word constrain_word(const SANE_Option_Descriptor* opt,
+                                SANE_Word word);
+static SANE_Status check_string(const SANE_Option_Descriptor* opt,
+                                const char* value);
+static void print_word(const SANE_Option_Descriptor* opt, SANE_Word word);
+static SANE_Status push_option(PiescanDevice* device, OptionId id,
+                               const ScanSettings* settings, SANE_Int* info,
+                               int* n_sent);
+static SANE_Status set_options(PiescanDevice* device,
+                               const ScanSettings* settings, int* n_sent);
+static SANE_Status acquire_sane(void);
+static void release_sane(void);
+static char* copy_string(const char* s);
+static SANE_Status find_device(const char* name, char** found);
+static SANE_Status open_device(PiescanDevice* device, const char* name);
+static size_t get_read_buffer_lines(size_t bytes_per_line);
+static SANE_Status scan_retrying(PiescanDevice* device,
+                                 const ScanSettings* settings, Image* im,
+                                 ScanLineCallback callback, void* user);
+static SANE_Status scan_lines(PiescanDevice* device,
+                              const ScanSettings* settings, Image* im,
+                              ScanLineCallback callback, void* user,
+                              uint32_t* n_delivered);
+static void set_mapped_planes(Image* im);
+static int alloc_block(Image* im, size_t size);
+static void free_block(Image* im);
+static int alloc_planes(Image* im);
+static void sync_planes(Image* im);
+static void release_planes(Image* im);
 
 
 
@@ -42,114 +190,337 @@ static void open_device();
 | Global variables                                                            |
 \*****************************************************************************/
 
-static SANE_Handle device;
-/*
-static const double gains[] = {
-1.000, 1.075, 1.154, 1.251, 1.362, 1.491, 1.653,  //  0,  5, 10, 15, 20, 25, 30
-1.858, 2.115, 2.458, 2.935, 3.638, 4.627          // 35, 40, 45, 50, 55, 60
+// SANE is initialized while any device is open.
+static pthread_mutex_t sane_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sane_users;
+
+#define OPTION(id, name, field, member, fallback) \
+    [id] = {name, field, offsetof(ScanSettings, member), fallback}
+
+static const OptionSpec option_table[N_OPTIONS] = {
+    OPTION(OPT_MODE, "mode", FIELD_STRING, mode, 2),
+    OPTION(OPT_DEPTH, "depth", FIELD_INT, depth, 3),
+    OPTION(OPT_RESOLUTION, "resolution", FIELD_INT, resolution, 4),
+    OPTION(OPT_THRESHOLD, "threshold", FIELD_INT, threshold, 6),
+    OPTION(OPT_SHARPEN, "sharpen", FIELD_BOOL, sharpen, 7),
+    OPTION(OPT_SHADING_ANALYSIS, "shading-analysis", FIELD_BOOL,
+           shading_analysis, 8),
+    OPTION(OPT_FAST_INFRARED, "fast-infrared", FIELD_BOOL, fast_infrared, 9),
+    OPTION(OPT_ADVANCE, "advance", FIELD_BOOL, auto_advance, 10),
+    OPTION(OPT_CALIBRATION, "calibration", FIELD_STRING, calibration, 11),
+    OPTION(OPT_TL_X, "tl-x", FIELD_DOUBLE, tl_x, 13),
+    OPTION(OPT_TL_Y, "tl-y", FIELD_DOUBLE, tl_y, 14),
+    OPTION(OPT_BR_X, "br-x", FIELD_DOUBLE, br_x, 15),
+    OPTION(OPT_BR_Y, "br-y", FIELD_DOUBLE, br_y, 16),
+    OPTION(OPT_CORRECT_SHADING, "correct-shading", FIELD_BOOL,
+           correct_shading, 18),
+    OPTION(OPT_CORRECT_INFRARED, "correct-infrared", FIELD_BOOL,
+           correct_infrared, 19),
+    OPTION(OPT_CLEAN_IMAGE, "clean-image", FIELD_BOOL, clean_image, 20),
+    OPTION(OPT_GAIN_ADJUST, "gain-adjust", FIELD_STRING, gain_adjust, 21),
+    OPTION(OPT_CROP, "crop", FIELD_STRING, crop, 22),
+    OPTION(OPT_SMOOTH, "smooth", FIELD_INT, smooth, 23),
+    OPTION(OPT_PREVIEW, "preview", FIELD_BOOL, preview, 27),
+    OPTION(OPT_SAVE_SHADING, "save-shading-data", FIELD_BOOL, save_shading,
+           28),
+    OPTION(OPT_SAVE_CCDMASK, "save-ccdmask", FIELD_BOOL, save_ccdmask, 29),
+    OPTION(OPT_LIGHT, "light", FIELD_INT, light, 30),
+    OPTION(OPT_DOUBLE_TIMES, "double-times", FIELD_INT, double_times, 31),
+    OPTION(OPT_EXPOSURE_R, "exposure-time-r", FIELD_INT, exposure_r, 32),
+    OPTION(OPT_EXPOSURE_G, "exposure-time-g", FIELD_INT, exposure_g, 33),
+    OPTION(OPT_EXPOSURE_B, "exposure-time-b", FIELD_INT, exposure_b, 34),
+    OPTION(OPT_EXPOSURE_I, "exposure-time-i", FIELD_INT, exposure_i, 35),
+    OPTION(OPT_GAIN_R, "gain-r", FIELD_INT, gain_r, 36),
+    OPTION(OPT_GAIN_G, "gain-g", FIELD_INT, gain_g, 37),
+    OPTION(OPT_GAIN_B, "gain-b", FIELD_INT, gain_b, 38),
+    OPTION(OPT_GAIN_I, "gain-i", FIELD_INT, gain_i, 39),
+    OPTION(OPT_OFFSET_R, "offset-r", FIELD_INT, offset_r, 40),
+    OPTION(OPT_OFFSET_G, "offset-g", FIELD_INT, offset_g, 41),
+    OPTION(OPT_OFFSET_B, "offset-b", FIELD_INT, offset_b, 42),
+    OPTION(OPT_OFFSET_I, "offset-i", FIELD_INT, offset_i, 43),
 };
-*/
+
+#undef OPTION
+
 
 
 /*****************************************************************************\
 | Function implementations                                                    |
 \*****************************************************************************/
 
-void
-piescan_open()
+PiescanRetry
+piescan_retry_default(void)
 {
-    SANE_Int version_code;
-    sane_init(&version_code, NULL);
+    PiescanRetry retry = {
+        .attempts = 6,
+        .delay_ms = 20,
+        .backoff = 2,
+        .max_delay_ms = 1000,
+        .statuses = PIESCAN_RETRY_ON(SANE_STATUS_DEVICE_BUSY)
+                  | PIESCAN_RETRY_ON(SANE_STATUS_IO_ERROR),
+    };
+    return retry;
+}
 
-#ifdef SIGHUP
-    signal(SIGHUP, sighandler);
-#endif
-#ifdef SIGPIPE
-    signal(SIGPIPE, sighandler);
-#endif
-    signal(SIGINT, sighandler);
-    signal(SIGTERM, sighandler);
+int
+piescan_open(PiescanDevice** device, const char* name,
+             const PiescanRetry* retry)
+{
+    SANE_Status status = SANE_STATUS_GOOD;
+    PiescanDevice* dev;
+
+    *device = NULL;
+
+    status = acquire_sane();
+    if (status != SANE_STATUS_GOOD) return status;
 
-    open_device();
+    dev = (PiescanDevice*) calloc(1, sizeof(PiescanDevice));
+    if (!dev) {
+        piescan_close(NULL);
+        return SANE_STATUS_NO_MEM;
+    }
+    dev->retry = retry ? *retry : piescan_retry_default();
+    if (dev->retry.attempts < 1) dev->retry.attempts = 1;
+
+    status = open_device(dev, name);
+    if (status == SANE_STATUS_GOOD) status = resolve_options(dev);
+    if (status != SANE_STATUS_GOOD) {
+        piescan_close(dev);
+        return status;
+    }
+
+    *device = dev;
+    return SANE_STATUS_GOOD;
 }
 
+// Also drops the SANE reference of a piescan_open() that failed before it
+// had a device, which is what NULL stands for here.
 void
-piescan_close()
+piescan_close(PiescanDevice* device)
 {
-    piescan_exit(SANE_STATUS_GOOD);
+    if (device) {
+        if (device->handle) {
+            fprintf(stderr, "Closing device\n");
+            sane_close(device->handle);
+        }
+        free(device->read_buffer);
+        if (device->scratch) free_image(device->scratch);
+        free_dust_filter(device->dust);
+        free(device->name);
+        free(device);
+    }
+
+    release_sane();
 }
 
-void
-piescan_exit(int status)
+SANE_Status
+acquire_sane(void)
 {
-    if (device) {
-        fprintf(stderr, "Closing device\n");
-        sane_close(device);
+    SANE_Status status = SANE_STATUS_GOOD;
+
+    pthread_mutex_lock(&sane_lock);
+    if (sane_users == 0) {
+        SANE_Int version_code;
+        status = sane_init(&version_code, NULL);
     }
-    fprintf(stderr, "Exiting SANE\n");
-    sane_exit();
+    if (status == SANE_STATUS_GOOD) ++sane_users;
+    pthread_mutex_unlock(&sane_lock);
 
-    fprintf(stderr, "finished\n");
-    exit(status);
+    if (status != SANE_STATUS_GOOD) {
+        fprintf(stderr, "Error: unable to initialize SANE: %s\n",
+                sane_strstatus(status));
+    }
+    return status;
 }
 
 void
-sighandler(int signum)
+release_sane(void)
+{
+    pthread_mutex_lock(&sane_lock);
+    if (--sane_users == 0) {
+        fprintf(stderr, "Exiting SANE\n");
+        sane_exit();
+    }
+    pthread_mutex_unlock(&sane_lock);
+}
+
+char*
+copy_string(const char* s)
 {
-    static SANE_Bool first_time = SANE_TRUE;
+    return strdup(s ? s : "");
+}
 
-    if (device) {
-        fprintf (stderr, "Received signal %d\n", signum);
-        if (first_time) {
-            first_time = SANE_FALSE;
-            fprintf(stderr, "Trying to stop scanner...\n");
-            sane_cancel(device);
-        } else {
-            fprintf(stderr, "Aborting\n");
-            _exit(1);
+int
+piescan_list_devices(PiescanDeviceInfo** devices, size_t* n_devices)
+{
+    const SANE_Device** list;
+    SANE_Status status;
+    size_t n = 0;
+
+    *devices = NULL;
+    *n_devices = 0;
+
+    status = acquire_sane();
+    if (status != SANE_STATUS_GOOD) return status;
+
+    // The list is only valid until the next call, from any thread.
+    pthread_mutex_lock(&sane_lock);
+    status = sane_get_devices(&list, SANE_FALSE);
+    if (status == SANE_STATUS_GOOD) {
+        while (list[n]) ++n;
+        *devices = (PiescanDeviceInfo*) calloc(n + 1,
+                                               sizeof(PiescanDeviceInfo));
+        if (!*devices) status = SANE_STATUS_NO_MEM;
+    }
+    for (size_t k = 0; status == SANE_STATUS_GOOD && k < n; ++k) {
+        PiescanDeviceInfo* info = &(*devices)[k];
+        info->name = copy_string(list[k]->name);
+        info->vendor = copy_string(list[k]->vendor);
+        info->model = copy_string(list[k]->model);
+        info->type = copy_string(list[k]->type);
+        *n_devices = k + 1;
+        if (!info->name || !info->vendor || !info->model || !info->type) {
+            status = SANE_STATUS_NO_MEM;
         }
     }
+    pthread_mutex_unlock(&sane_lock);
+
+    release_sane();
+
+    if (status != SANE_STATUS_GOOD) {
+        fprintf(stderr, "Error: unable to list devices: %s\n",
+                sane_strstatus(status));
+        piescan_free_device_list(*devices, *n_devices);
+        *devices = NULL;
+        *n_devices = 0;
+    }
+    return status;
 }
 
-const SANE_Option_Descriptor*
-get_option_descriptor_safe(SANE_Int i)
+void
+piescan_free_device_list(PiescanDeviceInfo* devices, size_t n_devices)
 {
-    const SANE_Option_Descriptor* opt = sane_get_option_descriptor(device, i);
-    if (!opt) {
-        fprintf(stderr, "Error: unable to get option descriptor\n");
-        piescan_exit(1);
+    if (!devices) return;
+
+    for (size_t k = 0; k < n_devices; ++k) {
+        free(devices[k].name);
+        free(devices[k].vendor);
+        free(devices[k].model);
+        free(devices[k].type);
     }
-    return opt;
+    free(devices);
+}
+
+const char*
+piescan_device_name(const PiescanDevice* device)
+{
+    return device->name;
+}
+
+const char*
+piescan_strstatus(int status)
+{
+    return sane_strstatus((SANE_Status) status);
 }
 
 void
-get_option_value_safe(SANE_Int i, void* v)
+piescan_set_calibration(PiescanDevice* device,
+                        const Calibration* calibration)
 {
-    SANE_Status status = sane_control_option(device, i, SANE_ACTION_GET_VALUE,
-                                             v, 0);
+    device->calibration = calibration;
+}
+
+int
+piescan_set_dust_removal(PiescanDevice* device, const DustOptions* options)
+{
+    free_dust_filter(device->dust);
+    device->dust = options ? new_dust_filter(options) : NULL;
+    return options && !device->dust ? ENOMEM : 0;
+}
+
+void
+piescan_cancel(PiescanDevice* device)
+{
+    if (device && device->handle) sane_cancel(device->handle);
+}
+
+// Decides whether to try again after attempt (counting from 1) failed with
+// status, and if so waits out the backoff first.
+bool
+retry_after(const PiescanRetry* retry, SANE_Status status, int attempt,
+            const char* what)
+{
+    if (attempt >= retry->attempts || status < 0 || status >= 32 ||
+        !(retry->statuses & PIESCAN_RETRY_ON(status))) {
+        return false;
+    }
+
+    double delay = retry->delay_ms * pow(retry->backoff, attempt - 1);
+    if (delay > retry->max_delay_ms) delay = retry->max_delay_ms;
+
+    fprintf(stderr, "Warning: %s: %s, retry %d of %d in %.0f ms\n", what,
+            sane_strstatus(status), attempt, retry->attempts - 1, delay);
+
+    struct timespec ts = {
+        .tv_sec = (time_t) (delay / 1e3),
+        .tv_nsec = (long) (fmod(delay, 1e3) * 1e6),
+    };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+
+    return true;
+}
+
+SANE_Status
+get_option_value(PiescanDevice* device, SANE_Int i, void* v)
+{
+    SANE_Status status;
+
+    for (int attempt = 1;; ++attempt) {
+        status = sane_control_option(device->handle, i, SANE_ACTION_GET_VALUE,
+                                     v, NULL);
+        if (status == SANE_STATUS_GOOD ||
+            !retry_after(&device->retry, status, attempt, "get option")) {
+            break;
+        }
+    }
+
     if (status != SANE_STATUS_GOOD) {
-        fprintf(stderr, "Error: %s\n", sane_strstatus(status));
-        piescan_exit(status);
+        fprintf(stderr, "Error: unable to get option %d: %s\n", i,
+                sane_strstatus(status));
     }
+    return status;
 }
 
-SANE_Int
-set_option_value_safe(SANE_Int i, void* v)
+SANE_Status
+set_option_value(PiescanDevice* device, SANE_Int i, void* v, SANE_Int* info)
 {
-    SANE_Int result = 0;
-    SANE_Status status = sane_control_option(device, i, SANE_ACTION_SET_VALUE,
-                                             v, &result);
+    SANE_Status status;
+
+    for (int attempt = 1;; ++attempt) {
+        SANE_Int result = 0;
+        status = sane_control_option(device->handle, i, SANE_ACTION_SET_VALUE,
+                                     v, &result);
+        if (status == SANE_STATUS_GOOD) {
+            *info |= result;
+            break;
+        }
+        if (!retry_after(&device->retry, status, attempt, "set option")) {
+            break;
+        }
+    }
+
     if (status != SANE_STATUS_GOOD) {
-        fprintf(stderr, "Error: %s\n", sane_strstatus(status));
-        piescan_exit(status);
+        fprintf(stderr, "Error: unable to set option %d: %s\n", i,
+                sane_strstatus(status));
     }
-    return result;
+    return status;
 }
 
-ScanSettings
-get_default_settings()
+int
+piescan_get_default_settings(PiescanDevice* device, ScanSettings* out)
 {
     ScanSettings settings;
+    SANE_Status status = SANE_STATUS_GOOD;
 
     settings.mode = "RGBI";
     settings.calibration = "from options";
@@ -158,15 +529,11 @@ get_default_settings()
 
     settings.resolution = 300;
     settings.threshold = 50;
-    SANE_Fixed fixval;
-    get_option_value_safe(13, &fixval);
-    settings.tl_x = SANE_UNFIX(fixval);
-    get_option_value_safe(14, &fixval);
-    settings.tl_y = SANE_UNFIX(fixval);
-    get_option_value_safe(15, &fixval);
-    settings.br_x = SANE_UNFIX(fixval);
-    get_option_value_safe(16, &fixval);
-    settings.br_y = SANE_UNFIX(fixval);
+    for (OptionId id = OPT_TL_X; id <= OPT_BR_Y; ++id) {
+        if (status == SANE_STATUS_GOOD) {
+            status = load_option(device, &settings, id);
+        }
+    }
 
     settings.sharpen = false;
     settings.shading_analysis = false;
@@ -196,370 +563,815 @@ get_default_settings()
     settings.offset_b = 0;
     settings.offset_i = 0;
 
-    return settings;
+    settings.swap_bytes = false;
+
+    *out = settings;
+    return status;
 }
 
-void
-print_options()
+int
+piescan_print_options(PiescanDevice* device)
 {
-    const SANE_Option_Descriptor* opt;
-    char strval[64];
-    SANE_Int intval;
-    SANE_Fixed fixval;
+    char strval[OPTION_STRING_SIZE];
+    SANE_Word word;
+
+    for (int id = 0; id < N_OPTIONS; ++id) {
+        const SANE_Option_Descriptor* opt = device->option_desc[id];
+        const SANE_Int i = device->option_index[id];
+        SANE_Status status;
+
+        if (opt->type == SANE_TYPE_STRING) {
+            if (opt->size > (SANE_Int) sizeof(strval)) continue;
+            if ((status = get_option_value(device, i, strval))) return status;
+            fprintf(stderr, "\t%-20s: %s\n", opt->name, strval);
+        } else {
+            if ((status = get_option_value(device, i, &word))) return status;
+            fprintf(stderr, "\t%-20s: ", opt->name);
+            print_word(opt, word);
+            fprintf(stderr, "\n");
+        }
+    }
 
-    SANE_Int options_str[] = {2, 11, 21, 22};
-    SANE_Int options_fix[] = {4, 6, 13, 14, 15, 16};
-    SANE_Int options_int[] = {3, 7, 8, 9, 10, 18, 19, 20, 23, 27, 28, 29, 30,
-                              31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42,
-                              43};
+    return SANE_STATUS_GOOD;
+}
 
-    for (int i = 0; i < 4; ++i) {
-        SANE_Int optnum = options_str[i];
-        opt = get_option_descriptor_safe(optnum);
-        get_option_value_safe(optnum, strval);
-        fprintf(stderr, "\t%-20s: %s\n", opt->name, strval);
+// Looks every option in option_table up by name, so a backend that numbers
+// its options differently still gets the right values.
+SANE_Status
+resolve_options(PiescanDevice* device)
+{
+    SANE_Int n_options = 0;
+    SANE_Status status = get_option_value(device, 0, &n_options);
+
+    if (status != SANE_STATUS_GOOD) return status;
+
+    for (int id = 0; id < N_OPTIONS; ++id) {
+        device->option_index[id] = -1;
     }
 
-    fprintf(stderr, "\n");
+    for (SANE_Int i = 1; i < n_options; ++i) {
+        const SANE_Option_Descriptor* opt =
+            sane_get_option_descriptor(device->handle, i);
+        if (!opt || !opt->name) continue;
+
+        for (int id = 0; id < N_OPTIONS; ++id) {
+            if (strcmp(opt->name, option_table[id].name) == 0) {
+                device->option_index[id] = i;
+                device->option_desc[id] = opt;
+            }
+        }
+    }
 
-    for (int i = 0; i < 6; ++i) {
-        SANE_Int optnum = options_fix[i];
-        opt = get_option_descriptor_safe(optnum);
-        get_option_value_safe(optnum, &fixval);
-        fprintf(stderr, "\t%-20s: %.17g\n", opt->name, SANE_UNFIX(fixval));
+    for (int id = 0; id < N_OPTIONS; ++id) {
+        if (device->option_index[id] >= 0) continue;
+
+        const SANE_Int fallback = option_table[id].fallback;
+        fprintf(stderr, "Warning: no option named %s, using option %d\n",
+                option_table[id].name, fallback);
+        device->option_index[id] = fallback;
+        device->option_desc[id] =
+            sane_get_option_descriptor(device->handle, fallback);
+        if (!device->option_desc[id]) {
+            fprintf(stderr, "Error: unable to get option descriptor\n");
+            return SANE_STATUS_UNSUPPORTED;
+        }
     }
 
-    fprintf(stderr, "\n");
+    invalidate_options(device);
+    return SANE_STATUS_GOOD;
+}
 
-    for (int i = 0; i < 26; ++i) {
-        SANE_Int optnum = options_int[i];
-        opt = get_option_descriptor_safe(optnum);
-        get_option_value_safe(optnum, &intval);
-        fprintf(stderr, "\t%-20s: %d\n", opt->name, intval);
+void
+invalidate_options(PiescanDevice* device)
+{
+    for (int id = 0; id < N_OPTIONS; ++id) {
+        device->option_cache[id].valid = false;
+    }
+}
+
+double
+get_field(const ScanSettings* settings, OptionId id)
+{
+    const void* field = (const char*) settings + option_table[id].offset;
+
+    switch (option_table[id].field) {
+        case FIELD_BOOL:   return *(const bool*) field;
+        case FIELD_INT:    return *(const int*) field;
+        case FIELD_DOUBLE: return *(const double*) field;
+        default:           return 0;
     }
 }
 
 void
-set_options(ScanSettings settings)
-{
-    SANE_Int optnum;
-    SANE_Int result;
-
-    SANE_Int   intval;
-    SANE_Fixed fixval;
-    SANE_Bool  boolval;
-
-    // Option 2: mode
-    optnum = 2;
-    result = set_option_value_safe(optnum, settings.mode);
-
-    // Option 3: depth
-    optnum = 3;
-    intval = settings.depth;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 4: resolution
-    optnum = 4;
-    fixval = SANE_FIX((double) settings.resolution);
-    result = set_option_value_safe(optnum, &fixval);
-
-    // Option 6: threshold, probably unused
-    optnum = 6;
-    fixval = SANE_FIX((double) settings.threshold);
-    result = set_option_value_safe(optnum, &fixval);
-
-    // Option 7: sharpen
-    optnum = 7;
-    boolval = settings.sharpen;
-    result = set_option_value_safe(optnum, &boolval);
-
-    // Option 8: shading-analysis
-    optnum = 8;
-    boolval = settings.shading_analysis;
-    result = set_option_value_safe(optnum, &boolval);
-
-    // Option 9: fast-infrared
-    optnum = 9;
-    boolval = settings.fast_infrared;
-    result = set_option_value_safe(optnum, &boolval);
-
-    // Option 10: advcane
-    optnum = 10;
-    boolval = settings.auto_advance;
-    result = set_option_value_safe(optnum, &boolval);
-
-    // Option 11: calibration
-    optnum = 11;
-    result = set_option_value_safe(optnum, settings.calibration);
-
-    // Option 13: top-left x
-    optnum = 13;
-    fixval = SANE_FIX(settings.tl_x);
-    result = set_option_value_safe(optnum, &fixval);
-
-    // Option 14: top-left y
-    optnum = 14;
-    fixval = SANE_FIX(settings.tl_y);
-    result = set_option_value_safe(optnum, &fixval);
-
-    // Option 15: bottom-right x
-    optnum = 15;
-    fixval = SANE_FIX(settings.br_x);
-    result = set_option_value_safe(optnum, &fixval);
-
-    // Option 16: bottom-right y
-    optnum = 16;
-    fixval = SANE_FIX(settings.br_y);
-    result = set_option_value_safe(optnum, &fixval);
-
-    // Option 18: correct-shading
-    optnum = 18;
-    boolval = settings.correct_shading;
-    result = set_option_value_safe(optnum, &boolval);
-
-    // Option 19: correct-infrared
-    optnum = 19;
-    boolval = settings.correct_infrared;
-    result = set_option_value_safe(optnum, &boolval);
-
-    // Option 20: clean-image
-    optnum = 20;
-    boolval = settings.clean_image;
-    result = set_option_value_safe(optnum, &boolval);
-
-    // Option 21: gain-adjust
-    optnum = 21;
-    result = set_option_value_safe(optnum, settings.gain_adjust);
-
-    // Option 22: crop
-    optnum = 22;
-    result = set_option_value_safe(optnum, settings.crop);
-
-    // Option 23: smooth
-    optnum = 23;
-    intval = settings.smooth;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 27: preview
-    optnum = 27;
-    boolval = settings.preview;
-    result = set_option_value_safe(optnum, &boolval);
-
-    // Option 28: save-shading-data
-    optnum = 28;
-    boolval = settings.save_shading;
-    result = set_option_value_safe(optnum, &boolval);
-
-    // Option 29: save-ccdmask
-    optnum = 29;
-    boolval = settings.save_ccdmask;
-    result = set_option_value_safe(optnum, &boolval);
-
-    // Option 30: light
-    optnum = 30;
-    intval = settings.light;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 31: double-times
-    optnum = 31;
-    intval = settings.double_times;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 32: exposure-time-r
-    optnum = 32;
-    intval = settings.exposure_r;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 33: exposure-time-g
-    optnum = 33;
-    intval = settings.exposure_g;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 34: exposure-time-b
-    optnum = 34;
-    intval = settings.exposure_b;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 35: exposure-time-i
-    optnum = 35;
-    intval = settings.exposure_i;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 36: gain-r
-    optnum = 36;
-    intval = settings.gain_r;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 37: gain-g
-    optnum = 37;
-    intval = settings.gain_g;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 38: gain-b
-    optnum = 38;
-    intval = settings.gain_b;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 39: gain-i
-    optnum = 39;
-    intval = settings.gain_i;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 40: offset-r
-    optnum = 40;
-    intval = settings.offset_r;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 41: offset-g
-    optnum = 41;
-    intval = settings.offset_g;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 42: offset-b
-    optnum = 42;
-    intval = settings.offset_b;
-    result = set_option_value_safe(optnum, &intval);
-
-    // Option 43: offset-i
-    optnum = 43;
-    intval = settings.offset_i;
-    result = set_option_value_safe(optnum, &intval);
+set_field(ScanSettings* settings, OptionId id, double value)
+{
+    void* field = (char*) settings + option_table[id].offset;
+
+    switch (option_table[id].field) {
+        case FIELD_BOOL:   *(bool*) field = value != 0; break;
+        case FIELD_INT:    *(int*) field = (int) lround(value); break;
+        case FIELD_DOUBLE: *(double*) field = value; break;
+        default:           break;
+    }
+}
+
+// Reads a numeric option back from the device into its field.
+SANE_Status
+load_option(PiescanDevice* device, ScanSettings* settings, OptionId id)
+{
+    SANE_Word word;
+    SANE_Status status = get_option_value(device, device->option_index[id],
+                                          &word);
+
+    if (status == SANE_STATUS_GOOD) {
+        set_field(settings, id,
+                  device->option_desc[id]->type == SANE_TYPE_FIXED
+                  ? SANE_UNFIX(word) : (double) word);
+    }
+    return status;
+}
+
+SANE_Word
+encode_option(const PiescanDevice* device, const ScanSettings* settings,
+              OptionId id)
+{
+    const double value = get_field(settings, id);
+
+    switch (device->option_desc[id]->type) {
+        case SANE_TYPE_FIXED: return SANE_FIX(value);
+        case SANE_TYPE_BOOL:  return value != 0 ? SANE_TRUE : SANE_FALSE;
+        default:              return (SANE_Word) lround(value);
+    }
+}
+
+// Moves word into the option's range, onto its quantization step or to the
+// nearest listed value, the way the backend would, but before anything is
+// sent.
+SANE_Word
+constrain_word(const SANE_Option_Descriptor* opt, SANE_Word word)
+{
+    if (opt->type != SANE_TYPE_INT && opt->type != SANE_TYPE_FIXED) {
+        return word;
+    }
+
+    if (opt->constraint_type == SANE_CONSTRAINT_RANGE) {
+        const SANE_Range* range = opt->constraint.range;
+        if (word < range->min) word = range->min;
+        if (word > range->max) word = range->max;
+        if (range->quant > 0) {
+            int64_t steps = ((int64_t) word - range->min + range->quant / 2)
+                          / range->quant;
+            int64_t snapped = range->min + steps * range->quant;
+            if (snapped > range->max) snapped -= range->quant;
+            word = (SANE_Word) snapped;
+        }
+    } else if (opt->constraint_type == SANE_CONSTRAINT_WORD_LIST) {
+        const SANE_Word* list = opt->constraint.word_list;
+        SANE_Word best = word;
+        int64_t best_distance = INT64_MAX;
+        for (SANE_Int k = 1; k <= list[0]; ++k) {
+            int64_t distance = llabs((int64_t) list[k] - word);
+            if (distance < best_distance) {
+                best = list[k];
+                best_distance = distance;
+            }
+        }
+        word = best;
+    }
+
+    return word;
+}
+
+// A string the backend would reject fails here, before the scan starts
+// rather than partway into it.
+SANE_Status
+check_string(const SANE_Option_Descriptor* opt, const char* value)
+{
+    if (!value || strlen(value) >= (size_t) opt->size ||
+        strlen(value) >= OPTION_STRING_SIZE) {
+        fprintf(stderr, "Error: invalid value for option %s\n", opt->name);
+        return SANE_STATUS_INVAL;
+    }
+
+    if (opt->constraint_type == SANE_CONSTRAINT_STRING_LIST) {
+        for (const SANE_String_Const* s = opt->constraint.string_list; *s;
+             ++s) {
+            if (strcmp(*s, value) == 0) return SANE_STATUS_GOOD;
+        }
+        fprintf(stderr, "Error: option %s can't be \"%s\"\n", opt->name,
+                value);
+        return SANE_STATUS_INVAL;
+    }
+
+    return SANE_STATUS_GOOD;
 }
 
 void
-open_device()
+print_word(const SANE_Option_Descriptor* opt, SANE_Word word)
+{
+    if (opt->type == SANE_TYPE_FIXED) {
+        fprintf(stderr, "%.17g", SANE_UNFIX(word));
+    } else {
+        fprintf(stderr, "%d", word);
+    }
+}
+
+// Sends one option unless the device already has that value, counting it
+// in n_sent if it was sent and adding the SANE_INFO_* flags of the call to
+// info.
+SANE_Status
+push_option(PiescanDevice* device, OptionId id, const ScanSettings* settings,
+            SANE_Int* info, int* n_sent)
+{
+    const SANE_Option_Descriptor* opt = device->option_desc[id];
+    CachedOption* cached = &device->option_cache[id];
+    SANE_Word requested = 0, word = 0;
+    char* string = NULL;
+    SANE_Status status;
+
+    if (option_table[id].field == FIELD_STRING) {
+        string = *(char* const*) ((const char*) settings
+                                  + option_table[id].offset);
+        if ((status = check_string(opt, string))) return status;
+        if (cached->valid && strcmp(cached->string, string) == 0) {
+            return SANE_STATUS_GOOD;
+        }
+    } else {
+        requested = encode_option(device, settings, id);
+        word = constrain_word(opt, requested);
+        if (cached->valid && cached->word == word) {
+            return SANE_STATUS_GOOD;
+        }
+    }
+
+    fprintf(stderr, "\t%s\n", opt->name);
+    if (!string && word != requested) {
+        fprintf(stderr, "Warning: option %s can't be ", opt->name);
+        print_word(opt, requested);
+        fprintf(stderr, ", using ");
+        print_word(opt, word);
+        fprintf(stderr, "\n");
+    }
+
+    // Whatever the device holds after a failed set, it isn't known.
+    cached->valid = false;
+    status = set_option_value(device, device->option_index[id],
+                              string ? (void*) string : (void*) &word, info);
+    if (status != SANE_STATUS_GOOD) return status;
+
+    if (string) {
+        strcpy(cached->string, string);
+    } else {
+        cached->word = word;
+    }
+    cached->valid = true;
+    ++*n_sent;
+    return SANE_STATUS_GOOD;
+}
+
+// Sends the options that differ from what the device was last given,
+// counting them in n_sent. If the backend reports that setting an option
+// reloaded the others, they may no longer hold the cached values, so
+// everything is sent once more.
+SANE_Status
+set_options(PiescanDevice* device, const ScanSettings* settings, int* n_sent)
 {
+    SANE_Int info = 0;
     SANE_Status status;
-    const SANE_Device **device_list;
-    const char* devname = 0;
 
-    status = sane_get_devices (&device_list, SANE_FALSE);
+    for (int pass = 0; pass < 2; ++pass) {
+        info = 0;
+
+        for (int id = 0; id < N_OPTIONS; ++id) {
+            status = push_option(device, (OptionId) id, settings, &info,
+                                 n_sent);
+            if (status != SANE_STATUS_GOOD) return status;
+        }
+
+        if (!(info & SANE_INFO_RELOAD_OPTIONS)) break;
+        invalidate_options(device);
+    }
+
+    // Still reloading after a full pass: trust nothing next time either.
+    if (info & SANE_INFO_RELOAD_OPTIONS) {
+        invalidate_options(device);
+    }
+
+    return SANE_STATUS_GOOD;
+}
+
+// Sets *found to a copy of the full name of the device name selects, as
+// described for piescan_open().
+SANE_Status
+find_device(const char* name, char** found)
+{
+    const SANE_Device** list;
+    const char* match = NULL;
+    SANE_Status status;
+    int n_matches = 0;
+
+    *found = NULL;
+
+    pthread_mutex_lock(&sane_lock);
+    status = sane_get_devices(&list, SANE_FALSE);
+    for (size_t k = 0; status == SANE_STATUS_GOOD && list[k]; ++k) {
+        if (!name || strcmp(list[k]->name, name) == 0) {
+            match = list[k]->name;
+            n_matches = 1;
+            break;
+        }
+        if (strstr(list[k]->name, name)) {
+            match = list[k]->name;
+            ++n_matches;
+        }
+    }
+    if (status == SANE_STATUS_GOOD) {
+        *found = n_matches == 1 ? strdup(match)
+               : n_matches == 0 && name ? strdup(name) : NULL;
+    }
+    pthread_mutex_unlock(&sane_lock);
+
     if (status != SANE_STATUS_GOOD) {
         fprintf(stderr, "Error: %s\n", sane_strstatus(status));
-        piescan_exit(status);
+        return status;
+    }
+    if (n_matches > 1) {
+        fprintf(stderr, "Error: %d devices match %s\n", n_matches, name);
+        return SANE_STATUS_INVAL;
     }
-    if (!device_list[0]) {
-        fprintf (stderr, "no SANE devices found\n");
-        piescan_exit(status);
+    if (!name && n_matches == 0) {
+        fprintf(stderr, "no SANE devices found\n");
+        return SANE_STATUS_INVAL;
     }
+    if (!*found) return SANE_STATUS_NO_MEM;
 
-    devname = device_list[0]->name;
-    fprintf(stderr, "Device found: %s\n", devname);
+    if (!name) fprintf(stderr, "Device found: %s\n", *found);
+    return SANE_STATUS_GOOD;
+}
 
-    status = sane_open(devname, &device);
+SANE_Status
+open_device(PiescanDevice* device, const char* name)
+{
+    SANE_Status status = find_device(name, &device->name);
+    if (status != SANE_STATUS_GOOD) return status;
+
+    for (int attempt = 1;; ++attempt) {
+        status = sane_open(device->name, &device->handle);
+        if (status == SANE_STATUS_GOOD ||
+            !retry_after(&device->retry, status, attempt, device->name)) {
+            break;
+        }
+    }
 
     if (status != SANE_STATUS_GOOD) {
-        fprintf (stderr, "Failed to open device %s with error: %s\n",
-           devname, sane_strstatus(status));
-        piescan_exit(status);
+        fprintf(stderr, "Failed to open device %s with error: %s\n",
+                device->name, sane_strstatus(status));
+        device->handle = NULL;
     }
+    return status;
 }
 
-void
-scan_image(Image* im, ScanSettings settings)
+int
+piescan_scan_image(PiescanDevice* device, Image* im, ScanSettings settings)
+{
+    return scan_retrying(device, &settings, im, NULL, NULL);
+}
+
+int
+piescan_scan_stream(PiescanDevice* device, ScanSettings settings,
+                    ScanLineCallback callback, void* user)
+{
+    return scan_retrying(device, &settings, NULL, callback, user);
+}
+
+// How many whole lines the read buffer holds.
+size_t
+get_read_buffer_lines(size_t bytes_per_line)
+{
+    const char* env = getenv("PIESCAN_READ_BUFFER_MB");
+    size_t mb = env && atoi(env) > 0 ? (size_t) atoi(env) : READ_BUFFER_MB;
+    size_t lines = (mb << 20) / bytes_per_line;
+
+    // sane_read() takes the free space as a SANE_Int.
+    if (lines * bytes_per_line > INT32_MAX) {
+        lines = INT32_MAX / bytes_per_line;
+    }
+    return lines > 0 ? lines : 1;
+}
+
+// Runs a scan, starting it over from its first line after a transient
+// error as long as no lines have gone to the callback yet. The device may
+// have been reset, so the options are all sent again.
+SANE_Status
+scan_retrying(PiescanDevice* device, const ScanSettings* settings, Image* im,
+              ScanLineCallback callback, void* user)
+{
+    SANE_Status status;
+
+    for (int attempt = 1;; ++attempt) {
+        uint32_t n_delivered = 0;
+
+        status = scan_lines(device, settings, im, callback, user,
+                            &n_delivered);
+        if (status == SANE_STATUS_GOOD || n_delivered > 0 ||
+            !retry_after(&device->retry, status, attempt, "scan")) {
+            break;
+        }
+        invalidate_options(device);
+    }
+
+    return status;
+}
+
+// Read loop behind piescan_scan_image() and piescan_scan_stream(). The
+// backend may return any number of bytes per read, so reads go into a buffer
+// of many lines and every complete line in it is de-interleaved in one
+// batch, straight into im when one is given, otherwise into a scratch image
+// of the same number of lines. The batch is then passed on to the callback,
+// if any, and a trailing partial line is moved to the front to be completed
+// by the next read. Lines passed to the callback are counted in n_delivered.
+SANE_Status
+scan_lines(PiescanDevice* device, const ScanSettings* settings, Image* im,
+           ScanLineCallback callback, void* user, uint32_t* n_delivered)
 {
     SANE_Status status = SANE_STATUS_GOOD;
     SANE_Parameters parm;
     SANE_Byte* buffer;
-
-    set_options(settings);
-    fprintf(stderr, "Scanning image with settings: \n");
-    print_options();
+    Image* scratch = NULL;
+    int n_sent = 0;
+    int err;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    fprintf(stderr, "Changed options: \n");
+    status = set_options(device, settings, &n_sent);
+    if (status != SANE_STATUS_GOOD) return status;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fprintf(stderr, "Sent %d of %d options in %.1f ms\n", n_sent, N_OPTIONS,
+            1e3 * (t1.tv_sec - t0.tv_sec) + 1e-6 * (t1.tv_nsec - t0.tv_nsec));
 
 #ifdef SANE_STATUS_WARMING_UP
     do {
         fprintf(stderr, "Warming up...\n");
-        status = sane_start(device);
+        status = sane_start(device->handle);
     } while (status == SANE_STATUS_WARMING_UP);
 #else
     fprintf(stderr, "Starting device\n");
-    status = sane_start(device);
+    status = sane_start(device->handle);
 #endif
 
     if (status != SANE_STATUS_GOOD) {
         fprintf(stderr, "Error: %s\n", sane_strstatus(status));
-        sane_cancel(device);
-        piescan_exit(status);
+        goto done;
     }
 
-    status = sane_get_parameters(device, &parm);
+    status = sane_get_parameters(device->handle, &parm);
     if (status != SANE_STATUS_GOOD) {
         fprintf(stderr, "Error: %s\n", sane_strstatus(status));
-        sane_cancel(device);
-        piescan_exit(status);
+        goto done;
+    }
+    if (parm.depth != 16 || parm.bytes_per_line != parm.pixels_per_line * 8) {
+        fprintf(stderr, "Error: expected 16-bit RGBI, got %d bytes per line "
+                "of %d pixels\n", parm.bytes_per_line, parm.pixels_per_line);
+        status = SANE_STATUS_INVAL;
+        goto done;
     }
 
+    const size_t line_bytes = (size_t) parm.bytes_per_line;
+    const size_t buffer_lines = get_read_buffer_lines(line_bytes);
+    const size_t buffer_bytes = buffer_lines * line_bytes;
 
-    buffer = (SANE_Byte*) malloc(parm.bytes_per_line);
-    resize_image(im, parm.pixels_per_line, parm.lines);
+    if (device->read_buffer_size < buffer_bytes) {
+        free(device->read_buffer);
+        device->read_buffer = (SANE_Byte*) malloc(buffer_bytes);
+        device->read_buffer_size = device->read_buffer ? buffer_bytes : 0;
+    }
+    buffer = device->read_buffer;
+    if (!buffer) {
+        fprintf(stderr, "Error: unable to allocate the read buffer\n");
+        status = SANE_STATUS_NO_MEM;
+        goto done;
+    }
+    if (im) {
+        err = resize_image(im, parm.pixels_per_line, parm.lines);
+        if (!err && im->map) {
+            write_raw_frame_header(im->map->data, im->width, im->height, 16,
+                                   settings);
+        }
+    } else {
+        if (!device->scratch) device->scratch = new_image();
+        scratch = device->scratch;
+        err = scratch ? resize_image(scratch, parm.pixels_per_line,
+                                     buffer_lines)
+                      : ENOMEM;
+    }
+    if (err) {
+        status = err == ENOMEM ? SANE_STATUS_NO_MEM : SANE_STATUS_IO_ERROR;
+        goto done;
+    }
 
-    int len;
-    int line = 0;
+    // The references for this scan's settings, found once.
+    const float* dark[4] = {NULL, NULL, NULL, NULL};
+    const float* gain[4] = {NULL, NULL, NULL, NULL};
+    if (device->calibration) {
+        int n_found = 0;
+        for (int c = 0; c < 4; ++c) {
+            n_found += calibration_find(device->calibration, settings, c,
+                                        parm.pixels_per_line, &dark[c],
+                                        &gain[c]);
+        }
+        fprintf(stderr, "Calibration: %d of 4 channels corrected\n",
+                n_found);
+    }
 
-    while (1) {
-        status = sane_read(device, buffer, parm.bytes_per_line, &len);
+    // Without the light there is no infrared to find dust in.
+    DustFilter* dust = im && settings->light ? device->dust : NULL;
+    if (dust && dust_filter_start(dust, im->width, im->height) != 0) {
+        fprintf(stderr, "Warning: no memory for dust removal\n");
+        dust = NULL;
+    }
 
-        if (status == SANE_STATUS_EOF) break;
+    size_t fill = 0;
+    uint32_t line = 0;
+    size_t n_reads = 0;
+    int cancelled = 0;
 
-        if (status != SANE_STATUS_GOOD) {
-            fprintf(stderr, "Error: %s\n", sane_strstatus(status));
-            sane_cancel(device);
-            free(buffer);
-            piescan_exit(status);
+    while (!cancelled) {
+        SANE_Int len;
+        status = sane_read(device->handle, buffer + fill,
+                           (SANE_Int) (buffer_bytes - fill), &len);
+
+        if (status == SANE_STATUS_EOF) {
+            status = SANE_STATUS_GOOD;
+            break;
         }
 
-        if (len == 0) continue;
+        if (status != SANE_STATUS_GOOD) {
+            fprintf(stderr, "Error: %s after %u lines\n",
+                    sane_strstatus(status), line);
+            goto done;
+        }
 
-        fprintf(stderr, "Line %d of %d\t", line + 1, parm.lines);
+        ++n_reads;
+        fill += (size_t) len;
+
+        uint32_t n_lines = (uint32_t) (fill / line_bytes);
+        if (n_lines == 0) continue;
+
+        // A backend that sends more lines than it announced doesn't get to
+        // write past the planes.
+        if (im && line + n_lines > im->height) {
+            if (line < im->height) {
+                fprintf(stderr, "Warning: backend sent more than %u lines\n",
+                        im->height);
+            }
+            n_lines = im->height - line;
+            fill = (size_t) n_lines * line_bytes;
+            if (n_lines == 0) continue;
+        }
 
-        uint16_t* tmpbuf = (uint16_t*) buffer;
-        for (int i = 0; i < parm.pixels_per_line; ++i) {
-            im->r[i + line*parm.pixels_per_line] = tmpbuf[4*i];
-            im->g[i + line*parm.pixels_per_line] = tmpbuf[4*i + 1];
-            im->b[i + line*parm.pixels_per_line] = tmpbuf[4*i + 2];
-            im->i[i + line*parm.pixels_per_line] = tmpbuf[4*i + 3];
+        fprintf(stderr, "Lines %u-%u of %d\n", line + 1, line + n_lines,
+                parm.lines);
+
+        size_t offset = im ? (size_t) line*parm.pixels_per_line : 0;
+        Image* dest = im ? im : scratch;
+
+        // Whole lines are contiguous in both the buffer and the planes.
+        deinterleave_rgbi((const uint16_t*) buffer, dest->r + offset,
+                          dest->g + offset, dest->b + offset,
+                          dest->i + offset,
+                          (size_t) n_lines * parm.pixels_per_line,
+                          settings->swap_bytes);
+
+        // Corrected while the lines are still in cache.
+        uint16_t* planes[4] = {dest->r + offset, dest->g + offset,
+                               dest->b + offset, dest->i + offset};
+        for (int c = 0; c < 4; ++c) {
+            if (!dark[c]) continue;
+            calibration_correct(planes[c], parm.pixels_per_line, n_lines,
+                                dark[c], gain[c]);
         }
+        if (dust) dust_filter_lines(dust, im, line + n_lines);
+
+        if (callback) {
+            ScanLines lines = {
+                .width = parm.pixels_per_line,
+                .height = parm.lines,
+                .first_line = line,
+                .n_lines = n_lines,
+                .r = dest->r + offset,
+                .g = dest->g + offset,
+                .b = dest->b + offset,
+                .i = dest->i + offset,
+            };
+            *n_delivered += n_lines;
+            cancelled = callback(&lines, user);
+        }
+
+        line += n_lines;
+        fill -= (size_t) n_lines * line_bytes;
+        memmove(buffer, buffer + (size_t) n_lines * line_bytes, fill);
+    }
+
+    if (cancelled) {
+        fprintf(stderr, "Scan cancelled by consumer\n");
+        status = SANE_STATUS_CANCELLED;
+    } else if (fill > 0) {
+        fprintf(stderr, "Warning: dropped %zu bytes of an incomplete line\n",
+                fill);
+    }
+    fprintf(stderr, "Read %u lines in %zu reads\n", line, n_reads);
 
-        fprintf(stderr, "finished\n");
-        ++line;
+    if (dust && !cancelled) {
+        dust_filter_finish(dust, im, line);
+        fprintf(stderr, "Dust: %zu defective pixels cleaned\n",
+                dust_filter_count(dust));
     }
 
-    sane_cancel(device);
-    free(buffer);
+done:
+    sane_cancel(device->handle);
+
+    return status;
 }
 
 Image*
 new_image()
 {
-    Image* im = (Image*) malloc(sizeof(Image));
-    im->width = 0;
-    im->height = 0;
-    im->r = (uint16_t*) malloc(sizeof(uint16_t));
-    im->g = (uint16_t*) malloc(sizeof(uint16_t));
-    im->b = (uint16_t*) malloc(sizeof(uint16_t));
-    im->i = (uint16_t*) malloc(sizeof(uint16_t));
-
-    return im;
+    return (Image*) calloc(1, sizeof(Image));
 }
 
-void
+// The old samples aren't kept. Heap planes stay in the block they're in if
+// they fit.
+int
 resize_image(Image* im, uint32_t width, uint32_t height)
 {
+    release_planes(im);
     im->width = width;
     im->height = height;
-    im->r = (uint16_t*) realloc(im->r, im->width*im->height*sizeof(uint16_t));
-    im->g = (uint16_t*) realloc(im->g, im->width*im->height*sizeof(uint16_t));
-    im->b = (uint16_t*) realloc(im->b, im->width*im->height*sizeof(uint16_t));
-    im->i = (uint16_t*) realloc(im->i, im->width*im->height*sizeof(uint16_t));
+    return alloc_planes(im);
 }
 
 void
 free_image(Image* im)
 {
-    free(im->i);
-    free(im->r);
-    free(im->g);
-    free(im->b);
+    release_planes(im);
+    free_block(im);
+    free(im->filename);
     free(im);
 }
 
+int
+map_image(Image* im, const char* filename, const ImageMapOptions* opts)
+{
+    release_planes(im);
+    if (filename) free_block(im);
+
+    free(im->filename);
+    im->filename = filename ? strdup(filename) : NULL;
+    if (opts) {
+        im->map_options = *opts;
+    } else {
+        memset(&im->map_options, 0, sizeof(ImageMapOptions));
+    }
+
+    im->width = 0;
+    im->height = 0;
+    return alloc_planes(im);
+}
+
+int
+privatize_image(Image* im)
+{
+    if (!im->map) return 0;
+
+    sync_planes(im);
+    free_mmap_array(im->map);
+
+    int err = get_mmap_private_opts(&im->map, im->filename,
+                                    &im->map_options.mmap);
+    if (err) {
+        fprintf(stderr, "Error: unable to map %s: %s\n", im->filename,
+                strerror(err));
+        im->map = NULL;
+        im->r = NULL;
+        im->g = NULL;
+        im->b = NULL;
+        im->i = NULL;
+        return err;
+    }
+    set_mapped_planes(im);
+    return 0;
+}
+
+void
+set_mapped_planes(Image* im)
+{
+    uint8_t* base = (uint8_t*) im->map->data;
+    const size_t first = raw_frame_plane_offset(im->width, im->height, 16, 0);
+    const size_t stride = raw_frame_plane_offset(im->width, im->height, 16, 1)
+                        - first;
+
+    im->r = (uint16_t*) (base + first);
+    im->g = (uint16_t*) (base + first + stride);
+    im->b = (uint16_t*) (base + first + 2*stride);
+    im->i = (uint16_t*) (base + first + 3*stride);
+}
+
+// Replaces im's block with an anonymous mapping of at least size bytes,
+// which is page aligned and, unlike a large malloc(), can be asked for huge
+// pages. Returns 0 or ENOMEM, without a block.
+int
+alloc_block(Image* im, size_t size)
+{
+    const MmapOptions* opts = &im->map_options.mmap;
+    const size_t page = opts->hugepages ? HUGE_PAGE_SIZE
+                                        : (size_t) sysconf(_SC_PAGESIZE);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    free_block(im);
+
+    size = (size + page - 1) / page * page;
+#ifdef MAP_POPULATE
+    if (opts->populate) flags |= MAP_POPULATE;
+#endif
+    void* block = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (block == MAP_FAILED) return ENOMEM;
+#ifdef MADV_HUGEPAGE
+    if (opts->hugepages) madvise(block, size, MADV_HUGEPAGE);
+#endif
+
+    im->block = block;
+    im->block_size = size;
+    return 0;
+}
+
+void
+free_block(Image* im)
+{
+    if (im->block) munmap(im->block, im->block_size);
+    im->block = NULL;
+    im->block_size = 0;
+}
+
+// Planes only exist once the image has a size. Returns 0 or an errno value,
+// with no planes left allocated.
+int
+alloc_planes(Image* im)
+{
+    const size_t size = (size_t) im->width * im->height * sizeof(uint16_t);
+
+    if (size == 0) return 0;
+
+    if (!im->filename) {
+        const size_t stride = (size + PLANE_ALIGN - 1)
+                            / PLANE_ALIGN * PLANE_ALIGN;
+        if (im->block_size < 4 * stride) {
+            int err = alloc_block(im, 4 * stride);
+            if (err) return err;
+        }
+
+        uint8_t* base = (uint8_t*) im->block;
+        im->r = (uint16_t*) base;
+        im->g = (uint16_t*) (base + stride);
+        im->b = (uint16_t*) (base + 2*stride);
+        im->i = (uint16_t*) (base + 3*stride);
+        return 0;
+    }
+
+    int err = get_mmap_writer_opts(&im->map, im->filename,
+                                   raw_frame_size(im->width, im->height, 16),
+                                   &im->map_options.mmap);
+    if (err) {
+        fprintf(stderr, "Error: unable to map %s: %s\n", im->filename,
+                strerror(err));
+        im->map = NULL;
+        return err;
+    }
+    write_raw_frame_header(im->map->data, im->width, im->height, 16, NULL);
+    set_mapped_planes(im);
+    return 0;
+}
+
+void
+sync_planes(Image* im)
+{
+    if (!im->map || im->map_options.sync == IMAGE_SYNC_NONE) return;
+
+    sync_mmap_array(im->map, im->map_options.sync == IMAGE_SYNC_WAIT
+                             ? MS_SYNC : MS_ASYNC);
+}
+
+void
+release_planes(Image* im)
+{
+    // Heap planes leave their block for the next size to reuse.
+    if (im->map) {
+        sync_planes(im);
+        free_mmap_array(im->map);
+        im->map = NULL;
+    }
+    im->r = NULL;
+    im->g = NULL;
+    im->b = NULL;
+    im->i = NULL;
+}
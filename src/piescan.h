@@ -8,12 +8,49 @@ extern "C" {
 #include <stdbool.h>
 #include <inttypes.h>
 
+#include "mmaparray.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// Bit of a SANE_Status in PiescanRetry.statuses.
+#define PIESCAN_RETRY_ON(status) (1u << (status))
+
 
 
 /*****************************************************************************\
 | Type definitions                                                            |
 \*****************************************************************************/
 
+// An open scanner. Everything that talks to it takes the handle and returns
+// a SANE_Status, so an error ends the call, not the process.
+typedef struct PiescanDevice PiescanDevice;
+
+// A scanner as SANE lists it. SANE has no notion of serial numbers, but
+// backends put the bus address, and some the serial, into the name.
+typedef struct {
+    char* name;
+    char* vendor;
+    char* model;
+    char* type;
+} PiescanDeviceInfo;
+
+// How an operation that failed with one of statuses is retried: up to
+// attempts tries in all, waiting delay_ms before the first retry and backoff
+// times longer before each one after that, but never more than max_delay_ms.
+// A scan is retried from its first line, so a streaming scan is only retried
+// as long as nothing has been passed to its callback yet.
+typedef struct {
+    int attempts;         // 1 never retries
+    double delay_ms;
+    double backoff;
+    double max_delay_ms;
+    unsigned statuses;    // PIESCAN_RETRY_ON() of each SANE_Status to retry
+} PiescanRetry;
+
 typedef struct {
     // String options
     char* mode;
@@ -58,8 +95,25 @@ typedef struct {
     int offset_g;
     int offset_b;
     int offset_i;
+
+    // Host-side options, not sent to the device
+    bool swap_bytes;  // Backend delivers samples in non-native byte order
 } ScanSettings;
 
+// When file-backed image planes are written back to disk as they are
+// released.
+typedef enum {
+    IMAGE_SYNC_NONE = 0,  // Leave writeback to the kernel
+    IMAGE_SYNC_ASYNC,     // msync(MS_ASYNC): schedule writeback
+    IMAGE_SYNC_WAIT,      // msync(MS_SYNC): block until written
+} ImageSync;
+
+// Heap planes only use mmap.populate and mmap.hugepages.
+typedef struct {
+    MmapOptions mmap;  // How the frame file is created and mapped
+    ImageSync sync;
+} ImageMapOptions;
+
 typedef struct {
     uint32_t width;
     uint32_t height;
@@ -68,23 +122,119 @@ typedef struct {
     uint16_t* g;
     uint16_t* b;
     uint16_t* i;
+
+    // Raw frame file set up by map_image(); NULL for heap planes.
+    char* filename;
+    MmapArray* map;
+    ImageMapOptions map_options;
+
+    // Heap planes live in one block, each plane 64-byte aligned. It is kept
+    // when the image is resized within it, so an image reused frame after
+    // frame doesn't go back to the allocator or fault in fresh pages.
+    void* block;
+    size_t block_size;
 } Image;
 
+// A block of consecutive, de-interleaved scanlines as handed to a streaming
+// consumer. Each plane holds n_lines rows of width samples. The pointers are
+// only valid for the duration of the callback.
+typedef struct {
+    uint32_t width;
+    int32_t height;  // Total lines in the frame, -1 if the backend can't tell
+    uint32_t first_line;
+    uint32_t n_lines;
+
+    const uint16_t* r;
+    const uint16_t* g;
+    const uint16_t* b;
+    const uint16_t* i;
+} ScanLines;
+
+// Called for every block of scanlines as soon as it has been read. Returning
+// a nonzero value cancels the scan, which then returns SANE_STATUS_CANCELLED.
+typedef int (*ScanLineCallback)(const ScanLines* lines, void* user);
+
 
 
 /*****************************************************************************\
 | Function declarations                                                       |
 \*****************************************************************************/
 
-void piescan_open(void);
-void piescan_close(void);
-ScanSettings get_default_settings();
-void print_options();
-void scan_image(Image* im, ScanSettings settings);
+// Retries a busy device and I/O errors 5 times, starting at 20 ms.
+PiescanRetry piescan_retry_default(void);
+
+// Lists the scanners attached into a new array of *n_devices entries, for
+// piescan_free_device_list().
+int piescan_list_devices(PiescanDeviceInfo** devices, size_t* n_devices);
+void piescan_free_device_list(PiescanDeviceInfo* devices, size_t n_devices);
+
+// Opens the scanner called name, or the first one found if name is NULL.
+// A name that isn't listed selects the one device whose name contains it,
+// such as a serial or a bus address; if several do, that is an error.
+// Unlisted names nobody matches are passed on to the backend. Devices can
+// be opened and used from different threads at once. retry applies to
+// every operation on the device and may be NULL for
+// piescan_retry_default(). SANE is initialized by the first open and shut
+// down by the last close, so a process can reopen devices without paying
+// for that every time. Installs no signal handlers; to stop a scan from
+// one, call piescan_cancel().
+int piescan_open(PiescanDevice** device, const char* name,
+                 const PiescanRetry* retry);
+void piescan_close(PiescanDevice* device);
+const char* piescan_device_name(const PiescanDevice* device);
+
+// Description of a status returned by any of these.
+const char* piescan_strstatus(int status);
+
+// Stops the scan in progress, which returns SANE_STATUS_CANCELLED. Safe to
+// call from a signal handler or another thread.
+void piescan_cancel(PiescanDevice* device);
+
+// Corrects the scans from then on with the dark and flat references the
+// calibration has for their settings, line by line as they are read; see
+// calibration.h. Channels it has no references for are left as scanned.
+// NULL stops correcting. The calibration must stay open while in use.
+struct Calibration;
+void piescan_set_calibration(PiescanDevice* device,
+                             const struct Calibration* calibration);
+
+// Removes dust and scratches from the scans from then on, as found in their
+// infrared plane, band by band while the lines come in; see dust.h. Only
+// piescan_scan_image() scans with the light on are cleaned, as the filter
+// looks across lines. NULL stops it. Returns 0 or ENOMEM.
+struct DustOptions;
+int piescan_set_dust_removal(PiescanDevice* device,
+                             const struct DustOptions* options);
+
+// Fills settings with the defaults, reading the scan area from the device.
+int piescan_get_default_settings(PiescanDevice* device,
+                                 ScanSettings* settings);
+int piescan_print_options(PiescanDevice* device);
+
+int piescan_scan_image(PiescanDevice* device, Image* im,
+                       ScanSettings settings);
+int piescan_scan_stream(PiescanDevice* device, ScanSettings settings,
+                        ScanLineCallback callback, void* user);
+
+// resize_image(), map_image() and privatize_image() return 0 or an errno
+// value, leaving im without planes on failure. A new image has no planes
+// until it is resized.
 Image* new_image();
-void resize_image(Image* im, uint32_t width, uint32_t height);
+int resize_image(Image* im, uint32_t width, uint32_t height);
 void free_image(Image* im);
 
+// Backs the planes of im with a raw frame file (see rawframe.h) from the next
+// resize on, which piescan_scan_image() does once the frame size is known,
+// so scanlines are de-interleaved straight into the page cache and the scan
+// settings end up in the file's header. opts may be NULL. Passing a NULL
+// filename goes back to heap planes. Either way the current planes are
+// released.
+int map_image(Image* im, const char* filename, const ImageMapOptions* opts);
+
+// Swaps file-backed planes for a copy-on-write view of the same file, so
+// in-place processing such as normalize_image() leaves the file untouched.
+int privatize_image(Image* im);
+
 
 
 #ifdef __cplusplus
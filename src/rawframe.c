@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rawframe.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+#define ALIGN_UP(n) (((n) + RAWFRAME_ALIGN - 1) / RAWFRAME_ALIGN * RAWFRAME_ALIGN)
+
+_Static_assert(sizeof(RawFrameHeader) <= RAWFRAME_ALIGN,
+               "raw frame header must fit its padding");
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+static void pack_string(char* dst, const char* src);
+static void pack_settings(RawFrameSettings* dst, const ScanSettings* src);
+static void unpack_settings(ScanSettings* dst, RawFrameSettings* src);
+static int check_header(const RawFrameHeader* header, size_t file_size);
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+size_t
+raw_frame_size(uint32_t width, uint32_t height, int bit_depth)
+{
+    return raw_frame_plane_offset(width, height, bit_depth, 4);
+}
+
+size_t
+raw_frame_plane_offset(uint32_t width, uint32_t height, int bit_depth,
+                       int channel)
+{
+    size_t stride = ALIGN_UP((size_t) width * height * (bit_depth / 8));
+    return ALIGN_UP(sizeof(RawFrameHeader)) + (size_t) channel * stride;
+}
+
+void
+write_raw_frame_header(void* base, uint32_t width, uint32_t height,
+                       int bit_depth, const ScanSettings* settings)
+{
+    RawFrameHeader* header = (RawFrameHeader*) base;
+
+    memset(header, 0, sizeof(RawFrameHeader));
+    memcpy(header->magic, RAWFRAME_MAGIC, sizeof(RAWFRAME_MAGIC));
+    header->version = RAWFRAME_VERSION;
+    header->header_size = raw_frame_plane_offset(width, height, bit_depth, 0);
+    header->byte_order = RAWFRAME_BYTE_ORDER;
+    header->bit_depth = bit_depth;
+    header->n_channels = 4;
+    memcpy(header->channels, "RGBI", 4);
+    header->width = width;
+    header->height = height;
+    header->plane_stride = raw_frame_plane_offset(width, height, bit_depth, 1)
+                         - raw_frame_plane_offset(width, height, bit_depth, 0);
+
+    if (settings) {
+        pack_settings(&header->settings, settings);
+    }
+}
+
+int
+open_raw_frame(RawFrame** frame, const char* filename)
+{
+    const MmapOptions opts = {MMAP_ACCESS_SEQUENTIAL, false, false, false};
+    MmapArray* map = NULL;
+
+    *frame = NULL;
+    int err = get_mmap_reader_opts(&map, filename, &opts);
+    if (err) {
+        return err;
+    }
+
+    err = check_header((const RawFrameHeader*) map->data, map->size);
+    if (err) {
+        free_mmap_array(map);
+        return err;
+    }
+
+    RawFrame* result = (RawFrame*) calloc(1, sizeof(RawFrame));
+    if (!result) {
+        free_mmap_array(map);
+        return ENOMEM;
+    }
+
+    // The mapping is read-only, so the plane and string pointers are only
+    // non-const to fit the Image and ScanSettings types.
+    RawFrameHeader* header = (RawFrameHeader*) map->data;
+    uint8_t* base = (uint8_t*) map->data;
+    result->map = map;
+    result->header = header;
+    for (int c = 0; c < 4; ++c) {
+        result->planes[c] = base + header->header_size
+                                 + c * header->plane_stride;
+    }
+    if (header->bit_depth == 16) {
+        result->im.width = header->width;
+        result->im.height = header->height;
+        result->im.r = (uint16_t*) result->planes[0];
+        result->im.g = (uint16_t*) result->planes[1];
+        result->im.b = (uint16_t*) result->planes[2];
+        result->im.i = (uint16_t*) result->planes[3];
+    }
+    unpack_settings(&result->settings, &header->settings);
+
+    *frame = result;
+    return 0;
+}
+
+void
+close_raw_frame(RawFrame* frame)
+{
+    free_mmap_array(frame->map);
+    free(frame);
+}
+
+void
+pack_string(char* dst, const char* src)
+{
+    if (src) {
+        strncpy(dst, src, RAWFRAME_STRING_SIZE - 1);
+    }
+}
+
+void
+pack_settings(RawFrameSettings* dst, const ScanSettings* src)
+{
+    pack_string(dst->mode, src->mode);
+    pack_string(dst->calibration, src->calibration);
+    pack_string(dst->gain_adjust, src->gain_adjust);
+    pack_string(dst->crop, src->crop);
+
+    dst->resolution = src->resolution;
+    dst->threshold = src->threshold;
+    dst->tl_x = src->tl_x;
+    dst->tl_y = src->tl_y;
+    dst->br_x = src->br_x;
+    dst->br_y = src->br_y;
+
+    dst->sharpen = src->sharpen;
+    dst->shading_analysis = src->shading_analysis;
+    dst->fast_infrared = src->fast_infrared;
+    dst->auto_advance = src->auto_advance;
+    dst->correct_shading = src->correct_shading;
+    dst->correct_infrared = src->correct_infrared;
+    dst->clean_image = src->clean_image;
+    dst->preview = src->preview;
+    dst->save_shading = src->save_shading;
+    dst->save_ccdmask = src->save_ccdmask;
+    dst->swap_bytes = src->swap_bytes;
+
+    dst->depth = src->depth;
+    dst->smooth = src->smooth;
+    dst->light = src->light;
+    dst->double_times = src->double_times;
+    dst->exposure_r = src->exposure_r;
+    dst->exposure_g = src->exposure_g;
+    dst->exposure_b = src->exposure_b;
+    dst->exposure_i = src->exposure_i;
+    dst->gain_r = src->gain_r;
+    dst->gain_g = src->gain_g;
+    dst->gain_b = src->gain_b;
+    dst->gain_i = src->gain_i;
+    dst->offset_r = src->offset_r;
+    dst->offset_g = src->offset_g;
+    dst->offset_b = src->offset_b;
+    dst->offset_i = src->offset_i;
+}
+
+void
+unpack_settings(ScanSettings* dst, RawFrameSettings* src)
+{
+    dst->mode = src->mode;
+    dst->calibration = src->calibration;
+    dst->gain_adjust = src->gain_adjust;
+    dst->crop = src->crop;
+
+    dst->resolution = src->resolution;
+    dst->threshold = src->threshold;
+    dst->tl_x = src->tl_x;
+    dst->tl_y = src->tl_y;
+    dst->br_x = src->br_x;
+    dst->br_y = src->br_y;
+
+    dst->sharpen = src->sharpen;
+    dst->shading_analysis = src->shading_analysis;
+    dst->fast_infrared = src->fast_infrared;
+    dst->auto_advance = src->auto_advance;
+    dst->correct_shading = src->correct_shading;
+    dst->correct_infrared = src->correct_infrared;
+    dst->clean_image = src->clean_image;
+    dst->preview = src->preview;
+    dst->save_shading = src->save_shading;
+    dst->save_ccdmask = src->save_ccdmask;
+    dst->swap_bytes = src->swap_bytes;
+
+    dst->depth = src->depth;
+    dst->smooth = src->smooth;
+    dst->light = src->light;
+    dst->double_times = src->double_times;
+    dst->exposure_r = src->exposure_r;
+    dst->exposure_g = src->exposure_g;
+    dst->exposure_b = src->exposure_b;
+    dst->exposure_i = src->exposure_i;
+    dst->gain_r = src->gain_r;
+    dst->gain_g = src->gain_g;
+    dst->gain_b = src->gain_b;
+    dst->gain_i = src->gain_i;
+    dst->offset_r = src->offset_r;
+    dst->offset_g = src->offset_g;
+    dst->offset_b = src->offset_b;
+    dst->offset_i = src->offset_i;
+}
+
+int
+check_header(const RawFrameHeader* header, size_t file_size)
+{
+    if (file_size < sizeof(RawFrameHeader) ||
+        memcmp(header->magic, RAWFRAME_MAGIC, sizeof(RAWFRAME_MAGIC)) != 0) {
+        return EINVAL;
+    }
+    if (header->byte_order != RAWFRAME_BYTE_ORDER) {
+        return header->byte_order == __builtin_bswap16(RAWFRAME_BYTE_ORDER)
+               ? ENOTSUP : EINVAL;
+    }
+    if (header->version != RAWFRAME_VERSION ||
+        (header->bit_depth != 16 && header->bit_depth != 32) ||
+        header->n_channels != 4 || memcmp(header->channels, "RGBI", 4) != 0) {
+        return EINVAL;
+    }
+
+    // Every plane must lie within the file on a RAWFRAME_ALIGN boundary, and
+    // every string must end. The sizes are the file's word, so none of the
+    // arithmetic on them may wrap.
+    uint64_t plane_bytes, end;
+    if (__builtin_mul_overflow((uint64_t) header->width, header->height,
+                               &plane_bytes) ||
+        __builtin_mul_overflow(plane_bytes, header->bit_depth / 8,
+                               &plane_bytes) ||
+        __builtin_mul_overflow(header->plane_stride, 3, &end) ||
+        __builtin_add_overflow(end, header->header_size, &end) ||
+        __builtin_add_overflow(end, plane_bytes, &end) ||
+        end > file_size) {
+        return EINVAL;
+    }
+    if (header->header_size < sizeof(RawFrameHeader) ||
+        header->header_size % RAWFRAME_ALIGN != 0 ||
+        header->plane_stride % RAWFRAME_ALIGN != 0 ||
+        header->plane_stride < plane_bytes) {
+        return EINVAL;
+    }
+    const RawFrameSettings* s = &header->settings;
+    if (!memchr(s->mode, 0, RAWFRAME_STRING_SIZE) ||
+        !memchr(s->calibration, 0, RAWFRAME_STRING_SIZE) ||
+        !memchr(s->gain_adjust, 0, RAWFRAME_STRING_SIZE) ||
+        !memchr(s->crop, 0, RAWFRAME_STRING_SIZE)) {
+        return EINVAL;
+    }
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+#ifndef RAWFRAME_H
+#define RAWFRAME_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "piescan.h"
+#include "mmaparray.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// A raw frame file is a RawFrameHeader padded to RAWFRAME_ALIGN bytes,
+// followed by the r, g, b and i planes of width x height samples in the
+// producer's byte order, each starting on a RAWFRAME_ALIGN boundary. Samples
+// are uint16_t for bit depth 16 (scans) and float for bit depth 32 (merged
+// HDR frames).
+#define RAWFRAME_MAGIC "PIESCAN"
+#define RAWFRAME_VERSION 1
+#define RAWFRAME_ALIGN 4096
+#define RAWFRAME_BYTE_ORDER 0x0102
+
+#define RAWFRAME_STRING_SIZE 32
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+// ScanSettings with fixed-size fields. Strings are NUL-terminated.
+typedef struct {
+    char mode[RAWFRAME_STRING_SIZE];
+    char calibration[RAWFRAME_STRING_SIZE];
+    char gain_adjust[RAWFRAME_STRING_SIZE];
+    char crop[RAWFRAME_STRING_SIZE];
+
+    int32_t resolution;
+    int32_t threshold;
+    double tl_x;
+    double tl_y;
+    double br_x;
+    double br_y;
+
+    uint8_t sharpen;
+    uint8_t shading_analysis;
+    uint8_t fast_infrared;
+    uint8_t auto_advance;
+    uint8_t correct_shading;
+    uint8_t correct_infrared;
+    uint8_t clean_image;
+    uint8_t preview;
+    uint8_t save_shading;
+    uint8_t save_ccdmask;
+    uint8_t swap_bytes;
+    uint8_t reserved[5];
+
+    int32_t depth;
+    int32_t smooth;
+    int32_t light;
+    int32_t double_times;
+    int32_t exposure_r;
+    int32_t exposure_g;
+    int32_t exposure_b;
+    int32_t exposure_i;
+    int32_t gain_r;
+    int32_t gain_g;
+    int32_t gain_b;
+    int32_t gain_i;
+    int32_t offset_r;
+    int32_t offset_g;
+    int32_t offset_b;
+    int32_t offset_i;
+} RawFrameSettings;
+
+typedef struct {
+    char magic[8];             // RAWFRAME_MAGIC
+    uint32_t version;          // RAWFRAME_VERSION
+    uint32_t header_size;      // Offset of the r plane
+    uint16_t byte_order;       // RAWFRAME_BYTE_ORDER as the producer stores it
+    uint16_t bit_depth;        // 16: uint16_t samples, 32: float samples
+    uint16_t n_channels;       // 4
+    char channels[6];          // "RGBI", NUL padded
+    uint32_t width;
+    uint32_t height;
+    uint64_t plane_stride;     // Bytes from the start of one plane to the next
+    RawFrameSettings settings;
+} RawFrameHeader;
+
+// A raw frame file opened for reading. Everything points into the mapping
+// and stays valid until close_raw_frame(). im is only filled in for 16-bit
+// frames, and must not be passed to free_image() or resized.
+typedef struct {
+    MmapArray* map;
+    const RawFrameHeader* header;
+    const void* planes[4];
+    Image im;
+    ScanSettings settings;
+} RawFrame;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+// File layout for a width x height frame of the given bit depth.
+size_t raw_frame_size(uint32_t width, uint32_t height, int bit_depth);
+size_t raw_frame_plane_offset(uint32_t width, uint32_t height, int bit_depth,
+                              int channel);
+
+// Fills in the header at the start of a raw frame mapping. settings may be
+// NULL to leave them zeroed until known.
+void write_raw_frame_header(void* base, uint32_t width, uint32_t height,
+                            int bit_depth, const ScanSettings* settings);
+
+// Maps a raw frame file and checks its header. Returns 0 or an errno value:
+// EINVAL for anything that isn't a version 1 raw frame, ENOTSUP for a frame
+// written on a machine of the other byte order.
+int open_raw_frame(RawFrame** frame, const char* filename);
+void close_raw_frame(RawFrame* frame);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // RAWFRAME_H
@@ -0,0 +1,610 @@
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "response.h"
+#include "threadpool.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+#define N_PATCHES (RESPONSE_GRID * RESPONSE_GRID)
+
+// A patch with a sample at or above this is clipped: the response already
+// bends before full scale.
+#define CLIP_LEVEL 65000
+
+// Patches whose signal rises by less than this over a series' exposures
+// are too dark for a meaningful slope.
+#define MIN_SPAN 1024.0
+
+#define LINE_SIZE 256
+
+static const char channel_names[4] = {'r', 'g', 'b', 'i'};
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+// What is kept of a frame.
+typedef struct {
+    int light;
+    int exposure[4];
+    int gain[4];
+    int offset[4];
+    float means[4][N_PATCHES];    // NAN for an empty or clipped patch
+} FrameStats;
+
+struct ResponseBuilder {
+    FrameStats* frames;
+    size_t n_frames;
+    size_t capacity;
+
+    uint32_t width;
+    uint32_t height;
+    int resolution;
+
+    pthread_mutex_t lock;
+};
+
+typedef struct {
+    const uint16_t* planes[4];
+    uint32_t width;
+    uint32_t height;
+    const uint8_t* columns;       // Patch column of each sample column
+    FrameStats* stats;
+} PatchJob;
+
+// One channel's lines through each patch at one gain and offset.
+typedef struct {
+    int gain;
+    int offset;
+    size_t n_fitted;
+    bool fitted[N_PATCHES];
+    double slope[N_PATCHES];
+    double intercept[N_PATCHES];
+} Series;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+static void patch_means(void* arg, size_t channel);
+static int compare_doubles(const void* a, const void* b);
+static double median(double* values, size_t n);
+static size_t fit_series(const ResponseBuilder* builder, int channel,
+                         Series* series, double* linearity);
+static bool fit_channel(const ResponseBuilder* builder, int channel,
+                        ResponseChannel* out);
+static void interpolate(const ResponseChannel* channel, int gain,
+                        const ResponseGain** lo, const ResponseGain** hi,
+                        double* t);
+static int channel_index(char name);
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+ResponseBuilder*
+new_response_builder(void)
+{
+    ResponseBuilder* builder =
+        (ResponseBuilder*) calloc(1, sizeof(ResponseBuilder));
+    if (builder) pthread_mutex_init(&builder->lock, NULL);
+    return builder;
+}
+
+void
+free_response_builder(ResponseBuilder* builder)
+{
+    if (!builder) return;
+
+    free(builder->frames);
+    pthread_mutex_destroy(&builder->lock);
+    free(builder);
+}
+
+size_t
+response_builder_count(const ResponseBuilder* builder)
+{
+    return builder->n_frames;
+}
+
+// Sums one channel's patches line by line, so the plane is read in order.
+void
+patch_means(void* arg, size_t channel)
+{
+    PatchJob* job = (PatchJob*) arg;
+    const uint16_t* plane = job->planes[channel];
+    uint64_t sums[N_PATCHES] = {0};
+    uint64_t counts[N_PATCHES] = {0};
+    bool clipped[N_PATCHES] = {false};
+
+    for (uint32_t y = 0; y < job->height; ++y) {
+        const uint16_t* line = plane + (size_t) y * job->width;
+        const size_t row = (size_t) y * RESPONSE_GRID / job->height
+                         * RESPONSE_GRID;
+        for (uint32_t x = 0; x < job->width; ++x) {
+            const size_t p = row + job->columns[x];
+            sums[p] += line[x];
+            counts[p] += 1;
+            clipped[p] |= line[x] >= CLIP_LEVEL;
+        }
+    }
+
+    float* means = job->stats->means[channel];
+    for (size_t p = 0; p < N_PATCHES; ++p) {
+        means[p] = counts[p] && !clipped[p]
+                 ? (float) ((double) sums[p] / counts[p]) : NAN;
+    }
+}
+
+int
+response_builder_add(ResponseBuilder* builder, const Image* im,
+                     const ScanSettings* settings)
+{
+    FrameStats stats = {
+        .light = settings->light,
+        .exposure = {settings->exposure_r, settings->exposure_g,
+                     settings->exposure_b, settings->exposure_i},
+        .gain = {settings->gain_r, settings->gain_g, settings->gain_b,
+                 settings->gain_i},
+        .offset = {settings->offset_r, settings->offset_g, settings->offset_b,
+                   settings->offset_i},
+    };
+    int err = 0;
+
+    if (im->width == 0 || im->height == 0) return EINVAL;
+
+    uint8_t* columns = (uint8_t*) malloc(im->width);
+    if (!columns) return ENOMEM;
+    for (uint32_t x = 0; x < im->width; ++x) {
+        columns[x] = (uint8_t) ((size_t) x * RESPONSE_GRID / im->width);
+    }
+
+    // The means are taken outside the lock; only keeping them is shared.
+    PatchJob job = {
+        .planes = {im->r, im->g, im->b, im->i},
+        .width = im->width,
+        .height = im->height,
+        .columns = columns,
+        .stats = &stats,
+    };
+    parallel_for(4, patch_means, &job);
+    free(columns);
+
+    pthread_mutex_lock(&builder->lock);
+    if (builder->n_frames == 0) {
+        builder->width = im->width;
+        builder->height = im->height;
+        builder->resolution = settings->resolution;
+    } else if (im->width != builder->width || im->height != builder->height ||
+               settings->resolution != builder->resolution) {
+        err = EINVAL;
+    }
+    if (!err && builder->n_frames == builder->capacity) {
+        size_t capacity = builder->capacity ? 2 * builder->capacity : 32;
+        FrameStats* grown = (FrameStats*)
+            realloc(builder->frames, capacity * sizeof(FrameStats));
+        if (grown) {
+            builder->frames = grown;
+            builder->capacity = capacity;
+        } else {
+            err = ENOMEM;
+        }
+    }
+    if (!err) builder->frames[builder->n_frames++] = stats;
+    pthread_mutex_unlock(&builder->lock);
+
+    return err;
+}
+
+int
+compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Reorders values.
+double
+median(double* values, size_t n)
+{
+    qsort(values, n, sizeof(double), compare_doubles);
+    return n % 2 ? values[n / 2] : 0.5 * (values[n / 2 - 1] + values[n / 2]);
+}
+
+// Least-squares line of every patch through the lit frames of the series'
+// gain and offset. Raises linearity to the largest residual seen, relative
+// to the signal at the longest exposure. Returns the patches fitted.
+size_t
+fit_series(const ResponseBuilder* builder, int channel, Series* series,
+           double* linearity)
+{
+    size_t n_fitted = 0;
+
+    for (size_t p = 0; p < N_PATCHES; ++p) {
+        double n = 0, se = 0, sm = 0, see = 0, sem = 0;
+        double e_min = INFINITY, e_max = 0;
+
+        for (size_t k = 0; k < builder->n_frames; ++k) {
+            const FrameStats* f = &builder->frames[k];
+            if (f->light == 0 || f->gain[channel] != series->gain ||
+                f->offset[channel] != series->offset ||
+                isnan(f->means[channel][p])) {
+                continue;
+            }
+            double e = f->exposure[channel];
+            double m = f->means[channel][p];
+            n += 1;
+            se += e;
+            sm += m;
+            see += e * e;
+            sem += e * m;
+            e_min = fmin(e_min, e);
+            e_max = fmax(e_max, e);
+        }
+
+        double var = n * see - se * se;
+        series->fitted[p] = false;
+        if (n < 2 || e_max <= e_min || var <= 0) continue;
+
+        double slope = (n * sem - se * sm) / var;
+        double intercept = (sm - slope * se) / n;
+        if (slope * (e_max - e_min) < MIN_SPAN) continue;
+
+        for (size_t k = 0; k < builder->n_frames; ++k) {
+            const FrameStats* f = &builder->frames[k];
+            if (f->light == 0 || f->gain[channel] != series->gain ||
+                f->offset[channel] != series->offset ||
+                isnan(f->means[channel][p])) {
+                continue;
+            }
+            double fit = intercept + slope * f->exposure[channel];
+            double deviation = fabs(f->means[channel][p] - fit)
+                             / (slope * e_max);
+            *linearity = fmax(*linearity, deviation);
+        }
+
+        series->fitted[p] = true;
+        series->slope[p] = slope;
+        series->intercept[p] = intercept;
+        ++n_fitted;
+    }
+    return n_fitted;
+}
+
+bool
+fit_channel(const ResponseBuilder* builder, int channel, ResponseChannel* out)
+{
+    Series* series = NULL;
+    size_t n_series = 0;
+    double linearity = 0;
+    bool valid = false;
+
+    memset(out, 0, sizeof(ResponseChannel));
+
+    // Every gain and offset the lit frames used, as a series.
+    series = (Series*) calloc(builder->n_frames ? builder->n_frames : 1,
+                              sizeof(Series));
+    double* values = (double*) malloc(N_PATCHES * 2 * sizeof(double));
+    if (!series || !values) goto done;
+
+    for (size_t k = 0; k < builder->n_frames; ++k) {
+        const FrameStats* f = &builder->frames[k];
+        bool known = f->light == 0;
+        for (size_t s = 0; !known && s < n_series; ++s) {
+            known = series[s].gain == f->gain[channel] &&
+                    series[s].offset == f->offset[channel];
+        }
+        if (known) continue;
+        Series* s = &series[n_series++];
+        s->gain = f->gain[channel];
+        s->offset = f->offset[channel];
+        s->n_fitted = fit_series(builder, channel, s, &linearity);
+    }
+
+    // Gains ascending; a slope per patch and gain, averaged over offsets.
+    int gains[RESPONSE_MAX_GAINS];
+    size_t n_gains = 0;
+    for (size_t s = 0; s < n_series; ++s) {
+        if (series[s].n_fitted == 0) continue;
+        size_t k = 0;
+        while (k < n_gains && gains[k] < series[s].gain) ++k;
+        if (k < n_gains && gains[k] == series[s].gain) continue;
+        if (n_gains == RESPONSE_MAX_GAINS) continue;
+        memmove(&gains[k + 1], &gains[k], (n_gains - k) * sizeof(int));
+        gains[k] = series[s].gain;
+        ++n_gains;
+    }
+    if (n_gains == 0) goto done;
+
+    double base[N_PATCHES];
+    for (size_t g = 0; g < n_gains; ++g) {
+        double slopes[N_PATCHES] = {0};
+        int counts[N_PATCHES] = {0};
+        for (size_t s = 0; s < n_series; ++s) {
+            if (series[s].gain != gains[g]) continue;
+            for (size_t p = 0; p < N_PATCHES; ++p) {
+                if (!series[s].fitted[p]) continue;
+                slopes[p] += series[s].slope[p];
+                counts[p] += 1;
+            }
+        }
+
+        // The curve is the typical ratio of a patch's slopes.
+        size_t n = 0;
+        for (size_t p = 0; p < N_PATCHES; ++p) {
+            if (g == 0) {
+                base[p] = counts[p] ? slopes[p] / counts[p] : NAN;
+                if (counts[p]) {
+                    out->peak_rate = fmax(out->peak_rate, base[p]);
+                }
+            } else if (counts[p] && !isnan(base[p])) {
+                values[n++] = slopes[p] / counts[p] / base[p];
+            }
+        }
+        if (g > 0 && n == 0) continue;
+
+        // Black levels are typical intercepts, fitted linear in offset.
+        double so = 0, sb = 0, soo = 0, sob = 0, n_offsets = 0;
+        for (size_t s = 0; s < n_series; ++s) {
+            if (series[s].gain != gains[g] || series[s].n_fitted == 0) {
+                continue;
+            }
+            size_t m = 0;
+            for (size_t p = 0; p < N_PATCHES; ++p) {
+                if (series[s].fitted[p]) {
+                    values[N_PATCHES + m++] = series[s].intercept[p];
+                }
+            }
+            double o = series[s].offset;
+            double b = median(values + N_PATCHES, m);
+            so += o;
+            sb += b;
+            soo += o * o;
+            sob += o * b;
+            n_offsets += 1;
+        }
+        double var = n_offsets * soo - so * so;
+        double per_offset = var > 0 ? (n_offsets * sob - so * sb) / var : 0;
+
+        ResponseGain* gain = &out->gains[out->n_gains++];
+        gain->gain = gains[g];
+        gain->factor = g == 0 ? 1.0 : median(values, n);
+        gain->black = (sb - per_offset * so) / n_offsets;
+        gain->black_per_offset = per_offset;
+    }
+
+    out->base_gain = gains[0];
+    out->linearity = linearity;
+    valid = out->peak_rate > 0;
+
+done:
+    out->valid = valid;
+    free(values);
+    free(series);
+    return valid;
+}
+
+int
+response_builder_fit(ResponseBuilder* builder, ResponseProfile* profile)
+{
+    int n_valid = 0;
+
+    pthread_mutex_lock(&builder->lock);
+    for (int c = 0; c < 4; ++c) {
+        n_valid += fit_channel(builder, c, &profile->channels[c]);
+    }
+    pthread_mutex_unlock(&builder->lock);
+    return n_valid;
+}
+
+int
+write_response_profile(const ResponseProfile* profile, const char* filename)
+{
+    FILE* file = fopen(filename, "w");
+    int err = 0;
+
+    if (!file) {
+        err = errno;
+        fprintf(stderr, "Error: unable to write %s: %s\n", filename,
+                strerror(err));
+        return err;
+    }
+
+    fprintf(file, "# piescan scanner response, see response.h\n"
+                  "response %d\n"
+                  "# channel <c> <base gain> <peak rate> <linearity>\n"
+                  "# gain <c> <gain> <factor> <black> "
+                  "<black per offset step>\n", RESPONSE_VERSION);
+    for (int c = 0; c < 4; ++c) {
+        const ResponseChannel* channel = &profile->channels[c];
+        if (!channel->valid) continue;
+
+        fprintf(file, "channel %c %d %.9g %.9g\n", channel_names[c],
+                channel->base_gain, channel->peak_rate, channel->linearity);
+        for (size_t k = 0; k < channel->n_gains; ++k) {
+            const ResponseGain* gain = &channel->gains[k];
+            fprintf(file, "gain %c %d %.9g %.9g %.9g\n", channel_names[c],
+                    gain->gain, gain->factor, gain->black,
+                    gain->black_per_offset);
+        }
+    }
+
+    if (ferror(file)) err = EIO;
+    if (fclose(file) != 0 && !err) err = errno;
+    if (err) {
+        fprintf(stderr, "Error: unable to write %s: %s\n", filename,
+                strerror(err));
+    }
+    return err;
+}
+
+int
+channel_index(char name)
+{
+    for (int c = 0; c < 4; ++c) {
+        if (channel_names[c] == name) return c;
+    }
+    return -1;
+}
+
+int
+read_response_profile(ResponseProfile* profile, const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+    char line[LINE_SIZE];
+    bool versioned = false;
+    int err = 0;
+
+    memset(profile, 0, sizeof(ResponseProfile));
+    if (!file) {
+        err = errno;
+        fprintf(stderr, "Error: unable to read %s: %s\n", filename,
+                strerror(err));
+        return err;
+    }
+
+    while (!err && fgets(line, sizeof(line), file)) {
+        ResponseGain gain;
+        ResponseChannel header = {0};
+        char name;
+        int version;
+        int c;
+
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        } else if (sscanf(line, "response %d", &version) == 1) {
+            versioned = version == RESPONSE_VERSION;
+            if (!versioned) err = EINVAL;
+        } else if (!versioned) {
+            err = EINVAL;
+        } else if (sscanf(line, "channel %c %d %lf %lf", &name,
+                          &header.base_gain, &header.peak_rate,
+                          &header.linearity) == 4 &&
+                   (c = channel_index(name)) >= 0 &&
+                   !profile->channels[c].valid) {
+            header.valid = true;
+            profile->channels[c] = header;
+        } else if (sscanf(line, "gain %c %d %lf %lf %lf", &name, &gain.gain,
+                          &gain.factor, &gain.black,
+                          &gain.black_per_offset) == 5 &&
+                   (c = channel_index(name)) >= 0 &&
+                   profile->channels[c].valid &&
+                   profile->channels[c].n_gains < RESPONSE_MAX_GAINS &&
+                   gain.factor > 0 &&
+                   (profile->channels[c].n_gains == 0 ||
+                    gain.gain > profile->channels[c].gains[
+                        profile->channels[c].n_gains - 1].gain)) {
+            ResponseChannel* channel = &profile->channels[c];
+            channel->gains[channel->n_gains++] = gain;
+        } else {
+            err = EINVAL;
+        }
+    }
+    if (!err && !versioned) err = EINVAL;
+
+    // A channel without its curve is no use.
+    for (int c = 0; !err && c < 4; ++c) {
+        if (profile->channels[c].valid && profile->channels[c].n_gains == 0) {
+            err = EINVAL;
+        }
+    }
+
+    fclose(file);
+    if (err) {
+        fprintf(stderr, "Error: %s is not a scanner response profile\n",
+                filename);
+    }
+    return err;
+}
+
+// The measured gains either side of gain and how far between them it is.
+void
+interpolate(const ResponseChannel* channel, int gain, const ResponseGain** lo,
+            const ResponseGain** hi, double* t)
+{
+    const ResponseGain* gains = channel->gains;
+    const size_t n = channel->n_gains;
+    size_t k = 0;
+
+    while (k + 1 < n && gains[k + 1].gain <= gain) ++k;
+    *lo = &gains[k];
+    *hi = k + 1 < n ? &gains[k + 1] : &gains[k];
+    *t = *hi == *lo || gain <= gains[k].gain ? 0.0
+       : (double) (gain - (*lo)->gain) / ((*hi)->gain - (*lo)->gain);
+}
+
+double
+response_factor(const ResponseChannel* channel, int gain)
+{
+    const ResponseGain* lo;
+    const ResponseGain* hi;
+    double t;
+
+    if (channel->n_gains == 0) return 1.0;
+    interpolate(channel, gain, &lo, &hi, &t);
+    return lo->factor + t * (hi->factor - lo->factor);
+}
+
+double
+response_black(const ResponseChannel* channel, int gain, int offset)
+{
+    const ResponseGain* lo;
+    const ResponseGain* hi;
+    double t;
+
+    if (channel->n_gains == 0) return 0.0;
+    interpolate(channel, gain, &lo, &hi, &t);
+    double b_lo = lo->black + lo->black_per_offset * offset;
+    double b_hi = hi->black + hi->black_per_offset * offset;
+    return b_lo + t * (b_hi - b_lo);
+}
+
+double
+response_rate(const ResponseChannel* channel, double level, int exposure,
+              int gain, int offset)
+{
+    if (!channel->valid || exposure <= 0) return 0.0;
+    return (level - response_black(channel, gain, offset))
+         / (response_factor(channel, gain) * exposure);
+}
+
+bool
+response_pick(const ResponseChannel* channel, double rate, int offset,
+              double target, int max_exposure, int* exposure, int* gain)
+{
+    if (!channel->valid || channel->n_gains == 0 || !(rate > 0) ||
+        max_exposure < 1) {
+        return false;
+    }
+
+    for (size_t k = 0; k < channel->n_gains; ++k) {
+        const ResponseGain* g = &channel->gains[k];
+        double e = (target - g->black - g->black_per_offset * offset)
+                 / (g->factor * rate);
+        if (e <= max_exposure) {
+            *exposure = e >= 1.0 ? (int) e : 1;
+            *gain = g->gain;
+            return true;
+        }
+    }
+
+    *exposure = max_exposure;
+    *gain = channel->gains[channel->n_gains - 1].gain;
+    return true;
+}
@@ -0,0 +1,129 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "piescan.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// The scanner's response is modelled per channel as
+//
+//     sample = black(gain, offset) + factor(gain) * rate * exposure
+//
+// where rate is the scene's brightness in counts per unit of exposure time
+// at the lowest gain measured, factor(gain) the gain curve relative to that
+// gain and black(gain, offset) linear in offset. A profile holds the fit of
+// factor and black at each gain a sweep measured, and is interpolated
+// between them.
+//
+// A profile file is text, one record per line, '#' starting a comment:
+//
+//     response <version>
+//     channel <c> <base gain> <peak rate> <linearity>
+//     gain <c> <gain> <factor> <black> <black per offset step>
+//
+// where c is one of r, g, b, i.
+#define RESPONSE_VERSION 1
+#define RESPONSE_SUFFIX ".response"
+
+// Frames are reduced to the means of a grid of patches per channel, so a
+// frame's statistics are a few kB whatever its size.
+#define RESPONSE_GRID 16
+
+// Most gain settings a profile holds per channel.
+#define RESPONSE_MAX_GAINS 64
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef struct {
+    int gain;
+    double factor;             // Of the base gain's response
+    double black;              // Level at offset 0 and no light
+    double black_per_offset;   // Added per offset step
+} ResponseGain;
+
+typedef struct {
+    bool valid;               // False if the sweep didn't measure it
+    int base_gain;
+    double peak_rate;         // Brightest patch, counts per exposure unit
+    double linearity;         // Largest deviation from a straight line,
+                              // relative to the signal
+    size_t n_gains;
+    ResponseGain gains[RESPONSE_MAX_GAINS];   // Ascending gain
+} ResponseChannel;
+
+typedef struct {
+    ResponseChannel channels[4];   // r, g, b, i
+} ResponseProfile;
+
+typedef struct ResponseBuilder ResponseBuilder;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+ResponseBuilder* new_response_builder(void);
+void free_response_builder(ResponseBuilder* builder);
+
+// Reduces im, scanned with settings, to its patch means and keeps those;
+// im itself can go as soon as this returns. The first frame fixes the size
+// and resolution; other frames are rejected with EINVAL. Safe to call from
+// several threads at once. Returns 0 or an errno value.
+int response_builder_add(ResponseBuilder* builder, const Image* im,
+                         const ScanSettings* settings);
+size_t response_builder_count(const ResponseBuilder* builder);
+
+// Fits the profile to the frames added so far. Per channel, every patch
+// that stayed unclipped for at least two exposures of a gain and offset
+// gives a line; their slopes give the gain curve and their intercepts the
+// black levels. A channel without a line at some gain is left invalid.
+// Returns the number of valid channels.
+int response_builder_fit(ResponseBuilder* builder, ResponseProfile* profile);
+
+// Return 0 or an errno value, after printing what went wrong; EINVAL for
+// a file that isn't a profile.
+int write_response_profile(const ResponseProfile* profile,
+                           const char* filename);
+int read_response_profile(ResponseProfile* profile, const char* filename);
+
+// The curve at any gain, interpolated between the measured ones and held
+// flat beyond them.
+double response_factor(const ResponseChannel* channel, int gain);
+double response_black(const ResponseChannel* channel, int gain, int offset);
+
+// The rate of a scene that read level on channel with the given settings.
+// Returns 0 or less if level is at or below black.
+double response_rate(const ResponseChannel* channel, double level,
+                     int exposure, int gain, int offset);
+
+// Picks the settings that bring a scene of rate to target: the lowest
+// measured gain that gets there within max_exposure, as exposure adds less
+// noise than gain, and otherwise the highest gain at max_exposure. The
+// offset is kept. Returns false if the channel or rate is unusable.
+bool response_pick(const ResponseChannel* channel, double rate, int offset,
+                   double target, int max_exposure, int* exposure,
+                   int* gain);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // RESPONSE_H
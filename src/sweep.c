@@ -0,0 +1,520 @@
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sweep.h"
+#include "autoexposure.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+#define MM_PER_INCH 25.4
+
+// Light option value for "on"; the pie backend's lamp setting.
+#define LIGHT_ON 4
+
+#define LINE_SIZE 1024
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+static char* trim(char* s);
+static int parse_values(SweepValues* values, const char* key,
+                        const char* text);
+static int parse_lights(SweepValues* values, const char* text);
+static int parse_bool(bool* value, const char* key, const char* text);
+static int parse_doubles(double* values, size_t n, const char* key,
+                         const char* text);
+static int channel_of(const char* key, const char* base);
+static size_t list_length(const SweepValues* lists, const char* name);
+static int value_at(const SweepValues* values, size_t k);
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+void
+sweep_config_default(SweepConfig* config)
+{
+    memset(config, 0, sizeof(SweepConfig));
+
+    config->resolution = 7200;
+    config->lights = (SweepValues) {2, {LIGHT_ON, 0}};
+    parse_values(&config->exposures[0], "exposure", "linear(3000, 280, 26)");
+    config->exposures[1] = config->exposures[0];
+    config->exposures[2] = config->exposures[0];
+    parse_values(&config->exposures[3], "exposure", "linear(700, 372, 26)");
+    for (int c = 0; c < 4; ++c) {
+        config->gains[c] = (SweepValues) {1, {0}};
+        config->offsets[c] = (SweepValues) {1, {0}};
+    }
+
+    strcpy(config->output, ".");
+    strcpy(config->prefix, "test");
+    config->raw = true;
+    config->png = true;
+    config->tiff_compression = 1;
+    config->hdr = true;
+    config->resume = true;
+    config->auto_brackets = 1;
+    config->auto_ratio = 4.0;
+    config->auto_target = 0.9;
+    config->preview_resolution = 300;
+    config->dust_threshold = 0.3;
+
+    config->exposure_line_us = 1.0;
+    config->light_change_s = 30.0;
+}
+
+char*
+trim(char* s)
+{
+    while (isspace((unsigned char) *s)) ++s;
+
+    char* end = s + strlen(s);
+    while (end > s && isspace((unsigned char) end[-1])) --end;
+    *end = '\0';
+
+    return s;
+}
+
+int
+parse_values(SweepValues* values, const char* key, const char* text)
+{
+    double start, step;
+    int count;
+    char tail;
+
+    if (sscanf(text, " linear ( %lf , %lf , %d ) %c", &start, &step, &count,
+               &tail) == 3 ||
+        sscanf(text, " geometric ( %lf , %lf , %d ) %c", &start, &step,
+               &count, &tail) == 3) {
+        const bool linear = strstr(text, "linear") != NULL;
+
+        if (count < 1 || count > SWEEP_MAX_VALUES ||
+            (!linear && step <= 0)) {
+            fprintf(stderr, "Error: %s: bad schedule %s\n", key, text);
+            return -1;
+        }
+        values->n = (size_t) count;
+        for (int k = 0; k < count; ++k) {
+            values->values[k] = (int) lround(linear ? start + step * k
+                                                    : start * pow(step, k));
+        }
+        return 0;
+    }
+
+    // A comma separated list.
+    const char* p = text;
+    values->n = 0;
+    while (*p) {
+        char* end;
+        long v = strtol(p, &end, 10);
+        while (isspace((unsigned char) *end)) ++end;
+
+        if (end == p || (*end && *end != ',') ||
+            values->n == SWEEP_MAX_VALUES) {
+            fprintf(stderr, "Error: %s: expected a list of at most %d "
+                    "integers, linear(...) or geometric(...), not %s\n", key,
+                    SWEEP_MAX_VALUES, text);
+            return -1;
+        }
+        values->values[values->n++] = (int) v;
+        p = *end ? end + 1 : end;
+    }
+
+    if (values->n == 0) {
+        fprintf(stderr, "Error: %s: empty list\n", key);
+        return -1;
+    }
+    return 0;
+}
+
+int
+parse_lights(SweepValues* values, const char* text)
+{
+    char copy[LINE_SIZE];
+    char* save = NULL;
+
+    snprintf(copy, sizeof(copy), "%s", text);
+    values->n = 0;
+
+    for (char* item = strtok_r(copy, ",", &save); item;
+         item = strtok_r(NULL, ",", &save)) {
+        item = trim(item);
+        if (values->n == SWEEP_MAX_VALUES) break;
+
+        if (strcmp(item, "on") == 0) {
+            values->values[values->n++] = LIGHT_ON;
+        } else if (strcmp(item, "off") == 0) {
+            values->values[values->n++] = 0;
+        } else {
+            char* end;
+            long v = strtol(item, &end, 10);
+            if (end == item || *end) {
+                fprintf(stderr, "Error: light: expected on, off or a number, "
+                        "not %s\n", item);
+                return -1;
+            }
+            values->values[values->n++] = (int) v;
+        }
+    }
+
+    if (values->n == 0) {
+        fprintf(stderr, "Error: light: empty list\n");
+        return -1;
+    }
+    return 0;
+}
+
+int
+parse_bool(bool* value, const char* key, const char* text)
+{
+    if (strcmp(text, "yes") == 0 || strcmp(text, "true") == 0 ||
+        strcmp(text, "1") == 0) {
+        *value = true;
+    } else if (strcmp(text, "no") == 0 || strcmp(text, "false") == 0 ||
+               strcmp(text, "0") == 0) {
+        *value = false;
+    } else {
+        fprintf(stderr, "Error: %s: expected yes or no, not %s\n", key, text);
+        return -1;
+    }
+    return 0;
+}
+
+int
+parse_doubles(double* values, size_t n, const char* key, const char* text)
+{
+    const char* p = text;
+
+    for (size_t k = 0; k < n; ++k) {
+        char* end;
+        values[k] = strtod(p, &end);
+        while (isspace((unsigned char) *end)) ++end;
+
+        if (end == p || (k + 1 < n ? *end != ',' : *end != '\0')) {
+            fprintf(stderr, "Error: %s: expected %zu comma separated "
+                    "numbers, not %s\n", key, n, text);
+            return -1;
+        }
+        p = end + 1;
+    }
+    return 0;
+}
+
+// 0-3 for base_r ... base_i, 4 for base itself, -1 for anything else.
+int
+channel_of(const char* key, const char* base)
+{
+    static const char suffixes[] = "rgbi";
+    size_t n = strlen(base);
+
+    if (strncmp(key, base, n) != 0) return -1;
+    if (key[n] == '\0') return 4;
+    if (key[n] == '_' && key[n + 1] && !key[n + 2]) {
+        const char* c = strchr(suffixes, key[n + 1]);
+        return c ? (int) (c - suffixes) : -1;
+    }
+    return -1;
+}
+
+int
+sweep_config_set(SweepConfig* config, const char* key, const char* value)
+{
+    SweepValues* lists[3] = {config->exposures, config->gains,
+                             config->offsets};
+    const char* bases[3] = {"exposure", "gain", "offset"};
+
+    for (int l = 0; l < 3; ++l) {
+        int c = channel_of(key, bases[l]);
+        if (c < 0) continue;
+
+        SweepValues values;
+        if (parse_values(&values, key, value) != 0) return -1;
+        for (int k = 0; k < 4; ++k) {
+            if (c == 4 || c == k) lists[l][k] = values;
+        }
+        return 0;
+    }
+
+    if (strcmp(key, "resolution") == 0) {
+        config->resolution = atoi(value);
+        if (config->resolution <= 0) {
+            fprintf(stderr, "Error: resolution: %s\n", value);
+            return -1;
+        }
+    } else if (strcmp(key, "roi") == 0) {
+        if (parse_doubles(config->roi, 4, key, value) != 0) return -1;
+        config->has_roi = config->roi[2] > config->roi[0] &&
+                          config->roi[3] > config->roi[1];
+    } else if (strcmp(key, "light") == 0) {
+        return parse_lights(&config->lights, value);
+    } else if (strcmp(key, "devices") == 0) {
+        snprintf(config->devices, SWEEP_PATH_SIZE, "%s", value);
+    } else if (strcmp(key, "output") == 0) {
+        snprintf(config->output, SWEEP_PATH_SIZE, "%s", value);
+    } else if (strcmp(key, "prefix") == 0) {
+        snprintf(config->prefix, SWEEP_PATH_SIZE, "%s", value);
+    } else if (strcmp(key, "raw") == 0) {
+        return parse_bool(&config->raw, key, value);
+    } else if (strcmp(key, "png") == 0) {
+        return parse_bool(&config->png, key, value);
+    } else if (strcmp(key, "tiff") == 0) {
+        return parse_bool(&config->tiff, key, value);
+    } else if (strcmp(key, "tiff_compression") == 0) {
+        config->tiff_compression = atoi(value);
+    } else if (strcmp(key, "hdr") == 0) {
+        return parse_bool(&config->hdr, key, value);
+    } else if (strcmp(key, "resume") == 0) {
+        return parse_bool(&config->resume, key, value);
+    } else if (strcmp(key, "calibrate") == 0) {
+        return parse_bool(&config->calibrate, key, value);
+    } else if (strcmp(key, "response") == 0) {
+        return parse_bool(&config->response, key, value);
+    } else if (strcmp(key, "auto_exposure") == 0) {
+        return parse_bool(&config->auto_exposure, key, value);
+    } else if (strcmp(key, "auto_brackets") == 0) {
+        config->auto_brackets = (size_t) strtoul(value, NULL, 10);
+    } else if (strcmp(key, "auto_ratio") == 0) {
+        config->auto_ratio = strtod(value, NULL);
+    } else if (strcmp(key, "auto_target") == 0) {
+        config->auto_target = strtod(value, NULL);
+    } else if (strcmp(key, "preview_resolution") == 0) {
+        config->preview_resolution = atoi(value);
+    } else if (strcmp(key, "response_profile") == 0) {
+        snprintf(config->response_profile, SWEEP_PATH_SIZE, "%s", value);
+    } else if (strcmp(key, "dust") == 0) {
+        return parse_bool(&config->dust, key, value);
+    } else if (strcmp(key, "dust_threshold") == 0) {
+        config->dust_threshold = strtod(value, NULL);
+    } else if (strcmp(key, "calibration") == 0) {
+        snprintf(config->calibration, SWEEP_PATH_SIZE, "%s", value);
+    } else if (strcmp(key, "first") == 0) {
+        config->first = (size_t) strtoul(value, NULL, 10);
+    } else if (strcmp(key, "line_us") == 0) {
+        double model[2];
+        if (parse_doubles(model, 2, key, value) != 0) return -1;
+        config->line_us = model[0];
+        config->exposure_line_us = model[1];
+    } else if (strcmp(key, "light_change_s") == 0) {
+        config->light_change_s = strtod(value, NULL);
+    } else {
+        fprintf(stderr, "Error: unknown sweep setting %s\n", key);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+sweep_config_load(SweepConfig* config, const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+    char line[LINE_SIZE];
+    int line_number = 0;
+    int status = 0;
+
+    if (!file) {
+        fprintf(stderr, "Error: unable to open %s\n", filename);
+        return -1;
+    }
+
+    while (status == 0 && fgets(line, sizeof(line), file)) {
+        ++line_number;
+
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        char* text = trim(line);
+        if (!*text) continue;
+
+        char* eq = strchr(text, '=');
+        if (!eq) {
+            fprintf(stderr, "Error: %s:%d: expected key = value\n", filename,
+                    line_number);
+            status = -1;
+            break;
+        }
+        *eq = '\0';
+
+        status = sweep_config_set(config, trim(text), trim(eq + 1));
+        if (status != 0) {
+            fprintf(stderr, "\tat %s:%d\n", filename, line_number);
+        }
+    }
+
+    fclose(file);
+    return status;
+}
+
+// The length a set of per-channel lists pairs up to, or 0 if they can't.
+size_t
+list_length(const SweepValues* lists, const char* name)
+{
+    size_t n = 1;
+
+    for (int c = 0; c < 4; ++c) {
+        if (lists[c].n == 1) continue;
+        if (n != 1 && lists[c].n != n) {
+            fprintf(stderr, "Error: %s lists of %zu and %zu values\n", name,
+                    n, lists[c].n);
+            return 0;
+        }
+        n = lists[c].n;
+    }
+    return n;
+}
+
+int
+sweep_config_check(const SweepConfig* config)
+{
+    if (!list_length(config->exposures, "exposure") ||
+        !list_length(config->gains, "gain") ||
+        !list_length(config->offsets, "offset")) {
+        return -1;
+    }
+    if (config->lights.n == 0) {
+        fprintf(stderr, "Error: no light values\n");
+        return -1;
+    }
+    // References built from corrected frames would be wrong.
+    if (config->calibrate && config->calibration[0]) {
+        fprintf(stderr, "Error: calibrate and calibration can't be used "
+                "together\n");
+        return -1;
+    }
+    if (config->auto_exposure &&
+        (config->auto_brackets < 1 ||
+         config->auto_brackets > AUTO_MAX_BRACKETS ||
+         !(config->auto_ratio >= 1) || !(config->auto_target > 0) ||
+         config->auto_target > 1 || config->preview_resolution <= 0)) {
+        fprintf(stderr, "Error: auto exposure needs 1-%d brackets, a ratio "
+                "of at least 1, a target within 0-1 and a preview "
+                "resolution\n", AUTO_MAX_BRACKETS);
+        return -1;
+    }
+    if (config->tiff &&
+        (config->tiff_compression < 0 || config->tiff_compression > 9)) {
+        fprintf(stderr, "Error: tiff_compression must be within 0-9\n");
+        return -1;
+    }
+    if (config->dust &&
+        !(config->dust_threshold > 0 && config->dust_threshold < 1)) {
+        fprintf(stderr, "Error: dust_threshold must be within 0-1\n");
+        return -1;
+    }
+    return 0;
+}
+
+int
+value_at(const SweepValues* values, size_t k)
+{
+    return values->values[values->n == 1 ? 0 : k];
+}
+
+int
+sweep_plan(SweepPlan* plan, const SweepConfig* config,
+           const ScanSettings* base)
+{
+    memset(plan, 0, sizeof(SweepPlan));
+    if (sweep_config_check(config) != 0) return -1;
+
+    const size_t n_exposures = list_length(config->exposures, "exposure");
+    const size_t n_gains = list_length(config->gains, "gain");
+    const size_t n_offsets = list_length(config->offsets, "offset");
+    const size_t n_lights = config->lights.n;
+
+    plan->n_groups = n_lights * n_gains * n_offsets;
+    plan->n_points = plan->n_groups * n_exposures;
+    plan->points = (SweepPoint*) calloc(plan->n_points, sizeof(SweepPoint));
+    if (!plan->points) return -1;
+
+    ScanSettings settings = *base;
+    if (config->resolution > 0) settings.resolution = config->resolution;
+    if (config->has_roi) {
+        settings.tl_x = config->roi[0];
+        settings.tl_y = config->roi[1];
+        settings.br_x = config->roi[2];
+        settings.br_y = config->roi[3];
+    }
+
+    SweepPoint* point = plan->points;
+    size_t group = 0;
+
+    for (size_t l = 0; l < n_lights; ++l) {
+        settings.light = config->lights.values[l];
+
+        for (size_t g = 0; g < n_gains; ++g) {
+            settings.gain_r = value_at(&config->gains[0], g);
+            settings.gain_g = value_at(&config->gains[1], g);
+            settings.gain_b = value_at(&config->gains[2], g);
+            settings.gain_i = value_at(&config->gains[3], g);
+
+            for (size_t o = 0; o < n_offsets; ++o, ++group) {
+                settings.offset_r = value_at(&config->offsets[0], o);
+                settings.offset_g = value_at(&config->offsets[1], o);
+                settings.offset_b = value_at(&config->offsets[2], o);
+                settings.offset_i = value_at(&config->offsets[3], o);
+
+                for (size_t e = 0; e < n_exposures; ++e, ++point) {
+                    settings.exposure_r = value_at(&config->exposures[0], e);
+                    settings.exposure_g = value_at(&config->exposures[1], e);
+                    settings.exposure_b = value_at(&config->exposures[2], e);
+                    settings.exposure_i = value_at(&config->exposures[3], e);
+
+                    point->index = (size_t) (point - plan->points);
+                    point->group = group;
+                    point->step = e;
+                    point->settings = settings;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+void
+sweep_plan_free(SweepPlan* plan)
+{
+    free(plan->points);
+    memset(plan, 0, sizeof(SweepPlan));
+}
+
+double
+sweep_estimate(const SweepPlan* plan, const SweepConfig* config,
+               const bool* skip)
+{
+    double total = 0;
+    int light = -1;
+
+    for (size_t k = 0; k < plan->n_points; ++k) {
+        if (skip && skip[k]) continue;
+
+        const ScanSettings* s = &plan->points[k].settings;
+        double lines = (s->br_y - s->tl_y) / MM_PER_INCH * s->resolution;
+        int longest = s->exposure_r;
+        if (s->exposure_g > longest) longest = s->exposure_g;
+        if (s->exposure_b > longest) longest = s->exposure_b;
+        if (s->exposure_i > longest) longest = s->exposure_i;
+
+        total += lines * (config->line_us + config->exposure_line_us * longest)
+               / 1e6;
+        if (s->light != light) {
+            total += config->light_change_s;
+            light = s->light;
+        }
+    }
+
+    return total;
+}
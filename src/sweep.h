@@ -0,0 +1,186 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "piescan.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// A sweep is the grid light x gain x offset x exposure. Each of these is a
+// list; per-channel lists (exposure_r, gain_g, ...) pair up by position, and
+// a list of one value goes with every position. A config file holds one
+// "key = value" per line, '#' starts a comment, and the same pairs can be
+// given as key=value arguments. Keys:
+//
+//     resolution = 7200               dpi
+//     roi = 0, 0, 36.8, 25.4          tl-x, tl-y, br-x, br-y in mm
+//     light = on, off                 on, off or the light option's value
+//     exposure = linear(3000, 280, 26)
+//     exposure_i = geometric(700, 1.12, 26)
+//     gain = 0, 19, 40                also gain_r ... gain_i
+//     offset = 0                      also offset_r ... offset_i
+//     devices = all                   scanners to drive at once: all, or
+//                                     names or parts of them such as a
+//                                     serial, comma separated; the first
+//                                     one found if empty
+//     output = scans                  directory for raw/, png/, tiff/ and
+//                                     hdr/, in a subdirectory per device if
+//                                     several
+//     prefix = test                   start of every file name
+//     raw = yes                       keep each exposure as a raw frame
+//     png = yes                       normalized 16-bit PNG per channel
+//     tiff = no                       normalized 16-bit RGBI tiled BigTIFF
+//                                     with a pyramid of smaller copies
+//     tiff_compression = 1            deflate level, 0 for none
+//     hdr = yes                       merge each group's exposures
+//     first = 0                       point to start at
+//     calibrate = no                  build dark and flat references from
+//                                     the sweep's light off and on frames,
+//                                     scanned without film, and write them
+//                                     to <output>/<prefix>.pcal
+//     calibration = test.pcal         correct every scan with those; a
+//                                     relative path is in output
+//     response = no                   fit the scanner's exposure, gain and
+//                                     offset response to the sweep and
+//                                     write <output>/<prefix>.response
+//     auto_exposure = no              pick exposures and gains from a
+//                                     preview instead: the shortest listed
+//                                     exposure starts it, the longest is
+//                                     the limit; kept in
+//                                     <output>/<prefix>.auto for resuming
+//     auto_brackets = 1               full-resolution exposures per group
+//     auto_ratio = 4                  between them, the first putting the
+//                                     highlights at auto_target
+//     auto_target = 0.9               of full scale
+//     preview_resolution = 300        dpi
+//     response_profile = test.response
+//                                     gain curve to pick gains with; a
+//                                     relative path is in output
+//     dust = no                       clean dust and scratches found in
+//                                     the infrared channel from r, g, b
+//     dust_threshold = 0.3            infrared drop, as a fraction of the
+//                                     local level, that marks a defect
+//     resume = yes                    skip points the journal has as done
+//     line_us = 0, 1.0                runtime model: fixed time per line
+//                                     plus time per exposure unit
+//     light_change_s = 30             runtime model: cost of a lamp switch
+//
+// exposure sets all four channels; lists are comma separated or one of
+// linear(start, step, count) and geometric(start, ratio, count).
+#define SWEEP_MAX_VALUES 256
+#define SWEEP_PATH_SIZE 256
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef struct {
+    size_t n;
+    int values[SWEEP_MAX_VALUES];
+} SweepValues;
+
+typedef struct {
+    // Shared by every point; 0 or an empty roi keeps the device's own.
+    int resolution;
+    bool has_roi;
+    double roi[4];
+
+    SweepValues lights;
+    SweepValues exposures[4];  // r, g, b, i
+    SweepValues gains[4];
+    SweepValues offsets[4];
+
+    char devices[SWEEP_PATH_SIZE];
+    char output[SWEEP_PATH_SIZE];
+    char prefix[SWEEP_PATH_SIZE];
+    bool raw;
+    bool png;
+    bool tiff;
+    int tiff_compression;
+    bool hdr;
+    size_t first;
+    bool resume;
+    bool calibrate;
+    char calibration[SWEEP_PATH_SIZE];  // Empty for none
+    bool response;
+    bool auto_exposure;
+    size_t auto_brackets;
+    double auto_ratio;
+    double auto_target;
+    int preview_resolution;
+    char response_profile[SWEEP_PATH_SIZE];  // Empty for none
+    bool dust;
+    double dust_threshold;
+
+    double line_us;            // Per line, whatever the exposure
+    double exposure_line_us;   // Per line and unit of the longest exposure
+    double light_change_s;
+} SweepConfig;
+
+// One frame of the sweep. Points of a group share light, gains and offsets
+// and differ only in exposure, which is what an HDR merge combines.
+typedef struct {
+    size_t index;
+    size_t group;
+    size_t step;               // Position in the exposure list
+    ScanSettings settings;
+} SweepPoint;
+
+typedef struct {
+    SweepPoint* points;
+    size_t n_points;
+    size_t n_groups;
+} SweepPlan;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+// The sweep main.c used to hard-code: light on, then off, 26 linear
+// exposures each, gains 0, 7200 dpi, everything written to the working
+// directory.
+void sweep_config_default(SweepConfig* config);
+
+// Both return 0, or -1 after printing what was wrong.
+int sweep_config_set(SweepConfig* config, const char* key, const char* value);
+int sweep_config_load(SweepConfig* config, const char* filename);
+
+// Whether the per-channel lists pair up; 0, or -1 after printing why not.
+int sweep_config_check(const SweepConfig* config);
+
+// Expands config into points on top of base. The grid is walked with the
+// most expensive change outermost: light, then gains, then offsets, then
+// exposure, so the lamp switches once per light value and the option cache
+// only has to send exposures within a group. Returns 0, or -1 if the config
+// fails sweep_config_check() or memory runs out.
+int sweep_plan(SweepPlan* plan, const SweepConfig* config,
+               const ScanSettings* base);
+void sweep_plan_free(SweepPlan* plan);
+
+// Estimated seconds to scan the plan under the config's runtime model,
+// including lamp switches. Points whose skip entry is set are left out; skip
+// may be NULL.
+double sweep_estimate(const SweepPlan* plan, const SweepConfig* config,
+                      const bool* skip);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // SWEEP_H
@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "threadpool.h"
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef struct ParallelJob {
+    ParallelTask task;
+    void* arg;
+    size_t n_tasks;
+    size_t next;         // Next task to hand out, taken atomically
+    size_t max_helpers;  // Pool threads allowed to join the caller
+
+    // Under pool.lock
+    size_t n_finished;
+    size_t n_helpers;    // Pool threads working on the job right now
+    pthread_cond_t done;
+    struct ParallelJob* link;
+} ParallelJob;
+
+// One set of threads shared by every parallel_for() in the process, however
+// many threads call it at once. Idle threads take tasks from the oldest job
+// that still has some, so a stage that runs out of work helps the others.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    ParallelJob* jobs;  // Jobs that may still have tasks, oldest first
+    size_t n_threads;
+} ThreadPool;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+static void start_pool(void);
+static size_t run_tasks(ParallelJob* job);
+static ParallelJob* find_job(void);
+static void* pool_worker(void* arg);
+
+
+
+/*****************************************************************************\
+| Global variables                                                            |
+\*****************************************************************************/
+
+static ThreadPool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+};
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+size_t
+get_n_threads(void)
+{
+    const char* env = getenv("PIESCAN_THREADS");
+    if (env && atoi(env) > 0) {
+        return (size_t) atoi(env);
+    }
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t) n : 1;
+}
+
+// Callers work on their own jobs, so the pool has one thread fewer than
+// get_n_threads(). Its threads are detached and live as long as the process.
+void
+start_pool(void)
+{
+    pthread_attr_t attr;
+    size_t n = get_n_threads() - 1;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (size_t t = 0; t < n; ++t) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, pool_worker, NULL) == 0) {
+            ++pool.n_threads;
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+size_t
+run_tasks(ParallelJob* job)
+{
+    size_t i, n = 0;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+            < job->n_tasks) {
+        job->task(job->arg, i);
+        ++n;
+    }
+    return n;
+}
+
+// Called with pool.lock held.
+ParallelJob*
+find_job(void)
+{
+    for (ParallelJob* job = pool.jobs; job; job = job->link) {
+        if (job->n_helpers < job->max_helpers &&
+            __atomic_load_n(&job->next, __ATOMIC_RELAXED) < job->n_tasks) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+void*
+pool_worker(void* arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        ParallelJob* job = find_job();
+        if (!job) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+            continue;
+        }
+
+        ++job->n_helpers;
+        pthread_mutex_unlock(&pool.lock);
+        size_t n = run_tasks(job);
+        pthread_mutex_lock(&pool.lock);
+
+        // The caller frees the job once the last helper has let go of it.
+        job->n_finished += n;
+        --job->n_helpers;
+        if (job->n_finished == job->n_tasks && job->n_helpers == 0) {
+            pthread_cond_signal(&job->done);
+        }
+    }
+
+    return NULL;
+}
+
+void
+parallel_for(size_t n_tasks, ParallelTask task, void* arg)
+{
+    parallel_for_n(n_tasks, get_n_threads(), task, arg);
+}
+
+void
+parallel_for_n(size_t n_tasks, size_t n_threads, ParallelTask task, void* arg)
+{
+    ParallelJob job = {
+        .task = task,
+        .arg = arg,
+        .n_tasks = n_tasks,
+        .max_helpers = n_threads > 1 ? n_threads - 1 : 0,
+    };
+
+    if (job.max_helpers >= n_tasks) job.max_helpers = n_tasks - 1;
+    if (n_tasks <= 1 || job.max_helpers == 0) {
+        run_tasks(&job);
+        return;
+    }
+
+    pthread_once(&pool_once, start_pool);
+    pthread_cond_init(&job.done, NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    ParallelJob** tail = &pool.jobs;
+    while (*tail) tail = &(*tail)->link;
+    *tail = &job;
+    if (job.max_helpers >= pool.n_threads) {
+        pthread_cond_broadcast(&pool.work);
+    } else {
+        for (size_t h = 0; h < job.max_helpers; ++h) {
+            pthread_cond_signal(&pool.work);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    // The calling thread works too. A task that calls parallel_for() itself
+    // does the same from inside the pool, so nesting can't deadlock.
+    size_t n = run_tasks(&job);
+
+    pthread_mutex_lock(&pool.lock);
+    for (ParallelJob** j = &pool.jobs; *j; j = &(*j)->link) {
+        if (*j == &job) {
+            *j = job.link;
+            break;
+        }
+    }
+    job.n_finished += n;
+    while (job.n_finished < job.n_tasks || job.n_helpers > 0) {
+        pthread_cond_wait(&job.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_cond_destroy(&job.done);
+}
@@ -0,0 +1,45 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef void (*ParallelTask)(void* arg, size_t index);
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+// Number of threads parallel_for() uses: the PIESCAN_THREADS environment
+// variable if set, otherwise the number of online CPUs.
+size_t get_n_threads(void);
+
+// Runs task(arg, i) for every i in [0, n_tasks) and returns once all of them
+// have finished. Tasks are handed out dynamically, so uneven tiles balance.
+// The calling thread runs tasks too, helped by a pool of threads started on
+// first use and shared by all callers, so concurrent pipelines don't
+// oversubscribe the CPUs. Safe to call from within a task.
+void parallel_for(size_t n_tasks, ParallelTask task, void* arg);
+
+// As parallel_for(), with an explicit upper bound on the number of threads.
+void parallel_for_n(size_t n_tasks, size_t n_threads, ParallelTask task,
+                    void* arg);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // THREADPOOL_H
@@ -0,0 +1,535 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "tiledtiff.h"
+#include "threadpool.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// Tags, in the ascending order a directory lists them.
+#define TAG_NEW_SUBFILE_TYPE 254
+#define TAG_IMAGE_WIDTH      256
+#define TAG_IMAGE_LENGTH     257
+#define TAG_BITS_PER_SAMPLE  258
+#define TAG_COMPRESSION      259
+#define TAG_PHOTOMETRIC      262
+#define TAG_SAMPLES_PER_PIXEL 277
+#define TAG_PLANAR_CONFIG    284
+#define TAG_PREDICTOR        317
+#define TAG_TILE_WIDTH       322
+#define TAG_TILE_LENGTH      323
+#define TAG_TILE_OFFSETS     324
+#define TAG_TILE_BYTE_COUNTS 325
+#define TAG_EXTRA_SAMPLES    338
+#define TAG_SAMPLE_FORMAT    339
+
+#define TYPE_SHORT 3
+#define TYPE_LONG  4
+#define TYPE_LONG8 16
+
+#define MAX_ENTRIES 16
+
+// Samples are written in the machine's order, which the header names.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BYTE_ORDER_MARK "II"
+#else
+#define BYTE_ORDER_MARK "MM"
+#endif
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+// One resolution of the pyramid. Its lines gather in strip, a plane per
+// channel, until a row of tiles is complete.
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t tiles_across;
+    uint32_t tiles_down;
+    uint16_t* strip[4];     // tile_size lines of width each
+    uint32_t n_lines;       // In strip
+    uint32_t done;          // Lines encoded before the strip
+    uint64_t* offsets;      // Per tile, row by row
+    uint64_t* byte_counts;
+} Level;
+
+struct TiledTiff {
+    FILE* fp;
+    TiledTiffOptions options;
+    uint16_t n_channels;
+    size_t n_levels;
+    Level levels[TILED_TIFF_MAX_LEVELS];
+    uint64_t end;           // Where the next tile goes
+
+    // Encoded tiles of a strip, tile_bound bytes apart.
+    uint8_t* encoded;
+    size_t tile_bound;
+    size_t* sizes;
+    int error;
+};
+
+typedef struct {
+    TiledTiff* tiff;
+    const Level* level;
+    int failed;
+} StripJob;
+
+typedef struct {
+    uint16_t tag;
+    uint16_t type;
+    uint64_t count;
+    uint64_t value;         // Or the offset of the values
+} Entry;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+static void encode_tile(void* arg, size_t tx);
+static int flush_strip(TiledTiff* tiff, size_t k);
+static int add_lines(TiledTiff* tiff, size_t k, const uint16_t* const* planes,
+                     size_t stride, uint32_t n_lines);
+static void reduce_strip(const Level* level, Level* next, size_t n_channels);
+static int write_directory(TiledTiff* tiff, size_t k, uint64_t* next_field);
+static int put(TiledTiff* tiff, const void* data, size_t size);
+
+
+
+/*****************************************************************************\
+| Function implementations                                                    |
+\*****************************************************************************/
+
+TiledTiffOptions
+tiled_tiff_default(void)
+{
+    TiledTiffOptions options = {
+        .tile_size = 256,
+        .compression_level = 1,
+        .compression_strategy = Z_RLE,
+        .predictor = true,
+    };
+    return options;
+}
+
+int
+open_tiled_tiff(TiledTiff** tiff, const char* filename, uint32_t width,
+                uint32_t height, uint16_t n_channels,
+                const TiledTiffOptions* options)
+{
+    const TiledTiffOptions opts = options ? *options : tiled_tiff_default();
+
+    *tiff = NULL;
+    if (width == 0 || height == 0 ||
+        (n_channels != 1 && n_channels != 3 && n_channels != 4) ||
+        opts.tile_size == 0 || opts.tile_size % 16 != 0 ||
+        opts.compression_level < 0 || opts.compression_level > 9 ||
+        opts.compression_strategy < 0 || opts.compression_strategy > Z_FIXED) {
+        return EINVAL;
+    }
+
+    TiledTiff* t = (TiledTiff*) calloc(1, sizeof(TiledTiff));
+    if (!t) return ENOMEM;
+    t->options = opts;
+    t->n_channels = n_channels;
+
+    // Halve until a level fits in one tile.
+    const size_t ts = opts.tile_size;
+    uint32_t w = width, h = height;
+    int err = 0;
+    do {
+        Level* level = &t->levels[t->n_levels++];
+        level->width = w;
+        level->height = h;
+        level->tiles_across = (uint32_t) ((w + ts - 1) / ts);
+        level->tiles_down = (uint32_t) ((h + ts - 1) / ts);
+
+        const size_t n_tiles = (size_t) level->tiles_across
+                             * level->tiles_down;
+        level->offsets = (uint64_t*) calloc(n_tiles, sizeof(uint64_t));
+        level->byte_counts = (uint64_t*) calloc(n_tiles, sizeof(uint64_t));
+        if (!level->offsets || !level->byte_counts) err = ENOMEM;
+        for (uint16_t c = 0; c < n_channels; ++c) {
+            level->strip[c] = (uint16_t*) malloc(ts * w * sizeof(uint16_t));
+            if (!level->strip[c]) err = ENOMEM;
+        }
+
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    } while (!err && (t->levels[t->n_levels - 1].width > ts ||
+                      t->levels[t->n_levels - 1].height > ts) &&
+             t->n_levels < TILED_TIFF_MAX_LEVELS);
+
+    const size_t tile_bytes = ts * ts * n_channels * sizeof(uint16_t);
+    t->tile_bound = opts.compression_level > 0 ? compressBound(tile_bytes)
+                                               : tile_bytes;
+    t->encoded = (uint8_t*) malloc(t->levels[0].tiles_across
+                                   * t->tile_bound);
+    t->sizes = (size_t*) calloc(t->levels[0].tiles_across, sizeof(size_t));
+    if (!err && (!t->encoded || !t->sizes)) err = ENOMEM;
+
+    if (!err) {
+        t->fp = fopen(filename, "wb");
+        if (!t->fp) err = errno;
+    }
+
+    // The header's directory offset is filled in on closing.
+    uint8_t header[16] = {BYTE_ORDER_MARK[0], BYTE_ORDER_MARK[1]};
+    const uint16_t fields[3] = {43, 8, 0};
+    memcpy(header + 2, fields, sizeof(fields));
+    if (!err) err = put(t, header, sizeof(header));
+
+    if (err) {
+        t->error = err;
+        close_tiled_tiff(t);
+        return err;
+    }
+    *tiff = t;
+    return 0;
+}
+
+int
+tiled_tiff_write_lines(TiledTiff* tiff, const uint16_t* const* planes,
+                       uint32_t n_lines)
+{
+    const Level* level = &tiff->levels[0];
+
+    if (tiff->error) return tiff->error;
+    if ((uint64_t) level->done + level->n_lines + n_lines > level->height) {
+        return EINVAL;
+    }
+    return add_lines(tiff, 0, planes, level->width, n_lines);
+}
+
+int
+close_tiled_tiff(TiledTiff* tiff)
+{
+    int err = tiff->error;
+
+    if (!err && tiff->levels[0].done + tiff->levels[0].n_lines
+                != tiff->levels[0].height) {
+        err = EINVAL;
+    }
+
+    // What is left of each strip, which feeds the level after it.
+    for (size_t k = 0; !err && k < tiff->n_levels; ++k) {
+        err = flush_strip(tiff, k);
+    }
+
+    // Each level's tile arrays and directory, the directories chained from
+    // the header.
+    uint64_t next_field = 8;
+    for (size_t k = 0; !err && k < tiff->n_levels; ++k) {
+        err = write_directory(tiff, k, &next_field);
+    }
+
+    if (tiff->fp && fclose(tiff->fp) != 0 && !err) err = errno;
+    for (size_t k = 0; k < tiff->n_levels; ++k) {
+        Level* level = &tiff->levels[k];
+        for (int c = 0; c < 4; ++c) free(level->strip[c]);
+        free(level->offsets);
+        free(level->byte_counts);
+    }
+    free(tiff->encoded);
+    free(tiff->sizes);
+    free(tiff);
+    return err;
+}
+
+int
+save_tiled_tiff(const Image* im, const char* filename,
+                const TiledTiffOptions* options)
+{
+    const uint16_t* planes[4] = {im->r, im->g, im->b, im->i};
+    TiledTiff* tiff;
+
+    int err = open_tiled_tiff(&tiff, filename, im->width, im->height, 4,
+                              options);
+    if (err) return err;
+    err = tiled_tiff_write_lines(tiff, planes, im->height);
+    int close_err = close_tiled_tiff(tiff);
+    return err ? err : close_err;
+}
+
+// Interleaves tile tx of the level's strip, padding it with zeros past the
+// image's edges, and deflates it into its slot of encoded.
+void
+encode_tile(void* arg, size_t tx)
+{
+    StripJob* job = (StripJob*) arg;
+    const TiledTiff* tiff = job->tiff;
+    const Level* level = job->level;
+    const size_t ts = tiff->options.tile_size;
+    const size_t n = tiff->n_channels;
+    const size_t x0 = tx * ts;
+    const size_t cols = x0 + ts < level->width ? ts : level->width - x0;
+    const size_t tile_bytes = ts * ts * n * sizeof(uint16_t);
+    uint8_t* out = tiff->encoded + tx * tiff->tile_bound;
+    const bool deflated = tiff->options.compression_level > 0;
+    uint16_t* tile = deflated ? (uint16_t*) malloc(tile_bytes)
+                              : (uint16_t*) out;
+
+    if (!tile) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    memset(tile, 0, tile_bytes);
+    for (size_t y = 0; y < level->n_lines; ++y) {
+        uint16_t* row = tile + y * ts * n;
+        for (size_t c = 0; c < n; ++c) {
+            const uint16_t* src = level->strip[c] + y * level->width + x0;
+            for (size_t x = 0; x < cols; ++x) row[x * n + c] = src[x];
+        }
+        // Each sample less the one of its channel to the left
+        if (deflated && tiff->options.predictor) {
+            for (size_t k = ts * n - 1; k >= n; --k) row[k] -= row[k - n];
+        }
+    }
+
+    if (!deflated) {
+        tiff->sizes[tx] = tile_bytes;
+        return;
+    }
+
+    // One zlib stream per tile, as the Deflate compression wants.
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, tiff->options.compression_level, Z_DEFLATED,
+                     15, 8, tiff->options.compression_strategy) != Z_OK) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        free(tile);
+        return;
+    }
+    strm.next_in = (Bytef*) tile;
+    strm.avail_in = (uInt) tile_bytes;
+    strm.next_out = out;
+    strm.avail_out = (uInt) tiff->tile_bound;
+    if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+    tiff->sizes[tx] = tiff->tile_bound - strm.avail_out;
+    deflateEnd(&strm);
+    free(tile);
+}
+
+// Encodes and writes the tiles of level k's strip, then hands the strip
+// on at half size to the level after it.
+int
+flush_strip(TiledTiff* tiff, size_t k)
+{
+    Level* level = &tiff->levels[k];
+    StripJob job = {tiff, level, 0};
+
+    if (level->n_lines == 0) return 0;
+
+    parallel_for(level->tiles_across, encode_tile, &job);
+    if (job.failed) return tiff->error = ENOMEM;
+
+    const size_t row = (size_t) (level->done / tiff->options.tile_size)
+                     * level->tiles_across;
+    for (uint32_t tx = 0; tx < level->tiles_across; ++tx) {
+        level->offsets[row + tx] = tiff->end;
+        level->byte_counts[row + tx] = tiff->sizes[tx];
+        int err = put(tiff, tiff->encoded + tx * tiff->tile_bound,
+                      tiff->sizes[tx]);
+        if (err) return err;
+    }
+
+    if (k + 1 < tiff->n_levels) {
+        reduce_strip(level, &tiff->levels[k + 1], tiff->n_channels);
+    }
+    level->done += level->n_lines;
+    level->n_lines = 0;
+
+    // Two strips fill the next level's.
+    Level* next = k + 1 < tiff->n_levels ? &tiff->levels[k + 1] : NULL;
+    if (next && next->n_lines == tiff->options.tile_size) {
+        return flush_strip(tiff, k + 1);
+    }
+    return 0;
+}
+
+// Copies n_lines lines, stride samples apart in planes, into level k's
+// strip, flushing it whenever it fills up.
+int
+add_lines(TiledTiff* tiff, size_t k, const uint16_t* const* planes,
+          size_t stride, uint32_t n_lines)
+{
+    Level* level = &tiff->levels[k];
+    const uint32_t ts = tiff->options.tile_size;
+    uint32_t line = 0;
+
+    while (line < n_lines) {
+        uint32_t m = ts - level->n_lines;
+        if (m > n_lines - line) m = n_lines - line;
+
+        for (uint16_t c = 0; c < tiff->n_channels; ++c) {
+            uint16_t* dst = level->strip[c]
+                          + (size_t) level->n_lines * level->width;
+            const uint16_t* src = planes[c] + (size_t) line * stride;
+            for (uint32_t y = 0; y < m; ++y) {
+                memcpy(dst + (size_t) y * level->width,
+                       src + (size_t) y * stride,
+                       level->width * sizeof(uint16_t));
+            }
+        }
+        level->n_lines += m;
+        line += m;
+
+        if (level->n_lines == ts) {
+            int err = flush_strip(tiff, k);
+            if (err) return err;
+        }
+    }
+    return 0;
+}
+
+// Averages 2x2 blocks of the strip into the next level's, repeating the
+// last line and column of an odd size. Strips but the last have an even
+// number of lines, so blocks never straddle two of them.
+void
+reduce_strip(const Level* level, Level* next, size_t n_channels)
+{
+    const uint32_t n_lines = (level->n_lines + 1) / 2;
+
+    for (size_t c = 0; c < n_channels; ++c) {
+        for (uint32_t y = 0; y < n_lines; ++y) {
+            const uint16_t* a = level->strip[c]
+                              + (size_t) 2 * y * level->width;
+            const uint16_t* b = 2 * y + 1 < level->n_lines
+                              ? a + level->width : a;
+            uint16_t* dst = next->strip[c]
+                          + (size_t) (next->n_lines + y) * next->width;
+            const uint32_t pairs = level->width / 2;
+
+            for (uint32_t x = 0; x < pairs; ++x) {
+                dst[x] = (uint16_t) (((uint32_t) a[2 * x] + a[2 * x + 1]
+                                      + b[2 * x] + b[2 * x + 1] + 2) >> 2);
+            }
+            if (level->width % 2) {
+                const uint32_t x = level->width - 1;
+                dst[pairs] = (uint16_t) (((uint32_t) a[x] + b[x] + 1) >> 1);
+            }
+        }
+    }
+    next->n_lines += n_lines;
+}
+
+// Writes level k's tile arrays and directory at the end of the file and
+// points *next_field, the previous link in the chain, at it.
+int
+write_directory(TiledTiff* tiff, size_t k, uint64_t* next_field)
+{
+    const Level* level = &tiff->levels[k];
+    const uint64_t n_tiles = (uint64_t) level->tiles_across
+                           * level->tiles_down;
+    const uint16_t n = tiff->n_channels;
+    const bool deflated = tiff->options.compression_level > 0;
+    Entry entries[MAX_ENTRIES];
+    size_t n_entries = 0;
+    int err;
+
+    // Directories and the arrays they point to start on a word boundary,
+    // and deflated tiles can leave the file at any length. The arrays are
+    // whole words, so the directory after them stays aligned.
+    if (tiff->end % 2) {
+        const uint8_t pad = 0;
+        err = put(tiff, &pad, 1);
+        if (err) return err;
+    }
+
+    // Arrays of one tile fit in the entry itself.
+    uint64_t offsets = level->offsets[0];
+    uint64_t byte_counts = level->byte_counts[0];
+    if (n_tiles > 1) {
+        offsets = tiff->end;
+        err = put(tiff, level->offsets, n_tiles * sizeof(uint64_t));
+        if (err) return err;
+        byte_counts = tiff->end;
+        err = put(tiff, level->byte_counts, n_tiles * sizeof(uint64_t));
+        if (err) return err;
+    }
+
+    // Values of up to 8 bytes sit in the entry, in the file's byte order:
+    // shorts packed from its first byte on.
+    uint16_t shorts[4] = {0, 0, 0, 0};
+    uint64_t bits, formats;
+    for (uint16_t c = 0; c < n; ++c) shorts[c] = 16;
+    memcpy(&bits, shorts, sizeof(bits));
+    for (uint16_t c = 0; c < n; ++c) shorts[c] = 1;   // Unsigned
+    memcpy(&formats, shorts, sizeof(formats));
+
+#define ENTRY(tag, type, count, value) \
+    entries[n_entries++] = (Entry) {tag, type, count, value}
+#define SHORT(v) ((uint64_t) (v) << \
+                  (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? 0 : 48))
+#define LONG(v) ((uint64_t) (v) << \
+                 (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? 0 : 32))
+
+    ENTRY(TAG_NEW_SUBFILE_TYPE, TYPE_LONG, 1, LONG(k > 0));
+    ENTRY(TAG_IMAGE_WIDTH, TYPE_LONG, 1, LONG(level->width));
+    ENTRY(TAG_IMAGE_LENGTH, TYPE_LONG, 1, LONG(level->height));
+    ENTRY(TAG_BITS_PER_SAMPLE, TYPE_SHORT, n, bits);
+    ENTRY(TAG_COMPRESSION, TYPE_SHORT, 1, SHORT(deflated ? 8 : 1));
+    ENTRY(TAG_PHOTOMETRIC, TYPE_SHORT, 1, SHORT(n >= 3 ? 2 : 1));
+    ENTRY(TAG_SAMPLES_PER_PIXEL, TYPE_SHORT, 1, SHORT(n));
+    ENTRY(TAG_PLANAR_CONFIG, TYPE_SHORT, 1, SHORT(1));
+    if (deflated && tiff->options.predictor) {
+        ENTRY(TAG_PREDICTOR, TYPE_SHORT, 1, SHORT(2));
+    }
+    ENTRY(TAG_TILE_WIDTH, TYPE_LONG, 1, LONG(tiff->options.tile_size));
+    ENTRY(TAG_TILE_LENGTH, TYPE_LONG, 1, LONG(tiff->options.tile_size));
+    ENTRY(TAG_TILE_OFFSETS, TYPE_LONG8, n_tiles, offsets);
+    ENTRY(TAG_TILE_BYTE_COUNTS, TYPE_LONG8, n_tiles, byte_counts);
+    // The fourth channel is an unspecified extra sample, not alpha.
+    if (n == 4) ENTRY(TAG_EXTRA_SAMPLES, TYPE_SHORT, 1, SHORT(0));
+    ENTRY(TAG_SAMPLE_FORMAT, TYPE_SHORT, n, formats);
+
+#undef ENTRY
+#undef SHORT
+#undef LONG
+
+    // Point the previous link here, then come back to the end.
+    const uint64_t directory = tiff->end;
+    if (fseeko(tiff->fp, (off_t) *next_field, SEEK_SET) != 0 ||
+        fwrite(&directory, sizeof(directory), 1, tiff->fp) != 1 ||
+        fseeko(tiff->fp, (off_t) tiff->end, SEEK_SET) != 0) {
+        return tiff->error = errno ? errno : EIO;
+    }
+
+    const uint64_t count = n_entries;
+    const uint64_t none = 0;
+    err = put(tiff, &count, sizeof(count));
+    for (size_t e = 0; !err && e < n_entries; ++e) {
+        err = put(tiff, &entries[e].tag, sizeof(uint16_t));
+        if (!err) err = put(tiff, &entries[e].type, sizeof(uint16_t));
+        if (!err) err = put(tiff, &entries[e].count, sizeof(uint64_t));
+        if (!err) err = put(tiff, &entries[e].value, sizeof(uint64_t));
+    }
+    *next_field = tiff->end;
+    if (!err) err = put(tiff, &none, sizeof(none));
+    return err;
+}
+
+// Appends size bytes to the file.
+int
+put(TiledTiff* tiff, const void* data, size_t size)
+{
+    if (size && fwrite(data, size, 1, tiff->fp) != 1) {
+        return tiff->error = errno ? errno : EIO;
+    }
+    tiff->end += size;
+    return 0;
+}
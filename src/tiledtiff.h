@@ -0,0 +1,87 @@
+#ifndef TILEDTIFF_H
+#define TILEDTIFF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "piescan.h"
+
+
+
+/*****************************************************************************\
+| Macros                                                                      |
+\*****************************************************************************/
+
+// A tiled BigTIFF of 16-bit samples, 1 (grey), 3 (RGB) or 4 (RGB and an
+// extra channel, such as infrared) per pixel, interleaved. After the full
+// image come reduced-resolution copies, each half the size of the one
+// before (2x2 box filtered) down to one that fits in a single tile, so a
+// viewer reads only the tiles of the level it shows. Levels follow each
+// other as IFDs marked as reduced-resolution images.
+//
+// Lines are written in order, in batches of any size. Every tile_size lines
+// the strip of tiles they complete is encoded on the thread pool, a tile
+// per task, and half as many lines go to the next level, so the whole
+// pyramid is built with one strip per level in memory.
+#define TILED_TIFF_MAX_LEVELS 24
+
+
+
+/*****************************************************************************\
+| Type definitions                                                            |
+\*****************************************************************************/
+
+typedef struct {
+    uint32_t tile_size;          // Of the square tiles, a multiple of 16
+    int compression_level;       // 0 stores tiles as they are, 1-9 deflates
+    int compression_strategy;    // Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE...
+    bool predictor;              // Horizontal differencing before deflate
+} TiledTiffOptions;
+
+typedef struct TiledTiff TiledTiff;
+
+
+
+/*****************************************************************************\
+| Function declarations                                                       |
+\*****************************************************************************/
+
+// 256 x 256 tiles, deflated at level 1 with Z_RLE after horizontal
+// differencing, which is what the fast PNG preset does with rows.
+TiledTiffOptions tiled_tiff_default(void);
+
+// Creates filename for a width x height image of n_channels; options may
+// be NULL. Returns 0 or an errno value: EINVAL for a size, channel count
+// or tile size it can't write.
+int open_tiled_tiff(TiledTiff** tiff, const char* filename, uint32_t width,
+                    uint32_t height, uint16_t n_channels,
+                    const TiledTiffOptions* options);
+
+// Appends n_lines lines, planes[c] pointing at the first of them in
+// channel c, width samples apart. Returns 0 or an errno value, EINVAL if
+// there are more lines than the image has; after an error the file is
+// unusable and only closing it is left.
+int tiled_tiff_write_lines(TiledTiff* tiff, const uint16_t* const* planes,
+                           uint32_t n_lines);
+
+// Finishes the pyramid and the directories and closes the file. Returns 0
+// or an errno value, EINVAL if lines were missing, having closed the file
+// either way.
+int close_tiled_tiff(TiledTiff* tiff);
+
+// Writes the r, g, b and i planes of im to filename in one go.
+int save_tiled_tiff(const Image* im, const char* filename,
+                    const TiledTiffOptions* options);
+
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // TILEDTIFF_H